@@ -0,0 +1,31 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <vector>
+#include <string>
+
+
+/* Wall clock in seconds */
+double benchSeconds();
+
+/* Thread counts to sweep: 1, 2, 4, ... up to the core count */
+std::vector<unsigned int> benchThreadCounts();
+
+/* Read a whole file, false if it cannot be read */
+bool benchReadFile(const std::string &path, std::vector<unsigned char> *data);
+
+/* Benchmarks, argv holds the arguments after the benchmark name */
+int benchDecode(int argc, char *argv[]);
+int benchEncode(int argc, char *argv[]);
+int benchAnalysis(int argc, char *argv[]);
+int benchSimplify(int argc, char *argv[]);
+int benchMemory(int argc, char *argv[]);
+int benchSubmit(int argc, char *argv[]);
+int benchQueue(int argc, char *argv[]);
+int benchLog(int argc, char *argv[]);
+int benchMeasure(int argc, char *argv[]);
+int benchRuns(int argc, char *argv[]);
+int benchRoots(int argc, char *argv[]);
+int benchWorkers(int argc, char *argv[]);
+
+#endif // BENCH_HPP
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "bench.hpp"
+#include "analysis.hpp"
+
+
+/* Binary slide with filled discs of the given radius range */
+static void drawDiscs(cv::Mat *image, unsigned int count, int min_radius, int max_radius,
+                                                                    unsigned int *seed) {
+    for (unsigned int n = 0; n < count; n++) {
+        *seed = *seed * 1103515245 + 12345;
+        int cx = (int)((*seed >> 8) % image->cols);
+        *seed = *seed * 1103515245 + 12345;
+        int cy = (int)((*seed >> 8) % image->rows);
+        *seed = *seed * 1103515245 + 12345;
+        int r = min_radius + (int)((*seed >> 8) % (max_radius - min_radius + 1));
+        for (int y = std::max(0, cy - r); y <= std::min(image->rows - 1, cy + r); y++) {
+            unsigned char *row = image->ptr(y);
+            for (int x = std::max(0, cx - r); x <= std::min(image->cols - 1, cx + r); x++) {
+                if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r) row[x] = 255;
+            }
+        }
+    }
+}
+
+/* Contour stages of one channel under each strategy */
+int benchAnalysis(int argc, char *argv[]) {
+
+    int size = (argc > 0) ? atoi(argv[0]) : 4096;
+    if (size <= 0) size = 4096;
+
+    // Sparse: a few hundred large cells. Dense: ~500k fragments, mostly
+    // specks of one or two pixels, among a few thousand small cells.
+    unsigned int seed = 12345;
+    cv::Mat sparse = cv::Mat::zeros(size, size, CV_8UC1);
+    drawDiscs(&sparse, 300, 15, 50, &seed);
+    cv::Mat dense = cv::Mat::zeros(size, size, CV_8UC1);
+    drawDiscs(&dense, 5000, 3, 8, &seed);
+    for (unsigned int n = 0; n < 500000; n++) {
+        seed = seed * 1103515245 + 12345;
+        size_t pixel = (seed >> 4) % ((size_t)size * size);
+        dense.data[pixel] = 255;
+        if (n % 3 == 0) dense.data[(pixel + 1) % ((size_t)size * size)] = 255;
+    }
+
+    const cv::Mat images[] = { sparse, dense };
+    const char *image_names[] = { "sparse", "dense" };
+    const AnalysisStrategy strategies[] = { AnalysisStrategy::SPARSE, AnalysisStrategy::DENSE,
+                                            AnalysisStrategy::AUTO };
+    const char *strategy_names[] = { "sparse", "dense", "auto" };
+
+    ThreadPool pool(0);
+    HistogramEngine histograms(std::vector<HistogramSpec>(1, defaultHistogramSpec()));
+    FilterCascade cascade(defaultFilterSpecs());
+    std::cout << "image " << size << "x" << size << ", " << pool.size() << " threads"
+              << std::endl;
+    std::cout << "image,strategy,estimate_ms,contours_ms,filter_ms,features_ms,total_ms,"
+              << "cells,metrics" << std::endl;
+
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t k = 0; k < 3; k++) {
+            double start = benchSeconds();
+            DensityEstimate density = estimateDensity(images[i]);
+            ContourPlan plan = planContours(density, strategies[k]);
+            double estimated = benchSeconds();
+
+            cv::Mat segmented;
+            std::vector<std::vector<cv::Point>> contours;
+            std::vector<cv::Vec4i> hierarchy;
+            std::vector<HierarchyType> mask;
+            std::vector<double> area;
+            ContourMeasures measures;
+            contourCalc(images[i], ChannelType::RED, 1.0, plan, &segmented,
+                                        &contours, &hierarchy, &mask, &area, &measures);
+            double traced = benchSeconds();
+
+            std::vector<std::vector<cv::Point>> cells;
+            std::vector<HierarchyType> cell_mask;
+            std::vector<double> cell_area;
+            ContourMeasures cell_measures;
+            std::vector<int> cell_index;
+            std::vector<FilterStats> filter_stats;
+            filterCells(contours, mask, area, measures, cascade, images[i], &cells, &cell_mask,
+                                &cell_area, &cell_measures, &cell_index, &filter_stats);
+            double filtered = benchSeconds();
+
+            std::vector<double> values;
+            CellSketches sketches;
+            std::string metrics = separationMetrics(cells, cell_measures, images[i],
+                                            histograms, plan, &pool, &values, &sketches);
+            double done = benchSeconds();
+
+            std::cout << image_names[i] << "," << strategy_names[k] << ","
+                      << 1000 * (estimated - start) << "," << 1000 * (traced - estimated) << ","
+                      << 1000 * (filtered - traced) << "," << 1000 * (done - filtered) << ","
+                      << 1000 * (done - start) << "," << cells.size() << ",\"" << metrics
+                      << "\"" << std::endl;
+            if (k == 2) std::cout << "  auto: " << describePlan(density, plan) << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "bench.hpp"
+#include "thread_pool.hpp"
+#include "tiff_decoder.hpp"
+
+
+/* Strip/tile decode throughput against the number of cores */
+int benchDecode(int argc, char *argv[]) {
+
+    if (argc < 1) {
+        std::cerr << "decode: missing tiff file" << std::endl;
+        return -1;
+    }
+    int repeats = (argc > 1) ? atoi(argv[1]) : 5;
+    if (repeats < 1) repeats = 1;
+
+    std::vector<unsigned char> data;
+    TiffInfo info;
+    if (!benchReadFile(argv[0], &data) || !parseTiff(data.data(), data.size(), &info)) {
+        std::cerr << "decode: unsupported tiff " << argv[0] << std::endl;
+        return -1;
+    }
+
+    size_t step = (size_t)info.width * (info.bits_per_sample / 8);
+    std::vector<std::vector<unsigned char>> planes(info.colorSamples(),
+                        std::vector<unsigned char>(step * info.height));
+    std::vector<unsigned char *> plane_data;
+    for (size_t i = 0; i < planes.size(); i++) plane_data.push_back(planes[i].data());
+    double megabytes = (double)step * info.height * planes.size() / (1 << 20);
+
+    std::cout << "image " << info.width << "x" << info.height << " samples "
+              << info.samples_per_pixel << " bits " << info.bits_per_sample
+              << " compression " << info.compression << " chunks "
+              << info.offsets.size() << std::endl;
+    std::cout << "threads,seconds,MB/s,speedup" << std::endl;
+
+    double baseline = 0.0;
+    std::vector<unsigned int> counts = benchThreadCounts();
+    for (size_t c = 0; c < counts.size(); c++) {
+        ThreadPool pool(counts[c]);
+        double best = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            double start = benchSeconds();
+            if (!decodeTiff(data.data(), data.size(), info, &pool,
+                                                plane_data.data(), step)) {
+                std::cerr << "decode: failed" << std::endl;
+                return -1;
+            }
+            double elapsed = benchSeconds() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        if (!c) baseline = best;
+        std::cout << counts[c] << "," << best << "," << megabytes / best << ","
+                  << baseline / best << std::endl;
+    }
+    return 0;
+}
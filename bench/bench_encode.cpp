@@ -0,0 +1,59 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "bench.hpp"
+#include "thread_pool.hpp"
+#include "tiff_codec.hpp"
+#include "tiff_encoder.hpp"
+
+
+/* Tiled TIFF encode throughput against the number of cores */
+int benchEncode(int argc, char *argv[]) {
+
+    unsigned int size = (argc > 0) ? (unsigned int)atoi(argv[0]) : 8192;
+    std::string out_path = (argc > 1) ? argv[1] : "/dev/null";
+    if (!size) size = 8192;
+
+    // Synthetic slide: smooth background, sparse bright cells, sensor noise
+    std::vector<std::vector<unsigned char>> planes(3,
+                                    std::vector<unsigned char>((size_t)size * size));
+    unsigned int seed = 12345;
+    for (size_t s = 0; s < planes.size(); s++) {
+        for (size_t y = 0; y < size; y++) {
+            for (size_t x = 0; x < size; x++) {
+                seed = seed * 1103515245 + 12345;
+                unsigned int value = (unsigned int)((x + y + 40 * s) / 64) % 32;
+                if (((x / 24) % 7 == s) && ((y / 24) % 5 == 1)) value += 160;
+                planes[s][y * size + x] = (unsigned char)(value + ((seed >> 16) & 7));
+            }
+        }
+    }
+    const unsigned char *plane_data[3] = { planes[0].data(), planes[1].data(), planes[2].data() };
+    double megabytes = 3.0 * size * size / (1 << 20);
+
+    const unsigned int schemes[] = { TIFF_COMPRESSION_NONE, TIFF_COMPRESSION_LZW,
+                                     TIFF_COMPRESSION_DEFLATE, TIFF_COMPRESSION_ZSTD };
+    const char *names[] = { "none", "lzw", "deflate", "zstd" };
+
+    std::cout << "image " << size << "x" << size << "x3 -> " << out_path << std::endl;
+    std::cout << "compression,threads,seconds,MB/s,speedup" << std::endl;
+    std::vector<unsigned int> counts = benchThreadCounts();
+    for (size_t k = 0; k < sizeof(schemes) / sizeof(schemes[0]); k++) {
+        if (!compressionSupported(schemes[k])) continue;
+        double baseline = 0.0;
+        for (size_t c = 0; c < counts.size(); c++) {
+            ThreadPool pool(counts[c]);
+            double start = benchSeconds();
+            if (!writeTiledTiff(out_path, plane_data, 3, size, size, 8, size,
+                                                            schemes[k], &pool)) {
+                std::cerr << "encode: failed" << std::endl;
+                return -1;
+            }
+            double elapsed = benchSeconds() - start;
+            if (!c) baseline = elapsed;
+            std::cout << names[k] << "," << counts[c] << "," << elapsed << ","
+                      << megabytes / elapsed << "," << baseline / elapsed << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <vector>
+
+#include "bench.hpp"
+#include "event_log.hpp"
+
+
+#define LOG_BENCH_RECORDS       20000   // Records per thread, default
+#define LOG_BENCH_BURST         64      // Records between pauses
+#define LOG_BENCH_PAUSE_US      2000    // Pause letting the flusher keep up
+
+/* Nanoseconds a thread spends per record, averaged over the threads. Every
+ * thread logs bursts of LOG_BENCH_BURST records separated by pauses, so
+ * that the rings are drained and nothing is dropped. Pauses are not timed. */
+template <typename Fn>
+static double perRecord(unsigned int threads, size_t records, const Fn &fn) {
+    std::vector<std::thread> workers;
+    std::vector<double> busy(threads, 0.0);
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&fn, &busy, t, records] {
+            for (size_t i = 0; i < records; i += LOG_BENCH_BURST) {
+                double start = benchSeconds();
+                for (size_t k = i; (k < i + LOG_BENCH_BURST) && (k < records); k++) fn(k);
+                busy[t] += benchSeconds() - start;
+                std::this_thread::sleep_for(std::chrono::microseconds(LOG_BENCH_PAUSE_US));
+            }
+        }));
+    }
+    double total = 0.0;
+    for (unsigned int t = 0; t < threads; t++) {
+        workers[t].join();
+        total += busy[t];
+    }
+    return total * 1e9 / ((double)threads * records);
+}
+
+/* Cost per record of a disabled level, of the ring logger and of a shared
+ * stream flushed at every line, against the thread count */
+int benchLog(int argc, char *argv[]) {
+
+    size_t records = (argc > 0) ? strtoul(argv[0], NULL, 10) : LOG_BENCH_RECORDS;
+    if (!records) records = LOG_BENCH_RECORDS;
+
+    if (!configureLog("/dev/null", LogLevel::INFO)) return -1;
+    std::ofstream stream("/dev/null");
+    std::mutex stream_mutex;
+    std::string image = "slide_0001.tif";
+
+    std::cout << "threads,disabled_ns,ring_ns,stream_ns" << std::endl;
+    std::vector<unsigned int> counts = benchThreadCounts();
+    for (size_t c = 0; c < counts.size(); c++) {
+        double disabled = perRecord(counts[c], records, [&](size_t i) {
+            LOG(DEBUG, "stage").field("image", image).field("stage", "contours_green")
+                               .field("seconds", i * 1e-3);
+        });
+        double ring = perRecord(counts[c], records, [&](size_t i) {
+            LOG(INFO, "stage").field("image", image).field("stage", "contours_green")
+                              .field("seconds", i * 1e-3);
+        });
+        double shared = perRecord(counts[c], records, [&](size_t i) {
+            std::lock_guard<std::mutex> lock(stream_mutex);
+            stream << "{\"event\":\"stage\",\"image\":\"" << image
+                   << "\",\"stage\":\"contours_green\",\"seconds\":" << i * 1e-3 << "}"
+                   << std::endl;
+        });
+        std::cout << counts[c] << "," << disabled << "," << ring << "," << shared << std::endl;
+    }
+    flushLog();
+    return 0;
+}
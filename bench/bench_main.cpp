@@ -0,0 +1,86 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+#include "bench.hpp"
+
+
+/* Benchmark table */
+struct Benchmark {
+    const char *name;
+    const char *usage;
+    int (*run)(int argc, char *argv[]);
+};
+
+static const Benchmark benchmarks[] = {
+    { "decode", "<tiff file> [repeats]    strip/tile decode MB/s against core count",
+                                                                        benchDecode },
+    { "encode", "[size] [output file]      tiled TIFF encode MB/s against core count",
+                                                                        benchEncode },
+    { "analysis", "[size]                   contour stages on sparse and dense slides per strategy",
+                                                                        benchAnalysis },
+    { "simplify", "[size] [cells]           feature time and drift of contour simplification",
+                                                                        benchSimplify },
+    { "memory", "[MiB]                    plane bandwidth with base/huge pages, local/remote node",
+                                                                        benchMemory },
+    { "submit", "[size] [frames]          frames submitted in shared memory vs written to disk",
+                                                                        benchSubmit },
+    { "queue", "[seconds] [socket]       interactive latency under bulk load, fifo vs fair queue",
+                                                                        benchQueue },
+    { "log", "[records]                ns per record: disabled level, ring logger, shared stream",
+                                                                        benchLog },
+    { "measure", "[cells]                  contour area and perimeter: OpenCV, scalar and vector sums",
+                                                                        benchMeasure },
+    { "runs", "[size]                   dense masks against run-length masks per foreground",
+                                                                        benchRuns },
+    { "roots", "[roots] [images] [size] [analyze]  one multi-root run vs a process per root",
+                                                                        benchRoots },
+    { "workers", "[images] [size] [analyze]  --workers batch with a truncated TIFF quarantined",
+                                                                        benchWorkers },
+};
+
+/* Wall clock in seconds */
+double benchSeconds() {
+    return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Thread counts to sweep: 1, 2, 4, ... up to the core count */
+std::vector<unsigned int> benchThreadCounts() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    if (!cores) cores = 1;
+    std::vector<unsigned int> counts;
+    for (unsigned int n = 1; n < cores; n *= 2) counts.push_back(n);
+    counts.push_back(cores);
+    return counts;
+}
+
+/* Read a whole file, false if it cannot be read */
+bool benchReadFile(const std::string &path, std::vector<unsigned char> *data) {
+    std::ifstream stream(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!stream.is_open()) return false;
+    data->resize((size_t)stream.tellg());
+    stream.seekg(0);
+    return (bool)stream.read((char *)data->data(), data->size());
+}
+
+/* Main - run the selected benchmark */
+int main(int argc, char *argv[]) {
+
+    size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    if (argc >= 2) {
+        for (size_t i = 0; i < count; i++) {
+            if (!strcmp(argv[1], benchmarks[i].name)) {
+                return benchmarks[i].run(argc - 2, argv + 2);
+            }
+        }
+    }
+
+    std::cerr << "Usage: " << argv[0] << " <benchmark> [arguments]" << std::endl;
+    for (size_t i = 0; i < count; i++) {
+        std::cerr << "  " << benchmarks[i].name << " " << benchmarks[i].usage << std::endl;
+    }
+    return -1;
+}
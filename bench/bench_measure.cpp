@@ -0,0 +1,101 @@
+#include <cmath>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
+#include "bench.hpp"
+#include "contour_measure.hpp"
+
+
+#define MEASURE_BENCH_CELLS     20000   // Contours measured, default
+#define MEASURE_BENCH_REPEATS   10      // Sweeps timed per method
+
+/* Area and perimeter of every contour through OpenCV, as the stages did */
+static double opencvMeasures(const std::vector<std::vector<cv::Point>> &contours,
+                             ContourMeasures *measures) {
+    double start = benchSeconds();
+    for (int r = 0; r < MEASURE_BENCH_REPEATS; r++) {
+        measures->area.resize(contours.size());
+        measures->perimeter.resize(contours.size());
+        for (size_t i = 0; i < contours.size(); i++) {
+            measures->area[i] = fabs(contourArea(cv::Mat(contours[i])));
+            measures->perimeter[i] = arcLength(contours[i], true);
+        }
+    }
+    return 1000 * (benchSeconds() - start) / MEASURE_BENCH_REPEATS;
+}
+
+/* Same with the scalar integer sums */
+static double scalarMeasures(const std::vector<std::vector<cv::Point>> &contours,
+                             ContourMeasures *measures) {
+    double start = benchSeconds();
+    for (int r = 0; r < MEASURE_BENCH_REPEATS; r++) {
+        measures->area.resize(contours.size());
+        measures->perimeter.resize(contours.size());
+        for (size_t i = 0; i < contours.size(); i++) {
+            int64_t twice_area = 0;
+            measureContourScalar(contours[i].data(), contours[i].size(),
+                                            &twice_area, &measures->perimeter[i]);
+            measures->area[i] = 0.5 * (double)std::llabs(twice_area);
+        }
+    }
+    return 1000 * (benchSeconds() - start) / MEASURE_BENCH_REPEATS;
+}
+
+/* Largest difference of the areas and relative one of the perimeters */
+static void compareMeasures(const ContourMeasures &a, const ContourMeasures &b,
+                            double *area_diff, double *perimeter_diff) {
+    *area_diff = 0.0;
+    *perimeter_diff = 0.0;
+    for (size_t i = 0; i < a.area.size(); i++) {
+        *area_diff = std::max(*area_diff, fabs(a.area[i] - b.area[i]));
+        *perimeter_diff = std::max(*perimeter_diff, fabs(a.perimeter[i] - b.perimeter[i]) /
+                                                    std::max(a.perimeter[i], 1e-9));
+    }
+}
+
+/* Time of contourArea and arcLength against the scalar and vector sums on
+ * ragged cell outlines, and how far their results are from OpenCV's */
+int benchMeasure(int argc, char *argv[]) {
+
+    int cells = (argc > 0) ? atoi(argv[0]) : MEASURE_BENCH_CELLS;
+    if (cells <= 0) cells = MEASURE_BENCH_CELLS;
+
+    // Outlines of 8 to 200 points around random centers
+    unsigned int seed = 12345;
+    std::vector<std::vector<cv::Point>> contours(cells);
+    for (int n = 0; n < cells; n++) {
+        seed = seed * 1103515245 + 12345;
+        int cx = (int)((seed >> 8) % 16384);
+        seed = seed * 1103515245 + 12345;
+        int cy = (int)((seed >> 8) % 16384);
+        seed = seed * 1103515245 + 12345;
+        int points = 8 + (int)((seed >> 8) % 193);
+        double r = 5 + points / 4;
+        for (int k = 0; k < points; k++) {
+            seed = seed * 1103515245 + 12345;
+            double t = k * 2 * M_PI / points;
+            double radius = r * (0.8 + 0.4 * ((seed >> 8) % 1000) / 1000.0);
+            contours[n].push_back(cv::Point(cx + (int)(radius * cos(t)),
+                                            cy + (int)(radius * sin(t))));
+        }
+    }
+
+    ContourMeasures reference, scalar, kernel;
+    double opencv_ms = opencvMeasures(contours, &reference);
+    double scalar_ms = scalarMeasures(contours, &scalar);
+    double start = benchSeconds();
+    for (int r = 0; r < MEASURE_BENCH_REPEATS; r++) measureContours(contours, &kernel);
+    double kernel_ms = 1000 * (benchSeconds() - start) / MEASURE_BENCH_REPEATS;
+
+    std::cout << "method,ms,speedup,max_area_diff,max_perimeter_rel_diff" << std::endl;
+    double area_diff, perimeter_diff;
+    std::cout << "opencv," << opencv_ms << ",1,0,0" << std::endl;
+    compareMeasures(reference, scalar, &area_diff, &perimeter_diff);
+    std::cout << "scalar," << scalar_ms << "," << opencv_ms / scalar_ms << ","
+              << area_diff << "," << perimeter_diff << std::endl;
+    compareMeasures(reference, kernel, &area_diff, &perimeter_diff);
+    std::cout << "kernel," << kernel_ms << "," << opencv_ms / kernel_ms << ","
+              << area_diff << "," << perimeter_diff << std::endl;
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "bench.hpp"
+#include "thread_pool.hpp"
+#include "plane_memory.hpp"
+
+
+#define RANDOM_READS            (1 << 20)   // Random reads per task
+
+static volatile uint64_t bench_sink;
+
+/* Sum the buffer as 64 bit words in one slice per task, GB/s */
+static double streamRead(const unsigned char *data, size_t size, ThreadPool *pool) {
+    const size_t tasks = pool->size() * 4;
+    const size_t words = size / sizeof(uint64_t);
+    std::vector<uint64_t> sums(tasks, 0);
+    double start = benchSeconds();
+    pool->parallelFor(tasks, [&](size_t task) {
+        const uint64_t *word = (const uint64_t *)data;
+        uint64_t sum = 0;
+        for (size_t i = task * words / tasks; i < (task + 1) * words / tasks; i++) sum += word[i];
+        sums[task] = sum;
+    });
+    double seconds = benchSeconds() - start;
+    for (size_t t = 0; t < tasks; t++) bench_sink += sums[t];
+    return size / seconds / 1e9;
+}
+
+/* Dependent reads at pseudo random offsets, bound by TLB misses, M reads/s */
+static double randomRead(const unsigned char *data, size_t size, ThreadPool *pool) {
+    const size_t tasks = pool->size();
+    const size_t words = size / sizeof(uint64_t);
+    std::vector<uint64_t> sums(tasks, 0);
+    double start = benchSeconds();
+    pool->parallelFor(tasks, [&](size_t task) {
+        const uint64_t *word = (const uint64_t *)data;
+        uint64_t state = 88172645463325252ull + task, sum = 0;
+        for (size_t i = 0; i < RANDOM_READS; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            sum += word[(state + sum) % words];
+        }
+        sums[task] = sum;
+    });
+    double seconds = benchSeconds() - start;
+    for (size_t t = 0; t < tasks; t++) bench_sink += sums[t];
+    return tasks * (double)RANDOM_READS / seconds / 1e6;
+}
+
+/* First touch from a thread pinned to the node, GB/s of page faults */
+static double touchOnNode(PlaneBuffer *buffer, const std::vector<int> &cpus) {
+    double seconds = 0;
+    std::thread toucher([&] {
+        pinCurrentThread(cpus);
+        double start = benchSeconds();
+        buffer->firstTouch();
+        seconds = benchSeconds() - start;
+    });
+    toucher.join();
+    return buffer->size() / seconds / 1e9;
+}
+
+/* Plane bandwidth with base and huge pages, local and remote to the node */
+int benchMemory(int argc, char *argv[]) {
+
+    size_t megabytes = (argc > 0) ? (size_t)atol(argv[0]) : 1024;
+    if (!megabytes) megabytes = 1024;
+    const size_t size = megabytes << 20;
+
+    NumaTopology topology = readNumaTopology();
+    const size_t num_nodes = topology.node_cpus.size();
+    std::cout << "plane " << megabytes << " MiB, " << num_nodes << " node(s)" << std::endl;
+    std::cout << "pages,reader,touch_GBps,stream_GBps,random_Mreads" << std::endl;
+
+    // Pages placed on node 0, then read by the workers of each node
+    for (int huge = 0; huge < 2; huge++) {
+        PlaneBuffer buffer(size, huge != 0);
+        if (!buffer.data()) {
+            std::cerr << "Could not map " << megabytes << " MiB" << std::endl;
+            return -1;
+        }
+        double touch = touchOnNode(&buffer, topology.node_cpus[0]);
+        const char *pages = buffer.hugePages() ? "huge" : "base";
+        if (huge && !buffer.hugePages()) pages = "base (no THP)";
+
+        for (size_t node = 0; node < num_nodes; node++) {
+            ThreadPool pool((unsigned int)topology.node_cpus[node].size(),
+                                                topology.node_cpus[node]);
+            pinCurrentThread(topology.node_cpus[node]);
+            double stream = streamRead(buffer.data(), buffer.size(), &pool);
+            double random = randomRead(buffer.data(), buffer.size(), &pool);
+            std::cout << pages << "," << ((node == 0) ? "local" : "remote") << " node " << node
+                      << "," << touch << "," << stream << "," << random << std::endl;
+        }
+    }
+    if (num_nodes < 2) std::cout << "single node, no remote reads" << std::endl;
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench.hpp"
+#include "job_queue.hpp"
+#include "submit_server.hpp"
+
+
+#define QUEUE_BENCH_BULK_CLIENTS    3       // Clients flooding bulk jobs
+#define QUEUE_BENCH_BULK_THREADS    4       // Jobs each bulk client keeps in flight
+#define QUEUE_BENCH_BULK_SIDE       4096    // Bulk frame side, pixels
+#define QUEUE_BENCH_SMALL_SIDE      1024    // Interactive frame side, pixels
+#define QUEUE_BENCH_PERIOD_MS       20      // Between interactive submissions
+#define QUEUE_BENCH_FLOOD_THREADS   8       // Interactive clients saturating the slots
+#define QUEUE_BENCH_PIXEL_RATE      4e8     // Pixels per second of the simulated jobs
+
+/* Submits one job of the class and side, returns its status */
+typedef std::function<SubmitStatus(JobClass job_class, int side)> Submitter;
+
+/* Latencies seen by the clients of one class */
+struct ClientSide {
+    QuantileSketch  latency;
+    uint64_t        rejected;
+    std::mutex      mutex;
+
+    ClientSide() : rejected(0) {}
+};
+
+/* Bulk clients submit back to back while the interactive clients submit
+ * every period_ms, for the given seconds */
+static void generateLoad(double seconds, const std::function<Submitter(const std::string &)> &connect,
+                         int interactive_clients, int period_ms, ClientSide *sides) {
+
+    std::atomic<bool> stop(false);
+    auto submitLoop = [&](const std::string &client, JobClass job_class, int side) {
+        Submitter submit = connect(client);
+        ClientSide &stats = sides[(size_t)job_class];
+        while (!stop) {
+            double start = benchSeconds();
+            SubmitStatus status = submit(job_class, side);
+            double latency = benchSeconds() - start;
+            {
+                std::lock_guard<std::mutex> lock(stats.mutex);
+                if (status == SubmitStatus::OK) stats.latency.add(latency);
+                if (status == SubmitStatus::REJECTED) stats.rejected++;
+            }
+            if ((job_class == JobClass::INTERACTIVE) && period_ms) {
+                usleep(period_ms * 1000);
+            } else if (status == SubmitStatus::REJECTED) {
+                usleep(1000);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < QUEUE_BENCH_BULK_CLIENTS; c++) {
+        for (int t = 0; t < QUEUE_BENCH_BULK_THREADS; t++) {
+            threads.push_back(std::thread(submitLoop, "bulk-" + std::to_string(c),
+                                          JobClass::BULK, QUEUE_BENCH_BULK_SIDE));
+        }
+    }
+    for (int c = 0; c < interactive_clients; c++) {
+        threads.push_back(std::thread(submitLoop, "interactive-" + std::to_string(c),
+                                      JobClass::INTERACTIVE, QUEUE_BENCH_SMALL_SIDE));
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    stop = true;
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+
+/* One line per class of what the clients saw */
+static void printClientSides(const std::string &mode, double seconds, ClientSide *sides) {
+    for (size_t c = 0; c < NUM_JOB_CLASSES; c++) {
+        const QuantileSketch &latency = sides[c].latency;
+        std::cout << mode << "," << JOB_CLASS_NAMES[c] << "," << latency.count() / seconds << ","
+                  << latency.quantile(0.50) * 1e3 << "," << latency.quantile(0.99) * 1e3 << ","
+                  << sides[c].rejected << std::endl;
+    }
+}
+
+/* The load simulated against an in-process queue, first served in order
+ * of arrival and then with the classes and fair sharing. The last run
+ * floods interactive jobs back to back, bulk jobs must still progress. */
+static int benchLocalQueue(double seconds) {
+
+    std::cout << "mode,class,jobs_per_second,p50_ms,p99_ms,rejected" << std::endl;
+    for (int mode = 0; mode < 3; mode++) {
+        const int fair = (mode > 0);
+        const bool flood = (mode == 2);
+        QueueLimits limits;
+        limits.slots = 4;
+        limits.interactive_slots = 1;
+        limits.client_queued = 64;
+        limits.class_queued = 1024;
+        limits.fair = (fair != 0);
+        JobQueue queue(limits);
+
+        // A job sleeps for as long as the pipeline would take on its pixels
+        auto connect = [&queue](const std::string &client) -> Submitter {
+            return [&queue, client](JobClass job_class, int side) {
+                double pixels = (double)side * side;
+                bool admitted = queue.run(client, job_class, pixels, [pixels] {
+                    usleep((useconds_t)(pixels / QUEUE_BENCH_PIXEL_RATE * 1e6));
+                });
+                return admitted ? SubmitStatus::OK : SubmitStatus::REJECTED;
+            };
+        };
+        ClientSide sides[NUM_JOB_CLASSES];
+        generateLoad(seconds, connect, flood ? QUEUE_BENCH_FLOOD_THREADS : 1,
+                     flood ? 0 : QUEUE_BENCH_PERIOD_MS, sides);
+        printClientSides(flood ? "fair_flood" : (fair ? "fair" : "fifo"), seconds, sides);
+        if (flood && !sides[(size_t)JobClass::BULK].latency.count()) {
+            std::cerr << "Bulk jobs starved under the interactive flood" << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The load sent to a running server, which reports its own statistics */
+static int benchServer(double seconds, const std::string &socket_path) {
+
+    // Every thread submits the same frames, from segments made up front
+    std::vector<int> segments;
+    for (int side : { QUEUE_BENCH_SMALL_SIDE, QUEUE_BENCH_BULK_SIDE }) {
+        unsigned char *data = NULL;
+        int fd = createSegment((size_t)side * side, &data);
+        if (fd < 0) {
+            std::cerr << "Could not create the segment" << std::endl;
+            return -1;
+        }
+        cv::Mat frame(side, side, CV_8UC1, data);
+        cv::randu(frame, cv::Scalar(0), cv::Scalar(256));
+        munmap(data, (size_t)side * side);
+        sealSegment(fd);
+        segments.push_back(fd);
+    }
+
+    std::atomic<bool> failed(false);
+    auto connect = [&](const std::string &client_name) -> Submitter {
+        std::shared_ptr<SubmitClient> client(new SubmitClient(socket_path));
+        if (!client->connected()) failed = true;
+        return [&, client, client_name](JobClass job_class, int side) {
+            SubmitRequest request;
+            memset(&request, 0, sizeof(request));
+            request.magic = SUBMIT_MAGIC;
+            request.version = SUBMIT_VERSION;
+            request.rows = request.cols = side;
+            request.depth = 8;
+            request.channels = 1;
+            request.step = side;
+            request.flags = (job_class == JobClass::BULK) ? SUBMIT_BULK : 0;
+            strncpy(request.client, client_name.c_str(), SUBMIT_CLIENT_SIZE - 1);
+            SubmitResult result;
+            int segment = segments[(side == QUEUE_BENCH_BULK_SIDE) ? 1 : 0];
+            if (failed || !client->submit(request, segment, &result)) {
+                failed = true;
+                usleep(QUEUE_BENCH_PERIOD_MS * 1000);
+                return SubmitStatus::FAILED;
+            }
+            return result.status;
+        };
+    };
+    ClientSide sides[NUM_JOB_CLASSES];
+    std::cout << "mode,class,jobs_per_second,p50_ms,p99_ms,rejected" << std::endl;
+    generateLoad(seconds, connect, 1, QUEUE_BENCH_PERIOD_MS, sides);
+    for (size_t i = 0; i < segments.size(); i++) close(segments[i]);
+    if (failed) {
+        std::cerr << "Could not submit to " << socket_path << std::endl;
+        return -1;
+    }
+    printClientSides("server", seconds, sides);
+
+    // What the server measured, queueing included
+    SubmitClient client(socket_path);
+    SubmitRequest request;
+    memset(&request, 0, sizeof(request));
+    request.magic = SUBMIT_MAGIC;
+    request.version = SUBMIT_VERSION;
+    request.flags = SUBMIT_STATS;
+    SubmitResult result;
+    if (!client.submit(request, -1, &result) || (result.status != SubmitStatus::OK)) {
+        std::cerr << "Could not read the server statistics" << std::endl;
+        return -1;
+    }
+    std::cout << result.names << std::endl;
+    for (size_t i = 0; i < result.values.size(); i++) {
+        std::cout << (i ? "," : "") << result.values[i];
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+/* Interactive latency under a bulk flood, in process or against --serve */
+int benchQueue(int argc, char *argv[]) {
+    double seconds = (argc > 0) ? atof(argv[0]) : 5.0;
+    if (seconds <= 0.0) seconds = 5.0;
+    if (argc > 1) return benchServer(seconds, argv[1]);
+    return benchLocalQueue(seconds);
+}
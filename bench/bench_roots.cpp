@@ -0,0 +1,208 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "bench.hpp"
+
+
+#define ROOTS_BENCH_TEMPLATE    "/tmp/analyze-roots-XXXXXX"  // Directory of the roots
+#define WORKERS_BENCH_PROCESSES 2           // --workers of the quarantine run
+
+/* Start a program with its output discarded, -1 on failure */
+static pid_t spawn(const std::vector<std::string> &args) {
+    pid_t pid = fork();
+    if (pid) return pid;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    }
+    std::vector<char *> argv;
+    for (size_t i = 0; i < args.size(); i++) argv.push_back((char *)args[i].c_str());
+    argv.push_back(NULL);
+    execv(argv[0], argv.data());
+    _exit(127);
+}
+
+/* Run the commands concurrently, seconds until the last one ends or -1 if
+ * any of them fails */
+static double runConcurrently(const std::vector<std::vector<std::string>> &commands) {
+    double start = benchSeconds();
+    std::vector<pid_t> pids;
+    for (size_t i = 0; i < commands.size(); i++) pids.push_back(spawn(commands[i]));
+    bool ok = true;
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status = 0;
+        ok &= (pids[i] > 0) && (waitpid(pids[i], &status, 0) == pids[i]) &&
+                                        WIFEXITED(status) && !WEXITSTATUS(status);
+    }
+    return ok ? benchSeconds() - start : -1;
+}
+
+/* A root of images of bright discs on dim noise */
+static bool writeRoot(const std::string &root, int images, int size, unsigned int *seed) {
+    if (mkdir(root.c_str(), 0700) || mkdir((root + "original").c_str(), 0700)) return false;
+    std::ofstream list((root + "image_list.dat").c_str());
+    for (int i = 0; i < images; i++) {
+        cv::Mat gray(size, size, CV_8UC1);
+        cv::randu(gray, cv::Scalar(0), cv::Scalar(30));
+        for (int n = 0; n < size * size / 2000; n++) {
+            *seed = *seed * 1103515245 + 12345;
+            cv::Point center((*seed >> 8) % size, (*seed >> 16) % size);
+            cv::circle(gray, center, 4 + (*seed >> 4) % 13, cv::Scalar(200), cv::FILLED);
+        }
+        cv::Mat image;
+        cv::merge(std::vector<cv::Mat>(3, gray), image);
+        std::string name = "image_" + std::to_string(i) + ".tif";
+        if (!cv::imwrite(root + "original/" + name, image)) return false;
+        list << name << "\n";
+    }
+    list.close();
+    return !list.fail();
+}
+
+/* Data lines of a CSV output, -1 if it is missing */
+static long csvRows(const std::string &path, std::string *last) {
+    std::ifstream stream(path.c_str());
+    if (!stream.is_open()) return -1;
+    std::string line;
+    long rows = -1;
+    while (std::getline(stream, line)) {
+        if (line.empty()) continue;
+        if (rows++ >= 0) *last = line;
+    }
+    return (rows < 0) ? 0 : rows;
+}
+
+/* One run over several roots against one process per root, on the same
+ * cores and the same images */
+int benchRoots(int argc, char *argv[]) {
+
+    int num_roots = (argc > 0) ? atoi(argv[0]) : 4;
+    int images = (argc > 1) ? atoi(argv[1]) : 8;
+    int size = (argc > 2) ? atoi(argv[2]) : 2048;
+    std::string analyze = (argc > 3) ? argv[3] : "./analyze";
+    if (num_roots <= 0) num_roots = 4;
+    if (images <= 0) images = 8;
+    if (size <= 0) size = 2048;
+    if (access(analyze.c_str(), X_OK)) {
+        std::cerr << "No analyze binary at " << analyze << std::endl;
+        return -1;
+    }
+
+    char base[] = ROOTS_BENCH_TEMPLATE;
+    if (!mkdtemp(base)) {
+        std::cerr << "Could not create the roots directory" << std::endl;
+        return -1;
+    }
+    std::vector<std::string> roots;
+    unsigned int seed = 12345;
+    bool ok = true;
+    for (int r = 0; ok && (r < num_roots); r++) {
+        roots.push_back(std::string(base) + "/root_" + std::to_string(r) + "/");
+        ok = writeRoot(roots.back(), images, size, &seed);
+    }
+
+    // Every process gets its share of the cores, the single run all of them
+    unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+    unsigned int share = std::max(cores / num_roots, 1u);
+    std::vector<std::string> common = { analyze, "--sync=none", "--log-level=off" };
+    std::vector<std::string> multi = common;
+    multi.push_back("--threads=" + std::to_string(cores));
+    multi.push_back("--jobs=" + std::to_string(num_roots));
+    multi.insert(multi.end(), roots.begin(), roots.end());
+    std::vector<std::vector<std::string>> singles;
+    for (int r = 0; r < num_roots; r++) {
+        singles.push_back(common);
+        singles.back().push_back("--threads=" + std::to_string(share));
+        singles.back().push_back(roots[r]);
+    }
+
+    std::cout << num_roots << " roots of " << images << " images " << size << "x" << size
+              << ", " << cores << " cores" << std::endl;
+    std::cout << "mode,processes,seconds,images_per_s" << std::endl;
+    if (ok) {
+        // The first run is untimed, it warms the page cache for both
+        runConcurrently(std::vector<std::vector<std::string>>(1, multi));
+        double multi_seconds = runConcurrently(std::vector<std::vector<std::string>>(1, multi));
+        double single_seconds = runConcurrently(singles);
+        ok = (multi_seconds > 0) && (single_seconds > 0);
+        if (ok) {
+            double total = (double)num_roots * images;
+            std::cout << "multi_root,1," << multi_seconds << "," << total / multi_seconds
+                      << std::endl;
+            std::cout << "process_per_root," << num_roots << "," << single_seconds << ","
+                      << total / single_seconds << std::endl;
+        } else {
+            std::cerr << "An analyze run failed" << std::endl;
+        }
+    } else {
+        std::cerr << "Could not write the roots" << std::endl;
+    }
+
+    std::string cmd = std::string("rm -rf ") + base;
+    system(cmd.c_str());
+    return ok ? 0 : -1;
+}
+
+/* A --workers run over a root whose middle image is a truncated TIFF: the
+ * batch must finish, with that image alone quarantined */
+int benchWorkers(int argc, char *argv[]) {
+
+    int images = (argc > 0) ? atoi(argv[0]) : 8;
+    int size = (argc > 1) ? atoi(argv[1]) : 1024;
+    std::string analyze = (argc > 2) ? argv[2] : "./analyze";
+    if (images < 2) images = 8;
+    if (size <= 0) size = 1024;
+    if (access(analyze.c_str(), X_OK)) {
+        std::cerr << "No analyze binary at " << analyze << std::endl;
+        return -1;
+    }
+
+    char base[] = ROOTS_BENCH_TEMPLATE;
+    if (!mkdtemp(base)) {
+        std::cerr << "Could not create the roots directory" << std::endl;
+        return -1;
+    }
+    std::string root = std::string(base) + "/root/";
+    std::string bad = "image_" + std::to_string(images / 2) + ".tif";
+    unsigned int seed = 12345;
+    struct stat st;
+    bool ok = writeRoot(root, images, size, &seed) &&
+                !stat((root + "original/" + bad).c_str(), &st) &&
+                !truncate((root + "original/" + bad).c_str(), st.st_size / 2);
+
+    std::cout << images << " images " << size << "x" << size << ", " << bad
+              << " truncated, " << WORKERS_BENCH_PROCESSES << " workers" << std::endl;
+    std::cout << "seconds,rows,quarantined,quarantined_image" << std::endl;
+    if (ok) {
+        std::vector<std::string> command = { analyze, "--sync=none", "--log-level=off",
+                    "--workers=" + std::to_string(WORKERS_BENCH_PROCESSES), root };
+        double seconds = runConcurrently(std::vector<std::vector<std::string>>(1, command));
+        std::string last_row, quarantined_image;
+        long rows = csvRows(root + "computed_metrics.csv", &last_row);
+        long quarantined = csvRows(root + "computed_quarantine.csv", &quarantined_image);
+        std::cout << seconds << "," << rows << "," << quarantined << ","
+                  << quarantined_image.substr(0, quarantined_image.find(',')) << std::endl;
+        ok = (seconds > 0) && (rows == images) && (quarantined == 1) &&
+                                    !quarantined_image.compare(0, bad.size() + 1, bad + ",");
+        if (!ok) {
+            std::cerr << "The batch did not finish with " << bad << " quarantined" << std::endl;
+        }
+    } else {
+        std::cerr << "Could not write the root" << std::endl;
+    }
+
+    std::string cmd = std::string("rm -rf ") + base;
+    system(cmd.c_str());
+    return ok ? 0 : -1;
+}
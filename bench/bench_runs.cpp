@@ -0,0 +1,113 @@
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "bench.hpp"
+#include "run_mask.hpp"
+
+
+#define RUN_BENCH_REPEATS       5       // Timed calls per operation
+#define RUN_BENCH_THRESHOLD     35      // Threshold of the red and white channels
+
+/* Mean milliseconds of a call */
+template <typename Fn>
+static double timeMs(const Fn &fn) {
+    double start = benchSeconds();
+    for (int r = 0; r < RUN_BENCH_REPEATS; r++) fn();
+    return 1000 * (benchSeconds() - start) / RUN_BENCH_REPEATS;
+}
+
+/* Gray channel: dim noise below the threshold and bright discs of radius
+ * 4 to 16 covering about fraction of the pixels */
+static void drawChannel(int size, double fraction, unsigned int *seed, cv::Mat *channel) {
+    channel->create(size, size, CV_8UC1);
+    for (int y = 0; y < size; y++) {
+        unsigned char *row = channel->ptr(y);
+        for (int x = 0; x < size; x++) {
+            *seed = *seed * 1103515245 + 12345;
+            row[x] = (unsigned char)((*seed >> 16) % RUN_BENCH_THRESHOLD);
+        }
+    }
+    const double disc_area = M_PI * 10 * 10;
+    size_t discs = (size_t)(fraction * size * size / disc_area);
+    for (size_t n = 0; n < discs; n++) {
+        *seed = *seed * 1103515245 + 12345;
+        int cx = (int)((*seed >> 8) % size);
+        *seed = *seed * 1103515245 + 12345;
+        int cy = (int)((*seed >> 8) % size);
+        *seed = *seed * 1103515245 + 12345;
+        int r = 4 + (int)((*seed >> 8) % 13);
+        cv::circle(*channel, cv::Point(cx, cy), r, cv::Scalar(100 + (*seed >> 8) % 156),
+                                                                        cv::FILLED);
+    }
+}
+
+/* Threshold, AND, OR, area and connected components of two channels as
+ * dense masks and as runs, and the bytes each takes, per foreground fraction */
+int benchRuns(int argc, char *argv[]) {
+
+    int size = (argc > 0) ? atoi(argv[0]) : 8192;
+    if (size <= 0) size = 8192;
+
+    // Both sides single threaded
+    int opencv_threads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    std::cout << "image " << size << "x" << size << std::endl;
+    std::cout << "foreground,dense_mib,runs_mib,threshold_ms,threshold_runs_ms,and_ms,"
+              << "and_runs_ms,or_ms,or_runs_ms,area_ms,area_runs_ms,ccl_ms,ccl_runs_ms,"
+              << "components" << std::endl;
+    const double fractions[] = { 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.4 };
+    unsigned int seed = 12345;
+    for (size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++) {
+        cv::Mat gray_a, gray_b;
+        drawChannel(size, fractions[f], &seed, &gray_a);
+        drawChannel(size, fractions[f], &seed, &gray_b);
+
+        cv::Mat mask_a, mask_b, dense;
+        RunMask runs_a, runs_b, runs;
+        double threshold_ms = timeMs([&] {
+            cv::threshold(gray_a, mask_a, RUN_BENCH_THRESHOLD, 255, cv::THRESH_BINARY);
+        });
+        double threshold_runs_ms = timeMs([&] {
+            buildRunMask(gray_a, RUN_BENCH_THRESHOLD, &runs_a);
+        });
+        cv::threshold(gray_b, mask_b, RUN_BENCH_THRESHOLD, 255, cv::THRESH_BINARY);
+        buildRunMask(gray_b, RUN_BENCH_THRESHOLD, &runs_b);
+
+        double and_ms = timeMs([&] { cv::bitwise_and(mask_a, mask_b, dense); });
+        double and_runs_ms = timeMs([&] { andRunMasks(runs_a, runs_b, &runs); });
+        double or_ms = timeMs([&] { cv::bitwise_or(mask_a, mask_b, dense); });
+        double or_runs_ms = timeMs([&] { orRunMasks(runs_a, runs_b, &runs); });
+
+        volatile uint64_t area = 0;
+        double area_ms = timeMs([&] { area = cv::countNonZero(mask_a); });
+        double area_runs_ms = timeMs([&] { area = runMaskArea(runs_a); });
+        if (runMaskArea(runs_a) != (uint64_t)cv::countNonZero(mask_a)) {
+            std::cerr << "Run mask area differs from the dense one" << std::endl;
+            return -1;
+        }
+
+        cv::Mat labels, stats, centroids;
+        std::vector<uint32_t> run_labels;
+        std::vector<RunComponent> components;
+        double ccl_ms = timeMs([&] {
+            cv::connectedComponentsWithStats(mask_a, labels, stats, centroids, 8, CV_32S);
+        });
+        double ccl_runs_ms = timeMs([&] { labelRuns(runs_a, &run_labels, &components); });
+
+        double foreground = (double)area / ((double)size * size);
+        double runs_mib = (runs_a.row_runs.size() * sizeof(uint32_t) +
+                                runs_a.runs.size() * sizeof(MaskRun)) / 1048576.0;
+        std::cout << foreground << "," << mask_a.total() / 1048576.0 << "," << runs_mib << ","
+                  << threshold_ms << "," << threshold_runs_ms << "," << and_ms << ","
+                  << and_runs_ms << "," << or_ms << "," << or_runs_ms << "," << area_ms << ","
+                  << area_runs_ms << "," << ccl_ms << "," << ccl_runs_ms << ","
+                  << components.size() << std::endl;
+    }
+    cv::setNumThreads(opencv_threads);
+    return 0;
+}
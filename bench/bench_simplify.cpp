@@ -0,0 +1,115 @@
+#include <cmath>
+#include <iostream>
+#include <cstdlib>
+
+#include "bench.hpp"
+#include "contour_simplify.hpp"
+
+
+/* Area, perimeter and min-rect of every contour, the geometric features */
+static double geometricFeatures(const std::vector<std::vector<cv::Point>> &contours) {
+    double checksum = 0;
+    for (size_t i = 0; i < contours.size(); i++) {
+        checksum += contourArea(contours[i]);
+        checksum += arcLength(contours[i], true);
+        checksum += minAreaRect(cv::Mat(contours[i])).size.width;
+    }
+    return checksum;
+}
+
+static size_t contourPoints(const std::vector<std::vector<cv::Point>> &contours) {
+    size_t points = 0;
+    for (size_t i = 0; i < contours.size(); i++) points += contours[i].size();
+    return points;
+}
+
+/* Feature time and drift of each simplification against the exact contours */
+int benchSimplify(int argc, char *argv[]) {
+
+    int size = (argc > 0) ? atoi(argv[0]) : 4096;
+    if (size <= 0) size = 4096;
+    int cells = (argc > 1) ? atoi(argv[1]) : 2000;
+    if (cells <= 0) cells = 2000;
+
+    // Large irregular cells with ragged outlines
+    unsigned int seed = 12345;
+    cv::Mat slide = cv::Mat::zeros(size, size, CV_8UC1);
+    for (int n = 0; n < cells; n++) {
+        seed = seed * 1103515245 + 12345;
+        int cx = (int)((seed >> 8) % size);
+        seed = seed * 1103515245 + 12345;
+        int cy = (int)((seed >> 8) % size);
+        seed = seed * 1103515245 + 12345;
+        double r = 20 + (seed >> 8) % 60;
+        std::vector<std::vector<cv::Point>> outline(1);
+        for (int k = 0; k < 96; k++) {
+            seed = seed * 1103515245 + 12345;
+            double t = k * 2 * M_PI / 96;
+            double radius = r * (0.8 + 0.4 * ((seed >> 8) % 1000) / 1000.0);
+            outline[0].push_back(cv::Point(cx + (int)(radius * cos(t)),
+                                           cy + (int)(radius * sin(t))));
+        }
+        cv::fillPoly(slide, outline, cv::Scalar(255));
+    }
+    std::vector<std::vector<cv::Point>> contours;
+    cv::findContours(slide, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+
+    double start = benchSeconds();
+    double checksum = geometricFeatures(contours);
+    double exact_ms = 1000 * (benchSeconds() - start);
+    size_t exact_points = contourPoints(contours);
+
+    ThreadPool pool(0);
+    std::cout << "image " << size << "x" << size << ", " << contours.size() << " contours, "
+              << exact_points << " points, " << pool.size() << " threads" << std::endl;
+    std::cout << "exact features " << exact_ms << " ms" << std::endl;
+    std::cout << "method,tolerance,simplify_ms,features_ms,speedup,points,kB,area_drift,"
+              << "area_drift_max,perimeter_drift,perimeter_drift_max,aspect_drift,"
+              << "aspect_drift_max" << std::endl;
+
+    const SimplifySpec specs[] = {
+        { SimplifyMethod::DOUGLAS_PEUCKER, 0.5 }, { SimplifyMethod::DOUGLAS_PEUCKER, 1.0 },
+        { SimplifyMethod::DOUGLAS_PEUCKER, 2.0 }, { SimplifyMethod::VISVALINGAM, 0.5 },
+        { SimplifyMethod::VISVALINGAM, 1.0 },     { SimplifyMethod::VISVALINGAM, 2.0 }
+    };
+    for (size_t s = 0; s < sizeof(specs) / sizeof(specs[0]); s++) {
+        std::vector<std::vector<cv::Point>> simplified;
+        start = benchSeconds();
+        simplifyContours(contours, specs[s], &pool, &simplified);
+        double simplified_at = benchSeconds();
+        checksum += geometricFeatures(simplified);
+        double done = benchSeconds();
+
+        ContourMeasures exact_measures, simplified_measures;
+        measureContours(contours, &exact_measures);
+        measureContours(simplified, &simplified_measures);
+        SimplifyDrift drift;
+        measureDrift(contours, exact_measures, simplified, simplified_measures,
+                                                            contours.size(), &drift);
+        double simplify_ms = 1000 * (simplified_at - start);
+        double features_ms = 1000 * (done - simplified_at);
+        std::cout << ((specs[s].method == SimplifyMethod::DOUGLAS_PEUCKER) ? "dp" : "vw")
+                  << "," << specs[s].tolerance << "," << simplify_ms << "," << features_ms
+                  << "," << exact_ms / (simplify_ms + features_ms) << "," << drift.points_out
+                  << "," << drift.points_out * sizeof(cv::Point) / 1024;
+        for (int m = 0; m < NUM_DRIFT_METRICS; m++) {
+            std::cout << "," << (drift.sampled ? drift.error_sum[m] / drift.sampled : 0.0)
+                      << "," << drift.error_max[m];
+        }
+        std::cout << std::endl;
+    }
+
+    // Scaling of the simplification itself
+    std::cout << "threads,dp_1_ms" << std::endl;
+    std::vector<unsigned int> counts = benchThreadCounts();
+    for (size_t t = 0; t < counts.size(); t++) {
+        ThreadPool sweep_pool(counts[t]);
+        std::vector<std::vector<cv::Point>> simplified;
+        start = benchSeconds();
+        simplifyContours(contours, specs[1], &sweep_pool, &simplified);
+        std::cout << counts[t] << "," << 1000 * (benchSeconds() - start) << std::endl;
+    }
+    std::cout << "exact points " << exact_points * sizeof(cv::Point) / 1024 << " kB, checksum "
+              << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "opencv2/imgcodecs.hpp"
+
+#include "bench.hpp"
+#include "submit_server.hpp"
+
+
+#define SUBMIT_BENCH_SOCKET     "/tmp/analyze_bench.sock"
+#define SUBMIT_BENCH_FILE       "/tmp/analyze_bench_submit.tif"
+
+/* Mean of every plane, standing in for the pipeline */
+static void planeMeans(const std::vector<cv::Mat> &planes, std::vector<double> *values) {
+    values->clear();
+    for (size_t i = 0; i < planes.size(); i++) values->push_back(cv::mean(planes[i])[0]);
+}
+
+/* Frames handed over in a memfd against written to disk and read back */
+int benchSubmit(int argc, char *argv[]) {
+
+    int size = (argc > 0) ? atoi(argv[0]) : 4096;
+    int frames = (argc > 1) ? atoi(argv[1]) : 20;
+    if (size <= 0) size = 4096;
+    if (frames <= 0) frames = 20;
+    const size_t plane_bytes = (size_t)size * size;
+    std::cout << "frame " << size << "x" << size << " BGR, " << frames << " frames" << std::endl;
+
+    // The acquisition side keeps its frame in a segment to begin with
+    unsigned char *data = NULL;
+    int segment = createSegment(3 * plane_bytes, &data);
+    if (segment < 0) {
+        std::cerr << "Could not create the segment" << std::endl;
+        return -1;
+    }
+    std::vector<cv::Mat> planes(3);
+    for (int i = 0; i < 3; i++) {
+        planes[i] = cv::Mat(size, size, CV_8UC1, data + i * plane_bytes);
+        cv::randu(planes[i], cv::Scalar(0), cv::Scalar(256));
+    }
+
+    // Sealed, so that the server analyzes it in place
+    for (int i = 0; i < 3; i++) planes[i] = planes[i].clone();
+    munmap(data, 3 * plane_bytes);
+    if (!sealSegment(segment)) {
+        std::cerr << "Could not seal the segment" << std::endl;
+        close(segment);
+        return -1;
+    }
+
+    SubmitServer server(SUBMIT_BENCH_SOCKET, [](const SubmitRequest &, const SubmitPeer &,
+                                                std::vector<cv::Mat> *in, SubmitResult *result) {
+        planeMeans(*in, &result->values);
+    });
+    std::thread serving([&server] { server.run(); });
+    SubmitClient *client = NULL;
+    for (int attempt = 0; (attempt < 100) && !(client && client->connected()); attempt++) {
+        delete client;
+        usleep(10000);
+        client = new SubmitClient(SUBMIT_BENCH_SOCKET);
+    }
+
+    SubmitRequest request;
+    memset(&request, 0, sizeof(request));
+    request.magic = SUBMIT_MAGIC;
+    request.version = SUBMIT_VERSION;
+    request.rows = size;
+    request.cols = size;
+    request.depth = 8;
+    request.channels = 3;
+    request.planar = 1;
+    request.step = size;
+    request.plane_stride = plane_bytes;
+
+    std::cout << "route,ms_per_frame,MBps" << std::endl;
+    bool ok = client->connected();
+    double start = benchSeconds();
+    for (int f = 0; ok && (f < frames); f++) {
+        SubmitResult result;
+        request.id = f;
+        ok = client->submit(request, segment, &result) && (result.status == SubmitStatus::OK);
+    }
+    double seconds = benchSeconds() - start;
+    if (ok) {
+        std::cout << "memfd," << seconds * 1e3 / frames << ","
+                  << 3.0 * plane_bytes * frames / seconds / 1e6 << std::endl;
+    } else {
+        std::cerr << "Submission failed" << std::endl;
+    }
+
+    // The route it replaces: write the frame, then read and split it again
+    cv::Mat image;
+    cv::merge(planes, image);
+    std::vector<double> values;
+    start = benchSeconds();
+    for (int f = 0; f < frames; f++) {
+        cv::imwrite(SUBMIT_BENCH_FILE, image);
+        cv::Mat read = cv::imread(SUBMIT_BENCH_FILE, cv::IMREAD_COLOR);
+        std::vector<cv::Mat> read_planes;
+        cv::split(read, read_planes);
+        planeMeans(read_planes, &values);
+    }
+    seconds = benchSeconds() - start;
+    remove(SUBMIT_BENCH_FILE);
+    std::cout << "file," << seconds * 1e3 / frames << ","
+              << 3.0 * plane_bytes * frames / seconds / 1e6 << std::endl;
+
+    delete client;
+    server.stop();
+    serving.join();
+    close(segment);
+    return ok ? 0 : -1;
+}
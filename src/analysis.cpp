@@ -0,0 +1,402 @@
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+#include "analysis.hpp"
+#include "run_mask.hpp"
+#include "deadline.hpp"
+
+
+const char *SKETCH_METRIC_NAMES[NUM_SKETCH_METRICS] = { "Area", "Diameter", "Aspect_Ratio" };
+
+/* Normalize the first plane of the image to 0..255 */
+void normalizeChannel(cv::Mat src, cv::Mat *norm) {
+
+    // Split the image
+    std::vector<cv::Mat> channel(3);
+    cv::split(src, channel);
+    cv::Mat img = channel[0];
+
+    // Normalize the image
+    cv::normalize(img, *norm, 0, 255, cv::NORM_MINMAX, CV_8UC1);
+}
+
+/* Enhance the image */
+bool enhanceImage(  cv::Mat src,
+                    ChannelType channel_type,
+                    cv::Mat *norm,
+                    cv::Mat *dst    ) {
+
+    // Normalize the image
+    cv::Mat normalized;
+    normalizeChannel(src, &normalized);
+
+    // Enhance the image using Gaussian blur and thresholding
+    cv::Mat enhanced;
+    switch(channel_type) {
+        case ChannelType::GREEN: {
+            // Enhance the green channel
+            cv::threshold(normalized, enhanced, GREEN_THRESHOLD, 255, cv::THRESH_BINARY);
+        } break;
+
+        case ChannelType::RED: {
+            // Enhance the red channel
+            cv::threshold(normalized, enhanced, RED_THRESHOLD, 255, cv::THRESH_BINARY);
+        } break;
+
+        case ChannelType::BLUE: {
+            // Enhance the white channel
+            cv::threshold(normalized, enhanced, BLUE_THRESHOLD, 255, cv::THRESH_BINARY);
+        } break;
+
+        default: {
+            std::cerr << "Invalid channel type" << std::endl;
+            return false;
+        }
+    }
+    *norm = normalized;
+    *dst = enhanced;
+    return true;
+}
+
+/* Sample every DENSITY_ROW_STEP-th row of a binary image for its foreground
+ * fraction and the pixels that start a new component in raster order */
+DensityEstimate estimateDensity(const cv::Mat &binary) {
+
+    DensityEstimate density = { 0.0, 0.0 };
+    if (binary.empty()) return density;
+
+    // A component starts at a foreground pixel with no 8-connected
+    // foreground neighbour on its left or in the row above
+    size_t foreground = 0, starts = 0, sampled = 0;
+    for (int y = 0; y < binary.rows; y += DENSITY_ROW_STEP) {
+        const unsigned char *row = binary.ptr(y);
+        const unsigned char *up = y ? binary.ptr(y - 1) : NULL;
+        unsigned int left = 0, up_left = 0;
+        for (int x = 0; x < binary.cols; x++) {
+            unsigned int pixel = (row[x] != 0);
+            unsigned int above = up ? (up[x] != 0) : 0;
+            unsigned int up_right = (up && (x + 1 < binary.cols)) ? (up[x + 1] != 0) : 0;
+            foreground += pixel;
+            starts += pixel & !(left | up_left | above | up_right);
+            left = pixel;
+            up_left = above;
+        }
+        sampled++;
+    }
+    density.foreground = (double)foreground / ((double)sampled * binary.cols);
+    density.components = (double)starts * binary.rows / sampled;
+    return density;
+}
+
+/* Pick the strategies of a channel, forced by a non AUTO strategy */
+ContourPlan planContours(const DensityEstimate &density, AnalysisStrategy strategy) {
+
+    ContourPlan plan;
+    switch (strategy) {
+        case AnalysisStrategy::SPARSE: {
+            plan.label_first = plan.approx_min_rect = plan.parallel_features = false;
+        } break;
+
+        case AnalysisStrategy::DENSE: {
+            plan.label_first = plan.approx_min_rect = plan.parallel_features = true;
+        } break;
+
+        default: {
+            // Crowded channels are mostly fragments that never become cells.
+            // The approximate min-rect changes the metrics, only DENSE has it.
+            plan.label_first = (density.components >= DENSE_COMPONENTS);
+            plan.approx_min_rect = false;
+            plan.parallel_features = (density.components >= PARALLEL_MIN_CELLS);
+        } break;
+    }
+    return plan;
+}
+
+/* One line description of the density and plan for the log */
+std::string describePlan(const DensityEstimate &density, const ContourPlan &plan) {
+    char line[256];
+    snprintf(line, sizeof(line), "foreground %.2f%%, ~%.0f components: %s, %s, %s",
+             100.0 * density.foreground, density.components,
+             plan.label_first ? "labeling + contours" : "contours",
+             plan.approx_min_rect ? "approximate min-rect" : "exact min-rect",
+             plan.parallel_features ? "parallel features" : "serial features");
+    return line;
+}
+
+/* Remove the components whose bounding box cannot enclose min_area. A
+ * contour runs through pixel centers, so its area is below (w-1)*(h-1)
+ * and contourCalc would reject it anyway. The components are labelled on
+ * the runs of the mask, without a label image. */
+static void dropThinComponents(cv::Mat src, double min_area, cv::Mat *dst) {
+
+    RunMask runs;
+    std::vector<uint32_t> labels;
+    std::vector<RunComponent> components;
+    buildRunMask(src, 0, &runs);
+    labelRuns(runs, &labels, &components);
+
+    std::vector<unsigned char> keep(components.size(), 0);
+    for (size_t i = 0; i < components.size(); i++) {
+        double width = components[i].right - components[i].left - 1;
+        double height = components[i].bottom - components[i].top - 1;
+        keep[i] = (width * height >= min_area);
+    }
+
+    *dst = cv::Mat::zeros(src.size(), CV_8UC1);
+    for (int y = 0; y < src.rows; y++) {
+        checkDeadline(y);
+        unsigned char *out = dst->ptr(y);
+        for (uint32_t r = runs.row_runs[y]; r < runs.row_runs[y + 1]; r++) {
+            if (!keep[labels[r]]) continue;
+            memset(out + runs.runs[r].start, 255, runs.runs[r].end - runs.runs[r].start);
+        }
+    }
+}
+
+/* Find the contours in the image */
+void contourCalc(   cv::Mat src, ChannelType channel_type, 
+                    double min_area, const ContourPlan &plan, cv::Mat *dst, 
+                    std::vector<std::vector<cv::Point>> *contours, 
+                    std::vector<cv::Vec4i> *hierarchy, 
+                    std::vector<HierarchyType> *validity_mask, 
+                    std::vector<double> *parent_area,
+                    ContourMeasures *measures   ) {
+
+    cv::Mat temp_src;
+    if (plan.label_first) {
+        dropThinComponents(src, min_area, &temp_src);
+    } else {
+        src.copyTo(temp_src);
+    }
+    switch(channel_type) {
+        case ChannelType::GREEN : {
+            findContours(temp_src, *contours, *hierarchy, cv::RETR_EXTERNAL, 
+                                                        cv::CHAIN_APPROX_SIMPLE);
+        } break;
+
+        case ChannelType::RED :
+        case ChannelType::WHITE : {
+            findContours(temp_src, *contours, *hierarchy, cv::RETR_CCOMP, 
+                                                        cv::CHAIN_APPROX_SIMPLE);
+        } break;
+
+        default: return;
+    }
+
+    // Every contour is measured once here, later stages reuse the sums
+    measureContours(*contours, measures);
+    *dst = cv::Mat::zeros(temp_src.size(), CV_8UC3);
+    if (!contours->size()) return;
+    validity_mask->assign(contours->size(), HierarchyType::INVALID_CNTR);
+    parent_area->assign(contours->size(), 0.0);
+
+    // Keep the contours whose size is >= than min_area
+    cv::RNG rng(12345);
+    checkDeadline();
+    for (int index = 0 ; index < (int)contours->size(); index++) {
+        checkDeadline(index);
+        if ((*hierarchy)[index][3] > -1) continue; // ignore child
+        double area_external = measures->area[index];
+        if (area_external < min_area) continue;
+
+        std::vector<int> cntr_list;
+        cntr_list.push_back(index);
+
+        int index_hole = (*hierarchy)[index][2];
+        double area_hole = 0.0;
+        while (index_hole > -1) {
+            double temp_area_hole = measures->area[index_hole];
+            if (temp_area_hole) {
+                cntr_list.push_back(index_hole);
+                area_hole += temp_area_hole;
+            }
+            index_hole = (*hierarchy)[index_hole][0];
+        }
+        double area_contour = area_external - area_hole;
+        if (area_contour >= min_area) {
+            (*validity_mask)[cntr_list[0]] = HierarchyType::PARENT_CNTR;
+            (*parent_area)[cntr_list[0]] = area_contour;
+            for (unsigned int i = 1; i < cntr_list.size(); i++) {
+                (*validity_mask)[cntr_list[i]] = HierarchyType::CHILD_CNTR;
+            }
+            cv::Scalar color = cv::Scalar(rng.uniform(0, 255), rng.uniform(0,255), 
+                                            rng.uniform(0,255));
+            drawContours(*dst, *contours, index, color, cv::FILLED, cv::LINE_8, *hierarchy);
+        }
+    }
+}
+
+/* Filter the parent contours through the cascade */
+void filterCells(   std::vector<std::vector<cv::Point>> contours,
+                    std::vector<HierarchyType> contour_mask,
+                    std::vector<double> contours_area,
+                    const ContourMeasures &measures,
+                    const FilterCascade &cascade, cv::Mat image,
+                    std::vector<std::vector<cv::Point>> *filtered_contours,
+                    std::vector<HierarchyType> *filtered_contour_mask,
+                    std::vector<double> *filtered_contours_area,
+                    ContourMeasures *filtered_measures,
+                    std::vector<int> *filtered_index,
+                    std::vector<FilterStats> *filter_stats  ) {
+
+    // Only the parents are cells, holes were subtracted from their area
+    std::vector<int> candidates;
+    for (size_t i = 0; i < contours.size(); i++) {
+        checkDeadline(i);
+        if (contour_mask[i] == HierarchyType::PARENT_CNTR) candidates.push_back((int)i);
+    }
+
+    std::vector<int> survivors;
+    cascade.run(contours, contours_area, measures.perimeter, candidates, image,
+                                                        &survivors, filter_stats);
+    for (size_t k = 0; k < survivors.size(); k++) {
+        int i = survivors[k];
+        filtered_contours->push_back(contours[i]);
+        filtered_contour_mask->push_back(contour_mask[i]);
+        filtered_contours_area->push_back(contours_area[i]);
+        filtered_index->push_back(i);
+    }
+    selectMeasures(measures, survivors, filtered_measures);
+}
+
+/* Mean intensity of the image inside a cell */
+double cellIntensity(cv::Mat image, const std::vector<cv::Point> &contour) {
+
+    cv::Rect rect = cv::boundingRect(contour) & cv::Rect(0, 0, image.cols, image.rows);
+    if (!rect.area()) return 0.0;
+    cv::Mat mask = cv::Mat::zeros(rect.size(), CV_8UC1);
+    std::vector<std::vector<cv::Point>> cell(1, contour);
+    drawContours(mask, cell, 0, 255, cv::FILLED, cv::LINE_8, cv::noArray(), INT_MAX, -rect.tl());
+    return cv::mean(image(rect), mask)[0];
+}
+
+/* Sides of the smallest rectangle over APPROX_RECT_ANGLES orientations in
+ * [0, 90) degrees. No hull and no allocation, close to the exact
+ * rectangle for the small contours of dense channels. */
+cv::Size2f approxMinRectSize(const std::vector<cv::Point> &points) {
+
+    struct Directions {
+        float c[APPROX_RECT_ANGLES], s[APPROX_RECT_ANGLES];
+        Directions() {
+            for (int k = 0; k < APPROX_RECT_ANGLES; k++) {
+                double angle = k * (M_PI / 2) / APPROX_RECT_ANGLES;
+                c[k] = (float)cos(angle);
+                s[k] = (float)sin(angle);
+            }
+        }
+    };
+    static const Directions dir;
+
+    if (points.empty()) return cv::Size2f(0, 0);
+    float min_u[APPROX_RECT_ANGLES], max_u[APPROX_RECT_ANGLES];
+    float min_v[APPROX_RECT_ANGLES], max_v[APPROX_RECT_ANGLES];
+    for (int k = 0; k < APPROX_RECT_ANGLES; k++) {
+        float x = (float)points[0].x, y = (float)points[0].y;
+        min_u[k] = max_u[k] = x * dir.c[k] + y * dir.s[k];
+        min_v[k] = max_v[k] = y * dir.c[k] - x * dir.s[k];
+    }
+    for (size_t i = 1; i < points.size(); i++) {
+        float x = (float)points[i].x, y = (float)points[i].y;
+        for (int k = 0; k < APPROX_RECT_ANGLES; k++) {
+            float u = x * dir.c[k] + y * dir.s[k];
+            float v = y * dir.c[k] - x * dir.s[k];
+            min_u[k] = std::min(min_u[k], u);
+            max_u[k] = std::max(max_u[k], u);
+            min_v[k] = std::min(min_v[k], v);
+            max_v[k] = std::max(max_v[k], v);
+        }
+    }
+
+    int best = 0;
+    float best_area = (max_u[0] - min_u[0]) * (max_v[0] - min_v[0]);
+    for (int k = 1; k < APPROX_RECT_ANGLES; k++) {
+        float area = (max_u[k] - min_u[k]) * (max_v[k] - min_v[k]);
+        if (area < best_area) {
+            best_area = area;
+            best = k;
+        }
+    }
+    return cv::Size2f(max_u[best] - min_u[best], max_v[best] - min_v[best]);
+}
+
+/* Separation metrics */
+std::string separationMetrics(
+                std::vector<std::vector<cv::Point>> contours,
+                const ContourMeasures &measures,
+                cv::Mat image, const HistogramEngine &histograms,
+                const ContourPlan &plan, ThreadPool *pool,
+                std::vector<double> *values,
+                CellSketches *sketches) {
+
+    float aggregate_diameter = 0;
+    float aggregate_aspect_ratio = 0;
+    const size_t num_cells = contours.size();
+    bool need_perimeter = histograms.uses(CellFeature::PERIMETER);
+    bool need_intensity = histograms.uses(CellFeature::INTENSITY);
+
+    CellFeatures features;
+    features[CellFeature::AREA].resize(num_cells);
+    features[CellFeature::DIAMETER].resize(num_cells);
+    features[CellFeature::ASPECT_RATIO].resize(num_cells);
+    if (need_perimeter) features[CellFeature::PERIMETER].resize(num_cells);
+    if (need_intensity) features[CellFeature::INTENSITY].resize(num_cells);
+
+    auto cellFeatures = [&](size_t i) {
+        checkDeadline(i);
+        cv::Size2f rect_size = plan.approx_min_rect ? approxMinRectSize(contours[i]) :
+                                                minAreaRect(cv::Mat(contours[i])).size;
+        float aspect_ratio = float(rect_size.width)/rect_size.height;
+        if (aspect_ratio > 1.0) aspect_ratio = 1.0/aspect_ratio;
+
+        float area = (float)measures.area[i];
+        features[CellFeature::AREA][i] = area;
+        features[CellFeature::DIAMETER][i] = 2 * sqrt(area / PI);
+        features[CellFeature::ASPECT_RATIO][i] = aspect_ratio;
+        if (need_perimeter) {
+            features[CellFeature::PERIMETER][i] = measures.perimeter[i];
+        }
+        if (need_intensity) {
+            features[CellFeature::INTENSITY][i] = cellIntensity(image, contours[i]);
+        }
+    };
+
+    // Per-cell features of crowded channels are spread over the pool
+    if (plan.parallel_features && pool && (num_cells >= PARALLEL_MIN_CELLS)) {
+        const size_t tasks = (num_cells + PARALLEL_MIN_CELLS - 1) / PARALLEL_MIN_CELLS;
+        pool->parallelFor(tasks, [&](size_t task) {
+            size_t end = std::min(num_cells, (task + 1) * PARALLEL_MIN_CELLS);
+            for (size_t i = task * PARALLEL_MIN_CELLS; i < end; i++) cellFeatures(i);
+        });
+    } else {
+        for (size_t i = 0; i < num_cells; i++) cellFeatures(i);
+    }
+
+    // Aggregates follow the cell order whichever way the features were computed
+    for (size_t i = 0; i < num_cells; i++) {
+        aggregate_aspect_ratio += (float)features[CellFeature::ASPECT_RATIO][i];
+        aggregate_diameter += features[CellFeature::DIAMETER][i];
+        sketches->metric[AREA_SKETCH].add(features[CellFeature::AREA][i]);
+        sketches->metric[DIAMETER_SKETCH].add(features[CellFeature::DIAMETER][i]);
+        sketches->metric[ASPECT_RATIO_SKETCH].add(features[CellFeature::ASPECT_RATIO][i]);
+    }
+    std::vector<unsigned int> count;
+    histograms.count(features, &count);
+
+    std::string result =    std::to_string(contours.size())     + "," +
+                            std::to_string(aggregate_diameter)  + "," +
+                            std::to_string(aggregate_aspect_ratio);
+    for (size_t i = 0; i < count.size(); i++) {
+        result += "," + std::to_string(count[i]);
+    }
+
+    values->push_back(contours.size());
+    values->push_back(aggregate_diameter);
+    values->push_back(aggregate_aspect_ratio);
+    values->insert(values->end(), count.begin(), count.end());
+
+    return result;
+}
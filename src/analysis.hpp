@@ -0,0 +1,127 @@
+#ifndef ANALYSIS_HPP
+#define ANALYSIS_HPP
+
+#include <string>
+#include <vector>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "options.hpp"
+#include "thread_pool.hpp"
+#include "histogram.hpp"
+#include "quantile_sketch.hpp"
+#include "cell_filter.hpp"
+#include "contour_measure.hpp"
+
+
+#define MIN_ARC_LENGTH          20      // Min arc length
+#define GREEN_THRESHOLD         15      // Foreground level of the normalized channels
+#define RED_THRESHOLD           35
+#define BLUE_THRESHOLD          35
+#define PI                      3.14    // Approximate value of pi
+#define DENSITY_ROW_STEP        4       // Rows sampled by the density estimate
+#define DENSE_COMPONENTS        20000   // Estimated components of a dense channel
+#define PARALLEL_MIN_CELLS      4096    // Cells worth spreading over the pool
+#define APPROX_RECT_ANGLES      16      // Orientations tried by the approximate min-rect
+
+/* Channel type */
+enum class ChannelType : unsigned char {
+    BLUE = 0,
+    GREEN,
+    RED,
+    WHITE
+};
+
+/* Hierarchy type */
+enum class HierarchyType : unsigned char {
+    INVALID_CNTR = 0,
+    CHILD_CNTR,
+    PARENT_CNTR
+};
+
+/* Per-cell features kept as quantile sketches */
+enum SketchMetric {
+    AREA_SKETCH = 0,
+    DIAMETER_SKETCH,
+    ASPECT_RATIO_SKETCH,
+    NUM_SKETCH_METRICS
+};
+extern const char *SKETCH_METRIC_NAMES[NUM_SKETCH_METRICS];
+
+/* Per-cell feature distributions of one channel */
+struct CellSketches {
+    QuantileSketch  metric[NUM_SKETCH_METRICS];
+};
+
+/* Cheap estimate of how crowded a thresholded channel is */
+struct DensityEstimate {
+    double          foreground;     // Fraction of foreground pixels
+    double          components;     // Estimated connected components
+};
+
+/* Strategies picked per channel from its density */
+struct ContourPlan {
+    bool            label_first;        // Drop components that cannot be cells before tracing
+    bool            approx_min_rect;    // Fixed orientation min-rect instead of calipers
+    bool            parallel_features;  // Per-cell features spread over the pool
+};
+
+/* Normalize the first plane of the image to 0..255 */
+void normalizeChannel(cv::Mat src, cv::Mat *norm);
+
+/* Enhance the image */
+bool enhanceImage(  cv::Mat src,
+                    ChannelType channel_type,
+                    cv::Mat *norm,
+                    cv::Mat *dst    );
+
+/* Sample every DENSITY_ROW_STEP-th row of a binary image for its foreground
+ * fraction and the pixels that start a new component in raster order */
+DensityEstimate estimateDensity(const cv::Mat &binary);
+
+/* Pick the strategies of a channel, forced by a non AUTO strategy */
+ContourPlan planContours(const DensityEstimate &density, AnalysisStrategy strategy);
+
+/* One line description of the density and plan for the log */
+std::string describePlan(const DensityEstimate &density, const ContourPlan &plan);
+
+/* Find the contours in the image */
+void contourCalc(   cv::Mat src, ChannelType channel_type,
+                    double min_area, const ContourPlan &plan, cv::Mat *dst,
+                    std::vector<std::vector<cv::Point>> *contours,
+                    std::vector<cv::Vec4i> *hierarchy,
+                    std::vector<HierarchyType> *validity_mask,
+                    std::vector<double> *parent_area,
+                    ContourMeasures *measures   );
+
+/* Filter the parent contours through the cascade, the work of each
+ * filter is reported in filter_stats */
+void filterCells(   std::vector<std::vector<cv::Point>> contours,
+                    std::vector<HierarchyType> contour_mask,
+                    std::vector<double> contours_area,
+                    const ContourMeasures &measures,
+                    const FilterCascade &cascade, cv::Mat image,
+                    std::vector<std::vector<cv::Point>> *filtered_contours,
+                    std::vector<HierarchyType> *filtered_contour_mask,
+                    std::vector<double> *filtered_contours_area,
+                    ContourMeasures *filtered_measures,
+                    std::vector<int> *filtered_index,
+                    std::vector<FilterStats> *filter_stats  );
+
+/* Sides of the smallest rectangle over APPROX_RECT_ANGLES orientations */
+cv::Size2f approxMinRectSize(const std::vector<cv::Point> &points);
+
+/* Mean intensity of the image inside a cell */
+double cellIntensity(cv::Mat image, const std::vector<cv::Point> &contour);
+
+/* Separation metrics: CSV fields of the channel, their numeric values
+ * appended to values and the per-cell features added to the sketches */
+std::string separationMetrics(
+                std::vector<std::vector<cv::Point>> contours,
+                const ContourMeasures &measures,
+                cv::Mat image, const HistogramEngine &histograms,
+                const ContourPlan &plan, ThreadPool *pool,
+                std::vector<double> *values,
+                CellSketches *sketches);
+
+#endif // ANALYSIS_HPP
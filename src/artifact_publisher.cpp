@@ -0,0 +1,210 @@
+#include <set>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "artifact_publisher.hpp"
+#include "event_log.hpp"
+
+
+static const char *SYNC_MODE_NAMES[] = { "fdatasync", "syncfs", "none" };
+
+/* Name to write an output under, in the same directory */
+std::string stagedPath(const std::string &path) {
+    size_t name = path.find_last_of('/');
+    name = (name == std::string::npos) ? 0 : name + 1;
+    return path.substr(0, name) + STAGED_PREFIX + path.substr(name);
+}
+
+static std::string parentDirectory(const std::string &path) {
+    size_t name = path.find_last_of('/');
+    if (name == std::string::npos) return ".";
+    return name ? path.substr(0, name) : "/";
+}
+
+/* Make the temporaries and the kept files durable, then rename the
+ * temporaries into place and sync the directories holding them. The
+ * sizes the kept files were synced at go into kept_sizes. */
+static bool syncAndRename(  const std::vector<Artifact> &artifacts,
+                            const std::vector<std::string> &kept, SyncMode mode,
+                            std::vector<uint64_t> *kept_sizes   ) {
+
+    bool ok = true;
+    std::vector<std::string> files;
+    for (size_t i = 0; i < artifacts.size(); i++) files.push_back(artifacts[i].temporary);
+    files.insert(files.end(), kept.begin(), kept.end());
+
+    std::vector<int> fds(files.size(), -1);
+    for (size_t i = 0; i < files.size(); i++) {
+        fds[i] = open(files[i].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fds[i] < 0) {
+            LOG(ERROR, "missing_output").field("path", files[i]);
+            ok = false;
+        }
+    }
+
+    // Writeback of every file goes out together before the first wait, so
+    // that the group costs about one device flush rather than one per file
+    if (mode == SyncMode::FDATASYNC) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i] >= 0) sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+            if ((fds[i] >= 0) && fdatasync(fds[i])) ok = false;
+        }
+    } else if (mode == SyncMode::SYNCFS) {
+        std::set<dev_t> synced;
+        for (size_t i = 0; i < fds.size(); i++) {
+            struct stat info;
+            if ((fds[i] < 0) || fstat(fds[i], &info) || synced.count(info.st_dev)) continue;
+            if (syncfs(fds[i])) ok = false;
+            synced.insert(info.st_dev);
+        }
+    }
+
+    kept_sizes->clear();
+    for (size_t i = artifacts.size(); i < fds.size(); i++) {
+        struct stat info;
+        kept_sizes->push_back(((fds[i] >= 0) && !fstat(fds[i], &info)) ? info.st_size : 0);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    if (!ok && (mode != SyncMode::NONE)) {
+        LOG(ERROR, "sync_failed").field("files", files.size());
+    }
+
+    // Only complete, durable files ever appear under the final names
+    std::set<std::string> directories;
+    for (size_t i = 0; i < artifacts.size(); i++) {
+        if (fds[i] < 0) continue;
+        if (rename(artifacts[i].temporary.c_str(), artifacts[i].path.c_str())) {
+            LOG(ERROR, "publish_failed").field("path", artifacts[i].path);
+            ok = false;
+            continue;
+        }
+        directories.insert(parentDirectory(artifacts[i].path));
+    }
+    if (mode != SyncMode::NONE) {
+        for (std::set<std::string>::iterator it = directories.begin();
+                                                it != directories.end(); it++) {
+            int fd = open(it->c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if ((fd < 0) || fsync(fd)) ok = false;
+            if (fd >= 0) close(fd);
+        }
+    }
+    return ok;
+}
+
+/* Publish artifacts right away, as a commit of their own */
+bool publishArtifacts(const std::vector<Artifact> &artifacts, SyncMode mode) {
+    std::vector<uint64_t> kept_sizes;
+    return artifacts.empty() ||
+           syncAndRename(artifacts, std::vector<std::string>(), mode, &kept_sizes);
+}
+
+/* Remove the temporaries of artifacts that will not be published */
+void discardArtifacts(const std::vector<Artifact> &artifacts) {
+    for (size_t i = 0; i < artifacts.size(); i++) remove(artifacts[i].temporary.c_str());
+}
+
+
+ArtifactPublisher::ArtifactPublisher(   const std::string &journal_path, SyncMode mode,
+                                        unsigned int group_size ) :
+    m_journal_fd(-1),
+    m_mode(mode),
+    m_group_size(group_size ? group_size : 1),
+    m_pending_images(0),
+    m_images(0),
+    m_group(0),
+    m_start(std::chrono::steady_clock::now()) {
+
+    m_journal_fd = open(journal_path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (m_journal_fd < 0) {
+        LOG(ERROR, "journal_failed").field("path", journal_path);
+        return;
+    }
+    std::ostringstream line;
+    line << "start time=" << (long long)time(NULL) << " sync=" << SYNC_MODE_NAMES[(int)mode]
+         << " group=" << m_group_size;
+    journal(line.str());
+}
+
+ArtifactPublisher::~ArtifactPublisher() {
+    if (m_journal_fd >= 0) close(m_journal_fd);
+}
+
+bool ArtifactPublisher::isOpen() const {
+    return m_journal_fd >= 0;
+}
+
+unsigned int ArtifactPublisher::groupSize() const {
+    return m_group_size;
+}
+
+/* A file written all along the run, made durable at every commit */
+void ArtifactPublisher::keepSynced(const std::string &path) {
+    m_kept.push_back(path);
+}
+
+/* Queue the artifacts of an image for the next commit */
+void ArtifactPublisher::add(const std::vector<Artifact> &artifacts, size_t images) {
+    m_pending.insert(m_pending.end(), artifacts.begin(), artifacts.end());
+    m_pending_images += images;
+}
+
+size_t ArtifactPublisher::pendingImages() const {
+    return m_pending_images;
+}
+
+/* Append a line to the journal, durable unless syncing is off */
+void ArtifactPublisher::journal(const std::string &line) {
+    if (m_journal_fd < 0) return;
+    std::string text = line + "\n";
+    if (write(m_journal_fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        LOG(ERROR, "journal_failed").field("error", strerror(errno));
+    }
+    if (m_mode != SyncMode::NONE) fdatasync(m_journal_fd);
+}
+
+/* Commit the queued artifacts and record the commit point */
+bool ArtifactPublisher::commit() {
+
+    std::vector<uint64_t> kept_sizes;
+    bool ok = syncAndRename(m_pending, m_kept, m_mode, &kept_sizes);
+    m_images += m_pending_images;
+    m_group++;
+
+    // The kept files are complete up to the sizes given, in case of resume
+    std::ostringstream line;
+    line << "commit group=" << m_group << " images=" << m_images
+         << " artifacts=" << m_pending.size();
+    for (size_t i = 0; i < m_kept.size(); i++) {
+        std::string name = m_kept[i].substr(m_kept[i].find_last_of('/') + 1);
+        line << " " << name << "=" << kept_sizes[i];
+    }
+    line << " seconds=" << std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - m_start).count();
+    if (!ok) line << " failed";
+    journal(line.str());
+
+    m_pending.clear();
+    m_pending_images = 0;
+    return ok;
+}
+
+/* Last commit and the end of the run in the journal */
+bool ArtifactPublisher::finish() {
+    m_kept.clear();
+    bool ok = commit();
+    std::ostringstream line;
+    line << "finish images=" << m_images << " seconds=" << std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() - m_start).count();
+    journal(line.str());
+    return ok;
+}
@@ -0,0 +1,85 @@
+#ifndef ARTIFACT_PUBLISHER_HPP
+#define ARTIFACT_PUBLISHER_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdint.h>
+
+
+#define STAGED_PREFIX           ".part-"    // Of the name an output is written under
+#define DEFAULT_SYNC_GROUP      16          // Images per commit
+#define JOURNAL_FILE_NAME       "run_journal.log"
+
+/* How a commit makes its files durable before renaming them */
+enum class SyncMode : unsigned char {
+    FDATASYNC = 0,      // Writeback started on every file, then fdatasync each
+    SYNCFS,             // One syncfs per filesystem
+    NONE                // Renamed only, atomic but not durable
+};
+
+/* An output written under a temporary name, published as path */
+struct Artifact {
+    std::string     temporary;
+    std::string     path;
+};
+
+/* Name to write an output under: the same directory and extension, with
+ * STAGED_PREFIX in front of the file name */
+std::string stagedPath(const std::string &path);
+
+/* Publish artifacts right away, as a commit of their own */
+bool publishArtifacts(const std::vector<Artifact> &artifacts, SyncMode mode);
+
+/* Remove the temporaries of artifacts that will not be published */
+void discardArtifacts(const std::vector<Artifact> &artifacts);
+
+/* Publishes the outputs of a run in groups. Artifacts wait until the next
+ * commit, which makes them and the files kept in sync durable at once,
+ * renames them into place, syncs their directories and appends a commit
+ * point to the run journal. A killed run leaves every output of the last
+ * commit complete and the later ones under their temporary names. */
+class ArtifactPublisher {
+public:
+    ArtifactPublisher(const std::string &journal_path, SyncMode mode, unsigned int group_size);
+    ~ArtifactPublisher();
+
+    /* False if the journal could not be created */
+    bool isOpen() const;
+
+    unsigned int groupSize() const;
+
+    /* A file written all along the run, made durable at every commit
+     * up to its size then, and published by its own artifact at the end */
+    void keepSynced(const std::string &path);
+
+    /* Queue the artifacts of an image for the next commit */
+    void add(const std::vector<Artifact> &artifacts, size_t images = 1);
+
+    /* Images queued since the last commit */
+    size_t pendingImages() const;
+
+    /* Commit the queued artifacts, false if one could not be published */
+    bool commit();
+
+    /* Last commit and the end of the run in the journal */
+    bool finish();
+
+private:
+    ArtifactPublisher(const ArtifactPublisher &);
+    ArtifactPublisher &operator=(const ArtifactPublisher &);
+
+    void journal(const std::string &line);
+
+    int                         m_journal_fd;
+    SyncMode                    m_mode;
+    unsigned int                m_group_size;
+    std::vector<std::string>    m_kept;
+    std::vector<Artifact>       m_pending;
+    size_t                      m_pending_images;
+    size_t                      m_images;           // Committed so far
+    unsigned int                m_group;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // ARTIFACT_PUBLISHER_HPP
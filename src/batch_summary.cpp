@@ -0,0 +1,138 @@
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "batch_summary.hpp"
+
+
+#define SUMMARY_HEADER  "Column,Count,Mean,Variance,Min,Max,Sum,M2"
+
+RunningStats::RunningStats() :
+    count(0),
+    mean(0),
+    m2(0),
+    min(std::numeric_limits<double>::infinity()),
+    max(-std::numeric_limits<double>::infinity()),
+    sum(0) {
+}
+
+void RunningStats::add(double value) {
+    count++;
+    double delta = value - mean;
+    mean += delta / count;
+    m2 += delta * (value - mean);
+    if (value < min) min = value;
+    if (value > max) max = value;
+    sum += value;
+}
+
+/* Combine with the stats of another stream (Chan et al.) */
+void RunningStats::merge(const RunningStats &other) {
+    if (!other.count) return;
+    if (!count) {
+        *this = other;
+        return;
+    }
+    double total = (double)count + other.count;
+    double delta = other.mean - mean;
+    mean += delta * other.count / total;
+    m2 += other.m2 + delta * delta * ((double)count * other.count / total);
+    count += other.count;
+    if (other.min < min) min = other.min;
+    if (other.max > max) max = other.max;
+    sum += other.sum;
+}
+
+/* Sample variance, 0 below two values */
+double RunningStats::variance() const {
+    return (count > 1) ? m2 / (count - 1) : 0.0;
+}
+
+
+BatchSummary::BatchSummary() {
+}
+
+BatchSummary::BatchSummary(const std::vector<std::string> &columns) :
+    m_columns(columns),
+    m_stats(columns.size()) {
+}
+
+/* Account for one row of values, in column order */
+void BatchSummary::add(const std::vector<double> &values) {
+    for (size_t i = 0; (i < values.size()) && (i < m_stats.size()); i++) {
+        m_stats[i].add(values[i]);
+    }
+}
+
+/* Fold another summary in, false if its columns differ */
+bool BatchSummary::merge(const BatchSummary &other) {
+    if (m_columns.empty()) {
+        *this = other;
+        return true;
+    }
+    if (other.m_columns != m_columns) return false;
+    for (size_t i = 0; i < m_stats.size(); i++) m_stats[i].merge(other.m_stats[i]);
+    return true;
+}
+
+const std::vector<std::string> &BatchSummary::columns() const {
+    return m_columns;
+}
+
+const RunningStats &BatchSummary::stats(size_t column) const {
+    return m_stats[column];
+}
+
+/* Column names may hold spaces and '<' but never commas */
+bool BatchSummary::write(const std::string &path) const {
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    fprintf(file, "%s\n", SUMMARY_HEADER);
+    for (size_t i = 0; i < m_columns.size(); i++) {
+        const RunningStats &s = m_stats[i];
+        if (s.count) {
+            fprintf(file, "%s,%llu,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n",
+                    m_columns[i].c_str(), (unsigned long long)s.count,
+                    s.mean, s.variance(), s.min, s.max, s.sum, s.m2);
+        } else {
+            fprintf(file, "%s,0,,,,,,\n", m_columns[i].c_str());
+        }
+    }
+    return (fclose(file) == 0);
+}
+
+bool BatchSummary::read(const std::string &path) {
+
+    std::ifstream stream(path.c_str());
+    if (!stream.is_open()) return false;
+    std::string line;
+    if (!std::getline(stream, line) || (line != SUMMARY_HEADER)) return false;
+
+    m_columns.clear();
+    m_stats.clear();
+    while (std::getline(stream, line)) {
+        if (line.empty()) continue;
+        std::vector<std::string> fields;
+        std::stringstream row(line);
+        std::string field;
+        while (std::getline(row, field, ',')) fields.push_back(field);
+        if (fields.size() < 2) return false;
+
+        RunningStats s;
+        s.count = strtoull(fields[1].c_str(), NULL, 10);
+        if (s.count) {
+            if (fields.size() != 8) return false;
+            s.mean = atof(fields[2].c_str());
+            s.min  = atof(fields[4].c_str());
+            s.max  = atof(fields[5].c_str());
+            s.sum  = atof(fields[6].c_str());
+            s.m2   = atof(fields[7].c_str());
+        }
+        m_columns.push_back(fields[0]);
+        m_stats.push_back(s);
+    }
+    return true;
+}
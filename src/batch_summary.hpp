@@ -0,0 +1,54 @@
+#ifndef BATCH_SUMMARY_HPP
+#define BATCH_SUMMARY_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+
+/* Streaming count, mean, variance (Welford), min, max and sum of a column */
+struct RunningStats {
+    uint64_t    count;
+    double      mean;
+    double      m2;         // Sum of squared deviations from the mean
+    double      min;
+    double      max;
+    double      sum;
+
+    RunningStats();
+    void add(double value);
+
+    /* Combine with the stats of another stream (Chan et al.) */
+    void merge(const RunningStats &other);
+
+    /* Sample variance, 0 below two values */
+    double variance() const;
+};
+
+/* Running stats of every metric column, mergeable across threads, runs
+ * and shards without going back to the rows */
+class BatchSummary {
+public:
+    BatchSummary();
+    explicit BatchSummary(const std::vector<std::string> &columns);
+
+    /* Account for one row of values, in column order */
+    void add(const std::vector<double> &values);
+
+    /* Fold another summary in, false if its columns differ */
+    bool merge(const BatchSummary &other);
+
+    const std::vector<std::string> &columns() const;
+    const RunningStats &stats(size_t column) const;
+
+    /* CSV with one line per column, values at full precision so that a
+     * summary read back merges exactly */
+    bool write(const std::string &path) const;
+    bool read(const std::string &path);
+
+private:
+    std::vector<std::string>    m_columns;
+    std::vector<RunningStats>   m_stats;
+};
+
+#endif // BATCH_SUMMARY_HPP
@@ -0,0 +1,101 @@
+#include <set>
+#include <iostream>
+#include <algorithm>
+
+#include "buffer_plan.hpp"
+
+
+BufferPlan::BufferPlan() :
+    m_released_bytes(0), m_peak_bytes(0), m_unplanned_peak_bytes(0) {
+}
+
+/* Look up a buffer, unused until a stage declares it */
+BufferPlan::Buffer &BufferPlan::buffer(const std::string &name) {
+    std::map<std::string, Buffer>::iterator it = m_buffers.find(name);
+    if (it == m_buffers.end()) {
+        Buffer unused;
+        unused.last_stage = (size_t)-1;
+        unused.released = false;
+        it = m_buffers.insert(std::make_pair(name, unused)).first;
+    }
+    return it->second;
+}
+
+/* Declare the next stage */
+void BufferPlan::stage( const std::string &name, const std::vector<std::string> &reads,
+                                                 const std::vector<std::string> &writes ) {
+    size_t index = m_stages.size();
+    m_stages.push_back(name);
+    for (size_t i = 0; i < reads.size(); i++) buffer(reads[i]).last_stage = index;
+    for (size_t i = 0; i < writes.size(); i++) buffer(writes[i]).last_stage = index;
+}
+
+/* Mats sharing a buffer, views of one allocation counted once. Mats over
+ * external memory are left to the owner of that memory. */
+void BufferPlan::bind(const std::string &name, const std::vector<cv::Mat *> &mats) {
+    bind(name, [mats] {
+        std::set<const uchar *> allocations;
+        size_t bytes = 0;
+        for (size_t i = 0; i < mats.size(); i++) {
+            const cv::Mat &mat = *mats[i];
+            if (mat.empty() || !mat.u || !allocations.insert(mat.datastart).second) continue;
+            bytes += mat.datalimit - mat.datastart;
+        }
+        return bytes;
+    }, [mats] {
+        for (size_t i = 0; i < mats.size(); i++) mats[i]->release();
+    });
+}
+
+/* Any other buffer, by its size and how to release it */
+void BufferPlan::bind(  const std::string &name, const std::function<size_t()> &bytes,
+                        const std::function<void()> &release    ) {
+    Buffer &bound = buffer(name);
+    bound.bytes.push_back(bytes);
+    bound.release.push_back(release);
+}
+
+/* Bytes of the buffers not released yet */
+size_t BufferPlan::liveBytes() const {
+    size_t bytes = 0;
+    std::map<std::string, Buffer>::const_iterator it;
+    for (it = m_buffers.begin(); it != m_buffers.end(); ++it) {
+        if (it->second.released) continue;
+        for (size_t i = 0; i < it->second.bytes.size(); i++) bytes += it->second.bytes[i]();
+    }
+    return bytes;
+}
+
+/* Mark a stage done and release the buffers it used last */
+void BufferPlan::finish(const std::string &name) {
+
+    std::vector<std::string>::iterator stage = std::find(m_stages.begin(), m_stages.end(), name);
+    if (stage == m_stages.end()) {
+        std::cerr << "Undeclared stage " << name << std::endl;
+        return;
+    }
+    size_t index = stage - m_stages.begin();
+
+    size_t live = liveBytes();
+    m_peak_bytes = std::max(m_peak_bytes, live);
+    m_unplanned_peak_bytes = std::max(m_unplanned_peak_bytes, live + m_released_bytes);
+
+    std::map<std::string, Buffer>::iterator it;
+    for (it = m_buffers.begin(); it != m_buffers.end(); ++it) {
+        Buffer &done = it->second;
+        if (done.released || (done.last_stage > index)) continue;
+        for (size_t i = 0; i < done.bytes.size(); i++) m_released_bytes += done.bytes[i]();
+        for (size_t i = 0; i < done.release.size(); i++) done.release[i]();
+        done.released = true;
+    }
+}
+
+/* Peak bytes alive at the end of a stage */
+size_t BufferPlan::peakBytes() const {
+    return m_peak_bytes;
+}
+
+/* Peak had every buffer been kept until the end of the image */
+size_t BufferPlan::unplannedPeakBytes() const {
+    return m_unplanned_peak_bytes;
+}
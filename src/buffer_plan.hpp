@@ -0,0 +1,76 @@
+#ifndef BUFFER_PLAN_HPP
+#define BUFFER_PLAN_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+#include "opencv2/core/core.hpp"
+
+
+/* Bytes held by a vector, nested vectors included */
+template<typename T> size_t bufferBytes(const std::vector<T> &buffer) {
+    return buffer.capacity() * sizeof(T);
+}
+template<typename T> size_t bufferBytes(const std::vector<std::vector<T>> &buffer) {
+    size_t bytes = buffer.capacity() * sizeof(std::vector<T>);
+    for (size_t i = 0; i < buffer.size(); i++) bytes += buffer[i].capacity() * sizeof(T);
+    return bytes;
+}
+
+/* Lifetimes of the intermediates of one image. The stages are declared
+ * up front, in pipeline order, by the buffers they read and write. When
+ * a stage finishes, every buffer it was the last user of is released,
+ * and the bytes still alive are sampled for the peak. */
+class BufferPlan {
+public:
+    BufferPlan();
+
+    /* Declare the next stage */
+    void stage( const std::string &name, const std::vector<std::string> &reads,
+                                         const std::vector<std::string> &writes );
+
+    /* Mats sharing a buffer, released together. Views of one allocation
+     * are counted once, Mats over external memory not at all. */
+    void bind(const std::string &buffer, const std::vector<cv::Mat *> &mats);
+
+    /* Vector buffers, released by swapping with an empty one */
+    template<typename T> void bind(const std::string &buffer, std::vector<T> *vector) {
+        bind(buffer, [vector] { return bufferBytes(*vector); },
+                     [vector] { std::vector<T>().swap(*vector); });
+    }
+
+    /* Any other buffer, by its size and how to release it */
+    void bind(  const std::string &buffer, const std::function<size_t()> &bytes,
+                const std::function<void()> &release    );
+
+    /* Mark a stage done and release the buffers it used last */
+    void finish(const std::string &stage);
+
+    /* Peak bytes alive at the end of a stage */
+    size_t peakBytes() const;
+
+    /* Peak had every buffer been kept until the end of the image */
+    size_t unplannedPeakBytes() const;
+
+private:
+    struct Buffer {
+        size_t                          last_stage;     // Index of the last stage using it
+        std::vector<std::function<size_t()>> bytes;
+        std::vector<std::function<void()>>   release;
+        bool                            released;
+    };
+
+    size_t liveBytes() const;
+    Buffer &buffer(const std::string &name);
+
+    std::vector<std::string>        m_stages;
+    std::map<std::string, Buffer>   m_buffers;
+    size_t                          m_released_bytes;
+    size_t                          m_peak_bytes;
+    size_t                          m_unplanned_peak_bytes;
+};
+
+#endif // BUFFER_PLAN_HPP
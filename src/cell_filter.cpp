@@ -0,0 +1,179 @@
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+#include "cell_filter.hpp"
+#include "analysis.hpp"
+#include "deadline.hpp"
+
+
+static const char *FILTER_NAMES[] = {
+    "points", "area", "perimeter", "bbox", "aspect_ratio", "solidity", "intensity"
+};
+
+static double filterClock() {
+    return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FilterStats::FilterStats() : evaluated(0), rejected(0), seconds(0.0) {
+}
+
+void FilterStats::merge(const FilterStats &other) {
+    evaluated += other.evaluated;
+    rejected += other.rejected;
+    seconds += other.seconds;
+}
+
+/* Parse "<property>:<min>[:<max>]" */
+bool parseFilterSpec(const std::string &text, FilterSpec *spec) {
+
+    std::vector<std::string> fields;
+    std::stringstream stream(text);
+    std::string field;
+    while (std::getline(stream, field, ':')) fields.push_back(field);
+    if ((fields.size() != 2) && (fields.size() != 3)) return false;
+
+    int kind = -1;
+    for (int i = 0; i < (int)FilterKind::NUM_FILTERS; i++) {
+        if (fields[0] == FILTER_NAMES[i]) kind = i;
+    }
+    if (kind < 0) return false;
+    spec->kind = (FilterKind)kind;
+
+    char *end = NULL;
+    spec->min = strtod(fields[1].c_str(), &end);
+    if (fields[1].empty() || *end) return false;
+    spec->max = std::numeric_limits<double>::infinity();
+    if (fields.size() == 3) {
+        spec->max = strtod(fields[2].c_str(), &end);
+        if (fields[2].empty() || *end || (spec->max < spec->min)) return false;
+    }
+    return true;
+}
+
+/* The historical filters: at least 5 points and MIN_ARC_LENGTH of perimeter */
+std::vector<FilterSpec> defaultFilterSpecs() {
+    const double unbounded = std::numeric_limits<double>::infinity();
+    FilterSpec points = { FilterKind::POINTS, 5, unbounded };
+    FilterSpec perimeter = { FilterKind::PERIMETER, MIN_ARC_LENGTH, unbounded };
+    std::vector<FilterSpec> specs;
+    specs.push_back(points);
+    specs.push_back(perimeter);
+    return specs;
+}
+
+/* Name of a filter for the reports, e.g. "aspect_ratio" */
+const char *filterName(FilterKind kind) {
+    return FILTER_NAMES[(int)kind];
+}
+
+
+FilterCascade::FilterCascade(const std::vector<FilterSpec> &specs) : m_specs(specs) {
+}
+
+const std::vector<FilterSpec> &FilterCascade::specs() const {
+    return m_specs;
+}
+
+/* Evaluate one filter on one cell */
+bool FilterCascade::passes(const FilterSpec &spec, const std::vector<cv::Point> &contour,
+                            double area, double perimeter, cv::Mat image) const {
+    double value = 0.0;
+    switch (spec.kind) {
+        case FilterKind::POINTS: {
+            value = (double)contour.size();
+        } break;
+
+        case FilterKind::AREA: {
+            value = area;
+        } break;
+
+        case FilterKind::PERIMETER: {
+            value = perimeter;
+        } break;
+
+        case FilterKind::BBOX: {
+            cv::Rect rect = cv::boundingRect(contour);
+            value = std::max(rect.width, rect.height);
+        } break;
+
+        case FilterKind::ASPECT_RATIO: {
+            cv::Size2f size = minAreaRect(cv::Mat(contour)).size;
+            value = (size.width < size.height) ? size.width / size.height :
+                                                 size.height / size.width;
+        } break;
+
+        case FilterKind::SOLIDITY: {
+            std::vector<cv::Point> hull;
+            cv::convexHull(contour, hull);
+            double hull_area = contourArea(hull);
+            value = (hull_area > 0) ? area / hull_area : 0.0;
+        } break;
+
+        default: {
+            value = cellIntensity(image, contour);
+        } break;
+    }
+    return (value >= spec.min) && (value <= spec.max);
+}
+
+/* Indices of the candidates passing every filter, in candidate order */
+void FilterCascade::run(    const std::vector<std::vector<cv::Point>> &contours,
+                            const std::vector<double> &areas,
+                            const std::vector<double> &perimeters,
+                            const std::vector<int> &candidates, cv::Mat image,
+                            std::vector<int> *survivors,
+                            std::vector<FilterStats> *stats) const {
+
+    stats->assign(m_specs.size(), FilterStats());
+    *survivors = candidates;
+    if (candidates.empty() || m_specs.empty()) return;
+
+    // Time and rejection rate of every filter on an even sample of the cells
+    std::vector<int> sample;
+    size_t stride = std::max((size_t)1, candidates.size() / FILTER_SAMPLE_CELLS);
+    for (size_t i = 0; i < candidates.size(); i += stride) sample.push_back(candidates[i]);
+
+    std::vector<double> rank(m_specs.size());
+    for (size_t f = 0; f < m_specs.size(); f++) {
+        size_t rejected = 0;
+        double start = filterClock();
+        for (size_t i = 0; i < sample.size(); i++) {
+            int c = sample[i];
+            rejected += !passes(m_specs[f], contours[c], areas[c], perimeters[c], image);
+        }
+        double cost = (filterClock() - start) / sample.size();
+
+        // Expected cost per rejection, filters rejecting nothing go last
+        double rejection = std::max((double)rejected, 0.5) / sample.size();
+        rank[f] = cost / rejection;
+    }
+    std::vector<size_t> order(m_specs.size());
+    for (size_t f = 0; f < order.size(); f++) order[f] = f;
+    std::stable_sort(order.begin(), order.end(),
+                     [&rank](size_t a, size_t b) { return rank[a] < rank[b]; });
+
+    // Each filter only sees the survivors of the previous ones
+    for (size_t k = 0; k < order.size(); k++) {
+        const FilterSpec &spec = m_specs[order[k]];
+        FilterStats &stat = (*stats)[order[k]];
+        double start = filterClock();
+        size_t kept = 0;
+        for (size_t i = 0; i < survivors->size(); i++) {
+            checkDeadline(i);
+            int c = (*survivors)[i];
+            if (passes(spec, contours[c], areas[c], perimeters[c], image)) {
+                (*survivors)[kept++] = c;
+            }
+        }
+        stat.seconds = filterClock() - start;
+        stat.evaluated = survivors->size();
+        stat.rejected = survivors->size() - kept;
+        survivors->resize(kept);
+        if (survivors->empty()) break;
+    }
+}
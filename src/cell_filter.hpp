@@ -0,0 +1,76 @@
+#ifndef CELL_FILTER_HPP
+#define CELL_FILTER_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+
+#define FILTER_SAMPLE_CELLS     256   // Cells sampled to order the cascade
+
+/* Properties a cell can be filtered on */
+enum class FilterKind : unsigned char {
+    POINTS = 0,     // Contour points
+    AREA,           // Area without the holes
+    PERIMETER,      // Closed arc length
+    BBOX,           // Longer side of the bounding box
+    ASPECT_RATIO,   // Short over long side of the min-rect
+    SOLIDITY,       // Area over convex hull area
+    INTENSITY,      // Mean intensity inside the cell
+    NUM_FILTERS
+};
+
+/* Keep the cells whose property lies in [min, max] */
+struct FilterSpec {
+    FilterKind      kind;
+    double          min;
+    double          max;
+};
+
+/* Work done by one filter */
+struct FilterStats {
+    uint64_t        evaluated;
+    uint64_t        rejected;
+    double          seconds;
+
+    FilterStats();
+    void merge(const FilterStats &other);
+};
+
+/* Parse "<property>:<min>[:<max>]" */
+bool parseFilterSpec(const std::string &text, FilterSpec *spec);
+
+/* The historical filters: at least 5 points and MIN_ARC_LENGTH of perimeter */
+std::vector<FilterSpec> defaultFilterSpecs();
+
+/* Name of a filter for the reports, e.g. "aspect_ratio" */
+const char *filterName(FilterKind kind);
+
+/* Filters applied cheapest and most selective first. The order is picked
+ * per call from the cost and rejection rate measured on a sample of the
+ * cells, then every filter only sees the survivors of the previous ones. */
+class FilterCascade {
+public:
+    explicit FilterCascade(const std::vector<FilterSpec> &specs);
+
+    const std::vector<FilterSpec> &specs() const;
+
+    /* Indices of the candidates passing every filter, in candidate order.
+     * stats gets one entry per spec, in spec order. The perimeters are
+     * those measured with the contours. */
+    void run(   const std::vector<std::vector<cv::Point>> &contours,
+                const std::vector<double> &areas,
+                const std::vector<double> &perimeters,
+                const std::vector<int> &candidates, cv::Mat image,
+                std::vector<int> *survivors, std::vector<FilterStats> *stats) const;
+
+private:
+    bool passes(const FilterSpec &spec, const std::vector<cv::Point> &contour,
+                            double area, double perimeter, cv::Mat image) const;
+
+    std::vector<FilterSpec>     m_specs;
+};
+
+#endif // CELL_FILTER_HPP
@@ -0,0 +1,276 @@
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "chunk_store.hpp"
+#include "tiff_codec.hpp"
+
+
+/* Locate the value of a top level key in the JSON header */
+static size_t findValue(const std::string &json, const std::string &key) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return pos;
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) return pos;
+    return json.find_first_not_of(" \t\r\n", pos + 1);
+}
+
+/* Parse a JSON array of unsigned integers */
+static bool parseArray(const std::string &json, const std::string &key,
+                       std::vector<unsigned long> *values) {
+    size_t pos = findValue(json, key);
+    if ((pos == std::string::npos) || (json[pos] != '[')) return false;
+    size_t end = json.find(']', pos);
+    if (end == std::string::npos) return false;
+
+    values->clear();
+    const char *p = json.c_str() + pos + 1;
+    const char *stop = json.c_str() + end;
+    while (p < stop) {
+        char *next = NULL;
+        unsigned long value = strtoul(p, &next, 10);
+        if (next == p) {
+            p++;
+            continue;
+        }
+        values->push_back(value);
+        p = next;
+    }
+    return true;
+}
+
+/* Parse a JSON string value */
+static bool parseString(const std::string &json, const std::string &key, std::string *value) {
+    size_t pos = findValue(json, key);
+    if ((pos == std::string::npos) || (json[pos] != '"')) return false;
+    size_t end = json.find('"', pos + 1);
+    if (end == std::string::npos) return false;
+    *value = json.substr(pos + 1, end - pos - 1);
+    return true;
+}
+
+/* Parse a JSON integer value, 0 if it is missing */
+static long long parseInteger(const std::string &json, const std::string &key) {
+    size_t pos = findValue(json, key);
+    if (pos == std::string::npos) return 0;
+    return strtoll(json.c_str() + pos, NULL, 10);
+}
+
+/* Size and mtime of an input file, false if it is not there */
+static bool inputStamp(const std::string &input_path, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(input_path.c_str(), &st) || !S_ISREG(st.st_mode)) return false;
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+/* Path of one chunk */
+static std::string chunkPath(const std::string &dir, size_t plane, size_t cy, size_t cx) {
+    std::ostringstream path;
+    path << dir << "/" << plane << "." << cy << "." << cx;
+    return path.str();
+}
+
+/* Read the .zarray header, false if the store is missing or unsupported */
+bool openChunkStore(const std::string &dir, ChunkStoreInfo *info) {
+
+    std::ifstream stream((dir + "/.zarray").c_str());
+    if (!stream.is_open()) return false;
+    std::stringstream buffer;
+    buffer << stream.rdbuf();
+    std::string json = buffer.str();
+
+    std::vector<unsigned long> shape, chunks;
+    if (!parseArray(json, "shape", &shape) || !parseArray(json, "chunks", &chunks)) {
+        return false;
+    }
+    if ((shape.size() != 3) || (chunks.size() != 3) || (chunks[0] != 1)) return false;
+    if (!shape[0] || !shape[1] || !shape[2] || !chunks[1] || !chunks[2]) return false;
+
+    std::string dtype, order;
+    if (!parseString(json, "dtype", &dtype)) return false;
+    if (parseString(json, "order", &order) && (order != "C")) return false;
+    if ((dtype == "|u1") || (dtype == "<u1")) {
+        info->bits_per_sample = 8;
+    } else if (dtype == "<u2") {
+        info->bits_per_sample = 16;
+    } else {
+        return false;
+    }
+
+    // Raw chunks or numcodecs zlib
+    size_t pos = findValue(json, "compressor");
+    if (pos == std::string::npos) return false;
+    if (!json.compare(pos, 4, "null")) {
+        info->compressed = false;
+    } else {
+        std::string id;
+        if (!parseString(json.substr(pos), "id", &id) || (id != "zlib")) return false;
+        info->compressed = true;
+    }
+
+    info->planes       = (unsigned int)shape[0];
+    info->height       = (unsigned int)shape[1];
+    info->width        = (unsigned int)shape[2];
+    info->chunk_height = (unsigned int)chunks[1];
+    info->chunk_width  = (unsigned int)chunks[2];
+
+    // Stores written before the input was recorded never match it
+    std::ifstream attrs((dir + "/.zattrs").c_str());
+    std::stringstream attrs_buffer;
+    if (attrs.is_open()) attrs_buffer << attrs.rdbuf();
+    std::string attrs_json = attrs_buffer.str();
+    info->input_size   = (uint64_t)parseInteger(attrs_json, "input_size");
+    info->input_mtime  = (int64_t)parseInteger(attrs_json, "input_mtime_ns");
+    return true;
+}
+
+/* The input still has the size and mtime recorded with the store */
+bool storeInputMatches(const ChunkStoreInfo &info, const std::string &input_path) {
+    uint64_t size;
+    int64_t mtime;
+    return inputStamp(input_path, &size, &mtime) && info.input_size &&
+                    (size == info.input_size) && (mtime == info.input_mtime);
+}
+
+/* Read the region of every plane, loading only the chunks it overlaps */
+bool readChunkRegion(   const std::string &dir, const ChunkStoreInfo &info,
+                        unsigned int x, unsigned int y,
+                        unsigned int width, unsigned int height, ThreadPool *pool,
+                        unsigned char *const *planes, size_t plane_step ) {
+
+    if (!width || !height || (x + width > info.width) || (y + height > info.height)) {
+        return false;
+    }
+    const size_t sample_bytes = info.bits_per_sample / 8;
+    const size_t cx0 = x / info.chunk_width, cx1 = (x + width - 1) / info.chunk_width;
+    const size_t cy0 = y / info.chunk_height, cy1 = (y + height - 1) / info.chunk_height;
+    const size_t across = cx1 - cx0 + 1, down = cy1 - cy0 + 1;
+    const size_t chunk_bytes = (size_t)info.chunk_width * info.chunk_height * sample_bytes;
+
+    std::atomic<bool> failed(false);
+    pool->parallelFor(info.planes * down * across, [&](size_t index) {
+        if (failed) return;
+        size_t plane = index / (down * across);
+        size_t cy = cy0 + (index / across) % down;
+        size_t cx = cx0 + index % across;
+
+        static thread_local std::vector<unsigned char> raw, chunk;
+        chunk.assign(chunk_bytes, 0);
+
+        // Missing chunks hold the fill value
+        FILE *file = fopen(chunkPath(dir, plane, cy, cx).c_str(), "rb");
+        if (file) {
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+            raw.resize(size > 0 ? (size_t)size : 0);
+            bool ok = raw.empty() || (fread(raw.data(), 1, raw.size(), file) == raw.size());
+            fclose(file);
+            if (ok && info.compressed) {
+                ok = deflateDecode(raw.data(), raw.size(), chunk.data(), chunk_bytes);
+            } else if (ok) {
+                memcpy(chunk.data(), raw.data(), (raw.size() < chunk_bytes) ?
+                                                        raw.size() : chunk_bytes);
+            }
+            if (!ok) {
+                failed = true;
+                return;
+            }
+        }
+
+        // Copy the overlap of the chunk and the region
+        size_t chunk_x = cx * info.chunk_width, chunk_y = cy * info.chunk_height;
+        size_t left = (x > chunk_x) ? x : chunk_x;
+        size_t top = (y > chunk_y) ? y : chunk_y;
+        size_t right = (x + width < chunk_x + info.chunk_width) ?
+                                    x + width : chunk_x + info.chunk_width;
+        size_t bottom = (y + height < chunk_y + info.chunk_height) ?
+                                    y + height : chunk_y + info.chunk_height;
+        for (size_t row = top; row < bottom; row++) {
+            const unsigned char *src = chunk.data() +
+                ((row - chunk_y) * info.chunk_width + (left - chunk_x)) * sample_bytes;
+            unsigned char *dst = planes[plane] + (row - y) * plane_step + (left - x) * sample_bytes;
+            memcpy(dst, src, (right - left) * sample_bytes);
+        }
+    });
+    return !failed;
+}
+
+/* Write the planes as a new store, chunks compressed concurrently */
+bool writeChunkStore(   const std::string &dir, const unsigned char *const *planes,
+                        unsigned int num_planes, unsigned int width, unsigned int height,
+                        unsigned int bits_per_sample, size_t plane_step,
+                        const std::string &input_path, ThreadPool *pool ) {
+
+    // A store rewritten for a replaced input stays closed until complete
+    struct stat st;
+    if ((stat(dir.c_str(), &st) == -1) && mkdir(dir.c_str(), 0700)) return false;
+    remove((dir + "/.zarray").c_str());
+    uint64_t input_size = 0;
+    int64_t input_mtime = 0;
+    inputStamp(input_path, &input_size, &input_mtime);
+
+    const size_t sample_bytes = bits_per_sample / 8;
+    const size_t across = (width + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+    const size_t down = (height + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+    const size_t row_bytes = (size_t)STORE_CHUNK_SIZE * sample_bytes;
+
+    std::atomic<bool> failed(false);
+    pool->parallelFor(num_planes * down * across, [&](size_t index) {
+        if (failed) return;
+        size_t plane = index / (down * across);
+        size_t cy = (index / across) % down;
+        size_t cx = index % across;
+
+        // Edge chunks are padded to the full chunk shape
+        static thread_local std::vector<unsigned char> chunk, encoded;
+        chunk.assign(row_bytes * STORE_CHUNK_SIZE, 0);
+        size_t x0 = cx * STORE_CHUNK_SIZE, y0 = cy * STORE_CHUNK_SIZE;
+        size_t valid_width = (width - x0 < STORE_CHUNK_SIZE) ? width - x0 : STORE_CHUNK_SIZE;
+        size_t valid_height = (height - y0 < STORE_CHUNK_SIZE) ? height - y0 : STORE_CHUNK_SIZE;
+        for (size_t r = 0; r < valid_height; r++) {
+            memcpy(chunk.data() + r * row_bytes,
+                   planes[plane] + (y0 + r) * plane_step + x0 * sample_bytes,
+                   valid_width * sample_bytes);
+        }
+
+        FILE *file = NULL;
+        if (deflateEncode(chunk.data(), chunk.size(), &encoded)) {
+            file = fopen(chunkPath(dir, plane, cy, cx).c_str(), "wb");
+        }
+        if (!file || (fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size())) {
+            failed = true;
+        }
+        if (file && fclose(file)) failed = true;
+    });
+    if (failed) return false;
+
+    // The header goes last so that a partial store never opens
+    std::ofstream attrs((dir + "/.zattrs").c_str());
+    attrs << "{\n"
+          << "    \"channel_order\": \"BGR\",\n"
+          << "    \"input_size\": " << input_size << ",\n"
+          << "    \"input_mtime_ns\": " << input_mtime << "\n"
+          << "}\n";
+    attrs.close();
+    std::ofstream header((dir + "/.zarray").c_str());
+    header << "{\n"
+           << "    \"zarr_format\": 2,\n"
+           << "    \"shape\": [" << num_planes << ", " << height << ", " << width << "],\n"
+           << "    \"chunks\": [1, " << STORE_CHUNK_SIZE << ", " << STORE_CHUNK_SIZE << "],\n"
+           << "    \"dtype\": \"" << ((bits_per_sample == 16) ? "<u2" : "|u1") << "\",\n"
+           << "    \"compressor\": {\"id\": \"zlib\", \"level\": " << DEFLATE_LEVEL << "},\n"
+           << "    \"fill_value\": 0,\n"
+           << "    \"order\": \"C\",\n"
+           << "    \"filters\": null\n"
+           << "}\n";
+    header.close();
+    return !header.fail() && !attrs.fail();
+}
@@ -0,0 +1,51 @@
+#ifndef CHUNK_STORE_HPP
+#define CHUNK_STORE_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+#include "thread_pool.hpp"
+
+
+#define STORE_CHUNK_SIZE        1024        // Chunk width and height
+#define STORE_SUFFIX            ".zarr"     // Store directory next to the input
+
+/* Layout of a chunked array store: a Zarr v2 array of shape
+ * [planes, height, width] with zlib compressed C order chunks of
+ * [1, chunk_height, chunk_width], one file per chunk named "p.y.x". The
+ * .zattrs of the store record the input it was converted from. */
+struct ChunkStoreInfo {
+    unsigned int    planes;
+    unsigned int    width;
+    unsigned int    height;
+    unsigned int    chunk_width;
+    unsigned int    chunk_height;
+    unsigned int    bits_per_sample;    // 8 or 16
+    bool            compressed;         // zlib, otherwise raw chunks
+    uint64_t        input_size;         // Size and modification time of the
+    int64_t         input_mtime;        // input, in ns, 0 if not recorded
+};
+
+/* Read the .zarray header, false if the store is missing or unsupported */
+bool openChunkStore(const std::string &dir, ChunkStoreInfo *info);
+
+/* Read the region [x, x+width) x [y, y+height) of every plane, loading
+ * only the chunks it overlaps, concurrently on the pool */
+bool readChunkRegion(   const std::string &dir, const ChunkStoreInfo &info,
+                        unsigned int x, unsigned int y,
+                        unsigned int width, unsigned int height, ThreadPool *pool,
+                        unsigned char *const *planes, size_t plane_step );
+
+/* Write the planes as a new store, chunks compressed concurrently. The
+ * size and mtime of the file at input_path are recorded in its .zattrs. */
+bool writeChunkStore(   const std::string &dir, const unsigned char *const *planes,
+                        unsigned int num_planes, unsigned int width, unsigned int height,
+                        unsigned int bits_per_sample, size_t plane_step,
+                        const std::string &input_path, ThreadPool *pool );
+
+/* The file at input_path still has the size and mtime recorded with the
+ * store, false for a store left behind by a replaced input */
+bool storeInputMatches(const ChunkStoreInfo &info, const std::string &input_path);
+
+#endif // CHUNK_STORE_HPP
@@ -0,0 +1,38 @@
+#ifndef CONTOUR_MEASURE_HPP
+#define CONTOUR_MEASURE_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+
+/* Area and closed perimeter of every contour of a channel, measured once
+ * when the contours are found and carried along to the later stages */
+struct ContourMeasures {
+    std::vector<double>     area;           // Exact for integer points
+    std::vector<double>     perimeter;
+};
+
+/* Shoelace sum (twice the signed area, exact in int64) and closed
+ * perimeter of one contour. Coordinates must stay within +-2^25. */
+void measureContour(const cv::Point *points, size_t count,
+                    int64_t *twice_area, double *perimeter);
+
+/* Same sums without the vector kernel, for reference */
+void measureContourScalar(  const cv::Point *points, size_t count,
+                            int64_t *twice_area, double *perimeter  );
+
+/* Measure every contour in one sweep, the areas unsigned like contourArea */
+void measureContours(   const std::vector<std::vector<cv::Point>> &contours,
+                        ContourMeasures *measures   );
+
+/* Measures of contours scaled by factor */
+void scaleMeasures(unsigned int factor, ContourMeasures *measures);
+
+/* Measures of the given contours, in the given order */
+void selectMeasures(const ContourMeasures &from, const std::vector<int> &indices,
+                    ContourMeasures *into);
+
+#endif // CONTOUR_MEASURE_HPP
@@ -0,0 +1,297 @@
+#include <cmath>
+#include <queue>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+
+#include "contour_simplify.hpp"
+#include "deadline.hpp"
+
+
+const char *DRIFT_METRIC_NAMES[NUM_DRIFT_METRICS] = { "Area", "Perimeter", "Aspect_Ratio" };
+
+SimplifyDrift::SimplifyDrift() : cells(0), points_in(0), points_out(0), sampled(0) {
+    for (int m = 0; m < NUM_DRIFT_METRICS; m++) {
+        error_sum[m] = 0.0;
+        error_max[m] = 0.0;
+    }
+}
+
+void SimplifyDrift::merge(const SimplifyDrift &other) {
+    cells += other.cells;
+    points_in += other.points_in;
+    points_out += other.points_out;
+    sampled += other.sampled;
+    for (int m = 0; m < NUM_DRIFT_METRICS; m++) {
+        error_sum[m] += other.error_sum[m];
+        error_max[m] = std::max(error_max[m], other.error_max[m]);
+    }
+}
+
+/* Parse "none", "dp:<tolerance>" or "vw:<tolerance>" */
+bool parseSimplifySpec(const std::string &text, SimplifySpec *spec) {
+
+    if (text == "none") {
+        spec->method = SimplifyMethod::NONE;
+        spec->tolerance = 0.0;
+        return true;
+    }
+
+    size_t colon = text.find(':');
+    if (colon == std::string::npos) return false;
+    std::string method = text.substr(0, colon);
+    std::string tolerance = text.substr(colon + 1);
+    if (method == "dp") {
+        spec->method = SimplifyMethod::DOUGLAS_PEUCKER;
+    } else if (method == "vw") {
+        spec->method = SimplifyMethod::VISVALINGAM;
+    } else {
+        return false;
+    }
+
+    char *end = NULL;
+    spec->tolerance = strtod(tolerance.c_str(), &end);
+    return !tolerance.empty() && (*end == '\0') && std::isfinite(spec->tolerance) &&
+                                                            (spec->tolerance > 0);
+}
+
+/* Douglas-Peucker on the open chain [first, last] of x, y. The distances
+ * of a span are computed in one flat pass over the coordinate arrays,
+ * which the compiler vectorizes, before the farthest point is picked. */
+static void douglasPeucker( const double *x, const double *y, size_t first, size_t last,
+                            double tolerance2, double *distance,
+                            std::vector<std::pair<size_t, size_t>> *spans,
+                            std::vector<unsigned char> *keep    ) {
+
+    spans->clear();
+    spans->push_back(std::make_pair(first, last));
+    while (!spans->empty()) {
+        size_t a = spans->back().first, b = spans->back().second;
+        spans->pop_back();
+        if (b <= a + 1) continue;
+
+        // Squared distances to the chord, scaled by its squared length
+        const double ax = x[a], ay = y[a];
+        const double dx = x[b] - ax, dy = y[b] - ay;
+        const double length2 = dx * dx + dy * dy;
+        double limit = tolerance2 * length2;
+        if (length2 > 0) {
+            for (size_t i = a + 1; i < b; i++) {
+                double cross = dx * (y[i] - ay) - dy * (x[i] - ax);
+                distance[i] = cross * cross;
+            }
+        } else {
+            // Both ends on the same pixel, distance to the point
+            limit = tolerance2;
+            for (size_t i = a + 1; i < b; i++) {
+                distance[i] = (x[i] - ax) * (x[i] - ax) + (y[i] - ay) * (y[i] - ay);
+            }
+        }
+
+        size_t farthest = a + 1;
+        for (size_t i = a + 2; i < b; i++) {
+            if (distance[i] > distance[farthest]) farthest = i;
+        }
+        if (distance[farthest] > limit) {
+            (*keep)[farthest] = 1;
+            spans->push_back(std::make_pair(a, farthest));
+            spans->push_back(std::make_pair(farthest, b));
+        }
+    }
+}
+
+/* Closed contour split at its first point and the point farthest from it */
+static void simplifyDouglasPeucker( const std::vector<cv::Point> &contour, double tolerance,
+                                    std::vector<cv::Point> *simplified  ) {
+
+    static thread_local std::vector<double> x, y, distance;
+    static thread_local std::vector<unsigned char> keep;
+    static thread_local std::vector<std::pair<size_t, size_t>> spans;
+
+    // Coordinates as separate arrays, the first point repeated to close it
+    const size_t n = contour.size();
+    x.resize(n + 1);
+    y.resize(n + 1);
+    distance.resize(n + 1);
+    keep.assign(n + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = contour[i].x;
+        y[i] = contour[i].y;
+    }
+    x[n] = x[0];
+    y[n] = y[0];
+
+    size_t anchor = 0;
+    double anchor_distance = -1;
+    for (size_t i = 1; i < n; i++) {
+        double d = (x[i] - x[0]) * (x[i] - x[0]) + (y[i] - y[0]) * (y[i] - y[0]);
+        if (d > anchor_distance) {
+            anchor_distance = d;
+            anchor = i;
+        }
+    }
+    keep[0] = keep[anchor] = 1;
+    const double tolerance2 = tolerance * tolerance;
+    douglasPeucker(x.data(), y.data(), 0, anchor, tolerance2, distance.data(), &spans, &keep);
+    douglasPeucker(x.data(), y.data(), anchor, n, tolerance2, distance.data(), &spans, &keep);
+
+    simplified->clear();
+    for (size_t i = 0; i < n; i++) {
+        if (keep[i]) simplified->push_back(contour[i]);
+    }
+}
+
+/* Twice the area of the triangle of a point and its neighbours */
+static double triangleArea2(const cv::Point &a, const cv::Point &b, const cv::Point &c) {
+    return fabs((double)(b.x - a.x) * (c.y - a.y) - (double)(b.y - a.y) * (c.x - a.x));
+}
+
+/* Visvalingam-Whyatt: repeatedly drop the point spanning the smallest
+ * triangle with its neighbours until every triangle reaches the threshold */
+static void simplifyVisvalingam(const std::vector<cv::Point> &contour, double tolerance,
+                                std::vector<cv::Point> *simplified  ) {
+
+    typedef std::pair<double, int> Entry;
+    static thread_local std::vector<int> prev, next;
+    static thread_local std::vector<double> area;
+
+    const int n = (int)contour.size();
+    prev.resize(n);
+    next.resize(n);
+    area.resize(n);
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    for (int i = 0; i < n; i++) {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+        area[i] = triangleArea2(contour[prev[i]], contour[i], contour[next[i]]);
+        heap.push(Entry(area[i], i));
+    }
+
+    // Areas are kept doubled, entries whose area changed since are stale
+    const double threshold = 2 * tolerance * tolerance;
+    int remaining = n;
+    while (!heap.empty() && (remaining > 3)) {
+        Entry top = heap.top();
+        heap.pop();
+        int i = top.second;
+        if ((area[i] < 0) || (top.first != area[i])) continue;
+        if (top.first >= threshold) break;
+
+        int p = prev[i], q = next[i];
+        next[p] = q;
+        prev[q] = p;
+        area[i] = -1;
+        remaining--;
+
+        // Neighbours never get below the removed area, so the order holds
+        area[p] = std::max(top.first, triangleArea2(contour[prev[p]], contour[p], contour[q]));
+        area[q] = std::max(top.first, triangleArea2(contour[p], contour[q], contour[next[q]]));
+        heap.push(Entry(area[p], p));
+        heap.push(Entry(area[q], q));
+    }
+
+    simplified->clear();
+    for (int i = 0; i < n; i++) {
+        if (area[i] >= 0) simplified->push_back(contour[i]);
+    }
+}
+
+/* Simplify one closed contour, contours too small to simplify are copied */
+void simplifyContour(   const std::vector<cv::Point> &contour, const SimplifySpec &spec,
+                        std::vector<cv::Point> *simplified  ) {
+
+    if ((spec.method == SimplifyMethod::NONE) || (contour.size() <= 4)) {
+        *simplified = contour;
+        return;
+    }
+    if (spec.method == SimplifyMethod::DOUGLAS_PEUCKER) {
+        simplifyDouglasPeucker(contour, spec.tolerance, simplified);
+    } else {
+        simplifyVisvalingam(contour, spec.tolerance, simplified);
+    }
+
+    // A polygon needs three points to keep an area
+    if (simplified->size() < 3) *simplified = contour;
+}
+
+/* Simplify every contour, blocks of contours spread over the pool */
+void simplifyContours(  const std::vector<std::vector<cv::Point>> &contours,
+                        const SimplifySpec &spec, ThreadPool *pool,
+                        std::vector<std::vector<cv::Point>> *simplified ) {
+
+    const size_t num_cells = contours.size();
+    simplified->resize(num_cells);
+    const size_t tasks = (num_cells + SIMPLIFY_BLOCK_CELLS - 1) / SIMPLIFY_BLOCK_CELLS;
+    auto simplifyBlock = [&](size_t task) {
+        size_t end = std::min(num_cells, (task + 1) * SIMPLIFY_BLOCK_CELLS);
+        for (size_t i = task * SIMPLIFY_BLOCK_CELLS; i < end; i++) {
+            checkDeadline(i);
+            simplifyContour(contours[i], spec, &(*simplified)[i]);
+        }
+    };
+    if (pool && (tasks > 1)) {
+        pool->parallelFor(tasks, simplifyBlock);
+    } else {
+        for (size_t task = 0; task < tasks; task++) simplifyBlock(task);
+    }
+}
+
+/* Short over long side of the min-rect */
+static double aspectRatio(const std::vector<cv::Point> &contour) {
+    cv::Size2f size = minAreaRect(cv::Mat(contour)).size;
+    double longer = std::max(size.width, size.height);
+    return (longer > 0) ? std::min(size.width, size.height) / longer : 0.0;
+}
+
+/* Compare the area, perimeter and min-rect aspect ratio of up to
+ * max_samples evenly spaced cells against their exact values, the areas
+ * and perimeters taken from the measures of both sets */
+void measureDrift(  const std::vector<std::vector<cv::Point>> &exact,
+                    const ContourMeasures &exact_measures,
+                    const std::vector<std::vector<cv::Point>> &simplified,
+                    const ContourMeasures &simplified_measures,
+                    size_t max_samples, SimplifyDrift *drift    ) {
+
+    drift->cells += exact.size();
+    for (size_t i = 0; i < exact.size(); i++) {
+        drift->points_in += exact[i].size();
+        drift->points_out += simplified[i].size();
+    }
+    if (exact.empty() || !max_samples) return;
+
+    size_t stride = std::max((size_t)1, exact.size() / max_samples);
+    for (size_t i = 0; i < exact.size(); i += stride) {
+        double before[NUM_DRIFT_METRICS], after[NUM_DRIFT_METRICS];
+        before[AREA_DRIFT] = exact_measures.area[i];
+        after[AREA_DRIFT] = simplified_measures.area[i];
+        before[PERIMETER_DRIFT] = exact_measures.perimeter[i];
+        after[PERIMETER_DRIFT] = simplified_measures.perimeter[i];
+        before[ASPECT_RATIO_DRIFT] = aspectRatio(exact[i]);
+        after[ASPECT_RATIO_DRIFT] = aspectRatio(simplified[i]);
+
+        for (int m = 0; m < NUM_DRIFT_METRICS; m++) {
+            double error = fabs(after[m] - before[m]) / std::max(fabs(before[m]), 1e-9);
+            drift->error_sum[m] += error;
+            drift->error_max[m] = std::max(drift->error_max[m], error);
+        }
+        drift->sampled++;
+    }
+}
+
+/* Replace the cells and their measures by the simplification, the drift
+ * of a sample of DRIFT_SAMPLE_CELLS cells is added to drift */
+void simplifyCells( std::vector<std::vector<cv::Point>> *contours,
+                    ContourMeasures *measures,
+                    const SimplifySpec &spec, ThreadPool *pool,
+                    SimplifyDrift *drift    ) {
+
+    if (spec.method == SimplifyMethod::NONE) return;
+    std::vector<std::vector<cv::Point>> simplified;
+    ContourMeasures simplified_measures;
+    simplifyContours(*contours, spec, pool, &simplified);
+    measureContours(simplified, &simplified_measures);
+    measureDrift(*contours, *measures, simplified, simplified_measures,
+                                                    DRIFT_SAMPLE_CELLS, drift);
+    contours->swap(simplified);
+    std::swap(*measures, simplified_measures);
+}
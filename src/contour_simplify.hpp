@@ -0,0 +1,80 @@
+#ifndef CONTOUR_SIMPLIFY_HPP
+#define CONTOUR_SIMPLIFY_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "thread_pool.hpp"
+#include "contour_measure.hpp"
+
+
+#define SIMPLIFY_BLOCK_CELLS    256   // Contours simplified per pool task
+#define DRIFT_SAMPLE_CELLS      256   // Cells compared against the exact metrics
+
+/* Polygon simplification of the cell contours */
+enum class SimplifyMethod : unsigned char {
+    NONE = 0,
+    DOUGLAS_PEUCKER,    // Drop points closer than tolerance to the kept outline
+    VISVALINGAM         // Drop points spanning triangles under tolerance^2
+};
+
+/* Method and tolerance in pixels */
+struct SimplifySpec {
+    SimplifyMethod  method;
+    double          tolerance;
+};
+
+/* Metrics compared before and after simplification */
+enum DriftMetric {
+    AREA_DRIFT = 0,
+    PERIMETER_DRIFT,
+    ASPECT_RATIO_DRIFT,
+    NUM_DRIFT_METRICS
+};
+extern const char *DRIFT_METRIC_NAMES[NUM_DRIFT_METRICS];
+
+/* Points saved and relative metric errors over the sampled cells */
+struct SimplifyDrift {
+    uint64_t        cells;
+    uint64_t        points_in;
+    uint64_t        points_out;
+    uint64_t        sampled;
+    double          error_sum[NUM_DRIFT_METRICS];
+    double          error_max[NUM_DRIFT_METRICS];
+
+    SimplifyDrift();
+    void merge(const SimplifyDrift &other);
+};
+
+/* Parse "none", "dp:<tolerance>" or "vw:<tolerance>" */
+bool parseSimplifySpec(const std::string &text, SimplifySpec *spec);
+
+/* Simplify one closed contour, contours too small to simplify are copied */
+void simplifyContour(   const std::vector<cv::Point> &contour, const SimplifySpec &spec,
+                        std::vector<cv::Point> *simplified  );
+
+/* Simplify every contour, blocks of contours spread over the pool */
+void simplifyContours(  const std::vector<std::vector<cv::Point>> &contours,
+                        const SimplifySpec &spec, ThreadPool *pool,
+                        std::vector<std::vector<cv::Point>> *simplified );
+
+/* Compare the area, perimeter and min-rect aspect ratio of up to
+ * max_samples evenly spaced cells against their exact values, the areas
+ * and perimeters taken from the measures of both sets */
+void measureDrift(  const std::vector<std::vector<cv::Point>> &exact,
+                    const ContourMeasures &exact_measures,
+                    const std::vector<std::vector<cv::Point>> &simplified,
+                    const ContourMeasures &simplified_measures,
+                    size_t max_samples, SimplifyDrift *drift    );
+
+/* Replace the cells and their measures by the simplification, the drift
+ * of a sample of DRIFT_SAMPLE_CELLS cells is added to drift */
+void simplifyCells( std::vector<std::vector<cv::Point>> *contours,
+                    ContourMeasures *measures,
+                    const SimplifySpec &spec, ThreadPool *pool,
+                    SimplifyDrift *drift    );
+
+#endif // CONTOUR_SIMPLIFY_HPP
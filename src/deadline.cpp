@@ -0,0 +1,98 @@
+#include <chrono>
+#include <limits>
+
+#include "deadline.hpp"
+#include "event_log.hpp"
+
+
+static thread_local Deadline *thread_deadline = NULL;
+
+static double deadlineClock() {
+    return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+DeadlineExceeded::DeadlineExceeded(const std::string &stage, double seconds) :
+    std::runtime_error("Deadline exceeded in " + stage), m_stage(stage), m_seconds(seconds) {
+}
+
+/* Stage running when the budget tripped */
+const std::string &DeadlineExceeded::stage() const {
+    return m_stage;
+}
+
+/* Seconds spent on the image so far */
+double DeadlineExceeded::seconds() const {
+    return m_seconds;
+}
+
+
+Deadline::Deadline(double image_seconds, double stage_seconds) :
+    m_start(deadlineClock()),
+    m_image_end(std::numeric_limits<double>::infinity()),
+    m_stage_seconds(stage_seconds),
+    m_stage_start(m_start),
+    m_stage_end(std::numeric_limits<double>::infinity()),
+    m_stage("start") {
+
+    if (image_seconds > 0) m_image_end = m_start + image_seconds;
+}
+
+/* Start the named stage, its budget counts from now */
+void Deadline::stage(const char *name) {
+    double now = deadlineClock();
+
+    // The time before the first stage is not a stage of its own
+    if (m_stage_start > m_start) {
+        LOG(DEBUG, "stage").field("stage", m_stage.load()).field("seconds", now - m_stage_start);
+    }
+    m_stage = name;
+    m_stage_start = now;
+    if (m_stage_seconds > 0) m_stage_end = now + m_stage_seconds;
+}
+
+/* End the last stage, logged like the others */
+void Deadline::finish() {
+    double now = deadlineClock();
+    LOG(DEBUG, "stage").field("stage", m_stage.load()).field("seconds", now - m_stage_start);
+    m_stage_start = now;
+}
+
+bool Deadline::expired() const {
+    double now = deadlineClock();
+    return (now > m_image_end) || (now > m_stage_end);
+}
+
+const char *Deadline::stageName() const {
+    return m_stage;
+}
+
+double Deadline::elapsed() const {
+    return deadlineClock() - m_start;
+}
+
+/* Deadline checked by the calling thread, NULL if none */
+Deadline *currentDeadline() {
+    return thread_deadline;
+}
+
+DeadlineScope::DeadlineScope(Deadline *deadline) : m_previous(thread_deadline) {
+    thread_deadline = deadline;
+}
+
+DeadlineScope::~DeadlineScope() {
+    thread_deadline = m_previous;
+}
+
+/* Throw DeadlineExceeded if the deadline of the calling thread expired */
+void checkDeadline() {
+    if (thread_deadline && thread_deadline->expired()) {
+        throw DeadlineExceeded(thread_deadline->stageName(), thread_deadline->elapsed());
+    }
+}
+
+/* Start the named stage of the calling thread's deadline, then check it */
+void enterStage(const char *name) {
+    if (thread_deadline) thread_deadline->stage(name);
+    checkDeadline();
+}
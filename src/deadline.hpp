@@ -0,0 +1,82 @@
+#ifndef DEADLINE_HPP
+#define DEADLINE_HPP
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <stdexcept>
+
+
+#define DEADLINE_CHECK_INTERVAL 1024  // Loop iterations between deadline checks
+
+/* Thrown at a checkpoint once the budget of the image or stage is spent */
+class DeadlineExceeded : public std::runtime_error {
+public:
+    DeadlineExceeded(const std::string &stage, double seconds);
+
+    /* Stage running when the budget tripped */
+    const std::string &stage() const;
+
+    /* Seconds spent on the image so far */
+    double seconds() const;
+
+private:
+    std::string     m_stage;
+    double          m_seconds;
+};
+
+/* Time budget of one image and of each of its stages, 0 for no limit.
+ * The stage is set by the thread driving the image, expired() may be
+ * polled from any thread. */
+class Deadline {
+public:
+    Deadline(double image_seconds, double stage_seconds);
+
+    /* Start the named stage, its budget counts from now. The stage
+     * before it is logged at DEBUG with its duration. */
+    void stage(const char *name);
+
+    /* End the last stage, logged like the others */
+    void finish();
+
+    bool expired() const;
+    const char *stageName() const;
+    double elapsed() const;
+
+private:
+    double                      m_start;
+    double                      m_image_end;
+    double                      m_stage_seconds;
+    double                      m_stage_start;
+    std::atomic<double>         m_stage_end;
+    std::atomic<const char *>   m_stage;
+};
+
+/* Deadline checked by the calling thread, NULL if none */
+Deadline *currentDeadline();
+
+/* Install a deadline on the calling thread for the scope's lifetime */
+class DeadlineScope {
+public:
+    explicit DeadlineScope(Deadline *deadline);
+    ~DeadlineScope();
+
+private:
+    DeadlineScope(const DeadlineScope &);
+    DeadlineScope &operator=(const DeadlineScope &);
+
+    Deadline       *m_previous;
+};
+
+/* Throw DeadlineExceeded if the deadline of the calling thread expired */
+void checkDeadline();
+
+/* Start the named stage of the calling thread's deadline, then check it */
+void enterStage(const char *name);
+
+/* Checkpoint for long loops, every DEADLINE_CHECK_INTERVAL iterations */
+inline void checkDeadline(size_t iteration) {
+    if (!(iteration % DEADLINE_CHECK_INTERVAL)) checkDeadline();
+}
+
+#endif // DEADLINE_HPP
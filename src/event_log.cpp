@@ -0,0 +1,435 @@
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "event_log.hpp"
+
+
+#define LOG_TRAILER             ",\"truncated\":true}\n"
+
+static const char *LOG_LEVEL_NAMES[] = { "debug", "info", "warn", "error", "off" };
+
+std::atomic<unsigned char> log_threshold((unsigned char)LogLevel::INFO);
+
+/* A formatted record waiting in a ring */
+struct LogSlot {
+    int64_t             time_us;
+    uint32_t            size;
+    char                text[LOG_RECORD_SIZE];
+};
+
+/* Records of one thread, written by it and read by the flusher only */
+struct LogRing {
+    LogSlot                 slots[LOG_RING_RECORDS];
+    std::atomic<uint32_t>   head;           // Next slot written
+    std::atomic<uint32_t>   tail;           // Next slot flushed
+    std::atomic<bool>       retired;        // Thread exited, dropped once drained
+    unsigned int            thread;
+};
+
+/* Ring of the calling thread, retired when the thread exits */
+struct RingOwner {
+    LogRing            *ring;
+    ~RingOwner() { if (ring) ring->retired = true; }
+};
+
+enum FlusherState { FLUSHER_IDLE, FLUSHER_RUNNING, FLUSHER_STOPPED };
+
+static std::mutex log_mutex;        // The rings, the output and the flusher
+static std::vector<std::unique_ptr<LogRing>> log_rings;
+static int log_fd = STDERR_FILENO;
+static unsigned int log_threads = 0;
+static pid_t log_pid = getpid();
+static std::thread *log_flusher = NULL;
+static std::atomic<int> log_state(FLUSHER_IDLE);
+static std::atomic<uint64_t> log_dropped(0);
+
+static thread_local RingOwner ring_owner = { NULL };
+static thread_local const std::string *context_root = NULL;
+static thread_local const std::string *context_image = NULL;
+
+/* Decimal digits of value, returns their count. snprintf costs several
+ * times more than the rest of a record. */
+static size_t formatUnsigned(unsigned long long value, char *text) {
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    for (size_t i = 0; i < count; i++) text[i] = digits[count - 1 - i];
+    return count;
+}
+
+static size_t formatInteger(long long value, char *text) {
+    if (value >= 0) return formatUnsigned((unsigned long long)value, text);
+    text[0] = '-';
+    return 1 + formatUnsigned(0ull - (unsigned long long)value, text + 1);
+}
+
+/* Microsecond resolution with the trailing zeros dropped, %.9g for the
+ * magnitudes it would lose */
+static size_t formatReal(double value, char *text) {
+    if (!std::isfinite(value)) {
+        memcpy(text, "null", 4);
+        return 4;
+    }
+    double magnitude = std::fabs(value);
+    if ((magnitude >= 1e12) || ((magnitude < 1e-3) && (magnitude != 0.0))) {
+        return snprintf(text, 32, "%.9g", value);
+    }
+    unsigned long long micros = (unsigned long long)(magnitude * 1e6 + 0.5);
+    size_t size = 0;
+    if (value < 0) text[size++] = '-';
+    size += formatUnsigned(micros / 1000000, text + size);
+    unsigned long long fraction = micros % 1000000;
+    if (fraction) {
+        text[size++] = '.';
+        for (unsigned long long scale = 100000; fraction; scale /= 10) {
+            text[size++] = (char)('0' + fraction / scale);
+            fraction %= scale;
+        }
+    }
+    return size;
+}
+
+static LogRing *threadRing() {
+    if (!ring_owner.ring) {
+        std::unique_ptr<LogRing> ring(new LogRing());
+        ring->head = 0;
+        ring->tail = 0;
+        ring->retired = false;
+        std::lock_guard<std::mutex> lock(log_mutex);
+        ring->thread = log_threads++;
+        ring_owner.ring = ring.get();
+        log_rings.push_back(std::move(ring));
+    }
+    return ring_owner.ring;
+}
+
+/* Write every committed record in time order with one write, then free
+ * the slots. Called with log_mutex held. */
+static void drainLocked() {
+
+    std::vector<std::pair<int64_t, const LogSlot *>> records;
+    std::vector<uint32_t> heads(log_rings.size());
+    std::vector<bool> retired(log_rings.size());
+    for (size_t r = 0; r < log_rings.size(); r++) {
+        LogRing &ring = *log_rings[r];
+        retired[r] = ring.retired.load(std::memory_order_acquire);
+        heads[r] = ring.head.load(std::memory_order_acquire);
+        for (uint32_t i = ring.tail.load(std::memory_order_relaxed); i != heads[r]; i++) {
+            const LogSlot &slot = ring.slots[i % LOG_RING_RECORDS];
+            records.push_back(std::make_pair(slot.time_us, &slot));
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+        [](const std::pair<int64_t, const LogSlot *> &a,
+           const std::pair<int64_t, const LogSlot *> &b) { return a.first < b.first; });
+
+    std::string text;
+    uint64_t dropped = log_dropped.exchange(0);
+    if (dropped) {
+        char line[128];
+        snprintf(line, sizeof(line), "{\"level\":\"warn\",\"pid\":%d,\"event\":\"log_dropped\","
+                                     "\"records\":%llu}\n", (int)log_pid,
+                                     (unsigned long long)dropped);
+        text += line;
+    }
+    for (size_t i = 0; i < records.size(); i++) {
+        text.append(records[i].second->text, records[i].second->size);
+    }
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t n = write(log_fd, text.data() + written, text.size() - written);
+        if (n <= 0) break;
+        written += n;
+    }
+
+    for (size_t r = log_rings.size(); r-- > 0; ) {
+        log_rings[r]->tail.store(heads[r], std::memory_order_release);
+        if (retired[r]) log_rings.erase(log_rings.begin() + r);
+    }
+}
+
+static void flusherLoop() {
+    while (log_state.load() == FLUSHER_RUNNING) {
+        {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            drainLocked();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_MS));
+    }
+}
+
+/* At exit the flusher stops and the last records are written inline */
+static void stopLog() {
+    std::thread *flusher = NULL;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        if (log_state.load() == FLUSHER_RUNNING) {
+            flusher = log_flusher;
+            log_flusher = NULL;
+        }
+        log_state = FLUSHER_STOPPED;
+    }
+    if (flusher) {
+        flusher->join();
+        delete flusher;
+    }
+    flushLog();
+}
+
+/* Start the flusher on the first record, or write inline once stopped */
+static void serviceLog() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    int state = log_state.load();
+    if (state == FLUSHER_STOPPED) {
+        drainLocked();
+    } else if (state == FLUSHER_IDLE) {
+        static bool exit_registered = false;
+        if (!exit_registered) atexit(stopLog);
+        exit_registered = true;
+        log_state = FLUSHER_RUNNING;
+        log_flusher = new std::thread(flusherLoop);
+    }
+}
+
+// A forked child has no flusher and must not write the parent's records.
+// The --workers supervisor forks while the flusher runs, holding log_mutex
+// across the fork keeps the flusher out of the rings the child copies.
+static void forkPrepare() {
+    log_mutex.lock();
+}
+
+static void forkParent() {
+    log_mutex.unlock();
+}
+
+static void forkChild() {
+    log_pid = getpid();
+    log_flusher = NULL;
+    if (log_state.load() == FLUSHER_RUNNING) log_state = FLUSHER_IDLE;
+    for (size_t r = 0; r < log_rings.size(); r++) {
+        LogRing &ring = *log_rings[r];
+        ring.tail.store(ring.head.load());
+        if (&ring != ring_owner.ring) ring.retired = true;
+    }
+    log_mutex.unlock();
+}
+
+static int log_atfork = pthread_atfork(forkPrepare, forkParent, forkChild);
+
+
+bool parseLogLevel(const std::string &text, LogLevel *level) {
+    for (unsigned char l = 0; l <= (unsigned char)LogLevel::OFF; l++) {
+        if (text == LOG_LEVEL_NAMES[l]) {
+            *level = (LogLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Write the records to path, standard error if empty, from level on */
+bool configureLog(const std::string &path, LogLevel level) {
+    int fd = STDERR_FILENO;
+    if (!path.empty()) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Could not open the log " << path << std::endl;
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(log_mutex);
+    drainLocked();
+    if (log_fd != STDERR_FILENO) close(log_fd);
+    log_fd = fd;
+    log_threshold = (unsigned char)level;
+    (void)log_atfork;
+    return true;
+}
+
+/* Write every record committed so far */
+void flushLog() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    drainLocked();
+}
+
+
+LogRecord::LogRecord(LogLevel level, const char *event) :
+    m_level(level),
+    m_time_us(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count()),
+    m_size(0),
+    m_truncated(false) {
+
+    // {"time":<s.us>,"level":"<level>","pid":<pid>,"thread":<n>,"event":
+    char *text = m_text;
+    memcpy(text, "{\"time\":", 8);
+    text += 8;
+    text += formatInteger(m_time_us / 1000000, text);
+    *text++ = '.';
+    for (long long scale = 100000, micros = m_time_us % 1000000; scale; scale /= 10) {
+        *text++ = (char)('0' + (micros / scale) % 10);
+    }
+    memcpy(text, ",\"level\":\"", 10);
+    text += 10;
+    const char *name = LOG_LEVEL_NAMES[(int)level];
+    size_t name_size = strlen(name);
+    memcpy(text, name, name_size);
+    text += name_size;
+    memcpy(text, "\",\"pid\":", 8);
+    text += 8;
+    text += formatInteger(log_pid, text);
+    memcpy(text, ",\"thread\":", 10);
+    text += 10;
+    text += formatUnsigned(threadRing()->thread, text);
+    memcpy(text, ",\"event\":", 9);
+    text += 9;
+    m_size = text - m_text;
+    if (!appendString(event)) rollback(m_size);
+    if (context_root) field("root", *context_root);
+    if (context_image) field("image", *context_image);
+}
+
+/* Close the line and commit it to the ring of the calling thread */
+LogRecord::~LogRecord() {
+
+    if (m_truncated) {
+        memcpy(m_text + m_size, LOG_TRAILER, sizeof(LOG_TRAILER) - 1);
+        m_size += sizeof(LOG_TRAILER) - 1;
+    } else {
+        memcpy(m_text + m_size, "}\n", 2);
+        m_size += 2;
+    }
+
+    LogRing *ring = threadRing();
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    while (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS) {
+        if (m_level < LogLevel::WARN) {
+            log_dropped++;
+            return;
+        }
+        if (log_state.load() == FLUSHER_RUNNING) {
+            std::this_thread::yield();
+        } else {
+            flushLog();
+        }
+    }
+    LogSlot &slot = ring->slots[head % LOG_RING_RECORDS];
+    slot.time_us = m_time_us;
+    slot.size = (uint32_t)m_size;
+    memcpy(slot.text, m_text, m_size);
+    ring->head.store(head + 1, std::memory_order_release);
+
+    if (log_state.load(std::memory_order_relaxed) != FLUSHER_RUNNING) serviceLog();
+}
+
+LogRecord &LogRecord::field(const char *key, const std::string &value) {
+    return field(key, value.c_str());
+}
+
+LogRecord &LogRecord::field(const char *key, const char *value) {
+    size_t start = m_size;
+    if (!this->key(key) || !appendString(value)) rollback(start);
+    return *this;
+}
+
+LogRecord &LogRecord::field(const char *key, double value) {
+    char text[32];
+    size_t size = formatReal(value, text);
+    size_t start = m_size;
+    if (!this->key(key) || !append(text, size)) rollback(start);
+    return *this;
+}
+
+LogRecord &LogRecord::field(const char *key, bool value) {
+    size_t start = m_size;
+    if (!this->key(key) || !append(value ? "true" : "false", value ? 4 : 5)) rollback(start);
+    return *this;
+}
+
+LogRecord &LogRecord::integer(const char *key, long long value) {
+    char text[32];
+    size_t size = formatInteger(value, text);
+    size_t start = m_size;
+    if (!this->key(key) || !append(text, size)) rollback(start);
+    return *this;
+}
+
+LogRecord &LogRecord::integer(const char *key, unsigned long long value) {
+    char text[32];
+    size_t size = formatUnsigned(value, text);
+    size_t start = m_size;
+    if (!this->key(key) || !append(text, size)) rollback(start);
+    return *this;
+}
+
+/* ,"key": */
+bool LogRecord::key(const char *key) {
+    return append(",", 1) && appendString(key) && append(":", 1);
+}
+
+/* Room is always left for the trailer */
+bool LogRecord::append(const char *text, size_t size) {
+    if (m_size + size > LOG_RECORD_SIZE - (sizeof(LOG_TRAILER) - 1)) return false;
+    memcpy(m_text + m_size, text, size);
+    m_size += size;
+    return true;
+}
+
+/* Quoted and escaped, bytes above 0x7f are passed through as UTF-8.
+ * Runs needing no escape are copied at once. */
+bool LogRecord::appendString(const char *text) {
+    if (!append("\"", 1)) return false;
+    const char *run = text;
+    for (const char *c = text; ; c++) {
+        unsigned char byte = (unsigned char)*c;
+        if (byte && (byte >= 0x20) && (byte != '"') && (byte != '\\')) continue;
+        if (!append(run, c - run)) return false;
+        if (!byte) break;
+        char escaped[8];
+        if (byte < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", byte);
+            if (!append(escaped, 6)) return false;
+        } else {
+            escaped[0] = '\\';
+            escaped[1] = (char)byte;
+            if (!append(escaped, 2)) return false;
+        }
+        run = c + 1;
+    }
+    return append("\"", 1);
+}
+
+/* Drop a field that did not fit, the record is marked truncated */
+void LogRecord::rollback(size_t size) {
+    m_size = size;
+    m_truncated = true;
+}
+
+
+LogContext::LogContext(const std::string &root, const std::string &image) :
+    m_previous_root(context_root),
+    m_previous_image(context_image) {
+
+    context_root = root.empty() ? NULL : &root;
+    context_image = &image;
+}
+
+LogContext::~LogContext() {
+    context_root = m_previous_root;
+    context_image = m_previous_image;
+}
@@ -0,0 +1,100 @@
+#ifndef EVENT_LOG_HPP
+#define EVENT_LOG_HPP
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <type_traits>
+
+
+#define LOG_RECORD_SIZE         512     // Bytes of a formatted record, fields beyond are cut
+#define LOG_RING_RECORDS        256     // Records buffered per logging thread
+#define LOG_FLUSH_MS            50      // Period of the background flusher
+
+/* Severity of a record, records below the configured level are skipped */
+enum class LogLevel : unsigned char {
+    DEBUG = 0,
+    INFO,
+    WARN,
+    ERROR,
+    OFF
+};
+
+/* Lowest level written, read on every LOG() */
+extern std::atomic<unsigned char> log_threshold;
+
+inline bool logEnabled(LogLevel level) {
+    return (unsigned char)level >= log_threshold.load(std::memory_order_relaxed);
+}
+
+bool parseLogLevel(const std::string &text, LogLevel *level);
+
+/* Write the records to path, standard error if empty, from level on */
+bool configureLog(const std::string &path, LogLevel level);
+
+/* Write every record committed so far. Called before a fork, so that the
+ * child does not write them again, and before _exit. */
+void flushLog();
+
+/* One JSON line: time, level, process, thread, event, the image of the
+ * thread's LogContext if any, then the fields in call order. Formatted
+ * on the stack and committed by the destructor into the ring of the
+ * calling thread, without a lock. When the ring is full a DEBUG or INFO
+ * record is dropped and counted, a WARN or ERROR one waits. */
+class LogRecord {
+public:
+    LogRecord(LogLevel level, const char *event);
+    ~LogRecord();
+
+    LogRecord &field(const char *key, const std::string &value);
+    LogRecord &field(const char *key, const char *value);
+    LogRecord &field(const char *key, double value);
+    LogRecord &field(const char *key, bool value);
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, LogRecord &>::type
+    field(const char *key, T value) {
+        if (std::is_signed<T>::value) return integer(key, (long long)value);
+        return integer(key, (unsigned long long)value);
+    }
+
+private:
+    LogRecord(const LogRecord &);
+    LogRecord &operator=(const LogRecord &);
+
+    LogRecord &integer(const char *key, long long value);
+    LogRecord &integer(const char *key, unsigned long long value);
+    bool key(const char *key);
+    bool append(const char *text, size_t size);
+    bool appendString(const char *text);
+    void rollback(size_t size);
+
+    LogLevel        m_level;
+    int64_t         m_time_us;
+    size_t          m_size;
+    bool            m_truncated;
+    char            m_text[LOG_RECORD_SIZE];
+};
+
+/* Records of the calling thread name this root and image for the scope's
+ * lifetime */
+class LogContext {
+public:
+    LogContext(const std::string &root, const std::string &image);
+    ~LogContext();
+
+private:
+    LogContext(const LogContext &);
+    LogContext &operator=(const LogContext &);
+
+    const std::string  *m_previous_root;
+    const std::string  *m_previous_image;
+};
+
+/* LOG(INFO, "event").field("key", value)... builds nothing when the level
+ * is disabled, the check is a relaxed load and a compare */
+#define LOG(level, event) \
+    if (!logEnabled(LogLevel::level)) {} else LogRecord(LogLevel::level, event)
+
+#endif // EVENT_LOG_HPP
@@ -0,0 +1,369 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "grid_search.hpp"
+
+
+/* Traced contours of one thresholded channel, shared by the points that
+ * threshold it the same way */
+struct TracedChannel {
+    ContourPlan     plan;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Vec4i>      hierarchy;
+    std::vector<HierarchyType>  validity;
+    std::vector<double>         parent_area;
+    ContourMeasures             measures;
+};
+
+/* Index of a channel's plane, masks and levels */
+static inline size_t plane(ChannelType type) {
+    return (size_t)type;
+}
+
+/* A whole field as a number */
+static bool parseValue(const std::string &field, double *value) {
+    char *end = NULL;
+    *value = strtod(field.c_str(), &end);
+    return !field.empty() && !*end && std::isfinite(*value);
+}
+
+/* Parse <param>:<start>:<end>:<step>, end included, or <param>:<v1>,<v2>,... */
+bool parseGridAxis(const std::string &text, GridAxis *axis) {
+
+    size_t colon = text.find(':');
+    if (colon == std::string::npos) return false;
+    axis->name = text.substr(0, colon);
+    axis->kind = FilterKind::POINTS;
+    if (axis->name == "green_threshold") {
+        axis->param = GridParam::GREEN_LEVEL;
+    } else if (axis->name == "red_threshold") {
+        axis->param = GridParam::RED_LEVEL;
+    } else if (axis->name == "blue_threshold") {
+        axis->param = GridParam::BLUE_LEVEL;
+    } else {
+        // <filter>_min or <filter>_max, filter names hold underscores too
+        size_t underscore = axis->name.find_last_of('_');
+        if (underscore == std::string::npos) return false;
+        std::string bound = axis->name.substr(underscore + 1);
+        if (bound == "min") {
+            axis->param = GridParam::FILTER_MIN;
+        } else if (bound == "max") {
+            axis->param = GridParam::FILTER_MAX;
+        } else {
+            return false;
+        }
+        int kind = -1;
+        for (int i = 0; i < (int)FilterKind::NUM_FILTERS; i++) {
+            if (axis->name.compare(0, underscore, filterName((FilterKind)i)) == 0) kind = i;
+        }
+        if (kind < 0) return false;
+        axis->kind = (FilterKind)kind;
+    }
+
+    std::vector<std::string> fields;
+    std::stringstream stream(text.substr(colon + 1));
+    std::string field;
+    while (std::getline(stream, field, ':')) fields.push_back(field);
+
+    axis->values.clear();
+    if (fields.size() == 3) {
+        double start, end, step;
+        if (!parseValue(fields[0], &start) || !parseValue(fields[1], &end) ||
+                !parseValue(fields[2], &step) || (step <= 0) || (end < start)) {
+            return false;
+        }
+        // The end is kept despite the rounding of the steps
+        double steps = floor((end - start) / step + 1e-9);
+        if (steps >= GRID_MAX_VALUES) return false;
+        for (int i = 0; i <= (int)steps; i++) axis->values.push_back(start + i * step);
+
+    } else if (fields.size() == 1) {
+        std::stringstream list(fields[0]);
+        while (std::getline(list, field, ',')) {
+            double value;
+            if (!parseValue(field, &value)) return false;
+            axis->values.push_back(value);
+        }
+        if (axis->values.size() > GRID_MAX_VALUES) return false;
+
+    } else {
+        return false;
+    }
+    if (axis->values.empty()) return false;
+
+    // Thresholds apply to the channels normalized to 0..255
+    if ((axis->param != GridParam::FILTER_MIN) && (axis->param != GridParam::FILTER_MAX)) {
+        for (size_t i = 0; i < axis->values.size(); i++) {
+            if ((axis->values[i] < 0) || (axis->values[i] > 255)) return false;
+        }
+    }
+    return true;
+}
+
+/* Points of the grid, GRID_MAX_POINTS + 1 for any larger grid */
+size_t gridPoints(const std::vector<GridAxis> &axes) {
+    size_t points = 1;
+    for (size_t a = 0; a < axes.size(); a++) {
+        points *= axes[a].values.size();
+        if (points > GRID_MAX_POINTS) return GRID_MAX_POINTS + 1;
+    }
+    return points;
+}
+
+/* Index of a level, added when new */
+static size_t levelIndex(std::vector<double> *levels, double level) {
+    for (size_t i = 0; i < levels->size(); i++) {
+        if ((*levels)[i] == level) return i;
+    }
+    levels->push_back(level);
+    return levels->size() - 1;
+}
+
+GridSearch::GridSearch( const std::vector<GridAxis> &axes,
+                        const std::vector<FilterSpec> &filters  ) {
+
+    const double unbounded = std::numeric_limits<double>::infinity();
+    const size_t num_points = gridPoints(axes);
+    for (size_t point = 0; point < num_points; point++) {
+
+        // The values of the point, the last axis varying fastest
+        std::vector<double> values(axes.size());
+        size_t rest = point;
+        for (size_t a = axes.size(); a-- > 0; ) {
+            values[a] = axes[a].values[rest % axes[a].values.size()];
+            rest /= axes[a].values.size();
+        }
+
+        double thresholds[3];
+        thresholds[plane(ChannelType::BLUE)]  = BLUE_THRESHOLD;
+        thresholds[plane(ChannelType::GREEN)] = GREEN_THRESHOLD;
+        thresholds[plane(ChannelType::RED)]   = RED_THRESHOLD;
+        std::vector<FilterSpec> specs = filters;
+        for (size_t a = 0; a < axes.size(); a++) {
+            switch (axes[a].param) {
+                case GridParam::GREEN_LEVEL : {
+                    thresholds[plane(ChannelType::GREEN)] = values[a];
+                } break;
+
+                case GridParam::RED_LEVEL : {
+                    thresholds[plane(ChannelType::RED)] = values[a];
+                } break;
+
+                case GridParam::BLUE_LEVEL : {
+                    thresholds[plane(ChannelType::BLUE)] = values[a];
+                } break;
+
+                case GridParam::FILTER_MIN :
+                case GridParam::FILTER_MAX : {
+                    // Swept bounds replace those of the filter, or add it
+                    bool found = false;
+                    for (size_t s = 0; s < specs.size(); s++) {
+                        found |= (specs[s].kind == axes[a].kind);
+                    }
+                    if (!found) {
+                        FilterSpec spec = { axes[a].kind, 0, unbounded };
+                        specs.push_back(spec);
+                    }
+                    for (size_t s = 0; s < specs.size(); s++) {
+                        if (specs[s].kind != axes[a].kind) continue;
+                        if (axes[a].param == GridParam::FILTER_MIN) {
+                            specs[s].min = values[a];
+                        } else {
+                            specs[s].max = values[a];
+                        }
+                    }
+                } break;
+            }
+        }
+        m_points.push_back(values);
+        m_cascades.push_back(FilterCascade(specs));
+
+        ThresholdSet set;
+        set.blue  = levelIndex(&m_levels[plane(ChannelType::BLUE)],
+                                thresholds[plane(ChannelType::BLUE)]);
+        set.green = levelIndex(&m_levels[plane(ChannelType::GREEN)],
+                                thresholds[plane(ChannelType::GREEN)]);
+        set.red   = levelIndex(&m_levels[plane(ChannelType::RED)],
+                                thresholds[plane(ChannelType::RED)]);
+        size_t index = 0;
+        while ((index < m_sets.size()) && ((m_sets[index].blue != set.blue) ||
+                        (m_sets[index].green != set.green) || (m_sets[index].red != set.red))) {
+            index++;
+        }
+        if (index == m_sets.size()) m_sets.push_back(set);
+        m_point_set.push_back(index);
+    }
+}
+
+size_t GridSearch::numPoints() const {
+    return m_points.size();
+}
+
+size_t GridSearch::numThresholdSets() const {
+    return m_sets.size();
+}
+
+const std::vector<double> &GridSearch::pointValues(size_t point) const {
+    return m_points[point];
+}
+
+/* Plan and trace one thresholded channel */
+static void traceChannel(   const cv::Mat &mask, ChannelType channel_type,
+                            AnalysisStrategy strategy, TracedChannel *traced  ) {
+    traced->plan = planContours(estimateDensity(mask), strategy);
+    cv::Mat segmented;
+    contourCalc(mask, channel_type, 1.0, traced->plan, &segmented, &traced->contours,
+                &traced->hierarchy, &traced->validity, &traced->parent_area, &traced->measures);
+}
+
+/* Metrics of every point on the blue, green and red planes */
+void GridSearch::evaluate(  const cv::Mat planes[3], AnalysisStrategy strategy,
+                            const SimplifySpec &simplify, const HistogramEngine &histograms,
+                            ThreadPool *pool, std::vector<std::vector<double>> *values ) const {
+
+    // Channels read from the same plane are normalized once
+    size_t source[3];
+    std::vector<size_t> distinct;
+    for (size_t c = 0; c < 3; c++) {
+        source[c] = c;
+        for (size_t d = 0; d < c; d++) {
+            if ((planes[d].data == planes[c].data) && (planes[d].size() == planes[c].size()) &&
+                                                    (planes[d].type() == planes[c].type())) {
+                source[c] = source[d];
+                break;
+            }
+        }
+        if (source[c] == c) distinct.push_back(c);
+    }
+    cv::Mat normalized[3];
+    pool->parallelFor(distinct.size(), [&](size_t i) {
+        normalizeChannel(planes[distinct[i]], &normalized[distinct[i]]);
+    });
+    for (size_t c = 0; c < 3; c++) normalized[c] = normalized[source[c]];
+
+    // Sets in level order, so that consecutive sets share most of their
+    // masks. They are taken in batches whose masks fit GRID_BATCH_MB, and
+    // the masks and traces of a batch are released before the next one.
+    std::vector<size_t> order(m_sets.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        const ThresholdSet &x = m_sets[a], &y = m_sets[b];
+        if (x.green != y.green) return x.green < y.green;
+        if (x.red != y.red) return x.red < y.red;
+        return x.blue < y.blue;
+    });
+    std::vector<std::vector<size_t>> set_points(m_sets.size());
+    for (size_t point = 0; point < m_points.size(); point++) {
+        set_points[m_point_set[point]].push_back(point);
+    }
+    const size_t plane_bytes = std::max(normalized[0].total(), (size_t)1);
+    const size_t max_masks = std::max(((size_t)GRID_BATCH_MB << 20) / plane_bytes, (size_t)3);
+
+    const size_t num_green = m_levels[plane(ChannelType::GREEN)].size();
+    const size_t num_red = m_levels[plane(ChannelType::RED)].size();
+    std::vector<cv::Mat> masks[3];
+    for (size_t c = 0; c < 3; c++) masks[c].resize(m_levels[c].size());
+    std::vector<TracedChannel> green(num_green), red(num_red);
+    values->assign(m_points.size(), std::vector<double>());
+    size_t next = 0;
+    while (next < order.size()) {
+
+        // The sets of the batch and the levels they need, one set at least
+        std::vector<size_t> batch;
+        std::vector<std::pair<size_t, size_t>> levels;
+        std::vector<unsigned char> needed[3];
+        for (size_t c = 0; c < 3; c++) needed[c].assign(m_levels[c].size(), 0);
+        while (next < order.size()) {
+            const ThresholdSet &set = m_sets[order[next]];
+            const size_t set_levels[3] = { set.blue, set.green, set.red };
+            size_t added = 0;
+            for (size_t c = 0; c < 3; c++) added += !needed[c][set_levels[c]];
+            if (!batch.empty() && (levels.size() + added > max_masks)) break;
+            for (size_t c = 0; c < 3; c++) {
+                if (needed[c][set_levels[c]]) continue;
+                needed[c][set_levels[c]] = 1;
+                levels.push_back(std::make_pair(c, set_levels[c]));
+            }
+            batch.push_back(order[next++]);
+        }
+
+        // Every level of the batch gives one mask
+        pool->parallelFor(levels.size(), [&](size_t i) {
+            size_t c = levels[i].first, l = levels[i].second;
+            cv::threshold(normalized[c], masks[c][l], m_levels[c][l], 255, cv::THRESH_BINARY);
+        });
+
+        // Green and red are traced once per level, white once per set
+        std::vector<size_t> traced_levels;
+        for (size_t i = 0; i < levels.size(); i++) {
+            if (levels[i].first != plane(ChannelType::BLUE)) traced_levels.push_back(i);
+        }
+        std::vector<TracedChannel> white(batch.size());
+        pool->parallelFor(traced_levels.size() + batch.size(), [&](size_t task) {
+            if (task < traced_levels.size()) {
+                size_t c = levels[traced_levels[task]].first;
+                size_t l = levels[traced_levels[task]].second;
+                if (c == plane(ChannelType::GREEN)) {
+                    traceChannel(masks[c][l], ChannelType::GREEN, strategy, &green[l]);
+                } else {
+                    traceChannel(masks[c][l], ChannelType::RED, strategy, &red[l]);
+                }
+                return;
+            }
+            task -= traced_levels.size();
+            const ThresholdSet &set = m_sets[batch[task]];
+            cv::Mat white_mask;
+            cv::bitwise_and(masks[plane(ChannelType::BLUE)][set.blue],
+                            masks[plane(ChannelType::GREEN)][set.green], white_mask);
+            cv::bitwise_and(white_mask, masks[plane(ChannelType::RED)][set.red], white_mask);
+            traceChannel(white_mask, ChannelType::WHITE, strategy, &white[task]);
+        });
+        for (size_t i = 0; i < levels.size(); i++) {
+            masks[levels[i].first][levels[i].second].release();
+        }
+
+        // Only the filters and features are left to every point. The
+        // channels are measured on the images analyzeChannels gives them.
+        std::vector<std::pair<size_t, size_t>> points;
+        for (size_t b = 0; b < batch.size(); b++) {
+            for (size_t i = 0; i < set_points[batch[b]].size(); i++) {
+                points.push_back(std::make_pair(b, set_points[batch[b]][i]));
+            }
+        }
+        pool->parallelFor(points.size(), [&](size_t i) {
+            const size_t point = points[i].second;
+            const ThresholdSet &set = m_sets[m_point_set[point]];
+            const TracedChannel *traced[] = { &green[set.green], &red[set.red],
+                                              &white[points[i].first] };
+            const cv::Mat *images[] = { &normalized[plane(ChannelType::GREEN)],
+                                        &normalized[plane(ChannelType::RED)],
+                                        &normalized[plane(ChannelType::BLUE)] };
+            for (size_t c = 0; c < 3; c++) {
+                std::vector<std::vector<cv::Point>> cells;
+                std::vector<HierarchyType> cells_validity;
+                std::vector<double> cells_area;
+                ContourMeasures cells_measures;
+                std::vector<int> cells_index;
+                std::vector<FilterStats> stats;
+                filterCells(traced[c]->contours, traced[c]->validity, traced[c]->parent_area,
+                            traced[c]->measures, m_cascades[point], *images[c],
+                            &cells, &cells_validity, &cells_area, &cells_measures,
+                            &cells_index, &stats);
+                SimplifyDrift drift;
+                simplifyCells(&cells, &cells_measures, simplify, pool, &drift);
+                CellSketches sketches;
+                separationMetrics(cells, cells_measures, *images[c], histograms,
+                                    traced[c]->plan, pool, &(*values)[point], &sketches);
+            }
+        });
+        for (size_t i = 0; i < traced_levels.size(); i++) {
+            size_t c = levels[traced_levels[i]].first, l = levels[traced_levels[i]].second;
+            (c == plane(ChannelType::GREEN) ? green[l] : red[l]) = TracedChannel();
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef GRID_SEARCH_HPP
+#define GRID_SEARCH_HPP
+
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "analysis.hpp"
+
+
+#define GRID_MAX_VALUES         1000        // Values an axis may expand to
+#define GRID_MAX_POINTS         100000      // Parameter points of a whole grid
+#define GRID_RESULTS_FILE       "grid_results.csv"  // Long format results of a root
+#define GRID_BATCH_MB           512         // Threshold masks an image keeps at once
+
+/* Parameters a grid search can sweep */
+enum class GridParam : unsigned char {
+    GREEN_LEVEL = 0,
+    RED_LEVEL,
+    BLUE_LEVEL,
+    FILTER_MIN,
+    FILTER_MAX
+};
+
+/* One swept parameter and its values, in order */
+struct GridAxis {
+    std::string     name;           // Column of the results
+    GridParam       param;
+    FilterKind      kind;           // Filter bounded by FILTER_MIN and FILTER_MAX
+    std::vector<double> values;
+};
+
+/* Parse <param>:<start>:<end>:<step>, end included, or <param>:<v1>,<v2>,...
+ * The params are green_threshold, red_threshold, blue_threshold and
+ * <filter>_min or <filter>_max of any --filter property. */
+bool parseGridAxis(const std::string &text, GridAxis *axis);
+
+/* Points of the grid, GRID_MAX_POINTS + 1 for any larger grid */
+size_t gridPoints(const std::vector<GridAxis> &axes);
+
+/* The points of the cartesian product of the axes, the last one varying
+ * fastest. Points sharing their thresholds share their masks and contours:
+ * an image is normalized once, the threshold sets are taken in batches
+ * whose masks fit GRID_BATCH_MB, every threshold of a batch is applied and
+ * traced once, and only the filters and features are computed per point. */
+class GridSearch {
+public:
+    /* The filters of the axes replace the bounds of those in filters, or
+     * are added to them */
+    GridSearch(const std::vector<GridAxis> &axes, const std::vector<FilterSpec> &filters);
+
+    size_t numPoints() const;
+    size_t numThresholdSets() const;
+
+    /* Value of every axis at a point, in axis order */
+    const std::vector<double> &pointValues(size_t point) const;
+
+    /* Metrics of every point on the blue, green and red planes, in the
+     * column order of the metrics CSV. Threshold levels, traced channels
+     * and points of a batch are each spread over the pool. */
+    void evaluate(  const cv::Mat planes[3], AnalysisStrategy strategy,
+                    const SimplifySpec &simplify, const HistogramEngine &histograms,
+                    ThreadPool *pool, std::vector<std::vector<double>> *values ) const;
+
+private:
+    /* Thresholds of a point, indices into the levels of each channel */
+    struct ThresholdSet {
+        size_t          green;
+        size_t          red;
+        size_t          blue;
+    };
+
+    std::vector<std::vector<double>>    m_points;
+    std::vector<FilterCascade>          m_cascades;     // One per point
+    std::vector<size_t>                 m_point_set;    // Threshold set of each point
+    std::vector<ThresholdSet>           m_sets;
+    std::vector<double>                 m_levels[3];    // Distinct blue, green, red thresholds
+};
+
+#endif // GRID_SEARCH_HPP
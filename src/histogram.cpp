@@ -0,0 +1,224 @@
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+#include "histogram.hpp"
+
+
+#define HISTOGRAM_BATCH         256   // Values binned per pass
+
+static const char *FEATURE_NAMES[] = {
+    "Area", "Diameter", "Aspect_Ratio", "Perimeter", "Intensity"
+};
+static const char *FEATURE_KEYS[] = {
+    "area", "diameter", "aspect_ratio", "perimeter", "intensity"
+};
+
+std::vector<double> &CellFeatures::operator[](CellFeature feature) {
+    return values[(int)feature];
+}
+
+const std::vector<double> &CellFeatures::operator[](CellFeature feature) const {
+    return values[(int)feature];
+}
+
+/* Parse a number, the whole field must be consumed */
+static bool parseNumber(const std::string &text, double *value) {
+    if (text.empty()) return false;
+    char *end = NULL;
+    *value = strtod(text.c_str(), &end);
+    return (*end == '\0') && std::isfinite(*value);
+}
+
+static void split(const std::string &text, char separator, std::vector<std::string> *fields) {
+    std::stringstream stream(text);
+    std::string field;
+    while (std::getline(stream, field, separator)) fields->push_back(field);
+}
+
+/* Parse "<feature>:linear:<start>:<width>:<bins>",
+ * "<feature>:log:<start>:<end>:<bins>" or "<feature>:edges:<e0>,<e1>,..." */
+bool parseHistogramSpec(const std::string &text, HistogramSpec *spec) {
+
+    std::vector<std::string> fields;
+    split(text, ':', &fields);
+    if (fields.size() < 3) return false;
+
+    int feature = -1;
+    for (int i = 0; i < (int)CellFeature::NUM_FEATURES; i++) {
+        if (fields[0] == FEATURE_KEYS[i]) feature = i;
+    }
+    if (feature < 0) return false;
+    spec->feature = (CellFeature)feature;
+    spec->edges.clear();
+
+    if ((fields[1] == "linear") || (fields[1] == "log")) {
+        double start, end_or_width, bins;
+        if ((fields.size() != 5) || !parseNumber(fields[2], &start) ||
+                !parseNumber(fields[3], &end_or_width) || !parseNumber(fields[4], &bins) ||
+                (bins < 1) || (bins != floor(bins))) {
+            return false;
+        }
+        if (fields[1] == "linear") {
+            if (end_or_width <= 0) return false;
+            spec->scale = BinScale::LINEAR;
+            for (int i = 0; i < (int)bins; i++) spec->edges.push_back(start + i * end_or_width);
+        } else {
+            if ((start <= 0) || (end_or_width <= start) || (bins < 2)) return false;
+            spec->scale = BinScale::LOG;
+            double ratio = end_or_width / start;
+            for (int i = 0; i < (int)bins; i++) {
+                spec->edges.push_back(start * pow(ratio, (double)i / (bins - 1)));
+            }
+        }
+
+    } else if (fields[1] == "edges") {
+        if (fields.size() != 3) return false;
+        std::vector<std::string> edges;
+        split(fields[2], ',', &edges);
+        for (size_t i = 0; i < edges.size(); i++) {
+            double edge;
+            if (!parseNumber(edges[i], &edge)) return false;
+            if (!spec->edges.empty() && (edge <= spec->edges.back())) return false;
+            spec->edges.push_back(edge);
+        }
+        if (spec->edges.empty()) return false;
+        spec->scale = BinScale::EDGES;
+
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* The historical area histogram, 0..400 px in 40 px bins */
+HistogramSpec defaultHistogramSpec() {
+    HistogramSpec spec;
+    spec.feature = CellFeature::AREA;
+    spec.scale = BinScale::LINEAR;
+    for (int i = 0; i < NUM_BINS; i++) spec.edges.push_back(i * BIN_AREA);
+    return spec;
+}
+
+/* Column name of a feature, e.g. "Aspect_Ratio" */
+const char *featureName(CellFeature feature) {
+    return FEATURE_NAMES[(int)feature];
+}
+
+
+HistogramEngine::HistogramEngine(const std::vector<HistogramSpec> &specs) : m_num_bins(0) {
+    for (size_t i = 0; i < specs.size(); i++) {
+        Binning binning;
+        binning.feature = specs[i].feature;
+        binning.scale   = specs[i].scale;
+        binning.edges   = specs[i].edges;
+        binning.start   = specs[i].edges[0];
+        binning.last    = (double)(specs[i].edges.size() - 1);
+        binning.step    = 1.0;
+        if ((binning.scale != BinScale::EDGES) && (specs[i].edges.size() > 1)) {
+            binning.step = (binning.scale == BinScale::LOG) ?
+                        log(specs[i].edges[1] / specs[i].edges[0]) :
+                        specs[i].edges[1] - specs[i].edges[0];
+        }
+        m_binnings.push_back(binning);
+        m_num_bins += specs[i].edges.size();
+    }
+}
+
+/* Whether some histogram needs the feature */
+bool HistogramEngine::uses(CellFeature feature) const {
+    for (size_t i = 0; i < m_binnings.size(); i++) {
+        if (m_binnings[i].feature == feature) return true;
+    }
+    return false;
+}
+
+/* Total bins over all histograms */
+size_t HistogramEngine::numBins() const {
+    return m_num_bins;
+}
+
+/* Column names of the bins, e.g. "0 <= Green_Contour_Area < 40" */
+void HistogramEngine::columnNames(const std::string &channel,
+                                        std::vector<std::string> *names) const {
+    for (size_t h = 0; h < m_binnings.size(); h++) {
+        const Binning &binning = m_binnings[h];
+        std::string name = channel + "_Contour_" + featureName(binning.feature);
+        for (size_t i = 0; i < binning.edges.size(); i++) {
+            std::ostringstream column;
+            if (i + 1 < binning.edges.size()) {
+                column << binning.edges[i] << " <= " << name << " < " << binning.edges[i + 1];
+            } else {
+                column << name << " >= " << binning.edges[i];
+            }
+            names->push_back(column.str());
+        }
+    }
+}
+
+/* Bin counts of every histogram, concatenated in spec order */
+void HistogramEngine::count(const CellFeatures &features,
+                                    std::vector<unsigned int> *counts) const {
+    counts->assign(m_num_bins, 0);
+    unsigned int *bins = counts->data();
+    for (size_t h = 0; h < m_binnings.size(); h++) {
+        binValues(m_binnings[h], features[m_binnings[h].feature], bins);
+        bins += m_binnings[h].edges.size();
+    }
+}
+
+/* Bin indices are computed a batch at a time without branches on the
+ * values: clamped arithmetic for linear and log bins, a fixed length
+ * binary search for explicit edges. The counts are updated afterwards. */
+void HistogramEngine::binValues(const Binning &binning, const std::vector<double> &values,
+                                                        unsigned int *counts) const {
+    unsigned int index[HISTOGRAM_BATCH];
+    const double *edges = binning.edges.data();
+    const size_t num_edges = binning.edges.size();
+
+    for (size_t first = 0; first < values.size(); first += HISTOGRAM_BATCH) {
+        size_t n = std::min(values.size() - first, (size_t)HISTOGRAM_BATCH);
+        const double *x = values.data() + first;
+
+        switch (binning.scale) {
+            case BinScale::LINEAR: {
+                for (size_t i = 0; i < n; i++) {
+                    double pos = (x[i] - binning.start) / binning.step;
+                    index[i] = (unsigned int)fmin(fmax(pos, 0.0), binning.last);
+                }
+            } break;
+
+            case BinScale::LOG: {
+                for (size_t i = 0; i < n; i++) {
+                    double pos = log(x[i] / binning.start) / binning.step;
+                    index[i] = (unsigned int)fmin(fmax(pos, 0.0), binning.last);
+                }
+            } break;
+
+            default: {
+                for (size_t i = 0; i < n; i++) {
+                    size_t base = 0, span = num_edges;
+                    while (span > 1) {
+                        size_t half = span / 2;
+                        base = (edges[base + half] <= x[i]) ? base + half : base;
+                        span -= half;
+                    }
+                    index[i] = (unsigned int)base;
+                }
+            } break;
+        }
+
+        // Rounding in the arithmetic may land one bin off at an edge
+        if (binning.scale != BinScale::EDGES) {
+            for (size_t i = 0; i < n; i++) {
+                unsigned int k = index[i];
+                k -= (k > 0) & (edges[k] > x[i]);
+                k += (k + 1 < num_edges) && (edges[k + 1] <= x[i]);
+                index[i] = k;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) counts[index[i]]++;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <string>
+#include <vector>
+
+
+#define BIN_AREA                40    // Default bin width of the area histogram
+#define NUM_BINS                11    // Default number of area bins
+
+/* Per-cell features a histogram can be built on */
+enum class CellFeature : unsigned char {
+    AREA = 0,
+    DIAMETER,
+    ASPECT_RATIO,
+    PERIMETER,
+    INTENSITY,
+    NUM_FEATURES
+};
+
+/* Spacing of the bin edges */
+enum class BinScale : unsigned char {
+    LINEAR = 0,
+    LOG,
+    EDGES
+};
+
+/* One histogram: bin i holds [edges[i], edges[i+1]), the last bin is open
+ * ended and values below edges[0] fall into the first bin */
+struct HistogramSpec {
+    CellFeature             feature;
+    BinScale                scale;
+    std::vector<double>     edges;
+};
+
+/* Values of every feature for each cell of one channel */
+struct CellFeatures {
+    std::vector<double>     values[(int)CellFeature::NUM_FEATURES];
+
+    std::vector<double> &operator[](CellFeature feature);
+    const std::vector<double> &operator[](CellFeature feature) const;
+};
+
+/* Parse "<feature>:linear:<start>:<width>:<bins>",
+ * "<feature>:log:<start>:<end>:<bins>" or "<feature>:edges:<e0>,<e1>,..." */
+bool parseHistogramSpec(const std::string &text, HistogramSpec *spec);
+
+/* The historical area histogram, 0..400 px in 40 px bins */
+HistogramSpec defaultHistogramSpec();
+
+/* Column name of a feature, e.g. "Aspect_Ratio" */
+const char *featureName(CellFeature feature);
+
+/* Bins a batch of values for a fixed set of histograms */
+class HistogramEngine {
+public:
+    explicit HistogramEngine(const std::vector<HistogramSpec> &specs);
+
+    /* Whether some histogram needs the feature */
+    bool uses(CellFeature feature) const;
+
+    /* Total bins over all histograms */
+    size_t numBins() const;
+
+    /* Column names of the bins, e.g. "0 <= Green_Contour_Area < 40" */
+    void columnNames(const std::string &channel, std::vector<std::string> *names) const;
+
+    /* Bin counts of every histogram, concatenated in spec order */
+    void count(const CellFeatures &features, std::vector<unsigned int> *counts) const;
+
+private:
+    struct Binning {
+        CellFeature             feature;
+        BinScale                scale;
+        std::vector<double>     edges;
+        double                  start;
+        double                  step;       // Width, or log width for LOG
+        double                  last;       // Index of the last bin
+    };
+
+    void binValues(const Binning &binning, const std::vector<double> &values,
+                                                        unsigned int *counts) const;
+
+    std::vector<Binning>    m_binnings;
+    size_t                  m_num_bins;
+};
+
+#endif // HISTOGRAM_HPP
@@ -0,0 +1,430 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "input_reader.hpp"
+#include "event_log.hpp"
+
+
+/* Minimal io_uring submission/completion queue driven by raw syscalls */
+class UringQueue {
+public:
+    UringQueue() :
+        m_fd(-1), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sqes(NULL),
+        m_sq_len(0), m_cq_len(0), m_sqes_len(0), m_sq_entries(0), m_to_submit(0) {
+    }
+
+    ~UringQueue() {
+        if (m_sqes) munmap(m_sqes, m_sqes_len);
+        if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) munmap(m_cq_ptr, m_cq_len);
+        if (m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_len);
+        if (m_fd >= 0) close(m_fd);
+    }
+
+    /* Set up the ring, false if io_uring is unavailable */
+    bool init(unsigned int entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0) return false;
+
+        m_sq_entries = params.sq_entries;
+        m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        m_cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            m_sq_len = m_cq_len = (m_sq_len > m_cq_len) ? m_sq_len : m_cq_len;
+        }
+
+        m_sq_ptr = mmap(NULL, m_sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED) return false;
+        if (single_mmap) {
+            m_cq_ptr = m_sq_ptr;
+        } else {
+            m_cq_ptr = mmap(NULL, m_cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ptr == MAP_FAILED) return false;
+        }
+        m_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        m_sqes = (struct io_uring_sqe *)sqes;
+
+        char *sq = (char *)m_sq_ptr;
+        m_sq_head  = (unsigned int *)(sq + params.sq_off.head);
+        m_sq_tail  = (unsigned int *)(sq + params.sq_off.tail);
+        m_sq_mask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+        m_sq_array = (unsigned int *)(sq + params.sq_off.array);
+        char *cq = (char *)m_cq_ptr;
+        m_cq_head  = (unsigned int *)(cq + params.cq_off.head);
+        m_cq_tail  = (unsigned int *)(cq + params.cq_off.tail);
+        m_cq_mask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+        m_cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    /* Queue a read, false if the submission queue is full */
+    bool pushRead(int fd, void *buf, unsigned int len,
+                  unsigned long long offset, unsigned long long user_data) {
+        unsigned int tail = *m_sq_tail;
+        unsigned int head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= m_sq_entries) return false;
+
+        unsigned int index = tail & *m_sq_mask;
+        struct io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = IORING_OP_READ;
+        sqe->fd        = fd;
+        sqe->addr      = (unsigned long long)(uintptr_t)buf;
+        sqe->len       = len;
+        sqe->off       = offset;
+        sqe->user_data = user_data;
+        m_sq_array[index] = index;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        m_to_submit++;
+        return true;
+    }
+
+    /* Submit the queued reads and wait for at least wait_nr completions */
+    bool submitAndWait(unsigned int wait_nr) {
+        while (true) {
+            unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+            long ret = syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_nr, flags, NULL, 0);
+            if (ret >= 0) {
+                m_to_submit -= (unsigned int)ret;
+                return true;
+            }
+            if (errno != EINTR) return false;
+        }
+    }
+
+    /* Pop one completion, false if the completion queue is empty */
+    bool popCompletion(unsigned long long *user_data, int *result) {
+        unsigned int head = *m_cq_head;
+        unsigned int tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) return false;
+
+        struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+        *user_data = cqe->user_data;
+        *result = cqe->res;
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int                     m_fd;
+    void                   *m_sq_ptr;
+    void                   *m_cq_ptr;
+    struct io_uring_sqe    *m_sqes;
+    size_t                  m_sq_len;
+    size_t                  m_cq_len;
+    size_t                  m_sqes_len;
+    unsigned int            m_sq_entries;
+    unsigned int            m_to_submit;
+    unsigned int           *m_sq_head;
+    unsigned int           *m_sq_tail;
+    unsigned int           *m_sq_mask;
+    unsigned int           *m_sq_array;
+    unsigned int           *m_cq_head;
+    unsigned int           *m_cq_tail;
+    unsigned int           *m_cq_mask;
+    struct io_uring_cqe    *m_cqes;
+};
+
+
+FileBuffer::FileBuffer() : data(NULL), size(0), capacity(0), valid(false) {
+}
+
+FileBuffer::~FileBuffer() {
+    free(data);
+}
+
+
+InputReader::InputReader(const std::vector<std::string> &paths, const Options &options) :
+    m_slots(URING_QUEUE_DEPTH),
+    m_next_file(0),
+    m_wanted(0),
+    m_inflight_bytes(0),
+    m_budget(options.readahead_bytes),
+    m_direct_io(options.direct_io),
+    m_stop(false) {
+
+    m_files.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        m_files[i].path         = paths[i];
+        m_files[i].fd           = -1;
+        m_files[i].outstanding  = 0;
+        m_files[i].ready        = false;
+        m_files[i].taken        = false;
+    }
+    for (unsigned int i = 0; i < URING_QUEUE_DEPTH; i++) {
+        m_free_slots.push_back(URING_QUEUE_DEPTH - 1 - i);
+    }
+
+    if (options.io_backend != IoBackend::SYNC) {
+        m_uring.reset(new UringQueue());
+        if (!m_uring->init(URING_QUEUE_DEPTH)) {
+            m_uring.reset();
+            if (options.io_backend == IoBackend::URING) {
+                LOG(WARN, "uring_unavailable");
+            }
+        }
+    }
+
+    m_thread = std::thread(&InputReader::run, this);
+}
+
+InputReader::~InputReader() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup_cv.notify_one();
+    m_thread.join();
+
+    for (size_t i = 0; i < m_files.size(); i++) {
+        if (m_files[i].fd >= 0) close(m_files[i].fd);
+    }
+}
+
+/* Block until the file at index has been read and take its buffer */
+std::shared_ptr<FileBuffer> InputReader::take(size_t index) {
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (index > m_wanted) {
+        m_wanted = index;
+        m_wakeup_cv.notify_one();
+    }
+    InputFile &file = m_files[index];
+    m_ready_cv.wait(lock, [&file] { return file.ready; });
+
+    std::shared_ptr<FileBuffer> buffer = file.buffer;
+    file.buffer.reset();
+    if (!file.taken) {
+        file.taken = true;
+        m_inflight_bytes -= buffer->capacity;
+        m_wakeup_cv.notify_one();
+    }
+    return buffer;
+}
+
+/* Name of the backend actually in use */
+const char *InputReader::backendName() const {
+    return m_uring ? "io_uring" : "pread";
+}
+
+/* Budget check for opening the next file, called with the lock held */
+bool InputReader::canStartFile() const {
+    if (m_next_file >= m_files.size()) return false;
+
+    // A consumer is already blocked on this file
+    if (m_next_file <= m_wanted) return true;
+    return m_inflight_bytes < m_budget;
+}
+
+/* Open the file, allocate its buffer and queue its reads */
+void InputReader::startFile(size_t index) {
+
+    InputFile &file = m_files[index];
+    file.buffer = std::make_shared<FileBuffer>();
+
+    // Nothing to read for this image
+    if (file.path.empty()) {
+        file.ready = true;
+        m_ready_cv.notify_all();
+        return;
+    }
+
+    int flags = O_RDONLY | O_CLOEXEC;
+    if (m_direct_io) flags |= O_DIRECT;
+    file.fd = open(file.path.c_str(), flags);
+    if ((file.fd < 0) && m_direct_io) {
+        // File system without O_DIRECT support
+        file.fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    struct stat st;
+    if ((file.fd < 0) || fstat(file.fd, &st) || (st.st_size <= 0)) {
+        finishFile(index);
+        return;
+    }
+
+    // Round the buffer up so that every read stays aligned
+    size_t size = (size_t)st.st_size;
+    size_t capacity = (size + READ_ALIGNMENT - 1) & ~((size_t)READ_ALIGNMENT - 1);
+    void *data = NULL;
+    if (posix_memalign(&data, READ_ALIGNMENT, capacity)) {
+        finishFile(index);
+        return;
+    }
+    file.buffer->data = (unsigned char *)data;
+    file.buffer->size = size;
+    file.buffer->capacity = capacity;
+    m_inflight_bytes += capacity;
+
+    // Let the kernel start its own readahead on the whole file
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    for (size_t offset = 0; offset < capacity; offset += READ_CHUNK_SIZE) {
+        ReadRequest request;
+        request.file   = index;
+        request.offset = offset;
+        request.length = (capacity - offset < READ_CHUNK_SIZE) ?
+                                            capacity - offset : READ_CHUNK_SIZE;
+        m_requests.push_back(request);
+        file.outstanding++;
+    }
+    file.buffer->valid = true;
+}
+
+/* Account for one finished read, requeue the remainder of short reads */
+void InputReader::completeRequest(const ReadRequest &request, long result) {
+
+    InputFile &file = m_files[request.file];
+    size_t expected = request.length;
+    if (request.offset + expected > file.buffer->size) {
+        expected = file.buffer->size - request.offset;
+    }
+
+    if (result < 0) {
+        if ((result == -EINTR) || (result == -EAGAIN)) {
+            m_requests.push_front(request);
+            return;
+        }
+        file.buffer->valid = false;
+
+    } else if ((size_t)result < expected) {
+        if (result == 0) {
+            // File shrank underneath us
+            file.buffer->valid = false;
+        } else {
+            ReadRequest remainder = request;
+            remainder.offset += result;
+            remainder.length -= result;
+            m_requests.push_front(remainder);
+            return;
+        }
+    }
+
+    if (!--file.outstanding) finishFile(request.file);
+}
+
+/* Mark the file as ready for its consumer */
+void InputReader::finishFile(size_t index) {
+
+    InputFile &file = m_files[index];
+    if (file.fd >= 0) {
+        close(file.fd);
+        file.fd = -1;
+    }
+    if (!file.buffer) file.buffer = std::make_shared<FileBuffer>();
+    if (!file.buffer->valid) {
+        LOG(ERROR, "read_failed").field("path", file.path);
+    }
+    file.ready = true;
+    m_ready_cv.notify_all();
+}
+
+/* Blocking read of one request */
+long InputReader::readSync(const ReadRequest &request) {
+
+    InputFile &file = m_files[request.file];
+    ssize_t ret = pread(file.fd, file.buffer->data + request.offset,
+                        request.length, request.offset);
+    return (ret < 0) ? -errno : (long)ret;
+}
+
+/* I/O thread - keep the device queue full within the byte budget */
+void InputReader::run() {
+
+    size_t outstanding = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup_cv.wait(lock, [this, outstanding] {
+                return m_stop || outstanding || !m_requests.empty() || canStartFile();
+            });
+            if (m_stop && !outstanding) break;
+            while (!m_stop && canStartFile()) {
+                startFile(m_next_file++);
+            }
+        }
+
+        // Blocking fallback, one request at a time. The read runs unlocked:
+        // the fd and buffer of a file with reads outstanding are only
+        // touched by this thread, and consumers of ready files go on.
+        if (!m_uring) {
+            ReadRequest request;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_requests.empty()) continue;
+                request = m_requests.front();
+                m_requests.pop_front();
+            }
+            long result = readSync(request);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            completeRequest(request, result);
+            continue;
+        }
+
+        // Fill the submission queue from the pending requests
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            while (!m_requests.empty() && !m_free_slots.empty()) {
+                ReadRequest request = m_requests.front();
+                unsigned int slot = m_free_slots.back();
+                InputFile &file = m_files[request.file];
+                if (!m_uring->pushRead(file.fd, file.buffer->data + request.offset,
+                                       (unsigned int)request.length, request.offset, slot)) {
+                    break;
+                }
+                m_slots[slot] = request;
+                m_free_slots.pop_back();
+                m_requests.pop_front();
+                outstanding++;
+            }
+        }
+        if (!outstanding) continue;
+
+        if (!m_uring->submitAndWait(1)) {
+            LOG(WARN, "uring_failed").field("error", strerror(errno));
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_uring.reset();
+
+            // Requeue everything that was handed to the ring
+            std::vector<bool> busy(m_slots.size(), true);
+            for (size_t k = 0; k < m_free_slots.size(); k++) busy[m_free_slots[k]] = false;
+            for (size_t slot = 0; slot < m_slots.size(); slot++) {
+                if (busy[slot]) m_requests.push_back(m_slots[slot]);
+            }
+            outstanding = 0;
+            continue;
+        }
+
+        // The ring and the slots are only touched by this thread. A kernel
+        // without IORING_OP_READ gets its chunks read here, unlocked.
+        std::vector<std::pair<unsigned int, long>> completions;
+        unsigned long long user_data = 0;
+        int result = 0;
+        while (m_uring->popCompletion(&user_data, &result)) {
+            unsigned int slot = (unsigned int)user_data;
+            long read = (result == -EINVAL) ? readSync(m_slots[slot]) : (long)result;
+            completions.push_back(std::make_pair(slot, read));
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < completions.size(); i++) {
+            m_free_slots.push_back(completions[i].first);
+            outstanding--;
+            completeRequest(m_slots[completions[i].first], completions[i].second);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef INPUT_READER_HPP
+#define INPUT_READER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "options.hpp"
+
+
+#define READ_CHUNK_SIZE         (1 << 20)   // Size of each read request
+#define READ_ALIGNMENT          4096        // Alignment of the read buffers
+#define URING_QUEUE_DEPTH       64          // Max read requests in flight
+
+/* Raw bytes of one input file, handed to the decoder without copying */
+struct FileBuffer {
+    unsigned char  *data;       // READ_ALIGNMENT aligned
+    size_t          size;       // Number of valid bytes
+    size_t          capacity;   // Allocated bytes, multiple of READ_ALIGNMENT
+    bool            valid;      // False if the file could not be read
+
+    FileBuffer();
+    ~FileBuffer();
+
+private:
+    FileBuffer(const FileBuffer &);
+    FileBuffer &operator=(const FileBuffer &);
+};
+
+class UringQueue;
+
+/* Reads the input images ahead of the pipeline, keeping a bounded number
+ * of bytes in flight. Reads are submitted through io_uring when available,
+ * otherwise through blocking pread with posix_fadvise hints. */
+class InputReader {
+public:
+    InputReader(const std::vector<std::string> &paths, const Options &options);
+    ~InputReader();
+
+    /* Block until the file at index has been read and take its buffer.
+     * Empty paths are skipped and yield an invalid buffer. */
+    std::shared_ptr<FileBuffer> take(size_t index);
+
+    /* Name of the backend actually in use */
+    const char *backendName() const;
+
+private:
+    struct InputFile {
+        std::string                 path;
+        int                         fd;
+        std::shared_ptr<FileBuffer> buffer;
+        size_t                      outstanding;    // Read requests not yet completed
+        bool                        ready;
+        bool                        taken;
+    };
+
+    struct ReadRequest {
+        size_t  file;
+        size_t  offset;
+        size_t  length;
+    };
+
+    void run();
+    bool canStartFile() const;
+    void startFile(size_t index);
+    void completeRequest(const ReadRequest &request, long result);
+    void finishFile(size_t index);
+    long readSync(const ReadRequest &request);
+
+    std::vector<InputFile>      m_files;
+    std::deque<ReadRequest>     m_requests;     // Queued but not submitted
+    std::vector<ReadRequest>    m_slots;        // Submitted to the ring
+    std::vector<unsigned int>   m_free_slots;
+    size_t                      m_next_file;
+    size_t                      m_wanted;       // Highest index a consumer waits on
+    size_t                      m_inflight_bytes;
+    size_t                      m_budget;
+    bool                        m_direct_io;
+    bool                        m_stop;
+    std::unique_ptr<UringQueue> m_uring;
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_ready_cv;
+    std::condition_variable     m_wakeup_cv;
+    std::thread                 m_thread;
+};
+
+#endif // INPUT_READER_HPP
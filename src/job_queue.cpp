@@ -0,0 +1,220 @@
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+
+#include "job_queue.hpp"
+
+
+const char *JOB_CLASS_NAMES[NUM_JOB_CLASSES] = { "interactive", "bulk" };
+
+/* Seconds on a monotonic clock */
+static double queueClock() {
+    return std::chrono::duration_cast<std::chrono::duration<double>>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ClassStats::ClassStats() : submitted(0), rejected(0), completed(0), queued(0), seconds(0.0) {
+}
+
+
+JobQueue::JobQueue(const QueueLimits &limits) :
+    m_limits(limits),
+    m_classes(NUM_JOB_CLASSES),
+    m_burst(0),
+    m_bulk_running(0),
+    m_stats(NUM_JOB_CLASSES),
+    m_start(queueClock()),
+    m_stop(false) {
+
+    if (m_limits.slots < 1) m_limits.slots = 1;
+    if (m_limits.interactive_slots >= m_limits.slots) m_limits.interactive_slots = m_limits.slots - 1;
+    if (!m_limits.fair) m_limits.interactive_slots = 0;
+    for (size_t i = 0; i < m_classes.size(); i++) m_classes[i].queued = 0;
+
+    // The last interactive_slots executors never pick up a bulk job
+    for (unsigned int i = 0; i < m_limits.slots; i++) {
+        bool interactive_only = (i >= m_limits.slots - m_limits.interactive_slots);
+        m_executors.push_back(std::thread(&JobQueue::executorLoop, this, interactive_only));
+    }
+}
+
+JobQueue::~JobQueue() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work_cv.notify_all();
+    for (size_t i = 0; i < m_executors.size(); i++) m_executors[i].join();
+}
+
+/* Queue a job and wait until one of the slots ran it */
+bool JobQueue::run( const std::string &client, JobClass job_class, double cost,
+                    const std::function<void()> &job    ) {
+
+    const size_t c = m_limits.fair ? (size_t)job_class : 0;
+    Job entry;
+    entry.fn = &job;
+    entry.job_class = job_class;
+    entry.cost = (cost > 0.0) ? cost : 1.0;
+    entry.submitted = queueClock();
+    entry.done = false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ClassStats &stats = m_stats[(size_t)job_class];
+    stats.submitted++;
+
+    // Admission: a full queue answers right away rather than piling up
+    size_t &client_queued = m_client_queued[client];
+    size_t class_queued = m_limits.fair ? m_classes[c].queued : m_fifo.size();
+    if ((client_queued >= m_limits.client_queued) || (class_queued >= m_limits.class_queued)) {
+        if (!client_queued) m_client_queued.erase(client);
+        stats.rejected++;
+        return false;
+    }
+    client_queued++;
+    stats.queued++;
+
+    if (m_limits.fair) {
+        ClassQueue &queue = m_classes[c];
+        std::map<std::string, ClientQueue>::iterator found = queue.clients.find(client);
+        if (found == queue.clients.end()) {
+            // A client coming back starts a round with no credit saved up
+            found = queue.clients.insert(std::make_pair(client, ClientQueue())).first;
+            found->second.deficit = 0.0;
+            queue.active.push_back(client);
+        }
+        found->second.jobs.push_back(&entry);
+        queue.queued++;
+    } else {
+        m_fifo.push_back(&entry);
+    }
+    m_work_cv.notify_all();
+
+    m_done_cv.wait(lock, [&] { return entry.done; });
+    if (!--m_client_queued[client]) m_client_queued.erase(client);
+    return true;
+}
+
+/* Next job of a class by deficit round robin: the client at the front runs
+ * jobs while its credit covers their cost, otherwise it gets a quantum more
+ * and goes to the back */
+JobQueue::Job *JobQueue::nextFromClass(ClassQueue *queue) {
+    while (!queue->active.empty()) {
+        const std::string name = queue->active.front();
+        ClientQueue &client = queue->clients[name];
+        Job *job = client.jobs.front();
+        if (client.deficit < job->cost) {
+            client.deficit += DRR_QUANTUM;
+            queue->active.pop_front();
+            queue->active.push_back(name);
+            continue;
+        }
+        client.deficit -= job->cost;
+        client.jobs.pop_front();
+        queue->queued--;
+        if (client.jobs.empty()) {
+            // An idle client keeps no credit
+            queue->clients.erase(name);
+            queue->active.pop_front();
+        }
+        return job;
+    }
+    return NULL;
+}
+
+/* Next job for an executor, NULL if none it may run */
+JobQueue::Job *JobQueue::nextJob(bool interactive_only) {
+
+    if (!m_limits.fair) {
+        if (m_fifo.empty()) return NULL;
+        Job *job = m_fifo.front();
+        m_fifo.pop_front();
+        return job;
+    }
+
+    ClassQueue &interactive = m_classes[(size_t)JobClass::INTERACTIVE];
+    ClassQueue &bulk = m_classes[(size_t)JobClass::BULK];
+    const unsigned int bulk_slots = m_limits.slots - m_limits.interactive_slots;
+    const bool bulk_ready = bulk.queued && !interactive_only && (m_bulk_running < bulk_slots);
+
+    // Interactive first, but a waiting bulk job gets a turn after a burst.
+    // The burst counts the interactive jobs the shared executors ran while
+    // bulk jobs waited, those of the interactive slots never delay them.
+    if (interactive.queued && (!bulk_ready || (m_burst < INTERACTIVE_BURST))) {
+        if (!interactive_only) {
+            m_burst = !bulk.queued ? 0 : std::min(m_burst + 1, (unsigned int)INTERACTIVE_BURST);
+        }
+        return nextFromClass(&interactive);
+    }
+    if (bulk_ready) {
+        m_burst = 0;
+        m_bulk_running++;
+        return nextFromClass(&bulk);
+    }
+    return NULL;
+}
+
+/* Executor: run jobs until the queue is destroyed and drained */
+void JobQueue::executorLoop(bool interactive_only) {
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        Job *job = NULL;
+        m_work_cv.wait(lock, [&] { return (job = nextJob(interactive_only)) || m_stop; });
+        if (!job) break;
+
+        ClassStats &stats = m_stats[(size_t)job->job_class];
+        stats.queued--;
+        stats.wait.add(queueClock() - job->submitted);
+        lock.unlock();
+
+        (*job->fn)();
+
+        lock.lock();
+        const double latency = queueClock() - job->submitted;
+        stats.completed++;
+        stats.latency.add(latency);
+        if (m_limits.fair && (job->job_class == JobClass::BULK)) {
+            m_bulk_running--;
+            m_work_cv.notify_all();     // A bulk slot opened
+        }
+        job->done = true;
+        m_done_cv.notify_all();
+    }
+}
+
+/* Statistics of every class */
+std::vector<ClassStats> JobQueue::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<ClassStats> stats = m_stats;
+    for (size_t i = 0; i < stats.size(); i++) stats[i].seconds = queueClock() - m_start;
+    return stats;
+}
+
+/* Flatten the statistics into named values, latencies in milliseconds */
+void queueStatsValues(  const std::vector<ClassStats> &stats,
+                        std::vector<double> *values, std::string *names ) {
+
+    static const char *columns[] = { "submitted", "rejected", "completed", "queued",
+                                     "per_second", "wait_p50_ms", "wait_p99_ms",
+                                     "latency_p50_ms", "latency_p95_ms", "latency_p99_ms" };
+    std::stringstream stream;
+    values->clear();
+    for (size_t i = 0; i < stats.size(); i++) {
+        const ClassStats &s = stats[i];
+        for (size_t k = 0; k < sizeof(columns) / sizeof(columns[0]); k++) {
+            stream << ((i || k) ? "," : "") << JOB_CLASS_NAMES[i] << "_" << columns[k];
+        }
+        values->push_back((double)s.submitted);
+        values->push_back((double)s.rejected);
+        values->push_back((double)s.completed);
+        values->push_back((double)s.queued);
+        values->push_back((s.seconds > 0.0) ? s.completed / s.seconds : 0.0);
+        values->push_back(s.wait.quantile(0.50) * 1000.0);
+        values->push_back(s.wait.quantile(0.99) * 1000.0);
+        values->push_back(s.latency.quantile(0.50) * 1000.0);
+        values->push_back(s.latency.quantile(0.95) * 1000.0);
+        values->push_back(s.latency.quantile(0.99) * 1000.0);
+    }
+    *names = stream.str();
+}
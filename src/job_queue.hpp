@@ -0,0 +1,115 @@
+#ifndef JOB_QUEUE_HPP
+#define JOB_QUEUE_HPP
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "quantile_sketch.hpp"
+
+
+#define DRR_QUANTUM             (1 << 22)   // Cost credited to a client per round, pixels
+#define INTERACTIVE_BURST       8           // Interactive jobs run before a waiting bulk one
+
+/* Priority classes of the jobs */
+enum class JobClass : unsigned char {
+    INTERACTIVE = 0,
+    BULK
+};
+#define NUM_JOB_CLASSES         2
+
+extern const char *JOB_CLASS_NAMES[NUM_JOB_CLASSES];
+
+/* Sizing and admission of a queue */
+struct QueueLimits {
+    unsigned int    slots;              // Jobs run at once
+    unsigned int    interactive_slots;  // Of which bulk jobs may not take
+    size_t          client_queued;      // Jobs a client may have waiting
+    size_t          class_queued;       // Jobs a class may have waiting
+    bool            fair;               // Classes and deficit round robin, else FIFO
+};
+
+/* Counters and distributions of one class since the queue started */
+struct ClassStats {
+    uint64_t        submitted;
+    uint64_t        rejected;
+    uint64_t        completed;
+    uint64_t        queued;             // Waiting right now
+    double          seconds;            // Since the queue started
+    QuantileSketch  wait;               // Seconds from submission to start
+    QuantileSketch  latency;            // Seconds from submission to completion
+
+    ClassStats();
+};
+
+/* Job queue shared by the clients of a service. Interactive jobs go
+ * before bulk ones, up to INTERACTIVE_BURST in a row while bulk jobs
+ * wait, and some slots only run interactive jobs. Within a class the
+ * clients share the slots by deficit round robin on the job costs, so
+ * that one client's large batch cannot starve the others. */
+class JobQueue {
+public:
+    explicit JobQueue(const QueueLimits &limits);
+    ~JobQueue();
+
+    /* Queue a job and wait until one of the slots ran it. False, without
+     * running it, if the client or the class has too many jobs waiting. */
+    bool run(   const std::string &client, JobClass job_class, double cost,
+                const std::function<void()> &job    );
+
+    /* Statistics of every class */
+    std::vector<ClassStats> stats() const;
+
+private:
+    JobQueue(const JobQueue &);
+    JobQueue &operator=(const JobQueue &);
+
+    struct Job {
+        const std::function<void()> *fn;
+        JobClass        job_class;
+        double          cost;
+        double          submitted;
+        bool            done;
+    };
+
+    struct ClientQueue {
+        std::deque<Job *>   jobs;
+        double              deficit;
+    };
+
+    struct ClassQueue {
+        std::map<std::string, ClientQueue>  clients;
+        std::deque<std::string>             active;     // Round robin order
+        size_t                              queued;
+    };
+
+    Job *nextJob(bool interactive_only);
+    Job *nextFromClass(ClassQueue *queue);
+    void executorLoop(bool interactive_only);
+
+    QueueLimits                         m_limits;
+    std::vector<ClassQueue>             m_classes;
+    std::deque<Job *>                   m_fifo;         // Without fair sharing
+    std::map<std::string, size_t>       m_client_queued;
+    unsigned int                        m_burst;        // Interactive jobs run in a row
+    unsigned int                        m_bulk_running;
+    std::vector<ClassStats>             m_stats;
+    double                              m_start;
+    bool                                m_stop;
+    std::vector<std::thread>            m_executors;
+    mutable std::mutex                  m_mutex;
+    std::condition_variable             m_work_cv;
+    std::condition_variable             m_done_cv;
+};
+
+/* Flatten the statistics into named values, latencies in milliseconds */
+void queueStatsValues(  const std::vector<ClassStats> &stats,
+                        std::vector<double> *values, std::string *names );
+
+#endif // JOB_QUEUE_HPP
@@ -0,0 +1,201 @@
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "label_image.hpp"
+
+
+static_assert(sizeof(LabelImageHeader) == LABEL_HEADER_SIZE, "label image header size");
+
+#define LABEL_ROWS_PER_TASK     64    // Rows converted or encoded per task
+
+/* Create the output file with its final size and map it for writing */
+static unsigned char *mapOutput(const std::string &path, size_t size, int *fd) {
+    *fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (*fd < 0) return NULL;
+    if (ftruncate(*fd, (off_t)size)) return NULL;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    return (map == MAP_FAILED) ? NULL : (unsigned char *)map;
+}
+
+/* Write a 32 bit label image through a shared mapping of the output file */
+bool writeLabelImage(   const std::string &path, const int32_t *labels, size_t step,
+                        unsigned int width, unsigned int height, unsigned int num_labels,
+                        LabelEncoding encoding, ThreadPool *pool    ) {
+
+    if (!width || !height) return false;
+
+    LabelImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LABEL_MAGIC, sizeof(header.magic));
+    header.byte_order   = LABEL_BYTE_ORDER;
+    header.version      = LABEL_VERSION;
+    header.label_bytes  = (num_labels <= UINT16_MAX) ? 2 : 4;
+    header.width        = width;
+    header.height       = height;
+    header.num_labels   = num_labels;
+    header.encoding     = encoding;
+    header.data_offset  = LABEL_HEADER_SIZE;
+
+    const size_t bands = (height + LABEL_ROWS_PER_TASK - 1) / LABEL_ROWS_PER_TASK;
+    std::vector<std::vector<LabelRun>> band_runs;
+    std::vector<uint64_t> row_runs;
+    if (encoding == LabelEncoding::RAW) {
+        header.data_size = (uint64_t)width * height * header.label_bytes;
+
+    } else {
+        // Collect the runs band by band, then index them by row
+        band_runs.resize(bands);
+        row_runs.assign(height + 1, 0);
+        pool->parallelFor(bands, [&](size_t band) {
+            size_t y1 = (band + 1) * LABEL_ROWS_PER_TASK;
+            if (y1 > height) y1 = height;
+            for (size_t y = band * LABEL_ROWS_PER_TASK; y < y1; y++) {
+                const int32_t *row = (const int32_t *)((const char *)labels + y * step);
+                size_t first = band_runs[band].size();
+                for (unsigned int x = 0; x < width; ) {
+                    unsigned int start = x;
+                    while ((x < width) && (row[x] == row[start])) x++;
+                    if (row[start] <= 0) continue;
+                    LabelRun run = { start, x - start, (uint32_t)row[start] };
+                    band_runs[band].push_back(run);
+                }
+                row_runs[y + 1] = band_runs[band].size() - first;
+            }
+        });
+        for (unsigned int y = 0; y < height; y++) row_runs[y + 1] += row_runs[y];
+        header.data_size = row_runs.size() * sizeof(uint64_t) +
+                                            row_runs[height] * sizeof(LabelRun);
+    }
+
+    int fd = -1;
+    size_t size = LABEL_HEADER_SIZE + header.data_size;
+    unsigned char *map = mapOutput(path, size, &fd);
+    if (!map) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    memcpy(map, &header, sizeof(header));
+    unsigned char *data = map + LABEL_HEADER_SIZE;
+
+    if (encoding == LabelEncoding::RAW) {
+        pool->parallelFor(bands, [&](size_t band) {
+            size_t y1 = (band + 1) * LABEL_ROWS_PER_TASK;
+            if (y1 > height) y1 = height;
+            for (size_t y = band * LABEL_ROWS_PER_TASK; y < y1; y++) {
+                const int32_t *row = (const int32_t *)((const char *)labels + y * step);
+                if (header.label_bytes == 4) {
+                    memcpy(data + y * width * 4, row, (size_t)width * 4);
+                } else {
+                    uint16_t *dst = (uint16_t *)(data + y * width * 2);
+                    for (unsigned int x = 0; x < width; x++) dst[x] = (uint16_t)row[x];
+                }
+            }
+        });
+
+    } else {
+        memcpy(data, row_runs.data(), row_runs.size() * sizeof(uint64_t));
+        LabelRun *runs = (LabelRun *)(data + row_runs.size() * sizeof(uint64_t));
+        pool->parallelFor(bands, [&](size_t band) {
+            if (band_runs[band].empty()) return;
+            memcpy(runs + row_runs[band * LABEL_ROWS_PER_TASK], band_runs[band].data(),
+                                            band_runs[band].size() * sizeof(LabelRun));
+        });
+    }
+
+    bool ok = (munmap(map, size) == 0);
+    if (::close(fd)) ok = false;
+    return ok;
+}
+
+
+LabelImageView::LabelImageView() : m_map(NULL), m_size(0) {
+    memset(&m_header, 0, sizeof(m_header));
+}
+
+LabelImageView::~LabelImageView() {
+    close();
+}
+
+/* Map the file and check its header, false if it is not a label image */
+bool LabelImageView::open(const std::string &path) {
+
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) || ((size_t)st.st_size < LABEL_HEADER_SIZE)) {
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+    m_map = (const unsigned char *)map;
+    m_size = st.st_size;
+
+    const LabelImageHeader &header = *(const LabelImageHeader *)m_map;
+    bool valid = !memcmp(header.magic, LABEL_MAGIC, sizeof(header.magic)) &&
+                 (header.byte_order == LABEL_BYTE_ORDER) &&
+                 (header.version == LABEL_VERSION) &&
+                 ((header.label_bytes == 2) || (header.label_bytes == 4)) &&
+                 (header.data_offset + header.data_size <= m_size);
+    if (valid && (header.encoding == LabelEncoding::RAW)) {
+        valid = (header.data_size == (uint64_t)header.width * header.height * header.label_bytes);
+    } else if (valid && (header.encoding == LabelEncoding::RLE)) {
+        uint64_t table_size = ((uint64_t)header.height + 1) * sizeof(uint64_t);
+        const uint64_t *table = (const uint64_t *)(m_map + header.data_offset);
+        valid = (header.data_size >= table_size) &&
+                (header.data_size == table_size + table[header.height] * sizeof(LabelRun));
+    } else {
+        valid = false;
+    }
+    if (!valid) {
+        close();
+        return false;
+    }
+    m_header = header;
+    return true;
+}
+
+void LabelImageView::close() {
+    if (m_map) munmap((void *)m_map, m_size);
+    m_map = NULL;
+    m_size = 0;
+}
+
+const LabelImageHeader &LabelImageView::header() const {
+    return m_header;
+}
+
+/* Label of the pixel at (x, y), 0 for background */
+uint32_t LabelImageView::label(unsigned int x, unsigned int y) const {
+
+    if (!m_map || (x >= m_header.width) || (y >= m_header.height)) return 0;
+    const unsigned char *data = m_map + m_header.data_offset;
+
+    if (m_header.encoding == LabelEncoding::RAW) {
+        size_t index = (size_t)y * m_header.width + x;
+        if (m_header.label_bytes == 2) return ((const uint16_t *)data)[index];
+        return ((const uint32_t *)data)[index];
+    }
+
+    // Binary search for the last run of the row starting at or before x
+    const uint64_t *table = (const uint64_t *)data;
+    const LabelRun *runs = (const LabelRun *)(table + m_header.height + 1);
+    uint64_t low = table[y], high = table[y + 1];
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (runs[mid].x <= x) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == table[y]) return 0;
+    const LabelRun &run = runs[low - 1];
+    return (x < run.x + run.length) ? run.label : 0;
+}
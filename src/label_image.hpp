@@ -0,0 +1,77 @@
+#ifndef LABEL_IMAGE_HPP
+#define LABEL_IMAGE_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+#include "thread_pool.hpp"
+
+
+#define LABEL_MAGIC             "LABELIMG"  // First 8 bytes of a label image
+#define LABEL_VERSION           1
+#define LABEL_BYTE_ORDER        0x01020304  // Written in host byte order
+#define LABEL_HEADER_SIZE       64          // Offset of the label data
+
+/* Encoding of the label data */
+enum class LabelEncoding : uint32_t {
+    RAW = 0,
+    RLE
+};
+
+/* Fixed size header of a label image file. RAW data is height rows of
+ * width labels of label_bytes each. RLE data is a table of height + 1
+ * uint64_t run indices, row y owning runs [table[y], table[y+1]), followed
+ * by the LabelRun entries of the non-zero runs sorted by x in each row. */
+struct LabelImageHeader {
+    char            magic[8];
+    uint32_t        byte_order;
+    uint16_t        version;
+    uint16_t        label_bytes;        // RAW label size, 2 or 4 by the label count
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        num_labels;         // Labels run from 1, 0 is background
+    LabelEncoding   encoding;
+    uint64_t        data_offset;
+    uint64_t        data_size;
+    unsigned char   reserved[16];
+};
+
+/* One run of equal non-zero labels along a row */
+struct LabelRun {
+    uint32_t        x;
+    uint32_t        length;
+    uint32_t        label;
+};
+
+/* Write a 32 bit label image through a shared mapping of the output file.
+ * Labels are narrowed to 16 bits when num_labels fits. */
+bool writeLabelImage(   const std::string &path, const int32_t *labels, size_t step,
+                        unsigned int width, unsigned int height, unsigned int num_labels,
+                        LabelEncoding encoding, ThreadPool *pool    );
+
+/* Read-only view of a memory-mapped label image */
+class LabelImageView {
+public:
+    LabelImageView();
+    ~LabelImageView();
+
+    /* Map the file and check its header, false if it is not a label image */
+    bool open(const std::string &path);
+    void close();
+
+    const LabelImageHeader &header() const;
+
+    /* Label of the pixel at (x, y), 0 for background */
+    uint32_t label(unsigned int x, unsigned int y) const;
+
+private:
+    LabelImageView(const LabelImageView &);
+    LabelImageView &operator=(const LabelImageView &);
+
+    const unsigned char    *m_map;
+    size_t                  m_size;
+    LabelImageHeader        m_header;
+};
+
+#endif // LABEL_IMAGE_HPP
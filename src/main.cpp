@@ -1,482 +1,2066 @@
 #include <iostream>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <fstream>
 #include <cmath>
+#include <climits>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#include <map>
+#include <ctime>
+#include <chrono>
+#include <unistd.h>
 
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/photo/photo.hpp"
 #include "opencv2/imgcodecs.hpp"
 
+#include "options.hpp"
+#include "input_reader.hpp"
+#include "thread_pool.hpp"
+#include "tiff_decoder.hpp"
+#include "tiff_encoder.hpp"
+#include "chunk_store.hpp"
+#include "mask_file.hpp"
+#include "label_image.hpp"
+#include "quantile_sketch.hpp"
+#include "batch_summary.hpp"
+#include "histogram.hpp"
+#include "cell_filter.hpp"
+#include "contour_simplify.hpp"
+#include "plane_memory.hpp"
+#include "buffer_plan.hpp"
+#include "deadline.hpp"
+#include "worker_supervisor.hpp"
+#include "submit_server.hpp"
+#include "job_queue.hpp"
+#include "results_index.hpp"
+#include "artifact_publisher.hpp"
+#include "event_log.hpp"
+#include "analysis.hpp"
+#include "grid_search.hpp"
+
 
 #define DEBUG_FLAG              1     // Debug flag for image channels
-#define BIN_AREA                40    // Bin area
-#define NUM_BINS                11    // Number of bins
-#define MIN_ARC_LENGTH          20    // Min arc length
-#define PI                      3.14  // Approximate value of pi
-
-/* Channel type */
-enum class ChannelType : unsigned char {
-    BLUE = 0,
-    GREEN,
-    RED,
-    WHITE
+#define HANG_DEADLINE_FACTOR    2     // Workers past this many image deadlines are killed
+#define IMAGE_STAGES            19    // Stages an image may enter, for the stage budgets
+
+/* Channels reported in the metrics, in column order */
+static const char *CHANNEL_NAMES[] = { "Green", "Red", "White" };
+#define NUM_CHANNELS            3
+
+/* Everything an image contributes to the batch outputs */
+struct ImageResult {
+    std::string                 row;        // Metrics CSV row
+    std::vector<double>         values;     // Numeric metric columns, in CSV order
+    std::vector<CellSketches>   sketches;   // One per channel
+    std::vector<std::vector<FilterStats>> filters;  // Per channel, one per filter
+    std::vector<SimplifyDrift>  drift;      // Per channel
+    unsigned int                downsample; // 1, or the factor of a degraded retry
+    bool                        timed_out;  // Deadline tripped, metrics left empty
+    bool                        crashed;    // Its worker died or failed on it, metrics empty
+    std::string                 timeout_stage;
+    double                      seconds;    // Spent before the deadline tripped
+    uint64_t                    content_hash; // Of the input file, 0 if not read
+    std::vector<Artifact>       artifacts;  // Outputs written under temporary names
 };
 
-/* Hierarchy type */
-enum class HierarchyType : unsigned char {
-    INVALID_CNTR = 0,
-    CHILD_CNTR,
-    PARENT_CNTR
+/* One timed-out image, or one degraded retry */
+struct TimeoutRecord {
+    std::string                 image;
+    unsigned int                downsample;
+    bool                        timed_out;
+    std::string                 stage;
+    double                      seconds;
 };
 
-/* Enhance the image */
-bool enhanceImage(  cv::Mat src,
-                    ChannelType channel_type,
-                    cv::Mat *norm,
-                    cv::Mat *dst    ) {
-
-    // Split the image
-    std::vector<cv::Mat> channel(3);
-    cv::split(src, channel);
-    cv::Mat img = channel[0];
-
-    // Normalize the image
-    cv::Mat normalized;
-    cv::normalize(img, normalized, 0, 255, cv::NORM_MINMAX, CV_8UC1);
-
-    // Enhance the image using Gaussian blur and thresholding
-    cv::Mat enhanced;
-    switch(channel_type) {
-        case ChannelType::GREEN: {
-            // Enhance the green channel
-            cv::threshold(normalized, enhanced, 15, 255, cv::THRESH_BINARY);
-        } break;
-
-        case ChannelType::RED: {
-            // Enhance the red channel
-            cv::threshold(normalized, enhanced, 35, 255, cv::THRESH_BINARY);
-        } break;
-
-        case ChannelType::BLUE: {
-            // Enhance the white channel
-            cv::threshold(normalized, enhanced, 35, 255, cv::THRESH_BINARY);
-        } break;
-
-        default: {
-            std::cerr << "Invalid channel type" << std::endl;
-            return false;
-        }
+/* One image quarantined after its worker process died or failed on it */
+struct QuarantineRecord {
+    std::string                 image;
+    std::string                 reason;
+};
+
+/* Batch accumulators, one set per lane merged once all images are done */
+struct BatchTotals {
+    BatchSummary                summary;
+    std::vector<CellSketches>   sketches;
+    std::vector<std::vector<FilterStats>> filters;
+    std::vector<SimplifyDrift>  drift;
+};
+
+/* One dataset root of a batch run, with its own outputs and journal. The
+ * images of every root run on the same lanes, rows are written per root
+ * in the order of its list. */
+struct Dataset {
+    std::string                 path;
+    std::string                 absolute_path;  // Resolved, the index points there
+    std::vector<std::string>    images;
+    std::vector<std::string>    input_paths;    // Empty for a chunk store input
+    std::unique_ptr<ArtifactPublisher> publisher;
+    std::vector<Artifact>       batch_outputs;  // Published by the last commit
+    std::ofstream               data_stream;
+    std::ofstream               sketch_stream;
+    std::vector<BatchTotals>    lanes;
+    std::vector<ImageResult>    results;
+    std::vector<bool>           finished;
+    std::vector<TimeoutRecord>  timeouts;
+    std::vector<QuarantineRecord> quarantine;
+    std::vector<IndexEntry>     index_entries;
+    size_t                      next_row;       // First row not yet written
+};
+
+/* One root of a grid search, its rows written in the order of its list */
+struct GridRoot {
+    std::string                 path;
+    std::vector<std::string>    images;
+    std::ofstream               stream;
+    std::vector<std::vector<std::vector<double>>> values;  // Per image and point
+    std::vector<bool>           finished;
+    size_t                      next_row;       // First image not yet written
+};
+
+/* An image of the run: its dataset and its place in the dataset list */
+struct DatasetImage {
+    size_t                      dataset;
+    size_t                      index;
+};
+
+/* Write the filtered cells of a channel as a label image, cell i labeled i+1 */
+bool writeLabels(   std::string out_path, cv::Size size,
+                    std::vector<std::vector<cv::Point>> contours,
+                    std::vector<cv::Vec4i> hierarchy,
+                    std::vector<int> filtered_index,
+                    LabelOutput label_output, ThreadPool *pool  ) {
+
+    // Holes are drawn along with their parent and stay background
+    cv::Mat labels = cv::Mat::zeros(size, CV_32SC1);
+    for (size_t i = 0; i < filtered_index.size(); i++) {
+        checkDeadline(i);
+        drawContours(labels, contours, filtered_index[i], cv::Scalar(i + 1),
+                                            cv::FILLED, cv::LINE_8, hierarchy, 1);
     }
-    *norm = normalized;
-    *dst = enhanced;
-    return true;
+    LabelEncoding encoding = (label_output == LabelOutput::RLE) ?
+                                    LabelEncoding::RLE : LabelEncoding::RAW;
+    return writeLabelImage(out_path, (const int32_t *)labels.data, labels.step,
+                labels.cols, labels.rows, filtered_index.size(), encoding, pool);
 }
 
-/* Find the contours in the image */
-void contourCalc(   cv::Mat src, ChannelType channel_type, 
-                    double min_area, cv::Mat *dst, 
-                    std::vector<std::vector<cv::Point>> *contours, 
-                    std::vector<cv::Vec4i> *hierarchy, 
-                    std::vector<HierarchyType> *validity_mask, 
-                    std::vector<double> *parent_area    ) {
-
-    cv::Mat temp_src;
-    src.copyTo(temp_src);
-    switch(channel_type) {
-        case ChannelType::GREEN : {
-            findContours(temp_src, *contours, *hierarchy, cv::RETR_EXTERNAL, 
-                                                        cv::CHAIN_APPROX_SIMPLE);
-        } break;
-
-        case ChannelType::RED :
-        case ChannelType::WHITE : {
-            findContours(temp_src, *contours, *hierarchy, cv::RETR_CCOMP, 
-                                                        cv::CHAIN_APPROX_SIMPLE);
-        } break;
-
-        default: return;
-    }
-
-    *dst = cv::Mat::zeros(temp_src.size(), CV_8UC3);
-    if (!contours->size()) return;
-    validity_mask->assign(contours->size(), HierarchyType::INVALID_CNTR);
-    parent_area->assign(contours->size(), 0.0);
-
-    // Keep the contours whose size is >= than min_area
-    cv::RNG rng(12345);
-    for (int index = 0 ; index < (int)contours->size(); index++) {
-        if ((*hierarchy)[index][3] > -1) continue; // ignore child
-        auto cntr_external = (*contours)[index];
-        double area_external = fabs(contourArea(cv::Mat(cntr_external)));
-        if (area_external < min_area) continue;
-
-        std::vector<int> cntr_list;
-        cntr_list.push_back(index);
-
-        int index_hole = (*hierarchy)[index][2];
-        double area_hole = 0.0;
-        while (index_hole > -1) {
-            std::vector<cv::Point> cntr_hole = (*contours)[index_hole];
-            double temp_area_hole = fabs(contourArea(cv::Mat(cntr_hole)));
-            if (temp_area_hole) {
-                cntr_list.push_back(index_hole);
-                area_hole += temp_area_hole;
-            }
-            index_hole = (*hierarchy)[index_hole][0];
-        }
-        double area_contour = area_external - area_hole;
-        if (area_contour >= min_area) {
-            (*validity_mask)[cntr_list[0]] = HierarchyType::PARENT_CNTR;
-            (*parent_area)[cntr_list[0]] = area_contour;
-            for (unsigned int i = 1; i < cntr_list.size(); i++) {
-                (*validity_mask)[cntr_list[i]] = HierarchyType::CHILD_CNTR;
-            }
-            cv::Scalar color = cv::Scalar(rng.uniform(0, 255), rng.uniform(0,255), 
-                                            rng.uniform(0,255));
-            drawContours(*dst, *contours, index, color, cv::FILLED, cv::LINE_8, *hierarchy);
+/* Scale the contours traced on a downsampled image back to full size */
+void scaleContours( unsigned int factor, std::vector<std::vector<cv::Point>> *contours,
+                    std::vector<double> *area, ContourMeasures *measures   ) {
+    for (size_t i = 0; i < contours->size(); i++) {
+        checkDeadline(i);
+        std::vector<cv::Point> &contour = (*contours)[i];
+        for (size_t k = 0; k < contour.size(); k++) {
+            contour[k].x *= factor;
+            contour[k].y *= factor;
         }
     }
+    for (size_t i = 0; i < area->size(); i++) (*area)[i] *= (double)factor * factor;
+    scaleMeasures(factor, measures);
 }
 
-/* Filter out ill-formed or small cells */
-void filterCells(   std::vector<std::vector<cv::Point>> contours,
-                    std::vector<HierarchyType> contour_mask,
-                    std::vector<double> contours_area,
-                    std::vector<std::vector<cv::Point>> *filtered_contours,
-                    std::vector<HierarchyType> *filtered_contour_mask,
-                    std::vector<double> *filtered_contours_area     ) {
+/* Decode a TIFF strip by strip on the pool straight into BGR planes */
+bool decodeTiffPlanes(  const FileBuffer &input, const Options &options, ThreadPool *pool,
+                        std::vector<cv::Mat> *channel,
+                        std::shared_ptr<PlaneBuffer> *plane_memory  ) {
 
-    for (size_t i = 0; i < contours.size(); i++) {
-        if (contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
+    TiffInfo info;
+    if (!input.valid || !parseTiff(input.data, input.size, &info)) return false;
 
-        // Eliminate invalid contours
-        if (contours[i].size() < 5) continue;
+    int type = (info.bits_per_sample == 16) ? CV_16UC1 : CV_8UC1;
+    std::vector<cv::Mat> planes;
+    if (!allocatePlanes(info.height, info.width, type, info.colorSamples(),
+                        options.huge_pages, options.numa, &planes, plane_memory)) {
+        return false;
+    }
+    std::vector<unsigned char *> plane_data;
+    for (size_t i = 0; i < planes.size(); i++) plane_data.push_back(planes[i].data);
+    if (!decodeTiff(input.data, input.size, info, pool,
+                                plane_data.data(), planes[0].step)) {
+        return false;
+    }
 
-        // Eliminate small contours via contour arc calculation
-        if (arcLength(contours[i], true) >= MIN_ARC_LENGTH) {
-            filtered_contours->push_back(contours[i]);
-            filtered_contour_mask->push_back(contour_mask[i]);
-            filtered_contours_area->push_back(contours_area[i]);
-        }
+    // OpenCV keeps the channels in BGR order, gray images share one plane
+    channel->resize(3);
+    if (planes.size() == 3) {
+        (*channel)[0] = planes[2];
+        (*channel)[1] = planes[1];
+        (*channel)[2] = planes[0];
+    } else {
+        (*channel)[0] = (*channel)[1] = (*channel)[2] = planes[0];
     }
+    return true;
 }
 
-/* Separation metrics */
-std::string separationMetrics(
-                std::vector<std::vector<cv::Point>> contours) {
+/* Clip the region of interest to the image, the whole image if unset */
+bool regionOfInterest(const Options &options, int cols, int rows, cv::Rect *roi) {
 
-    float aggregate_diameter = 0;
-    float aggregate_aspect_ratio = 0;
-    std::vector<unsigned int> count(NUM_BINS, 0);
+    *roi = cv::Rect(0, 0, cols, rows);
+    if (!options.region_width || !options.region_height) return true;
 
-    for (size_t i = 0; i < contours.size(); i++) {
-        auto min_area_rect = minAreaRect(cv::Mat(contours[i]));
-        float aspect_ratio = float(min_area_rect.size.width)/min_area_rect.size.height;
-        if (aspect_ratio > 1.0) aspect_ratio = 1.0/aspect_ratio;
-        aggregate_aspect_ratio += aspect_ratio;
+    cv::Rect region(options.region_x, options.region_y,
+                    options.region_width, options.region_height);
+    *roi = region & *roi;
+    return (roi->area() > 0);
+}
 
-        float area = contourArea(contours[i]);
-        aggregate_diameter += 2 * sqrt(area / PI);
-        unsigned int bin_index = (area/BIN_AREA < NUM_BINS) ? 
-                                            area/BIN_AREA : NUM_BINS-1;
-        count[bin_index]++;
+/* Read the region of interest of the BGR planes from a chunked array store */
+bool readStorePlanes(   std::string store_dir, const ChunkStoreInfo &store,
+                        const Options &options, ThreadPool *pool,
+                        std::vector<cv::Mat> *channel,
+                        std::shared_ptr<PlaneBuffer> *plane_memory  ) {
+
+    cv::Rect roi;
+    if (!regionOfInterest(options, store.width, store.height, &roi)) return false;
+
+    // Gray stores hold a single plane shared by all three channels
+    unsigned int num_planes = (store.planes >= 3) ? 3 : 1;
+    int type = (store.bits_per_sample == 16) ? CV_16UC1 : CV_8UC1;
+    std::vector<cv::Mat> planes;
+    if (!allocatePlanes(roi.height, roi.width, type, store.planes,
+                        options.huge_pages, options.numa, &planes, plane_memory)) {
+        return false;
     }
-
-    std::string result =    std::to_string(contours.size())     + "," +
-                            std::to_string(aggregate_diameter)  + "," +
-                            std::to_string(aggregate_aspect_ratio);
-    for (size_t i = 0; i < count.size(); i++) {
-        result += "," + std::to_string(count[i]);
+    std::vector<unsigned char *> plane_data;
+    for (size_t i = 0; i < planes.size(); i++) plane_data.push_back(planes[i].data);
+    if (!readChunkRegion(store_dir, store, roi.x, roi.y, roi.width, roi.height,
+                                    pool, plane_data.data(), planes[0].step)) {
+        return false;
     }
 
-    return result;
+    channel->resize(3);
+    for (size_t i = 0; i < 3; i++) {
+        (*channel)[i] = planes[(num_planes == 3) ? i : 0];
+    }
+    return true;
 }
 
-/* Process each image */
-bool processImage(std::string path, std::string image_name, std::string *result) {
+/* Convert the decoded BGR planes of the input into a chunked array store */
+bool writeStorePlanes(  std::string store_dir, const std::vector<cv::Mat> &channel,
+                        const std::string &input_path, ThreadPool *pool ) {
 
-    *result = image_name + ",";
+    const cv::Mat &plane = channel[0];
+    if ((plane.type() != CV_8UC1) && (plane.type() != CV_16UC1)) return false;
+    const unsigned char *plane_data[3];
+    for (size_t i = 0; i < 3; i++) {
+        if ((channel[i].type() != plane.type()) || (channel[i].step != plane.step) ||
+                (channel[i].cols != plane.cols) || (channel[i].rows != plane.rows)) {
+            return false;
+        }
+        plane_data[i] = channel[i].data;
+    }
+    unsigned int bits = (plane.type() == CV_16UC1) ? 16 : 8;
+    return writeChunkStore(store_dir, plane_data, 3, plane.cols, plane.rows,
+                                                    bits, plane.step, input_path, pool);
+}
 
-    // Create the output directory
-    std::string out_directory = path + "result/";
-    struct stat st = {0};
-    if (stat(out_directory.c_str(), &st) == -1) {
-        mkdir(out_directory.c_str(), 0700);
+/* Scratch file for the ImageMagick fallbacks, unique per thread */
+std::string tempImagePath() {
+    std::ostringstream temp_path;
+    temp_path << "/tmp/img_" << getpid() << "_" << std::this_thread::get_id() << ".jpg";
+    return temp_path.str();
+}
+
+/* Write an output image from its blue, green and red layers */
+void writeImage(    std::string out_path, cv::Mat blue, cv::Mat green, cv::Mat red,
+                    unsigned int compression, ThreadPool *pool  ) {
+
+    // TIFF outputs are compressed tile by tile on the pool
+    std::string extension = out_path.substr(out_path.find_last_of(".") + 1);
+    for (size_t i = 0; i < extension.size(); i++) extension[i] = tolower(extension[i]);
+    if (((extension == "tif") || (extension == "tiff")) &&
+            (blue.type() == CV_8UC1) && (green.type() == CV_8UC1) && (red.type() == CV_8UC1) &&
+            (blue.step == red.step) && (green.step == red.step)) {
+        const unsigned char *planes[3] = { red.data, green.data, blue.data };
+        if (writeTiledTiff(out_path, planes, 3, red.cols, red.rows, 8,
+                                                red.step, compression, pool)) {
+            return;
+        }
     }
 
-    // Extract the pixel map from the input image
-    std::string image_path = path + "original/" + image_name;
-    std::string cmd = "convert -quiet -quality 100 " + image_path + " /tmp/img.jpg";
+    // Any other format goes through ImageMagick
+    std::vector<cv::Mat> merge_layers;
+    merge_layers.push_back(blue);
+    merge_layers.push_back(green);
+    merge_layers.push_back(red);
+    cv::Mat color;
+    cv::merge(merge_layers, color);
+    std::vector<int> compression_params;
+    compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    compression_params.push_back(101);
+    std::string temp_path = tempImagePath();
+    cv::imwrite(temp_path, color, compression_params);
+    std::string cmd = "convert -quiet " + temp_path + " " + out_path;
     system(cmd.c_str());
-    cv::Mat image = cv::imread("/tmp/img.jpg", cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
-    if (image.empty()) {
-        std::cerr << "Invalid input file" << std::endl;
-        return false;
+    remove(temp_path.c_str());
+}
+
+/* Masks kept for an input, next to it */
+std::string maskPath(std::string path, std::string image_name) {
+    return path + "original/" + image_name + MASK_SUFFIX;
+}
+
+/* Input a mask file was kept for */
+std::string maskInput(std::string mask_path) {
+    return mask_path.substr(0, mask_path.size() - strlen(MASK_SUFFIX));
+}
+
+/* Masks are only reused for the region they were cut with */
+bool maskRegionMatches(const Options &options, const MaskFileHeader &header) {
+    return  (header.region_x == options.region_x) &&
+            (header.region_y == options.region_y) &&
+            (header.region_width == options.region_width) &&
+            (header.region_height == options.region_height);
+}
+
+/* Masks are only reused for the input they were cut from, those left
+ * behind by a replaced input are warned about */
+bool maskInputFresh(std::string mask_path, const MaskFileHeader &header) {
+    if (maskInputMatches(header, maskInput(mask_path))) return true;
+    LOG(WARN, "stale_masks").field("path", mask_path);
+    return false;
+}
+
+/* A store is only read in place of the input it was converted from, or
+ * of a removed input. Those left behind by a replaced input are warned
+ * about when warn is set. */
+bool openFreshStore(const std::string &input_path, bool warn, ChunkStoreInfo *store) {
+    std::string store_dir = input_path + STORE_SUFFIX;
+    if (!openChunkStore(store_dir, store)) return false;
+    if (storeInputMatches(*store, input_path) || access(input_path.c_str(), F_OK)) return true;
+    if (warn) {
+        LOG(WARN, "stale_chunk_store").field("path", store_dir);
+    }
+    return false;
+}
+
+/* Decode an input into its BGR planes, cropped to the region of interest */
+bool decodeChannels(std::string path, std::string image_name,
+                    const FileBuffer &input, const Options &options, ThreadPool *pool,
+                    std::vector<cv::Mat> *planes,
+                    std::shared_ptr<PlaneBuffer> *plane_memory ) {
+
+    // Inputs converted to a chunked array store are read chunk by chunk.
+    // The planes they and TIFFs are decoded into live in plane_memory.
+    std::vector<cv::Mat> &channel = *planes;
+    channel.resize(3);
+    std::string input_path = path + "original/" + image_name;
+    std::string store_dir = input_path + STORE_SUFFIX;
+    ChunkStoreInfo store;
+    if (openFreshStore(input_path, true, &store)) {
+        if (!readStorePlanes(store_dir, store, options, pool, planes, plane_memory)) {
+            LOG(ERROR, "invalid_chunk_store").field("path", store_dir);
+            return false;
+        }
+
+    } else {
+        // Baseline TIFFs are decoded strip by strip straight into the planes
+        if (!decodeTiffPlanes(input, options, pool, planes, plane_memory)) {
+
+            // Otherwise decode the pixel map straight from the read buffer
+            cv::Mat image;
+            if (input.valid && (input.size <= INT_MAX)) {
+                cv::Mat raw(1, (int)input.size, CV_8UC1, input.data);
+                image = cv::imdecode(raw, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+            }
+
+            // Formats OpenCV cannot decode go through ImageMagick
+            if (image.empty()) {
+                std::string temp_path = tempImagePath();
+                std::string cmd = "convert -quiet -quality 100 " + input_path + " " + temp_path;
+                system(cmd.c_str());
+                image = cv::imread(temp_path, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+                remove(temp_path.c_str());
+                if (image.empty()) {
+                    LOG(ERROR, "invalid_input").field("path", input_path);
+                    return false;
+                }
+            }
+
+            // Split the image
+            cv::split(image, channel);
+        }
+
+        // Keep a chunked copy for later partial analyses, or replace a stale one
+        if (options.convert_store && !writeStorePlanes(store_dir, channel, input_path, pool)) {
+            LOG(WARN, "chunk_store_failed").field("path", store_dir);
+        }
+
+        // Crop to the region of interest
+        cv::Rect roi;
+        if (!regionOfInterest(options, channel[0].cols, channel[0].rows, &roi)) {
+            LOG(ERROR, "invalid_region").field("cols", channel[0].cols)
+                                         .field("rows", channel[0].rows);
+            return false;
+        }
+        for (size_t i = 0; i < channel.size(); i++) channel[i] = channel[i](roi);
+    }
+    return true;
+}
+
+/* Reset the result of an image before it is processed */
+void startResult(std::string image_name, unsigned int downsample, ImageResult *result) {
+    result->row = image_name + ",";
+    result->values.clear();
+    result->sketches.assign(NUM_CHANNELS, CellSketches());
+    result->filters.assign(NUM_CHANNELS, std::vector<FilterStats>());
+    result->drift.assign(NUM_CHANNELS, SimplifyDrift());
+    result->downsample = downsample;
+    result->timed_out = false;
+    result->crashed = false;
+    result->timeout_stage.clear();
+    result->seconds = 0.0;
+    result->content_hash = 0;
+    result->artifacts.clear();
+}
+
+/* Keep the outer boundaries of the filtered cells, holes left out */
+void keepCells( const std::vector<std::vector<cv::Point>> &contours,
+                const std::vector<HierarchyType> &mask,
+                std::vector<std::vector<cv::Point>> *cells  ) {
+    cells->clear();
+    for (size_t i = 0; i < contours.size(); i++) {
+        if (mask[i] == HierarchyType::PARENT_CNTR) cells->push_back(contours[i]);
     }
-    system("rm /tmp/img.jpg");
+}
 
-    // Split the image
-    std::vector<cv::Mat> channel(3);
-    cv::split(image, channel);
-    cv::Mat blue  = channel[0];
-    cv::Mat green = channel[0];
-    cv::Mat red   = channel[0];
+/* Analyze the BGR planes of an image, releasing them and the planes memory
+ * once used. The images and labels are written to out_directory, nothing
+ * when it is empty, under the temporary names of result->artifacts. With
+ * masks, the analysis starts from them and the planes are not used. The
+ * thresholded masks are kept in mask_path unless it is empty. With cells,
+ * the cells of every channel are kept. */
+bool analyzeChannels(   std::vector<cv::Mat> *planes, std::shared_ptr<PlaneBuffer> *planes_memory,
+                        std::string image_name, std::string out_directory,
+                        const Options &options, const HistogramEngine &histograms,
+                        const FilterCascade &cascade, unsigned int downsample,
+                        const ChannelMasks *masks, std::string mask_path,
+                        ThreadPool *pool, ImageResult *result,
+                        std::vector<std::vector<std::vector<cv::Point>>> *cells  ) {
+
+    std::vector<cv::Mat> &channel = *planes;
+    std::shared_ptr<PlaneBuffer> &plane_memory = *planes_memory;
+    if (cells) cells->assign(NUM_CHANNELS, std::vector<std::vector<cv::Point>>());
+
+    // Outputs are recorded before they are written, so that an image that
+    // trips its deadline halfway through can remove what it wrote
+    auto staged = [result](const std::string &out_path) {
+        Artifact artifact = { stagedPath(out_path), out_path };
+        result->artifacts.push_back(artifact);
+        return artifact.temporary;
+    };
+
+    // Degraded retries trace the cells on downsampled planes. The contours
+    // are scaled back and the normalized channels upsampled for the features.
+    const cv::Size image_size = masks ? masks->green.size() : channel[0].size();
+    ChannelMasks small_masks;
+    if (downsample > 1) {
+        enterStage("downsample");
+        if (masks) {
+            const cv::Mat *full[] = { &masks->blue, &masks->green, &masks->red };
+            cv::Mat *small[] = { &small_masks.blue, &small_masks.green, &small_masks.red };
+            for (size_t i = 0; i < 3; i++) {
+                cv::resize(*full[i], *small[i], cv::Size(), 1.0 / downsample, 1.0 / downsample,
+                                                                        cv::INTER_NEAREST);
+            }
+            masks = &small_masks;
+        }
+        for (size_t i = 0; i < channel.size(); i++) {
+            cv::Mat small;
+            cv::resize(channel[i], small, cv::Size(), 1.0 / downsample, 1.0 / downsample,
+                                                                        cv::INTER_AREA);
+            channel[i] = small;
+        }
+        plane_memory.reset();
+    }
+    cv::Mat blue, green, red;
+    if (!masks) {
+        blue  = channel[0];
+        green = channel[0];
+        red   = channel[0];
+    }
+
+    /* Intermediates are released as soon as their last stage is done */
+    cv::Mat green_normalized, green_enhanced, green_segmented;
+    cv::Mat red_normalized, red_enhanced, red_segmented;
+    cv::Mat blue_normalized, blue_enhanced;
+    cv::Mat white_enhanced, white_segmented;
+    std::vector<std::vector<cv::Point>> contours_green, contours_red, contours_white;
+    std::vector<cv::Vec4i> hierarchy_green, hierarchy_red, hierarchy_white;
+    std::vector<HierarchyType> green_contour_mask, red_contour_mask, white_contour_mask;
+    std::vector<double> green_contour_area, red_contour_area, white_contour_area;
+    ContourMeasures green_measures, red_measures, white_measures;
+    std::vector<std::vector<cv::Point>> contours_green_filtered, contours_red_filtered,
+                                        contours_white_filtered;
+    std::vector<HierarchyType> green_filtered_contour_mask, red_filtered_contour_mask,
+                                white_filtered_contour_mask;
+    std::vector<double> green_filtered_contours_area, red_filtered_contours_area,
+                        white_filtered_contours_area;
+    ContourMeasures green_filtered_measures, red_filtered_measures, white_filtered_measures;
+    std::vector<int> green_filtered_index, red_filtered_index, white_filtered_index;
+
+    // Masks carry no normalized channels to draw on, only labels are written
+    const bool write_images = !out_directory.empty();
+    const bool draw_images = write_images && !masks;
+    const bool labels = write_images && (options.label_output != LabelOutput::NONE);
+    const bool write_enhanced = draw_images && DEBUG_FLAG && (downsample == 1);
+    const bool write_normalized = draw_images && DEBUG_FLAG;
+    const bool keep_masks = !mask_path.empty() && !masks && (downsample == 1);
+    BufferPlan buffers;
+    buffers.stage("enhance_green", {"channel"}, {"green_normalized", "green_enhanced"});
+    buffers.stage("contours_green", {"green_enhanced"}, {"green_segmented", "green_contours"});
+    buffers.stage("enhance_red", {"channel"}, {"red_normalized", "red_enhanced"});
+    buffers.stage("contours_red", {"red_enhanced"}, {"red_segmented", "red_contours"});
+    buffers.stage("enhance_blue", {"channel"}, {"blue_normalized", "blue_enhanced"});
+    if (keep_masks) {
+        buffers.stage("write_masks", {"blue_enhanced", "green_enhanced", "red_enhanced"}, {});
+    }
+    buffers.stage("contours_white", {"blue_enhanced", "green_enhanced", "red_enhanced"},
+                                    {"white_enhanced", "white_segmented", "white_contours"});
+    if (write_enhanced) {
+        buffers.stage("write_enhanced", {"blue_enhanced", "green_enhanced", "red_enhanced"}, {});
+    }
+    buffers.stage("cells_green", {"green_contours", "green_normalized"}, {"green_cells"});
+    if (labels) buffers.stage("labels_green", {"green_contours", "green_cells"}, {});
+    buffers.stage("cells_red", {"red_contours", "red_normalized"}, {"red_cells"});
+    if (labels) buffers.stage("labels_red", {"red_contours", "red_cells"}, {});
+    buffers.stage("cells_white", {"white_contours", "blue_normalized"}, {"white_cells"});
+    if (labels) buffers.stage("labels_white", {"white_contours", "white_cells"}, {});
+    if (DEBUG_FLAG) {
+        buffers.stage("write_normalized", {"blue_normalized", "green_normalized",
+                                            "red_normalized"}, {});
+    }
+    buffers.stage("write_analyzed", {"blue_normalized", "green_normalized", "red_normalized",
+                                     "green_cells", "white_cells"}, {});
+
+    buffers.bind("channel", {&channel[0], &channel[1], &channel[2], &blue, &green, &red});
+    buffers.bind("channel", [&plane_memory] { return plane_memory ? plane_memory->size() : 0; },
+                            [&plane_memory] { plane_memory.reset(); });
+    buffers.bind("green_normalized", {&green_normalized});
+    buffers.bind("green_enhanced", {&green_enhanced});
+    buffers.bind("green_segmented", {&green_segmented});
+    buffers.bind("red_normalized", {&red_normalized});
+    buffers.bind("red_enhanced", {&red_enhanced});
+    buffers.bind("red_segmented", {&red_segmented});
+    buffers.bind("blue_normalized", {&blue_normalized});
+    buffers.bind("blue_enhanced", {&blue_enhanced});
+    buffers.bind("white_enhanced", {&white_enhanced});
+    buffers.bind("white_segmented", {&white_segmented});
+    buffers.bind("green_contours", &contours_green);
+    buffers.bind("green_contours", &hierarchy_green);
+    buffers.bind("green_contours", &green_contour_mask);
+    buffers.bind("green_contours", &green_contour_area);
+    buffers.bind("green_contours", &green_measures.area);
+    buffers.bind("green_contours", &green_measures.perimeter);
+    buffers.bind("red_contours", &contours_red);
+    buffers.bind("red_contours", &hierarchy_red);
+    buffers.bind("red_contours", &red_contour_mask);
+    buffers.bind("red_contours", &red_contour_area);
+    buffers.bind("red_contours", &red_measures.area);
+    buffers.bind("red_contours", &red_measures.perimeter);
+    buffers.bind("white_contours", &contours_white);
+    buffers.bind("white_contours", &hierarchy_white);
+    buffers.bind("white_contours", &white_contour_mask);
+    buffers.bind("white_contours", &white_contour_area);
+    buffers.bind("white_contours", &white_measures.area);
+    buffers.bind("white_contours", &white_measures.perimeter);
+    buffers.bind("green_cells", &contours_green_filtered);
+    buffers.bind("green_cells", &green_filtered_contour_mask);
+    buffers.bind("green_cells", &green_filtered_contours_area);
+    buffers.bind("green_cells", &green_filtered_measures.area);
+    buffers.bind("green_cells", &green_filtered_measures.perimeter);
+    buffers.bind("green_cells", &green_filtered_index);
+    buffers.bind("red_cells", &contours_red_filtered);
+    buffers.bind("red_cells", &red_filtered_contour_mask);
+    buffers.bind("red_cells", &red_filtered_contours_area);
+    buffers.bind("red_cells", &red_filtered_measures.area);
+    buffers.bind("red_cells", &red_filtered_measures.perimeter);
+    buffers.bind("red_cells", &red_filtered_index);
+    buffers.bind("white_cells", &contours_white_filtered);
+    buffers.bind("white_cells", &white_filtered_contour_mask);
+    buffers.bind("white_cells", &white_filtered_contours_area);
+    buffers.bind("white_cells", &white_filtered_measures.area);
+    buffers.bind("white_cells", &white_filtered_measures.perimeter);
+    buffers.bind("white_cells", &white_filtered_index);
 
     /** Gather BGR channel information needed for feature extraction **/
 
     // Green channel
-    cv::Mat green_normalized, green_enhanced;
-    if(!enhanceImage(green, ChannelType::GREEN, &green_normalized, &green_enhanced)) {
+    enterStage("enhance_green");
+    if (masks) {
+        green_enhanced = masks->green;
+    } else if(!enhanceImage(green, ChannelType::GREEN, &green_normalized, &green_enhanced)) {
         return false;
     }
-    cv::Mat green_segmented;
-    std::vector<std::vector<cv::Point>> contours_green;
-    std::vector<cv::Vec4i> hierarchy_green;
-    std::vector<HierarchyType> green_contour_mask;
-    std::vector<double> green_contour_area;
-    contourCalc(green_enhanced, ChannelType::GREEN, 1.0, 
+    buffers.finish("enhance_green");
+    enterStage("contours_green");
+    DensityEstimate green_density = estimateDensity(green_enhanced);
+    ContourPlan green_plan = planContours(green_density, options.strategy);
+    contourCalc(green_enhanced, ChannelType::GREEN, 1.0, green_plan,
                 &green_segmented, &contours_green, 
                 &hierarchy_green, &green_contour_mask, 
-                &green_contour_area);
+                &green_contour_area, &green_measures);
+    if (downsample > 1) {
+        scaleContours(downsample, &contours_green, &green_contour_area, &green_measures);
+    }
+    buffers.finish("contours_green");
 
     // Red channel
-    cv::Mat red_normalized, red_enhanced;
-    if(!enhanceImage(red, ChannelType::RED, &red_normalized, &red_enhanced)) {
+    enterStage("enhance_red");
+    if (masks) {
+        red_enhanced = masks->red;
+    } else if(!enhanceImage(red, ChannelType::RED, &red_normalized, &red_enhanced)) {
         return false;
     }
-    cv::Mat red_segmented;
-    std::vector<std::vector<cv::Point>> contours_red;
-    std::vector<cv::Vec4i> hierarchy_red;
-    std::vector<HierarchyType> red_contour_mask;
-    std::vector<double> red_contour_area;
-    contourCalc(red_enhanced, ChannelType::RED, 1.0, 
+    buffers.finish("enhance_red");
+    enterStage("contours_red");
+    DensityEstimate red_density = estimateDensity(red_enhanced);
+    ContourPlan red_plan = planContours(red_density, options.strategy);
+    contourCalc(red_enhanced, ChannelType::RED, 1.0, red_plan,
                 &red_segmented, &contours_red, 
                 &hierarchy_red, &red_contour_mask, 
-                &red_contour_area);
+                &red_contour_area, &red_measures);
+    if (downsample > 1) {
+        scaleContours(downsample, &contours_red, &red_contour_area, &red_measures);
+    }
+    buffers.finish("contours_red");
 
     // White channel
-    cv::Mat blue_normalized, blue_enhanced;
-    if(!enhanceImage(blue, ChannelType::BLUE, &blue_normalized, &blue_enhanced)) {
+    enterStage("enhance_blue");
+    if (masks) {
+        blue_enhanced = masks->blue;
+    } else if(!enhanceImage(blue, ChannelType::BLUE, &blue_normalized, &blue_enhanced)) {
         return false;
     }
-    cv::Mat white_enhanced;
+    buffers.finish("enhance_blue");
+
+    // Kept for the runs that only change the contour logic
+    if (keep_masks) {
+        enterStage("write_masks");
+        ChannelMasks kept = { blue_enhanced, green_enhanced, red_enhanced };
+        cv::Rect region(options.region_x, options.region_y,
+                        options.region_width, options.region_height);
+        if (!writeMaskFile(mask_path, kept, region, result->content_hash,
+                                                    maskInput(mask_path), pool)) {
+            LOG(WARN, "masks_failed").field("path", mask_path);
+        }
+        buffers.finish("write_masks");
+    }
+    enterStage("contours_white");
     bitwise_and(blue_enhanced, green_enhanced, white_enhanced);
     bitwise_and(white_enhanced, red_enhanced, white_enhanced);
-    cv::Mat white_segmented;
-    std::vector<std::vector<cv::Point>> contours_white;
-    std::vector<cv::Vec4i> hierarchy_white;
-    std::vector<HierarchyType> white_contour_mask;
-    std::vector<double> white_contour_area;
-    contourCalc(white_enhanced, ChannelType::WHITE, 1.0, 
+    DensityEstimate white_density = estimateDensity(white_enhanced);
+    ContourPlan white_plan = planContours(white_density, options.strategy);
+    contourCalc(white_enhanced, ChannelType::WHITE, 1.0, white_plan,
                 &white_segmented, &contours_white, 
                 &hierarchy_white, &white_contour_mask, 
-                &white_contour_area);
+                &white_contour_area, &white_measures);
+    if (downsample > 1) {
+        scaleContours(downsample, &contours_white, &white_contour_area, &white_measures);
+    }
+    buffers.finish("contours_white");
 
+    // The strategies picked for every channel
+    LOG(INFO, "contour_plan").field("green", describePlan(green_density, green_plan))
+                             .field("red", describePlan(red_density, red_plan))
+                             .field("white", describePlan(white_density, white_plan));
+
+    /* Enhanced image, written before the features so that it can go */
+    std::string out_enhanced = out_directory + image_name;
+    out_enhanced.insert(out_enhanced.find_last_of("."), "_b_enhanced", 11);
+    if (write_enhanced) {
+        enterStage("write_enhanced");
+        writeImage(staged(out_enhanced), blue_enhanced, green_enhanced, red_enhanced,
+                                                        options.compression, pool);
+        buffers.finish("write_enhanced");
+    }
 
     /** Extract multi-dimensional features for analysis **/
 
+    // The features of a degraded retry are computed at full size
+    if ((downsample > 1) && !masks) {
+        enterStage("upsample");
+        cv::Mat *normalized[] = { &blue_normalized, &green_normalized, &red_normalized };
+        for (size_t i = 0; i < 3; i++) {
+            cv::Mat full;
+            cv::resize(*normalized[i], full, image_size, 0, 0, cv::INTER_LINEAR);
+            *normalized[i] = full;
+        }
+    }
+
+    // Label images are written as soon as the cells of a channel are known
+    std::string out_labels = out_directory + image_name;
+    out_labels = out_labels.substr(0, out_labels.find_last_of("."));
+    bool labels_written = true;
+
     /* Characterize the green channel */
-    std::vector<std::vector<cv::Point>> contours_green_filtered;
-    std::vector<HierarchyType> green_filtered_contour_mask;
-    std::vector<double> green_filtered_contours_area;
+    enterStage("cells_green");
     filterCells(    contours_green,
                     green_contour_mask,
                     green_contour_area,
+                    green_measures,
+                    cascade, green_normalized,
                     &contours_green_filtered,
                     &green_filtered_contour_mask,
-                    &green_filtered_contours_area    );
-    *result += separationMetrics(contours_green_filtered) + ",";
+                    &green_filtered_contours_area,
+                    &green_filtered_measures,
+                    &green_filtered_index,
+                    &result->filters[0]    );
+    simplifyCells(&contours_green_filtered, &green_filtered_measures, options.simplify, pool,
+                                                        &result->drift[0]);
+    if (cells) keepCells(contours_green_filtered, green_filtered_contour_mask, &(*cells)[0]);
+    result->row += separationMetrics(contours_green_filtered, green_filtered_measures,
+                                        green_normalized,
+                                        histograms, green_plan, pool, &result->values,
+                                                    &result->sketches[0]) + ",";
+    buffers.finish("cells_green");
+    if (labels) {
+        enterStage("labels_green");
+        labels_written &= writeLabels(  staged(out_labels + "_d_green_labels.lbl"), image_size,
+                                        contours_green, hierarchy_green, green_filtered_index,
+                                        options.label_output, pool  );
+        buffers.finish("labels_green");
+    }
 
     /* Characterize the red channel */
-    std::vector<std::vector<cv::Point>> contours_red_filtered;
-    std::vector<HierarchyType> red_filtered_contour_mask;
-    std::vector<double> red_filtered_contours_area;
+    enterStage("cells_red");
     filterCells(    contours_red,
                     red_contour_mask,
                     red_contour_area,
+                    red_measures,
+                    cascade, red_normalized,
                     &contours_red_filtered,
                     &red_filtered_contour_mask,
-                    &red_filtered_contours_area    );
-    *result += separationMetrics(contours_red_filtered) + ",";
+                    &red_filtered_contours_area,
+                    &red_filtered_measures,
+                    &red_filtered_index,
+                    &result->filters[1]    );
+    simplifyCells(&contours_red_filtered, &red_filtered_measures, options.simplify, pool,
+                                                        &result->drift[1]);
+    if (cells) keepCells(contours_red_filtered, red_filtered_contour_mask, &(*cells)[1]);
+    result->row += separationMetrics(contours_red_filtered, red_filtered_measures,
+                                        red_normalized,
+                                        histograms, red_plan, pool, &result->values,
+                                                    &result->sketches[1]) + ",";
+    buffers.finish("cells_red");
+    if (labels) {
+        enterStage("labels_red");
+        labels_written &= writeLabels(  staged(out_labels + "_d_red_labels.lbl"), image_size,
+                                        contours_red, hierarchy_red, red_filtered_index,
+                                        options.label_output, pool  );
+        buffers.finish("labels_red");
+    }
 
     /* Characterize the white channel */
-    std::vector<std::vector<cv::Point>> contours_white_filtered;
-    std::vector<HierarchyType> white_filtered_contour_mask;
-    std::vector<double> white_filtered_contours_area;
+    enterStage("cells_white");
     filterCells(    contours_white,
                     white_contour_mask,
                     white_contour_area,
+                    white_measures,
+                    cascade, blue_normalized,
                     &contours_white_filtered,
                     &white_filtered_contour_mask,
-                    &white_filtered_contours_area    );
-    *result += separationMetrics(contours_white_filtered);
+                    &white_filtered_contours_area,
+                    &white_filtered_measures,
+                    &white_filtered_index,
+                    &result->filters[2]    );
+    simplifyCells(&contours_white_filtered, &white_filtered_measures, options.simplify, pool,
+                                                        &result->drift[2]);
+    if (cells) keepCells(contours_white_filtered, white_filtered_contour_mask, &(*cells)[2]);
+    result->row += separationMetrics(contours_white_filtered, white_filtered_measures,
+                                        blue_normalized,
+                                        histograms, white_plan, pool, &result->values,
+                                                    &result->sketches[2]);
+    buffers.finish("cells_white");
+    if (labels) {
+        enterStage("labels_white");
+        labels_written &= writeLabels(  staged(out_labels + "_d_white_labels.lbl"), image_size,
+                                        contours_white, hierarchy_white, white_filtered_index,
+                                        options.label_output, pool  );
+        buffers.finish("labels_white");
+    }
+    if (!labels_written) {
+        LOG(WARN, "labels_failed");
+    }
 
 
     /** Draw the required images **/
 
     /* Normalized image */
-    std::vector<cv::Mat> merge_normalized;
-    merge_normalized.push_back(blue_normalized);
-    merge_normalized.push_back(green_normalized);
-    merge_normalized.push_back(red_normalized);
-    cv::Mat color_normalized;
-    cv::merge(merge_normalized, color_normalized);
     std::string out_normalized = out_directory + image_name;
     out_normalized.insert(out_normalized.find_last_of("."), "_a_normalized", 13);
-    if (DEBUG_FLAG) {
-        std::vector<int> compression_params;
-        compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-        compression_params.push_back(101);
-        cv::imwrite("/tmp/img.jpg", color_normalized, compression_params);
-        cmd = "convert -quiet /tmp/img.jpg " + out_normalized;
-        system(cmd.c_str());
-        system("rm /tmp/img.jpg");
-    }
-
-    /* Enhanced image */
-    std::vector<cv::Mat> merge_enhanced;
-    merge_enhanced.push_back(blue_enhanced);
-    merge_enhanced.push_back(green_enhanced);
-    merge_enhanced.push_back(red_enhanced);
-    cv::Mat color_enhanced;
-    cv::merge(merge_enhanced, color_enhanced);
-    std::string out_enhanced = out_directory + image_name;
-    out_enhanced.insert(out_enhanced.find_last_of("."), "_b_enhanced", 11);
-    if (DEBUG_FLAG) {
-        std::vector<int> compression_params;
-        compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-        compression_params.push_back(101);
-        cv::imwrite("/tmp/img.jpg", color_enhanced, compression_params);
-        cmd = "convert -quiet /tmp/img.jpg " + out_enhanced;
-        system(cmd.c_str());
-        system("rm /tmp/img.jpg");
+    if (write_normalized) {
+        enterStage("write_normalized");
+        writeImage(staged(out_normalized), blue_normalized, green_normalized, red_normalized,
+                                                        options.compression, pool);
+        buffers.finish("write_normalized");
     }
 
     /* Analyzed image */
-    cv::Mat drawing_blue  = blue_normalized;
-    cv::Mat drawing_green = green_normalized;
-    cv::Mat drawing_red   = red_normalized;
-
-    // Draw green boundaries
-    for (size_t i = 0; i < contours_green_filtered.size(); i++) {
-        if (green_filtered_contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
-        drawContours(drawing_blue, contours_green_filtered, i, 0, 1, 8);
-        drawContours(drawing_green, contours_green_filtered, i, 255, 1, 8);
-        drawContours(drawing_red, contours_green_filtered, i, 255, 1, 8);
-    }
-
-    // Draw white boundaries
-    for (size_t i = 0; i < contours_white_filtered.size(); i++) {
-        if (white_filtered_contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
-        drawContours(drawing_blue, contours_white_filtered, i, 255, 1, 8);
-        drawContours(drawing_green, contours_white_filtered, i, 0, 1, 8);
-        drawContours(drawing_red, contours_white_filtered, i, 255, 1, 8);
-    }
-
-    // Merge the modified red, blue and green layers
-    std::vector<cv::Mat> merge_analyzed;
-    merge_analyzed.push_back(drawing_blue);
-    merge_analyzed.push_back(drawing_green);
-    merge_analyzed.push_back(drawing_red);
-    cv::Mat color_analyzed;
-    cv::merge(merge_analyzed, color_analyzed);
-    std::string out_analyzed = out_directory + image_name;
-    if (DEBUG_FLAG) out_analyzed.insert(out_analyzed.find_last_of("."), "_c_analyzed", 11);
-    std::vector<int> compression_params;
-    compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-    compression_params.push_back(101);
-    cv::imwrite("/tmp/img.jpg", color_analyzed, compression_params);
-    cmd = "convert -quiet /tmp/img.jpg " + out_analyzed;
-    system(cmd.c_str());
-    system("rm /tmp/img.jpg");
+    if (draw_images) {
+        enterStage("write_analyzed");
+        cv::Mat drawing_blue  = blue_normalized;
+        cv::Mat drawing_green = green_normalized;
+        cv::Mat drawing_red   = red_normalized;
+
+        // Draw green boundaries
+        for (size_t i = 0; i < contours_green_filtered.size(); i++) {
+            checkDeadline(i);
+            if (green_filtered_contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
+            drawContours(drawing_blue, contours_green_filtered, i, 0, 1, 8);
+            drawContours(drawing_green, contours_green_filtered, i, 255, 1, 8);
+            drawContours(drawing_red, contours_green_filtered, i, 255, 1, 8);
+        }
+
+        // Draw white boundaries
+        for (size_t i = 0; i < contours_white_filtered.size(); i++) {
+            checkDeadline(i);
+            if (white_filtered_contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
+            drawContours(drawing_blue, contours_white_filtered, i, 255, 1, 8);
+            drawContours(drawing_green, contours_white_filtered, i, 0, 1, 8);
+            drawContours(drawing_red, contours_white_filtered, i, 255, 1, 8);
+        }
+
+        // Write the modified red, blue and green layers
+        std::string out_analyzed = out_directory + image_name;
+        if (DEBUG_FLAG) out_analyzed.insert(out_analyzed.find_last_of("."), "_c_analyzed", 11);
+        writeImage(staged(out_analyzed), drawing_blue, drawing_green, drawing_red,
+                                                            options.compression, pool);
+        drawing_blue.release();
+        drawing_green.release();
+        drawing_red.release();
+    }
+    buffers.finish("write_analyzed");
+
+    LOG(INFO, "memory").field("peak_mib", buffers.peakBytes() >> 20)
+                       .field("unplanned_peak_mib", buffers.unplannedPeakBytes() >> 20);
 
     return true;
 }
 
-/* Main - create the threads and start the processing */
-int main(int argc, char *argv[]) {
+/* Process each image */
+bool processImage(  std::string path, std::string image_name,
+                    const FileBuffer &input, const Options &options,
+                    const HistogramEngine &histograms, const FilterCascade &cascade,
+                    unsigned int downsample, ThreadPool *pool, ImageResult *result ) {
+
+    startResult(image_name, downsample, result);
+    if (input.valid) result->content_hash = contentHash(input.data, input.size);
+    LogContext log_context(path, image_name);
+    LOG(INFO, "image_start").field("downsample", downsample);
+
+    // Budgets are checked by the long loops and between the pool's items,
+    // a tripped one throws DeadlineExceeded out of the image
+    Deadline deadline(options.deadline, options.stage_deadline);
+    DeadlineScope deadline_scope(&deadline);
+    enterStage("decode");
+
+    // Create the output directory
+    std::string out_directory = path + "result/";
+    struct stat st = {0};
+    if (stat(out_directory.c_str(), &st) == -1) {
+        mkdir(out_directory.c_str(), 0700);
+    }
+
+    // Inputs whose masks were kept start from them when asked to, the
+    // reader skipped their files. Stale masks fall back to the input.
+    std::vector<cv::Mat> channel;
+    std::shared_ptr<PlaneBuffer> plane_memory;
+    std::string mask_path = maskPath(path, image_name);
+    ChannelMasks masks;
+    MaskFileHeader mask_header;
+    const bool from_masks = options.from_masks &&
+                            readMaskFile(mask_path, pool, &mask_header, &masks) &&
+                            maskRegionMatches(options, mask_header) &&
+                            maskInputFresh(mask_path, mask_header);
+    if (from_masks) {
+        result->content_hash = mask_header.content_hash;
+    } else if (!decodeChannels(path, image_name, input, options, pool, &channel, &plane_memory)) {
+        return false;
+    }
+    if (!analyzeChannels(&channel, &plane_memory, image_name, out_directory, options,
+                         histograms, cascade, downsample, from_masks ? &masks : NULL,
+                         (options.keep_masks && !from_masks) ? mask_path : std::string(),
+                         pool, result, NULL)) {
+        return false;
+    }
 
-    /* Check for argument count */
-    if (argc != 2) {
-        std::cerr << "Invalid number of arguments." << std::endl;
+    deadline.finish();
+    result->seconds = deadline.elapsed();
+    LOG(INFO, "image_done").field("seconds", result->seconds);
+    return true;
+}
+
+/* Leave the metrics of an image empty */
+void emptyResult(std::string image_name, size_t num_columns, ImageResult *result) {
+    result->row = image_name + std::string(num_columns, ',');
+    result->values.clear();
+    result->sketches.assign(NUM_CHANNELS, CellSketches());
+    result->filters.clear();
+    result->drift.clear();
+    result->timed_out = false;
+    result->crashed = false;
+    result->timeout_stage.clear();
+    result->seconds = 0.0;
+    result->content_hash = 0;
+    result->artifacts.clear();
+}
+
+/* Leave the metrics of a timed-out image empty, and none of its outputs */
+void timedOut(  std::string image_name, size_t num_columns, const DeadlineExceeded &timeout,
+                unsigned int downsample, ImageResult *result    ) {
+    uint64_t content_hash = result->content_hash;
+    discardArtifacts(result->artifacts);
+    emptyResult(image_name, num_columns, result);
+    result->content_hash = content_hash;
+    result->downsample = downsample;
+    result->timed_out = true;
+    result->timeout_stage = timeout.stage();
+    result->seconds = timeout.seconds();
+}
+
+/* Write the timed-out images and the outcome of their degraded retries */
+bool writeTimeouts(std::string timeouts_file, const std::vector<TimeoutRecord> &timeouts) {
+
+    std::ofstream stream(timeouts_file.c_str(), std::ios::out);
+    if (!stream.is_open()) return false;
+
+    stream << "Image,Downsample,Outcome,Stage,Seconds" << std::endl;
+    for (size_t i = 0; i < timeouts.size(); i++) {
+        const TimeoutRecord &record = timeouts[i];
+        stream << record.image << "," << record.downsample << ","
+               << (record.timed_out ? "timed_out" : "completed") << ","
+               << record.stage << "," << record.seconds << std::endl;
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+/* Write the images whose worker process died or failed on them */
+bool writeQuarantine(std::string quarantine_file, const std::vector<QuarantineRecord> &records) {
+
+    std::ofstream stream(quarantine_file.c_str(), std::ios::out);
+    if (!stream.is_open()) return false;
+
+    stream << "Image,Reason" << std::endl;
+    for (size_t i = 0; i < records.size(); i++) {
+        stream << records[i].image << "," << records[i].reason << std::endl;
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+/* Results of the worker processes come back as flat bytes */
+static void appendBytes(std::string *bytes, const void *data, size_t size) {
+    bytes->append((const char *)data, size);
+}
+
+static void appendField(std::string *bytes, const std::string &field) {
+    uint64_t size = field.size();
+    appendBytes(bytes, &size, sizeof(size));
+    bytes->append(field);
+}
+
+/* Reads the fields back, failing past the end */
+struct ByteReader {
+    const char     *next;
+    const char     *end;
+
+    bool read(void *data, size_t size) {
+        if ((size_t)(end - next) < size) return false;
+        memcpy(data, next, size);
+        next += size;
+        return true;
+    }
+
+    bool field(std::string *field) {
+        uint64_t size;
+        if (!read(&size, sizeof(size)) || ((uint64_t)(end - next) < size)) return false;
+        field->assign(next, size);
+        next += size;
+        return true;
+    }
+};
+
+/* Flatten the result of an image */
+void encodeResult(const ImageResult &result, std::string *bytes) {
+
+    bytes->clear();
+    appendField(bytes, result.row);
+    uint64_t count = result.values.size();
+    appendBytes(bytes, &count, sizeof(count));
+    appendBytes(bytes, result.values.data(), count * sizeof(double));
+
+    std::string sketch;
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+            result.sketches[c].metric[m].serialize(&sketch);
+            appendField(bytes, sketch);
+        }
+    }
+
+    count = result.filters.size();
+    appendBytes(bytes, &count, sizeof(count));
+    for (size_t c = 0; c < result.filters.size(); c++) {
+        count = result.filters[c].size();
+        appendBytes(bytes, &count, sizeof(count));
+        appendBytes(bytes, result.filters[c].data(), count * sizeof(FilterStats));
+    }
+    count = result.drift.size();
+    appendBytes(bytes, &count, sizeof(count));
+    appendBytes(bytes, result.drift.data(), count * sizeof(SimplifyDrift));
+
+    uint32_t downsample = result.downsample;
+    uint8_t timed_out = result.timed_out;
+    appendBytes(bytes, &downsample, sizeof(downsample));
+    appendBytes(bytes, &timed_out, sizeof(timed_out));
+    appendField(bytes, result.timeout_stage);
+    appendBytes(bytes, &result.seconds, sizeof(result.seconds));
+    appendBytes(bytes, &result.content_hash, sizeof(result.content_hash));
+    count = result.artifacts.size();
+    appendBytes(bytes, &count, sizeof(count));
+    for (size_t i = 0; i < result.artifacts.size(); i++) {
+        appendField(bytes, result.artifacts[i].temporary);
+        appendField(bytes, result.artifacts[i].path);
+    }
+}
+
+/* Rebuild the result of an image, false if the bytes are malformed */
+bool decodeResult(const std::string &bytes, ImageResult *result) {
+
+    ByteReader reader = { bytes.data(), bytes.data() + bytes.size() };
+    uint64_t count = 0;
+    if (!reader.field(&result->row) || !reader.read(&count, sizeof(count)) ||
+            (count > bytes.size() / sizeof(double))) {
+        return false;
+    }
+    result->values.resize(count);
+    if (!reader.read(result->values.data(), count * sizeof(double))) return false;
+
+    std::string sketch;
+    result->sketches.assign(NUM_CHANNELS, CellSketches());
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+            if (!reader.field(&sketch) || !result->sketches[c].metric[m].deserialize(sketch)) {
+                return false;
+            }
+        }
+    }
+
+    if (!reader.read(&count, sizeof(count)) || (count > NUM_CHANNELS)) return false;
+    result->filters.resize(count);
+    for (size_t c = 0; c < result->filters.size(); c++) {
+        if (!reader.read(&count, sizeof(count)) ||
+                (count > bytes.size() / sizeof(FilterStats))) {
+            return false;
+        }
+        result->filters[c].resize(count);
+        if (!reader.read(result->filters[c].data(), count * sizeof(FilterStats))) return false;
+    }
+    if (!reader.read(&count, sizeof(count)) || (count > NUM_CHANNELS)) return false;
+    result->drift.resize(count);
+    if (!reader.read(result->drift.data(), count * sizeof(SimplifyDrift))) return false;
+
+    uint32_t downsample;
+    uint8_t timed_out;
+    if (!reader.read(&downsample, sizeof(downsample)) ||
+            !reader.read(&timed_out, sizeof(timed_out)) ||
+            !reader.field(&result->timeout_stage) ||
+            !reader.read(&result->seconds, sizeof(result->seconds)) ||
+            !reader.read(&result->content_hash, sizeof(result->content_hash)) ||
+            !reader.read(&count, sizeof(count)) || (count > bytes.size())) {
+        return false;
+    }
+    result->artifacts.resize(count);
+    for (size_t i = 0; i < result->artifacts.size(); i++) {
+        if (!reader.field(&result->artifacts[i].temporary) ||
+                !reader.field(&result->artifacts[i].path)) {
+            return false;
+        }
+    }
+    result->downsample = downsample;
+    result->timed_out = (timed_out != 0);
+    result->crashed = false;
+    return reader.next == reader.end;
+}
+
+/* Names of the numeric metric columns, in CSV order */
+std::vector<std::string> metricColumns(const HistogramEngine &histograms) {
+
+    std::vector<std::string> columns;
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        std::string name = CHANNEL_NAMES[c];
+        columns.push_back(name + "_Contour_Count");
+        columns.push_back(name + "_Contour_Diameter_(mean)");
+        columns.push_back(name + "_Contour_Aspect_Ratio_(mean)");
+        histograms.columnNames(name, &columns);
+    }
+    return columns;
+}
+
+/* Fold the sketches of every channel into the totals */
+void mergeSketches(const std::vector<CellSketches> &from, std::vector<CellSketches> *into) {
+    into->resize(NUM_CHANNELS);
+    for (size_t c = 0; (c < from.size()) && (c < NUM_CHANNELS); c++) {
+        for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+            (*into)[c].metric[m].merge(from[c].metric[m]);
+        }
+    }
+}
+
+/* Fold the filter work of every channel into the totals */
+void mergeFilterStats(  const std::vector<std::vector<FilterStats>> &from,
+                        std::vector<std::vector<FilterStats>> *into ) {
+    into->resize(NUM_CHANNELS);
+    for (size_t c = 0; (c < from.size()) && (c < NUM_CHANNELS); c++) {
+        (*into)[c].resize(std::max((*into)[c].size(), from[c].size()));
+        for (size_t f = 0; f < from[c].size(); f++) (*into)[c][f].merge(from[c][f]);
+    }
+}
+
+/* Write the work of every filter of the cascade over the batch */
+bool writeFilterStats(  std::string filters_file, const FilterCascade &cascade,
+                        const std::vector<std::vector<FilterStats>> &filters    ) {
+
+    std::ofstream stream(filters_file.c_str(), std::ios::out);
+    if (!stream.is_open()) return false;
+
+    stream << "Channel,Filter,Min,Max,Evaluated,Rejected,Seconds" << std::endl;
+    const std::vector<FilterSpec> &specs = cascade.specs();
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        for (size_t f = 0; f < specs.size(); f++) {
+            FilterStats stats;
+            if ((c < filters.size()) && (f < filters[c].size())) stats = filters[c][f];
+            stream << CHANNEL_NAMES[c] << "," << filterName(specs[f].kind) << ","
+                   << specs[f].min << "," << specs[f].max << "," << stats.evaluated << ","
+                   << stats.rejected << "," << stats.seconds << std::endl;
+        }
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+/* Fold the simplification drift of every channel into the totals */
+void mergeDrift(const std::vector<SimplifyDrift> &from, std::vector<SimplifyDrift> *into) {
+    into->resize(NUM_CHANNELS);
+    for (size_t c = 0; (c < from.size()) && (c < NUM_CHANNELS); c++) (*into)[c].merge(from[c]);
+}
+
+/* Write the points saved and the metric drift of the simplification */
+bool writeDrift(std::string drift_file, const std::vector<SimplifyDrift> &drift) {
+
+    std::ofstream stream(drift_file.c_str(), std::ios::out);
+    if (!stream.is_open()) return false;
+
+    stream << "Channel,Cells,Points_In,Points_Out,Sampled";
+    for (unsigned int m = 0; m < NUM_DRIFT_METRICS; m++) {
+        stream << "," << DRIFT_METRIC_NAMES[m] << "_Drift_(mean),"
+               << DRIFT_METRIC_NAMES[m] << "_Drift_(max)";
+    }
+    stream << std::endl;
+
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        SimplifyDrift channel_drift;
+        if (c < drift.size()) channel_drift = drift[c];
+        stream << CHANNEL_NAMES[c] << "," << channel_drift.cells << ","
+               << channel_drift.points_in << "," << channel_drift.points_out << ","
+               << channel_drift.sampled;
+        for (unsigned int m = 0; m < NUM_DRIFT_METRICS; m++) {
+            double mean = channel_drift.sampled ?
+                            channel_drift.error_sum[m] / channel_drift.sampled : 0.0;
+            stream << "," << mean << "," << channel_drift.error_max[m];
+        }
+        stream << std::endl;
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+/* Append the sketches of one image to the sketch file */
+void writeSketches( std::ostream &stream, std::string image_name,
+                    const std::vector<CellSketches> &sketches   ) {
+
+    SketchRecord record;
+    record.image = image_name;
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        record.channel = CHANNEL_NAMES[c];
+        for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+            record.metric = SKETCH_METRIC_NAMES[m];
+            record.sketch = sketches[c].metric[m];
+            writeSketchRecord(stream, record);
+        }
+    }
+}
+
+/* Write the quantiles of the merged sketches */
+bool writeQuantiles(std::string quantiles_file, const std::vector<CellSketches> &sketches) {
+
+    static const double QUANTILES[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+    std::ofstream stream(quantiles_file.c_str(), std::ios::out);
+    if (!stream.is_open()) return false;
+
+    stream << "Channel,Metric,Count,Min";
+    for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+        stream << ",P" << QUANTILES[i] * 100;
+    }
+    stream << ",Max" << std::endl;
+
+    for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+        for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+            const QuantileSketch &sketch = sketches[c].metric[m];
+            stream << CHANNEL_NAMES[c] << "," << SKETCH_METRIC_NAMES[m] << "," << sketch.count();
+            if (!sketch.count()) {
+                stream << std::endl;
+                continue;
+            }
+            stream << "," << sketch.min();
+            for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+                stream << "," << sketch.quantile(QUANTILES[i]);
+            }
+            stream << "," << sketch.max() << std::endl;
+        }
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+/* Combine the summaries and sketches of several shard directories */
+int mergeShards(const Options &options) {
+
+    std::string path = options.path;
+    BatchSummary summary;
+    std::vector<CellSketches> batch_sketches(NUM_CHANNELS);
+
+    std::string sketch_file = path + "computed_sketches.bin";
+    std::ofstream sketch_stream(sketch_file.c_str(), std::ios::out | std::ios::binary);
+    if (!sketch_stream.is_open()) {
+        LOG(ERROR, "output_failed").field("path", sketch_file);
         return -1;
     }
+    writeSketchHeader(sketch_stream);
 
-    /* Read the path to the data */
-    std::string path(argv[1]);
+    for (size_t i = 0; i < options.merge_dirs.size(); i++) {
+        const std::string &shard = options.merge_dirs[i];
+        LOG(INFO, "merge_shard").field("path", shard);
+
+        BatchSummary shard_summary;
+        if (!shard_summary.read(shard + "computed_summary.csv")) {
+            LOG(ERROR, "invalid_summary").field("path", shard);
+            return -1;
+        }
+        if (!summary.merge(shard_summary)) {
+            LOG(ERROR, "summary_columns_mismatch").field("path", shard);
+            return -1;
+        }
+
+        // Per image sketches are carried over so that the output merges again
+        std::vector<SketchRecord> records;
+        if (!readSketchFile(shard + "computed_sketches.bin", &records)) {
+            LOG(ERROR, "invalid_sketches").field("path", shard);
+            return -1;
+        }
+        for (size_t r = 0; r < records.size(); r++) {
+            writeSketchRecord(sketch_stream, records[r]);
+            for (unsigned int c = 0; c < NUM_CHANNELS; c++) {
+                if (records[r].channel != CHANNEL_NAMES[c]) continue;
+                for (unsigned int m = 0; m < NUM_SKETCH_METRICS; m++) {
+                    if (records[r].metric != SKETCH_METRIC_NAMES[m]) continue;
+                    batch_sketches[c].metric[m].merge(records[r].sketch);
+                }
+            }
+        }
+    }
+    sketch_stream.close();
+    if (sketch_stream.fail()) {
+        LOG(ERROR, "output_failed").field("path", sketch_file);
+        return -1;
+    }
+
+    std::string summary_file = path + "computed_summary.csv";
+    std::string quantile_file = path + "computed_quantiles.csv";
+    if (!summary.write(summary_file)) {
+        LOG(ERROR, "output_failed").field("path", summary_file);
+        return -1;
+    }
+    if (!writeQuantiles(quantile_file, batch_sketches)) {
+        LOG(ERROR, "output_failed").field("path", quantile_file);
+        return -1;
+    }
+    LOG(INFO, "merge_done").field("shards", options.merge_dirs.size());
+    return 0;
+}
+
+/* List the indexed images matching every --query condition, with the
+ * rows read straight from their metrics files */
+int queryIndex(const Options &options) {
+
+    auto start = std::chrono::steady_clock::now();
+    std::string index_file = options.index_file.empty() ? options.path + INDEX_FILE_NAME
+                                                        : options.index_file;
+    ResultsIndex index;
+    if (!index.open(index_file)) {
+        std::cerr << "Could not open the results index " << index_file << std::endl;
+        return -1;
+    }
+    std::vector<IndexPredicate> predicates(options.queries.size());
+    for (size_t i = 0; i < options.queries.size(); i++) {
+        if (!parseIndexPredicate(options.queries[i], &predicates[i])) {
+            std::cerr << "Invalid query: " << options.queries[i] << std::endl;
+            return -1;
+        }
+    }
+    std::vector<size_t> matches;
+    if (!queryResultsIndex(index, predicates, &matches)) return -1;
+
+    // Hash, metrics file, artifacts and row, tab separated
+    std::map<std::string, int> metrics_fds;
+    std::string row;
+    for (size_t i = 0; i < matches.size(); i++) {
+        IndexEntry entry = index.entry(matches[i]);
+        if (!metrics_fds.count(entry.metrics_file)) {
+            metrics_fds[entry.metrics_file] = open(entry.metrics_file.c_str(), O_RDONLY);
+        }
+        int fd = metrics_fds[entry.metrics_file];
+        row.assign(entry.row_size, '\0');
+        if ((fd < 0) || (pread(fd, &row[0], row.size(), entry.row_offset) != (ssize_t)row.size()) ||
+                (row.compare(0, entry.image.size() + 1, entry.image + ",") != 0)) {
+            std::cerr << "Stale row of " << entry.image << " in " << entry.metrics_file << std::endl;
+            row.clear();
+        }
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)entry.content_hash);
+        std::cout << hash << "\t" << entry.metrics_file << "\t" << entry.artifacts << "\t"
+                  << row << "\n";
+    }
+    for (std::map<std::string, int>::iterator it = metrics_fds.begin();
+                                                    it != metrics_fds.end(); it++) {
+        if (it->second >= 0) close(it->second);
+    }
+    std::cout << std::flush;
+    std::cerr << matches.size() << " of " << index.size() << " image(s) in "
+              << std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    return 0;
+}
+
+/* Serve the images submitted over the local socket until killed */
+int serveSubmissions(const Options &options) {
+
+    HistogramEngine histograms(options.histograms);
+    FilterCascade cascade(options.filters);
+    std::vector<std::string> columns = metricColumns(histograms);
+    std::string names;
+    for (size_t i = 0; i < columns.size(); i++) names += (i ? "," : "") + columns[i];
+    ThreadPool pool(options.threads);
+
+    std::string out_directory = options.path + "result/";
+    struct stat st = {0};
+    if (stat(out_directory.c_str(), &st) == -1) {
+        mkdir(out_directory.c_str(), 0700);
+    }
+
+    // At most --jobs submissions run at once, the rest wait their turn
+    QueueLimits limits;
+    limits.slots = options.jobs;
+    limits.interactive_slots = options.interactive_slots;
+    limits.client_queued = options.client_queue;
+    limits.class_queued = options.class_queue;
+    limits.fair = true;
+    JobQueue queue(limits);
+
+    // The planes are views of the client's segment, analyzed where they are
+    auto analyze = [&](const SubmitRequest &request, std::vector<cv::Mat> *planes,
+                                                     SubmitResult *reply) {
+        std::string image_name(request.name);
+        const bool write_images = (request.flags & SUBMIT_WRITE_IMAGES) != 0;
+        if (write_images && ((image_name.find('.') == std::string::npos) ||
+                                    (image_name.find('/') != std::string::npos))) {
+            reply->status = SubmitStatus::INVALID;
+            reply->message = "Writing the images needs a file name";
+            return;
+        }
+        if (image_name.empty()) image_name = "submission";
+
+        ImageResult result;
+        startResult(image_name, 1, &result);
+        LogContext log_context(std::string(), image_name);
+        Deadline deadline(options.deadline, options.stage_deadline);
+        DeadlineScope deadline_scope(&deadline);
+        std::shared_ptr<PlaneBuffer> plane_memory;
+        try {
+            if (!analyzeChannels(planes, &plane_memory, image_name,
+                            write_images ? out_directory : std::string(), options,
+                            histograms, cascade, 1, NULL, std::string(), &pool, &result,
+                            (request.flags & SUBMIT_WANT_CELLS) ? &reply->cells : NULL)) {
+                discardArtifacts(result.artifacts);
+                reply->status = SubmitStatus::FAILED;
+                reply->message = "Analysis failed";
+                return;
+            }
+        } catch (const DeadlineExceeded &timeout) {
+            discardArtifacts(result.artifacts);
+            reply->status = SubmitStatus::TIMED_OUT;
+            reply->message = std::string("Deadline exceeded in ") + timeout.stage();
+            LOG(WARN, "timed_out").field("stage", timeout.stage())
+                                  .field("seconds", timeout.seconds());
+            return;
+        }
+        deadline.finish();
+
+        // Every submission is a commit of its own
+        if (!publishArtifacts(result.artifacts, options.sync_mode)) {
+            reply->status = SubmitStatus::FAILED;
+            reply->message = "Could not publish the images";
+            return;
+        }
+        reply->status = SubmitStatus::OK;
+        reply->values = result.values;
+        reply->names = names;
+    };
+
+    // Clients share the queue under the name they give, else their user.
+    // A submission costs its pixels, the deadline counts once it runs.
+    auto handler = [&](const SubmitRequest &request, const SubmitPeer &peer,
+                       std::vector<cv::Mat> *planes, SubmitResult *reply) {
+        if (request.flags & SUBMIT_STATS) {
+            reply->status = SubmitStatus::OK;
+            queueStatsValues(queue.stats(), &reply->values, &reply->names);
+            return;
+        }
+        std::string client(request.client);
+        if (client.empty()) client = "uid:" + std::to_string(peer.uid);
+        JobClass job_class = (request.flags & SUBMIT_BULK) ? JobClass::BULK
+                                                           : JobClass::INTERACTIVE;
+        if (!queue.run(client, job_class, (double)request.rows * request.cols,
+                       [&] { analyze(request, planes, reply); })) {
+            reply->status = SubmitStatus::REJECTED;
+            reply->message = "Too many submissions waiting";
+        }
+    };
+
+    SubmitServer server(options.serve_socket, handler);
+    LOG(INFO, "serving").field("socket", options.serve_socket).field("jobs", options.jobs);
+    return server.run() ? 0 : -1;
+}
+
+/* Name of a batch output of a root, written under a temporary name and
+ * published by the last commit */
+std::string stagedOutput(Dataset *dataset, const std::string &name) {
+    Artifact artifact = { stagedPath(dataset->path + name), dataset->path + name };
+    dataset->batch_outputs.push_back(artifact);
+    return artifact.temporary;
+}
+
+/* Read the image list of a root */
+bool readImageList(const std::string &path, std::vector<std::string> *images) {
 
-    /* Read the list of directories to process */
     std::string image_list_filename = path + "image_list.dat";
-    std::vector<std::string> input_images;
     FILE *file = fopen(image_list_filename.c_str(), "r");
     if (!file) {
-        std::cerr << "Invalid raw image" << std::endl;
-        return -1;
+        LOG(ERROR, "invalid_image_list").field("path", image_list_filename);
+        return false;
     }
 
     char line[128];
     while (fgets(line, sizeof(line), file) != NULL) {
         line[strlen(line)-1] = 0;
         std::string temp_str(line);
-        input_images.push_back(temp_str);
+        images->push_back(temp_str);
     }
     fclose(file);
+    return true;
+}
 
-    /* Create and prepare the file for metrics */
-    std::string metrics_file = path + "computed_metrics.csv";
-    std::ofstream data_stream;
-    data_stream.open(metrics_file, std::ios::out);
-    if (!data_stream.is_open()) {
-        std::cerr << "Could not create the metrics file." << std::endl;
-        return -1;
-    }
+/* Read the image list of a root and create its journal, metrics and
+ * sketch files */
+bool openDataset(   const std::string &path, const Options &options,
+                    const std::vector<std::string> &columns, Dataset *dataset   ) {
 
-    data_stream << "Image_Name,";
+    dataset->path = path;
 
-    // Green channel
-    data_stream << "Green_Contour_Count,";
-    data_stream << "Green_Contour_Diameter_(mean),";
-    data_stream << "Green_Contour_Aspect_Ratio_(mean),";
-    for (unsigned int i = 0; i < NUM_BINS-1; i++) {
-        data_stream << i*BIN_AREA << " <= Green_Contour_Area < " << (i+1)*BIN_AREA << ",";
+    /* Read the list of directories to process */
+    if (!readImageList(path, &dataset->images)) return false;
+
+    // The index points at the rows by absolute path, so that one index
+    // can serve the runs of many directories
+    char *real_path = realpath(path.c_str(), NULL);
+    dataset->absolute_path = real_path ? std::string(real_path) + "/" : path;
+    free(real_path);
+
+    /* Every output is written under a temporary name and published by a
+     * commit every --sync-group images, recorded in the run journal */
+    dataset->publisher.reset(new ArtifactPublisher(path + JOURNAL_FILE_NAME,
+                                                   options.sync_mode, options.sync_group));
+    if (!dataset->publisher->isOpen()) return false;
+
+    /* Create and prepare the file for metrics, synced at every commit */
+    std::string metrics_file = stagedOutput(dataset, "computed_metrics.csv");
+    dataset->publisher->keepSynced(metrics_file);
+    dataset->data_stream.open(metrics_file, std::ios::out);
+    if (!dataset->data_stream.is_open()) {
+        LOG(ERROR, "output_failed").field("path", metrics_file);
+        return false;
     }
-    data_stream << "Green_Contour_Area >= " << (NUM_BINS-1)*BIN_AREA << ",";
-
-    // Red channel
-    data_stream << "Red_Contour_Count,";
-    data_stream << "Red_Contour_Diameter_(mean),";
-    data_stream << "Red_Contour_Aspect_Ratio_(mean),";
-    for (unsigned int i = 0; i < NUM_BINS-1; i++) {
-        data_stream << i*BIN_AREA << " <= Red_Contour_Area < " << (i+1)*BIN_AREA << ",";
+    dataset->data_stream << "Image_Name";
+    for (size_t i = 0; i < columns.size(); i++) {
+        dataset->data_stream << "," << columns[i];
     }
-    data_stream << "Red_Contour_Area >= " << (NUM_BINS-1)*BIN_AREA << ",";
+    dataset->data_stream << std::endl;
+
+    /* Per image sketches of the cell features, merged into the batch ones */
+    std::string sketch_file = stagedOutput(dataset, "computed_sketches.bin");
+    dataset->publisher->keepSynced(sketch_file);
+    dataset->sketch_stream.open(sketch_file.c_str(), std::ios::out | std::ios::binary);
+    if (!dataset->sketch_stream.is_open()) {
+        LOG(ERROR, "output_failed").field("path", sketch_file);
+        return false;
+    }
+    writeSketchHeader(dataset->sketch_stream);
+
+    /* Inputs are read ahead of the pipeline, except those already
+     * converted to a chunked array store and those started from masks */
+    for (size_t index = 0; index < dataset->images.size(); index++) {
+        std::string image_path = path + "original/" + dataset->images[index];
+        ChunkStoreInfo store;
+        MaskFileHeader mask_header;
+        if (openFreshStore(image_path, false, &store)) image_path.clear();
+        std::string mask_path = maskPath(path, dataset->images[index]);
+        if (options.from_masks && readMaskHeader(mask_path, &mask_header) &&
+                maskRegionMatches(options, mask_header) &&
+                maskInputMatches(mask_header, maskInput(mask_path))) {
+            image_path.clear();
+        }
+        dataset->input_paths.push_back(image_path);
+    }
+    return true;
+}
 
-    // White channel
-    data_stream << "White_Contour_Count,";
-    data_stream << "White_Contour_Diameter_(mean),";
-    data_stream << "White_Contour_Aspect_Ratio_(mean),";
-    for (unsigned int i = 0; i < NUM_BINS-1; i++) {
-        data_stream << i*BIN_AREA << " <= White_Contour_Area < " << (i+1)*BIN_AREA << ",";
+/* Merge the lanes of a root into its batch files, then publish them with
+ * the last commit */
+bool finishDataset( const Options &options, const FilterCascade &cascade, bool workers,
+                    Dataset *dataset    ) {
+
+    BatchTotals batch = dataset->lanes[0];
+    for (size_t lane = 1; lane < dataset->lanes.size(); lane++) {
+        batch.summary.merge(dataset->lanes[lane].summary);
+        mergeSketches(dataset->lanes[lane].sketches, &batch.sketches);
+        mergeFilterStats(dataset->lanes[lane].filters, &batch.filters);
+        mergeDrift(dataset->lanes[lane].drift, &batch.drift);
+    }
+    if (!batch.summary.write(stagedOutput(dataset, "computed_summary.csv"))) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
+    }
+    if (!writeQuantiles(stagedOutput(dataset, "computed_quantiles.csv"), batch.sketches)) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
+    }
+    if (!writeFilterStats(stagedOutput(dataset, "computed_filters.csv"), cascade,
+                                                                        batch.filters)) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
+    }
+    if ((options.simplify.method != SimplifyMethod::NONE) &&
+            !writeDrift(stagedOutput(dataset, "computed_simplification.csv"), batch.drift)) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
+    }
+    if (((options.deadline > 0) || (options.stage_deadline > 0)) &&
+            !writeTimeouts(stagedOutput(dataset, "computed_timeouts.csv"), dataset->timeouts)) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
     }
-    data_stream << "White_Contour_Area >= " << (NUM_BINS-1)*BIN_AREA;
+    if (workers &&
+            !writeQuarantine(stagedOutput(dataset, "computed_quarantine.csv"),
+                                                                dataset->quarantine)) {
+        LOG(ERROR, "output_failed").field("path", dataset->batch_outputs.back().path);
+        return false;
+    }
+    dataset->publisher->add(dataset->batch_outputs, 0);
+    return dataset->publisher->finish();
+}
 
-    data_stream << std::endl;
+/* Drop the staged results of the roots of a failed grid search */
+static void removeGridResults(const std::vector<std::unique_ptr<GridRoot>> &roots) {
+    for (size_t d = 0; d < roots.size(); d++) {
+        if (!roots[d]->stream.is_open()) continue;
+        roots[d]->stream.close();
+        remove(stagedPath(roots[d]->path + GRID_RESULTS_FILE).c_str());
+    }
+}
 
+/* Metrics of the images of every root at every --grid point. An image is
+ * decoded once for all the points, the lanes take options.jobs images at
+ * a time and spread the points of each over the pool. Every root gets the
+ * long format GRID_RESULTS_FILE, one row per image, point and metric. */
+int gridSearch(const Options &options) {
+
+    std::vector<GridAxis> axes(options.grid.size());
+    for (size_t i = 0; i < axes.size(); i++) parseGridAxis(options.grid[i], &axes[i]);
+    GridSearch grid(axes, options.filters);
+    HistogramEngine histograms(options.histograms);
+    std::vector<std::string> columns = metricColumns(histograms);
+
+    /* The images of every root, root after root */
+    std::vector<std::unique_ptr<GridRoot>> roots;
+    std::vector<DatasetImage> run_images;
+    std::vector<std::string> input_paths;
+    for (size_t d = 0; d < options.paths.size(); d++) {
+        roots.push_back(std::unique_ptr<GridRoot>(new GridRoot()));
+        GridRoot &root = *roots.back();
+        root.path = options.paths[d];
+        if (!readImageList(root.path, &root.images)) {
+            removeGridResults(roots);
+            return -1;
+        }
 
-    /* Process the image set */
-    for (unsigned int index = 0; index < input_images.size(); index++) {
-        std::cout << "Processing " << input_images[index] << std::endl;
-        std::string result;
-        if (!processImage(path, input_images[index], &result)) {
-            std::cerr << "ERROR !!!" << std::endl;
+        std::string results_file = stagedPath(root.path + GRID_RESULTS_FILE);
+        root.stream.open(results_file.c_str(), std::ios::out);
+        if (!root.stream.is_open()) {
+            LOG(ERROR, "output_failed").field("path", results_file);
+            removeGridResults(roots);
             return -1;
         }
-        data_stream << result << std::endl;
+        root.stream << "Image_Name";
+        for (size_t a = 0; a < axes.size(); a++) root.stream << "," << axes[a].name;
+        root.stream << ",Metric,Value" << std::endl;
+        root.values.resize(root.images.size());
+        root.finished.assign(root.images.size(), false);
+        root.next_row = 0;
+
+        for (size_t index = 0; index < root.images.size(); index++) {
+            DatasetImage image = { d, index };
+            run_images.push_back(image);
+            std::string image_path = root.path + "original/" + root.images[index];
+            ChunkStoreInfo store;
+            if (openFreshStore(image_path, false, &store)) image_path.clear();
+            input_paths.push_back(image_path);
+        }
+    }
+    LOG(INFO, "grid_start").field("roots", roots.size()).field("images", run_images.size())
+                           .field("points", grid.numPoints())
+                           .field("threshold_sets", grid.numThresholdSets());
+
+    InputReader reader(input_paths, options);
+    ThreadPool pool(options.threads);
+    std::mutex output_mutex;
+    std::atomic<bool> failed(false);
+    std::atomic<size_t> next_job(0);
+    pool.parallelFor(options.jobs, [&](size_t) {
+        while (!failed) {
+            size_t job = next_job++;
+            if (job >= run_images.size()) return;
+            GridRoot &root = *roots[run_images[job].dataset];
+            size_t index = run_images[job].index;
+            const std::string &image = root.images[index];
+            LogContext log_context(root.path, image);
+            auto start = std::chrono::steady_clock::now();
+
+            // The planes are taken as analyzeChannels takes them
+            std::shared_ptr<FileBuffer> input = reader.take(job);
+            std::vector<cv::Mat> channel;
+            std::shared_ptr<PlaneBuffer> plane_memory;
+            if (!decodeChannels(root.path, image, *input, options, &pool,
+                                                        &channel, &plane_memory)) {
+                LOG(ERROR, "image_failed").field("root", root.path).field("image", image);
+                failed = true;
+                return;
+            }
+            input.reset();
+            const cv::Mat planes[3] = { channel[0], channel[0], channel[0] };
+            std::vector<std::vector<double>> values;
+            grid.evaluate(planes, options.strategy, options.simplify, histograms, &pool, &values);
+            channel.clear();
+            plane_memory.reset();
+
+            // Every point has one value per metric column, or the rows are wrong
+            for (size_t point = 0; point < values.size(); point++) {
+                if (values[point].size() != columns.size()) {
+                    LOG(ERROR, "grid_columns_mismatch").field("image", image)
+                                    .field("point", point).field("values", values[point].size())
+                                    .field("columns", columns.size());
+                    failed = true;
+                    return;
+                }
+            }
+            LOG(INFO, "image_done").field("seconds", std::chrono::duration<double>(
+                                        std::chrono::steady_clock::now() - start).count());
+
+            // The rows of a root are written in the order of its list
+            std::lock_guard<std::mutex> lock(output_mutex);
+            root.values[index].swap(values);
+            root.finished[index] = true;
+            while ((root.next_row < root.images.size()) && root.finished[root.next_row]) {
+                const std::vector<std::vector<double>> &rows = root.values[root.next_row];
+                for (size_t point = 0; point < rows.size(); point++) {
+                    const std::vector<double> &point_values = grid.pointValues(point);
+                    for (size_t m = 0; m < columns.size(); m++) {
+                        root.stream << root.images[root.next_row];
+                        for (size_t a = 0; a < point_values.size(); a++) {
+                            root.stream << "," << point_values[a];
+                        }
+                        root.stream << "," << columns[m] << "," << rows[point][m] << "\n";
+                    }
+                }
+                std::vector<std::vector<double>>().swap(root.values[root.next_row]);
+                root.next_row++;
+            }
+        }
+    });
+    if (failed) {
+        removeGridResults(roots);
+        return -1;
     }
-    data_stream.close();
 
+    /* The results of a root appear once complete */
+    for (size_t d = 0; d < roots.size(); d++) {
+        std::string results_file = roots[d]->path + GRID_RESULTS_FILE;
+        roots[d]->stream.close();
+        if (roots[d]->stream.fail() ||
+                rename(stagedPath(results_file).c_str(), results_file.c_str())) {
+            LOG(ERROR, "output_failed").field("path", results_file);
+            remove(stagedPath(results_file).c_str());
+            removeGridResults(roots);
+            return -1;
+        }
+    }
+    LOG(INFO, "grid_done").field("images", run_images.size());
     return 0;
 }
 
+/* Main - create the threads and start the processing */
+int main(int argc, char *argv[]) {
+
+    /* Parse the options */
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (!configureLog(options.log_file, options.log_level)) return -1;
+    if (!options.merge_dirs.empty()) return mergeShards(options);
+    if (!options.serve_socket.empty()) return serveSubmissions(options);
+    if (!options.queries.empty()) return queryIndex(options);
+    if (!options.grid.empty()) return gridSearch(options);
+
+    /* Read the lists of images of every root, and create their outputs */
+    HistogramEngine histograms(options.histograms);
+    FilterCascade cascade(options.filters);
+    std::vector<std::string> columns = metricColumns(histograms);
+    std::vector<std::unique_ptr<Dataset>> datasets;
+    for (size_t d = 0; d < options.paths.size(); d++) {
+        datasets.push_back(std::unique_ptr<Dataset>(new Dataset()));
+        if (!openDataset(options.paths[d], options, columns, datasets.back().get())) return -1;
+    }
+
+    /* All the images of the run, root after root, so that one root
+     * finishes while the lanes already start on the next one */
+    std::vector<DatasetImage> run_images;
+    std::vector<std::string> input_paths;
+    for (size_t d = 0; d < datasets.size(); d++) {
+        for (size_t index = 0; index < datasets[d]->images.size(); index++) {
+            DatasetImage image = { d, index };
+            run_images.push_back(image);
+            input_paths.push_back(datasets[d]->input_paths[index]);
+        }
+    }
+    LOG(INFO, "run_start").field("roots", datasets.size()).field("images", run_images.size());
+    NumaTopology topology = readNumaTopology();
+
+    /* With --workers the images run in forked worker processes, each with
+     * its share of the threads. The workers, and the replacements of those
+     * that die, are forked while the log flusher started by the first
+     * record runs: the event log's atfork handlers hold log_mutex across
+     * every fork. No other thread may be started before the supervisor
+     * exists, the reader and the pools come after it and the lane pool
+     * of a --workers run starts no thread. */
+    std::unique_ptr<WorkerSupervisor> supervisor;
+    if (options.workers) {
+        unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+        unsigned int worker_threads =
+                std::max((options.threads ? options.threads : cores) / options.workers, 1u);
+        auto setup = [&, worker_threads](unsigned int worker) -> WorkerSupervisor::WorkerFn {
+            std::shared_ptr<ThreadPool> worker_pool;
+            if (options.numa) {
+                const std::vector<int> &cpus =
+                        topology.node_cpus[worker % topology.node_cpus.size()];
+                pinCurrentThread(cpus);
+                worker_pool.reset(new ThreadPool(worker_threads, cpus));
+            } else {
+                worker_pool.reset(new ThreadPool(worker_threads));
+            }
+            return [&, worker_pool](size_t job, unsigned int downsample,
+                                    const FileBuffer &input, std::string *bytes) {
+                const Dataset &dataset = *datasets[run_images[job].dataset];
+                const std::string &image = dataset.images[run_images[job].index];
+                ImageResult result;
+                try {
+                    if (!processImage(dataset.path, image, input, options, histograms,
+                                        cascade, downsample, worker_pool.get(), &result)) {
+                        LOG(ERROR, "image_failed").field("root", dataset.path)
+                                                  .field("image", image);
+                        *bytes = "failed";
+                        return false;
+                    }
+                } catch (const DeadlineExceeded &timeout) {
+                    timedOut(image, columns.size(), timeout, downsample, &result);
+                }
+                encodeResult(result, bytes);
+                return true;
+            };
+        };
+
+        // A worker stuck well past the image deadline is inside a call the
+        // checkpoints cannot reach, it is killed and its image quarantined.
+        // Without --deadline, every stage spending its budget bounds the image.
+        double image_budget = (options.deadline > 0) ? options.deadline :
+                                                options.stage_deadline * IMAGE_STAGES;
+        supervisor.reset(new WorkerSupervisor(options.workers, largestInput(input_paths),
+                                    setup, image_budget * HANG_DEADLINE_FACTOR));
+        LOG(INFO, "workers").field("processes", options.workers)
+                            .field("threads", worker_threads);
+    }
+    std::unique_ptr<InputReader> reader;
+    if (!supervisor) reader.reset(new InputReader(input_paths, options));
+
+    /* With --numa every node gets a pool pinned to its CPUs and lane i
+     * works on node i % nodes, so an image is decoded into planes placed
+     * on the node whose workers then process it. The lanes themselves
+     * run on a pool of their own. */
+    std::vector<std::unique_ptr<ThreadPool>> node_pools;
+    if (options.numa && !supervisor) {
+        size_t num_nodes = topology.node_cpus.size();
+        for (size_t node = 0; node < num_nodes; node++) {
+            unsigned int node_threads = options.threads ?
+                    std::max(options.threads / (unsigned int)num_nodes, 1u) :
+                    (unsigned int)topology.node_cpus[node].size();
+            node_pools.push_back(std::unique_ptr<ThreadPool>(
+                        new ThreadPool(node_threads, topology.node_cpus[node])));
+        }
+        LOG(INFO, "numa").field("nodes", num_nodes);
+    }
+    ThreadPool pool(supervisor ? 1 : (options.numa ? options.jobs : options.threads));
+
+    /* Process the images of every root, options.jobs images at a time.
+     * Every lane accumulates batch totals per root, and the rows of a root
+     * are written in the order of its list. */
+    BatchTotals lane_totals;
+    lane_totals.summary = BatchSummary(columns);
+    lane_totals.sketches.resize(NUM_CHANNELS);
+    lane_totals.filters.resize(NUM_CHANNELS);
+    lane_totals.drift.resize(NUM_CHANNELS);
+    for (size_t d = 0; d < datasets.size(); d++) {
+        Dataset &dataset = *datasets[d];
+        dataset.lanes.assign(options.jobs, lane_totals);
+        dataset.results.resize(dataset.images.size());
+        dataset.finished.assign(dataset.images.size(), false);
+        dataset.next_row = 0;
+    }
+    std::mutex output_mutex;
+    std::atomic<bool> failed(false);
+    const int64_t run_time = (int64_t)time(NULL);
+
+    // Rows of timed-out images wait for their retry when there is one
+    auto flushRows = [&](Dataset &dataset, bool hold_timeouts) {
+        while ((dataset.next_row < dataset.images.size()) && dataset.finished[dataset.next_row]) {
+            const ImageResult &row = dataset.results[dataset.next_row];
+            if (hold_timeouts && row.timed_out && (row.downsample == 1)) break;
+            const std::string &image = dataset.images[dataset.next_row];
+            IndexEntry entry;
+            entry.image = image;
+            entry.content_hash = row.content_hash;
+            entry.metrics_file = dataset.absolute_path + "computed_metrics.csv";
+            entry.row_offset = (uint64_t)dataset.data_stream.tellp();
+            entry.row_size = (uint32_t)row.row.size();
+            entry.artifacts = dataset.absolute_path + "result/" + image;
+            entry.indexed = run_time;
+            entry.values = row.values;
+            dataset.index_entries.push_back(entry);
+            dataset.data_stream << row.row << std::endl;
+            writeSketches(dataset.sketch_stream, image, row.sketches);
+            dataset.publisher->add(row.artifacts);
+            dataset.results[dataset.next_row] = ImageResult();
+            dataset.next_row++;
+
+            // A commit point: the rows so far and the outputs of their images
+            if (dataset.publisher->pendingImages() >= dataset.publisher->groupSize()) {
+                dataset.data_stream.flush();
+                dataset.sketch_stream.flush();
+                if (!dataset.publisher->commit()) failed = true;
+            }
+        }
+    };
+
+    // Fold a finished image into a lane, then flush every row now complete
+    auto completeImage = [&](size_t lane, size_t job) {
+        Dataset &dataset = *datasets[run_images[job].dataset];
+        size_t index = run_images[job].index;
+        const ImageResult &result = dataset.results[index];
+        if (!result.timed_out && !result.crashed) {
+            BatchTotals &totals = dataset.lanes[lane];
+            totals.summary.add(result.values);
+            mergeSketches(result.sketches, &totals.sketches);
+            mergeFilterStats(result.filters, &totals.filters);
+            mergeDrift(result.drift, &totals.drift);
+        }
+
+        if (result.timed_out) {
+            LOG(WARN, "timed_out").field("root", dataset.path).field("image", dataset.images[index])
+                                  .field("stage", result.timeout_stage)
+                                  .field("seconds", result.seconds)
+                                  .field("downsample", result.downsample);
+        }
+        std::lock_guard<std::mutex> lock(output_mutex);
+        if ((result.timed_out || (result.downsample > 1)) && !result.crashed) {
+            TimeoutRecord record = { dataset.images[index], result.downsample, result.timed_out,
+                                                result.timeout_stage, result.seconds };
+            dataset.timeouts.push_back(record);
+        }
+        dataset.finished[index] = true;
+        flushRows(dataset, options.retry_downsample > 1);
+    };
+
+    // One pass over the given images, read ahead by the pass reader
+    auto runPass = [&](const std::vector<size_t> &jobs, InputReader &pass_reader,
+                                                            unsigned int downsample) {
+        std::atomic<size_t> next_job(0);
+        pool.parallelFor(options.jobs, [&](size_t lane) {
+            ThreadPool *image_pool = &pool;
+            if (!node_pools.empty()) {
+                size_t node = lane % node_pools.size();
+                pinCurrentThread(topology.node_cpus[node]);
+                image_pool = node_pools[node].get();
+            }
+            while (!failed) {
+                size_t k = next_job++;
+                if (k >= jobs.size()) return;
+                size_t job = jobs[k];
+                Dataset &dataset = *datasets[run_images[job].dataset];
+                const std::string &image = dataset.images[run_images[job].index];
+
+                // A tripped deadline unwinds the image, releasing its buffers
+                std::shared_ptr<FileBuffer> input = pass_reader.take(k);
+                ImageResult &result = dataset.results[run_images[job].index];
+                try {
+                    if (!processImage(dataset.path, image, *input, options, histograms,
+                                            cascade, downsample, image_pool, &result)) {
+                        LOG(ERROR, "image_failed").field("root", dataset.path)
+                                                  .field("image", image);
+                        failed = true;
+                        return;
+                    }
+                } catch (const DeadlineExceeded &timeout) {
+                    timedOut(image, columns.size(), timeout, downsample, &result);
+                }
+                input.reset();
+                completeImage(lane, job);
+            }
+        });
+    };
+
+    // The same pass over the worker processes. Their results are decoded
+    // and merged by the supervisor, and the images they die or fail on
+    // quarantined, so that one bad input does not end the batch.
+    auto runWorkerPass = [&](const std::vector<size_t> &jobs, unsigned int downsample) {
+        std::vector<WorkerJob> worker_jobs;
+        for (size_t k = 0; k < jobs.size(); k++) {
+            WorkerJob job = { jobs[k], input_paths[jobs[k]], downsample };
+            worker_jobs.push_back(job);
+        }
+        auto completed = [&](const WorkerJob &job, const std::string &bytes) {
+            if (failed) return;
+            Dataset &dataset = *datasets[run_images[job.index].dataset];
+            if (!decodeResult(bytes, &dataset.results[run_images[job.index].index])) {
+                LOG(ERROR, "invalid_worker_result").field("root", dataset.path)
+                        .field("image", dataset.images[run_images[job.index].index]);
+                failed = true;
+                return;
+            }
+            completeImage(0, job.index);
+        };
+        auto quarantine = [&](const WorkerJob &job, const std::string &reason) {
+            Dataset &dataset = *datasets[run_images[job.index].dataset];
+            const std::string &image = dataset.images[run_images[job.index].index];
+            LOG(ERROR, "quarantined").field("root", dataset.path).field("image", image)
+                                     .field("reason", reason);
+            ImageResult &result = dataset.results[run_images[job.index].index];
+            emptyResult(image, columns.size(), &result);
+            result.downsample = job.param;
+            result.crashed = true;
+            QuarantineRecord record = { image, reason };
+            dataset.quarantine.push_back(record);
+            completeImage(0, job.index);
+        };
+        if (!supervisor->run(worker_jobs, completed, quarantine)) {
+            LOG(ERROR, "workers_failed");
+            failed = true;
+        }
+    };
+
+    std::vector<size_t> all_jobs(run_images.size());
+    for (size_t job = 0; job < run_images.size(); job++) all_jobs[job] = job;
+    if (supervisor) {
+        runWorkerPass(all_jobs, 1);
+    } else {
+        runPass(all_jobs, *reader, 1);
+    }
+
+    /* Retry the images that timed out on downsampled planes */
+    std::vector<size_t> retries;
+    std::vector<std::string> retry_paths;
+    for (size_t job = 0; job < run_images.size(); job++) {
+        Dataset &dataset = *datasets[run_images[job].dataset];
+        size_t index = run_images[job].index;
+        if ((index < dataset.next_row) || !dataset.results[index].timed_out) continue;
+        dataset.finished[index] = false;
+        retries.push_back(job);
+        retry_paths.push_back(input_paths[job]);
+    }
+    if (!failed && !retries.empty() && (options.retry_downsample > 1)) {
+        if (supervisor) {
+            runWorkerPass(retries, options.retry_downsample);
+        } else {
+            InputReader retry_reader(retry_paths, options);
+            runPass(retries, retry_reader, options.retry_downsample);
+        }
+    }
+    for (size_t d = 0; d < datasets.size(); d++) {
+        flushRows(*datasets[d], false);
+        datasets[d]->data_stream.close();
+        datasets[d]->sketch_stream.close();
+    }
+    if (failed) return -1;
+
+    /* Write and publish the batch files of every root */
+    size_t quarantined = 0;
+    for (size_t d = 0; d < datasets.size(); d++) {
+        if (!finishDataset(options, cascade, supervisor != NULL, datasets[d].get())) return -1;
+        quarantined += datasets[d]->quarantine.size();
+    }
+    if (supervisor) {
+        LOG(INFO, "workers_done").field("restarts", supervisor->restarts())
+                                 .field("quarantined", quarantined);
+    }
+
+    /* Then the indexes point at the published rows, each index file
+     * rewritten once for all the roots it holds */
+    std::map<std::string, std::vector<IndexEntry>> index_entries;
+    for (size_t d = 0; d < datasets.size(); d++) {
+        std::string index_file = options.index_file.empty() ?
+                                    datasets[d]->path + INDEX_FILE_NAME : options.index_file;
+        std::vector<IndexEntry> &entries = index_entries[index_file];
+        entries.insert(entries.end(), datasets[d]->index_entries.begin(),
+                                        datasets[d]->index_entries.end());
+    }
+    for (std::map<std::string, std::vector<IndexEntry>>::iterator it = index_entries.begin();
+                                                            it != index_entries.end(); it++) {
+        if (!updateResultsIndex(it->first, columns, it->second)) return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <vector>
+#include <cstdio>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "mask_file.hpp"
+#include "tiff_codec.hpp"
+
+
+static_assert(sizeof(MaskFileHeader) == MASK_HEADER_SIZE, "mask file header size");
+
+/* Pack rows [y0, y1) of a mask, 8 pixels per byte, leftmost in the high bit */
+static void packRows(const cv::Mat &mask, int y0, int y1, unsigned char *dst) {
+    const size_t row_bytes = ((size_t)mask.cols + 7) / 8;
+    for (int y = y0; y < y1; y++, dst += row_bytes) {
+        const unsigned char *row = mask.ptr(y);
+        int x = 0;
+        for (size_t b = 0; b + 1 < row_bytes; b++, x += 8) {
+            dst[b] = (unsigned char)((row[x]     & 0x80) | (row[x + 1] & 0x40) |
+                                     (row[x + 2] & 0x20) | (row[x + 3] & 0x10) |
+                                     (row[x + 4] & 0x08) | (row[x + 5] & 0x04) |
+                                     (row[x + 6] & 0x02) | (row[x + 7] & 0x01));
+        }
+        unsigned char last = 0;
+        for (int bit = 7; x < mask.cols; x++, bit--) last |= (row[x] ? 1 : 0) << bit;
+        dst[row_bytes - 1] = last;
+    }
+}
+
+/* Unpack rows [y0, y1) into 255 and 0 bytes */
+static void unpackRows(const unsigned char *src, int y0, int y1, cv::Mat *mask) {
+
+    struct Spread {
+        uint64_t bytes[256];
+        Spread() {
+            for (int v = 0; v < 256; v++) {
+                unsigned char pixels[8];
+                for (int bit = 0; bit < 8; bit++) pixels[bit] = (v & (0x80 >> bit)) ? 255 : 0;
+                memcpy(&bytes[v], pixels, sizeof(pixels));
+            }
+        }
+    };
+    static const Spread spread;
+
+    const size_t row_bytes = ((size_t)mask->cols + 7) / 8;
+    for (int y = y0; y < y1; y++, src += row_bytes) {
+        unsigned char *row = mask->ptr(y);
+        int x = 0;
+        for (size_t b = 0; b + 1 < row_bytes; b++, x += 8) {
+            memcpy(row + x, &spread.bytes[src[b]], 8);
+        }
+        for (int bit = 7; x < mask->cols; x++, bit--) {
+            row[x] = (src[row_bytes - 1] >> bit) & 1 ? 255 : 0;
+        }
+    }
+}
+
+/* Size and mtime of an input file, false if it is not there */
+static bool inputStamp(const std::string &input_path, uint64_t *size, int64_t *mtime) {
+    struct stat info;
+    if (stat(input_path.c_str(), &info) || !S_ISREG(info.st_mode)) return false;
+    *size = (uint64_t)info.st_size;
+    *mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+/* Write the masks, bands packed and compressed concurrently */
+bool writeMaskFile( const std::string &path, const ChannelMasks &masks,
+                    const cv::Rect &region, uint64_t content_hash,
+                    const std::string &input_path, ThreadPool *pool ) {
+
+    const cv::Mat *planes[MASK_PLANES] = { &masks.blue, &masks.green, &masks.red };
+    for (int p = 0; p < MASK_PLANES; p++) {
+        if ((planes[p]->type() != CV_8UC1) || (planes[p]->size() != masks.green.size()) ||
+                                                                    planes[p]->empty()) {
+            return false;
+        }
+    }
+
+    MaskFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MASK_MAGIC, sizeof(header.magic));
+    header.byte_order   = MASK_BYTE_ORDER;
+    header.version      = MASK_VERSION;
+    header.planes       = MASK_PLANES;
+    header.width        = masks.green.cols;
+    header.height       = masks.green.rows;
+    header.band_rows    = MASK_BAND_ROWS;
+    header.encoding     = compressionSupported(TIFF_COMPRESSION_ZSTD) ?
+                                    MaskEncoding::ZSTD : MaskEncoding::DEFLATE;
+    header.region_x     = region.x;
+    header.region_y     = region.y;
+    header.region_width = region.width;
+    header.region_height = region.height;
+    header.content_hash = content_hash;
+    inputStamp(input_path, &header.input_size, &header.input_mtime);
+
+    const size_t row_bytes = ((size_t)header.width + 7) / 8;
+    const size_t bands = (header.height + MASK_BAND_ROWS - 1) / MASK_BAND_ROWS;
+    std::vector<std::vector<unsigned char>> encoded(MASK_PLANES * bands);
+    std::vector<unsigned char> band_ok(encoded.size(), 0);
+    pool->parallelFor(encoded.size(), [&](size_t task) {
+        const cv::Mat &mask = *planes[task / bands];
+        int y0 = (int)((task % bands) * MASK_BAND_ROWS);
+        int y1 = std::min(y0 + MASK_BAND_ROWS, mask.rows);
+        std::vector<unsigned char> packed((y1 - y0) * row_bytes);
+        packRows(mask, y0, y1, packed.data());
+        band_ok[task] = (header.encoding == MaskEncoding::ZSTD) ?
+                            zstdEncode(packed.data(), packed.size(), &encoded[task]) :
+                            deflateEncode(packed.data(), packed.size(), &encoded[task]);
+    });
+
+    std::vector<uint64_t> table(encoded.size() + 1, 0);
+    for (size_t i = 0; i < encoded.size(); i++) {
+        if (!band_ok[i]) return false;
+        table[i + 1] = table[i] + encoded[i].size();
+    }
+
+    // Complete files only, a crash leaves at most the temporary one
+    std::string temp_path = path + ".tmp";
+    std::ofstream stream(temp_path.c_str(), std::ios::out | std::ios::binary);
+    if (!stream.is_open()) return false;
+    stream.write((const char *)&header, sizeof(header));
+    stream.write((const char *)table.data(), table.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < encoded.size(); i++) {
+        stream.write((const char *)encoded[i].data(), encoded[i].size());
+    }
+    stream.close();
+    if (stream.fail() || rename(temp_path.c_str(), path.c_str())) {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Check the header of a mask file */
+static bool validHeader(const MaskFileHeader &header) {
+    if (memcmp(header.magic, MASK_MAGIC, sizeof(header.magic)) ||
+            (header.byte_order != MASK_BYTE_ORDER) || (header.version != MASK_VERSION) ||
+            (header.planes != MASK_PLANES) || !header.band_rows ||
+            !header.width || !header.height ||
+            (header.width > INT_MAX) || (header.height > INT_MAX)) {
+        return false;
+    }
+    switch (header.encoding) {
+        case MaskEncoding::DEFLATE : return true;
+        case MaskEncoding::ZSTD    : return compressionSupported(TIFF_COMPRESSION_ZSTD);
+        default: return false;
+    }
+}
+
+/* The input still has the size and mtime recorded with the masks */
+bool maskInputMatches(const MaskFileHeader &header, const std::string &input_path) {
+    uint64_t size;
+    int64_t mtime;
+    return inputStamp(input_path, &size, &mtime) &&
+                    (size == header.input_size) && (mtime == header.input_mtime);
+}
+
+/* Check the header of a mask file, false if it is missing or unusable */
+bool readMaskHeader(const std::string &path, MaskFileHeader *header) {
+    std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
+    if (!stream.is_open()) return false;
+    if (!stream.read((char *)header, sizeof(*header))) return false;
+    return validHeader(*header);
+}
+
+/* Read the masks back, bands unpacked concurrently */
+bool readMaskFile(  const std::string &path, ThreadPool *pool,
+                    MaskFileHeader *header, ChannelMasks *masks ) {
+
+    std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (!stream.is_open()) return false;
+    size_t size = (size_t)stream.tellg();
+    if (size < MASK_HEADER_SIZE) return false;
+    std::vector<unsigned char> data(size);
+    stream.seekg(0);
+    if (!stream.read((char *)data.data(), size)) return false;
+    memcpy(header, data.data(), sizeof(*header));
+    if (!validHeader(*header)) return false;
+
+    // The band table must fit and point inside the file, in order
+    const size_t bands = ((size_t)header->height + header->band_rows - 1) / header->band_rows;
+    const size_t table_size = (MASK_PLANES * bands + 1) * sizeof(uint64_t);
+    if (size - MASK_HEADER_SIZE < table_size) return false;
+    std::vector<uint64_t> table(MASK_PLANES * bands + 1);
+    memcpy(table.data(), data.data() + MASK_HEADER_SIZE, table_size);
+    const unsigned char *bands_data = data.data() + MASK_HEADER_SIZE + table_size;
+    const size_t bands_size = size - MASK_HEADER_SIZE - table_size;
+    for (size_t i = 0; i + 1 < table.size(); i++) {
+        if ((table[i] > table[i + 1]) || (table[i + 1] > bands_size)) return false;
+    }
+
+    cv::Mat *planes[MASK_PLANES] = { &masks->blue, &masks->green, &masks->red };
+    for (int p = 0; p < MASK_PLANES; p++) {
+        planes[p]->create(header->height, header->width, CV_8UC1);
+    }
+    const size_t row_bytes = ((size_t)header->width + 7) / 8;
+    std::vector<unsigned char> band_ok(MASK_PLANES * bands, 0);
+    pool->parallelFor(band_ok.size(), [&](size_t task) {
+        cv::Mat *mask = planes[task / bands];
+        int y0 = (int)((task % bands) * header->band_rows);
+        int y1 = (int)std::min((size_t)y0 + header->band_rows, (size_t)header->height);
+        std::vector<unsigned char> packed((y1 - y0) * row_bytes);
+        const unsigned char *src = bands_data + table[task];
+        size_t src_size = table[task + 1] - table[task];
+        bool ok = (header->encoding == MaskEncoding::ZSTD) ?
+                            zstdDecode(src, src_size, packed.data(), packed.size()) :
+                            deflateDecode(src, src_size, packed.data(), packed.size());
+        if (ok) unpackRows(packed.data(), y0, y1, mask);
+        band_ok[task] = ok;
+    });
+    for (size_t i = 0; i < band_ok.size(); i++) {
+        if (!band_ok[i]) return false;
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef MASK_FILE_HPP
+#define MASK_FILE_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+#include "opencv2/core/core.hpp"
+
+#include "thread_pool.hpp"
+
+
+#define MASK_MAGIC              "CELLMASK"  // First 8 bytes of a mask file
+#define MASK_VERSION            2
+#define MASK_BYTE_ORDER         0x01020304  // Written in host byte order
+#define MASK_HEADER_SIZE        80          // Offset of the band table
+#define MASK_BAND_ROWS          256         // Rows packed and compressed together
+#define MASK_SUFFIX             ".masks"    // Mask file next to the input
+#define MASK_PLANES             3           // Blue, green and red
+
+/* Compression of the bit-packed bands */
+enum class MaskEncoding : uint32_t {
+    DEFLATE = 0,
+    ZSTD
+};
+
+/* Fixed size header of a mask file. It is followed by a table of
+ * MASK_PLANES * bands + 1 uint64_t offsets from the end of the table,
+ * band b of plane p owning [table[p * bands + b], table[p * bands + b + 1]),
+ * then the compressed bands. A band holds MASK_BAND_ROWS rows, fewer for
+ * the last one, of (width + 7) / 8 bytes with the leftmost pixel in the
+ * high bit. */
+struct MaskFileHeader {
+    char            magic[8];
+    uint32_t        byte_order;
+    uint16_t        version;
+    uint16_t        planes;
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        band_rows;
+    MaskEncoding    encoding;
+    uint32_t        region_x;           // --region the masks were cut with,
+    uint32_t        region_y;           // all 0 for the whole image
+    uint32_t        region_width;
+    uint32_t        region_height;
+    uint64_t        content_hash;       // Of the input the masks come from
+    uint64_t        input_size;         // Size and modification time of the
+    int64_t         input_mtime;        // input, in ns, 0 if it was not a file
+    unsigned char   reserved[8];
+};
+
+/* Thresholded channels of an image as enhanceImage leaves them, 255 on
+ * the foreground and 0 elsewhere */
+struct ChannelMasks {
+    cv::Mat         blue;
+    cv::Mat         green;
+    cv::Mat         red;
+};
+
+/* Write the masks, bands packed and compressed concurrently, with zstd
+ * when the build has it. The file is renamed into place once complete.
+ * region, content_hash and the size and mtime of the file at input_path
+ * are recorded for readMaskFile's callers. */
+bool writeMaskFile( const std::string &path, const ChannelMasks &masks,
+                    const cv::Rect &region, uint64_t content_hash,
+                    const std::string &input_path, ThreadPool *pool );
+
+/* The file at input_path still has the size and mtime recorded with the
+ * masks, false for masks left behind by a replaced input */
+bool maskInputMatches(const MaskFileHeader &header, const std::string &input_path);
+
+/* Check the header of a mask file, false if it is missing or unusable */
+bool readMaskHeader(const std::string &path, MaskFileHeader *header);
+
+/* Read the masks back, bands unpacked concurrently */
+bool readMaskFile(  const std::string &path, ThreadPool *pool,
+                    MaskFileHeader *header, ChannelMasks *masks );
+
+#endif // MASK_FILE_HPP
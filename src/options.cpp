@@ -0,0 +1,545 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+
+#include "options.hpp"
+#include "tiff_codec.hpp"
+#include "results_index.hpp"
+#include "grid_search.hpp"
+
+
+Options::Options() :
+    readahead_bytes((size_t)DEFAULT_READAHEAD_MB << 20),
+    io_backend(IoBackend::AUTO),
+    direct_io(false),
+    threads(0),
+    compression(TIFF_COMPRESSION_DEFLATE),
+    convert_store(false),
+    keep_masks(false),
+    from_masks(false),
+    region_x(0),
+    region_y(0),
+    region_width(0),
+    region_height(0),
+    label_output(LabelOutput::NONE),
+    jobs(1),
+    histograms(1, defaultHistogramSpec()),
+    strategy(AnalysisStrategy::AUTO),
+    filters(defaultFilterSpecs()),
+    simplify{SimplifyMethod::NONE, 0.0},
+    huge_pages(true),
+    numa(false),
+    deadline(0.0),
+    stage_deadline(0.0),
+    retry_downsample(0),
+    workers(0),
+    interactive_slots(1),
+    client_queue(DEFAULT_CLIENT_QUEUE),
+    class_queue(DEFAULT_CLASS_QUEUE),
+    sync_mode(SyncMode::FDATASYNC),
+    sync_group(DEFAULT_SYNC_GROUP),
+    log_level(LogLevel::INFO) {
+}
+
+/* Parse an unsigned integer option value */
+static bool parseUnsigned(const std::string &value, unsigned long *result) {
+    if (value.empty()) return false;
+    char *end = NULL;
+    *result = strtoul(value.c_str(), &end, 10);
+    return (*end == '\0');
+}
+
+/* Parse a duration in seconds */
+static bool parseSeconds(const std::string &value, double *result) {
+    if (value.empty()) return false;
+    char *end = NULL;
+    *result = strtod(value.c_str(), &end);
+    return (*end == '\0') && (*result >= 0);
+}
+
+/* Add a dataset root, the trailing / is optional. Roots are resolved so
+ * that a directory given twice, under any name, runs only once: two runs
+ * of it would write the same outputs concurrently. */
+static bool addRoot(std::string path, Options *options) {
+    size_t begin = path.find_first_not_of(" \t\r\n");
+    size_t end = path.find_last_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        std::cerr << "Invalid image directory path" << std::endl;
+        return false;
+    }
+    path = path.substr(begin, end - begin + 1);
+
+    // Roots that do not resolve are kept as given, their image list fails
+    char *real_path = realpath(path.c_str(), NULL);
+    if (real_path) path = real_path;
+    free(real_path);
+    if (path[path.size()-1] != '/') path += "/";
+    for (size_t i = 0; i < options->paths.size(); i++) {
+        if (options->paths[i] == path) {
+            std::cerr << "Skipping repeated image directory path " << path << std::endl;
+            return true;
+        }
+    }
+    options->paths.push_back(path);
+    return true;
+}
+
+/* Add the dataset roots listed in a file, one per line, surrounding
+ * blanks trimmed. Blank lines and lines starting with # are skipped. */
+static bool readRoots(const std::string &roots_file, Options *options) {
+    std::ifstream stream(roots_file.c_str());
+    if (!stream.is_open()) {
+        std::cerr << "Could not read the roots file " << roots_file << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(stream, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if ((begin == std::string::npos) || (line[begin] == '#')) continue;
+        if (!addRoot(line, options)) return false;
+    }
+    return true;
+}
+
+/* Parse the command line into the options */
+bool parseOptions(int argc, char *argv[], Options *options) {
+
+    bool default_histograms = true;
+    bool default_filters = true;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        // Positional arguments are the image directory paths
+        if (arg.compare(0, 2, "--")) {
+            if (!addRoot(arg, options)) return false;
+            continue;
+        }
+
+        std::string key = arg.substr(2);
+        std::string value;
+        size_t pos = key.find('=');
+        if (pos != std::string::npos) {
+            value = key.substr(pos+1);
+            key = key.substr(0, pos);
+        }
+
+        if (key == "readahead") {
+            unsigned long megabytes = 0;
+            if (!parseUnsigned(value, &megabytes)) {
+                std::cerr << "Invalid readahead size: " << value << std::endl;
+                return false;
+            }
+            options->readahead_bytes = (size_t)megabytes << 20;
+
+        } else if (key == "io") {
+            if (value == "auto") {
+                options->io_backend = IoBackend::AUTO;
+            } else if (value == "uring") {
+                options->io_backend = IoBackend::URING;
+            } else if (value == "sync") {
+                options->io_backend = IoBackend::SYNC;
+            } else {
+                std::cerr << "Invalid I/O backend: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "direct-io") {
+            options->direct_io = true;
+
+        } else if (key == "threads") {
+            unsigned long threads = 0;
+            if (!parseUnsigned(value, &threads)) {
+                std::cerr << "Invalid thread count: " << value << std::endl;
+                return false;
+            }
+            options->threads = (unsigned int)threads;
+
+        } else if (key == "compression") {
+            if (value == "none") {
+                options->compression = TIFF_COMPRESSION_NONE;
+            } else if (value == "lzw") {
+                options->compression = TIFF_COMPRESSION_LZW;
+            } else if (value == "deflate") {
+                options->compression = TIFF_COMPRESSION_DEFLATE;
+            } else if (value == "zstd") {
+                options->compression = TIFF_COMPRESSION_ZSTD;
+            } else {
+                std::cerr << "Invalid compression: " << value << std::endl;
+                return false;
+            }
+            if (!compressionSupported(options->compression)) {
+                std::cerr << "Compression not supported by this build: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "convert-store") {
+            options->convert_store = true;
+
+        } else if (key == "keep-masks") {
+            options->keep_masks = true;
+
+        } else if (key == "from-masks") {
+            options->from_masks = true;
+
+        } else if (key == "region") {
+            unsigned int x, y, width, height;
+            char trailing;
+            if ((sscanf(value.c_str(), "%u,%u,%u,%u%c", &x, &y, &width, &height,
+                                                        &trailing) != 4) || !width || !height) {
+                std::cerr << "Invalid region: " << value << std::endl;
+                return false;
+            }
+            options->region_x = x;
+            options->region_y = y;
+            options->region_width = width;
+            options->region_height = height;
+
+        } else if (key == "labels") {
+            if (value == "none") {
+                options->label_output = LabelOutput::NONE;
+            } else if (value == "raw") {
+                options->label_output = LabelOutput::RAW;
+            } else if (value == "rle") {
+                options->label_output = LabelOutput::RLE;
+            } else {
+                std::cerr << "Invalid label output: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "jobs") {
+            unsigned long jobs = 0;
+            if (!parseUnsigned(value, &jobs) || !jobs) {
+                std::cerr << "Invalid job count: " << value << std::endl;
+                return false;
+            }
+            options->jobs = (unsigned int)jobs;
+
+        } else if (key == "merge") {
+            if (value.empty()) {
+                std::cerr << "Invalid shard directory" << std::endl;
+                return false;
+            }
+            if (value[value.size()-1] != '/') value += "/";
+            options->merge_dirs.push_back(value);
+
+        } else if (key == "histogram") {
+            HistogramSpec spec;
+            if (!parseHistogramSpec(value, &spec)) {
+                std::cerr << "Invalid histogram: " << value << std::endl;
+                return false;
+            }
+            // The first histogram given replaces the default one
+            if (default_histograms) options->histograms.clear();
+            default_histograms = false;
+            options->histograms.push_back(spec);
+
+        } else if (key == "strategy") {
+            if (value == "auto") {
+                options->strategy = AnalysisStrategy::AUTO;
+            } else if (value == "sparse") {
+                options->strategy = AnalysisStrategy::SPARSE;
+            } else if (value == "dense") {
+                options->strategy = AnalysisStrategy::DENSE;
+            } else {
+                std::cerr << "Invalid strategy: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "filter") {
+            FilterSpec spec;
+            if (!parseFilterSpec(value, &spec)) {
+                std::cerr << "Invalid filter: " << value << std::endl;
+                return false;
+            }
+            // The first filter given replaces the default ones
+            if (default_filters) options->filters.clear();
+            default_filters = false;
+            options->filters.push_back(spec);
+
+        } else if (key == "simplify") {
+            if (!parseSimplifySpec(value, &options->simplify)) {
+                std::cerr << "Invalid simplification: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "grid") {
+            GridAxis axis;
+            if (!parseGridAxis(value, &axis)) {
+                std::cerr << "Invalid grid axis: " << value << std::endl;
+                return false;
+            }
+            options->grid.push_back(value);
+
+        } else if (key == "huge-pages") {
+            if (value == "on") {
+                options->huge_pages = true;
+            } else if (value == "off") {
+                options->huge_pages = false;
+            } else {
+                std::cerr << "Invalid huge pages setting: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "numa") {
+            options->numa = true;
+
+        } else if ((key == "deadline") || (key == "stage-deadline")) {
+            double seconds = 0.0;
+            if (!parseSeconds(value, &seconds)) {
+                std::cerr << "Invalid deadline: " << value << std::endl;
+                return false;
+            }
+            if (key == "deadline") {
+                options->deadline = seconds;
+            } else {
+                options->stage_deadline = seconds;
+            }
+
+        } else if (key == "retry-degraded") {
+            unsigned long factor = 0;
+            if (!parseUnsigned(value, &factor) || (factor < 2)) {
+                std::cerr << "Invalid downsampling factor: " << value << std::endl;
+                return false;
+            }
+            options->retry_downsample = (unsigned int)factor;
+
+        } else if (key == "workers") {
+            unsigned long workers = 0;
+            if (!parseUnsigned(value, &workers) || !workers) {
+                std::cerr << "Invalid number of workers: " << value << std::endl;
+                return false;
+            }
+            options->workers = (unsigned int)workers;
+
+        } else if (key == "serve") {
+            if (value.empty()) {
+                std::cerr << "Invalid socket path: " << value << std::endl;
+                return false;
+            }
+            options->serve_socket = value;
+
+        } else if ((key == "index") || (key == "query")) {
+            if (value.empty()) {
+                std::cerr << "Invalid " << key << ": " << value << std::endl;
+                return false;
+            }
+            if (key == "index") {
+                options->index_file = value;
+            } else {
+                options->queries.push_back(value);
+            }
+
+        } else if (key == "sync") {
+            if (value == "fdatasync") {
+                options->sync_mode = SyncMode::FDATASYNC;
+            } else if (value == "syncfs") {
+                options->sync_mode = SyncMode::SYNCFS;
+            } else if (value == "none") {
+                options->sync_mode = SyncMode::NONE;
+            } else {
+                std::cerr << "Invalid sync mode: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "sync-group") {
+            unsigned long group = 0;
+            if (!parseUnsigned(value, &group) || !group) {
+                std::cerr << "Invalid sync group: " << value << std::endl;
+                return false;
+            }
+            options->sync_group = (unsigned int)group;
+
+        } else if (key == "log") {
+            if (value.empty()) {
+                std::cerr << "Invalid log file" << std::endl;
+                return false;
+            }
+            options->log_file = value;
+
+        } else if (key == "log-level") {
+            if (!parseLogLevel(value, &options->log_level)) {
+                std::cerr << "Invalid log level: " << value << std::endl;
+                return false;
+            }
+
+        } else if (key == "roots") {
+            if (!readRoots(value, options)) return false;
+
+        } else if (key == "interactive-slots") {
+            unsigned long slots = 0;
+            if (!parseUnsigned(value, &slots)) {
+                std::cerr << "Invalid number of interactive slots: " << value << std::endl;
+                return false;
+            }
+            options->interactive_slots = (unsigned int)slots;
+
+        } else if ((key == "client-queue") || (key == "class-queue")) {
+            unsigned long limit = 0;
+            if (!parseUnsigned(value, &limit) || !limit) {
+                std::cerr << "Invalid queue limit: " << value << std::endl;
+                return false;
+            }
+            if (key == "client-queue") {
+                options->client_queue = (unsigned int)limit;
+            } else {
+                options->class_queue = (unsigned int)limit;
+            }
+
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options->paths.empty()) {
+        std::cerr << "Invalid number of arguments." << std::endl;
+        return false;
+    }
+    options->path = options->paths[0];
+
+    // Masks hold no intensities to filter or bin cells on
+    if (options->from_masks) {
+        bool intensity = false;
+        for (size_t i = 0; i < options->filters.size(); i++) {
+            intensity |= (options->filters[i].kind == FilterKind::INTENSITY);
+        }
+        for (size_t i = 0; i < options->histograms.size(); i++) {
+            intensity |= (options->histograms[i].feature == CellFeature::INTENSITY);
+        }
+        if (intensity) {
+            std::cerr << "Intensity filters and histograms need the images, not --from-masks"
+                      << std::endl;
+            return false;
+        }
+    }
+
+    // Every parameter swept once, over a grid a run can hold per image
+    if (!options->grid.empty()) {
+        std::vector<GridAxis> axes(options->grid.size());
+        for (size_t i = 0; i < axes.size(); i++) {
+            parseGridAxis(options->grid[i], &axes[i]);
+            for (size_t j = 0; j < i; j++) {
+                if (axes[j].name == axes[i].name) {
+                    std::cerr << "Repeated grid axis: " << axes[i].name << std::endl;
+                    return false;
+                }
+            }
+        }
+        if (gridPoints(axes) > GRID_MAX_POINTS) {
+            std::cerr << "Grid of more than " << GRID_MAX_POINTS << " points" << std::endl;
+            return false;
+        }
+        if (options->from_masks) {
+            std::cerr << "A grid search thresholds the images, not --from-masks" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Print the command line usage */
+void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] <image directory path>..."
+              << std::endl
+              << "  --readahead=<MiB>      bytes kept in flight across upcoming images"
+              << " (default " << DEFAULT_READAHEAD_MB << ")" << std::endl
+              << "  --io=auto|uring|sync   input reader backend (default auto)" << std::endl
+              << "  --direct-io            bypass the page cache for input reads" << std::endl
+              << "  --threads=<N>          worker threads (default: number of cores)" << std::endl
+              << "  --compression=deflate|lzw|zstd|none" << std::endl
+              << "                         compression of the TIFF outputs (default deflate)"
+              << std::endl
+              << "  --convert-store        keep a chunked array store (Zarr v2) of each input"
+              << std::endl
+              << "  --keep-masks           keep the bit-packed thresholded masks of each input"
+              << std::endl
+              << "  --from-masks           start from the kept masks, skipping decode and"
+              << std::endl
+              << "                         enhancement (no output images)" << std::endl
+              << "  --region=x,y,w,h       analyze only this region of every image" << std::endl
+              << "  --labels=none|raw|rle  write memory-mappable label images (default none)"
+              << std::endl
+              << "  --jobs=<N>             images processed concurrently (default 1)" << std::endl
+              << "  --merge=<directory>    combine the summaries and sketches of a shard"
+              << std::endl
+              << "                         into the image directory, repeat per shard"
+              << std::endl
+              << "  --histogram=<feature>:linear:<start>:<width>:<bins>" << std::endl
+              << "  --histogram=<feature>:log:<start>:<end>:<bins>" << std::endl
+              << "  --histogram=<feature>:edges:<e0>,<e1>,..." << std::endl
+              << "                         per-cell histogram of area, diameter, aspect_ratio,"
+              << std::endl
+              << "                         perimeter or intensity, repeat per histogram"
+              << std::endl
+              << "                         (default area:linear:0:40:11)" << std::endl
+              << "  --strategy=auto|sparse|dense" << std::endl
+              << "                         contour processing strategies, auto picks them"
+              << std::endl
+              << "                         per channel from its density (default auto),"
+              << std::endl
+              << "                         dense approximates the min-rect of the cells"
+              << std::endl
+              << "  --filter=<property>:<min>[:<max>]" << std::endl
+              << "                         keep the cells whose points, area, perimeter, bbox,"
+              << std::endl
+              << "                         aspect_ratio, solidity or intensity is in range,"
+              << std::endl
+              << "                         repeat per filter (default points:5 perimeter:20)"
+              << std::endl
+              << "  --simplify=none|dp:<tolerance>|vw:<tolerance>" << std::endl
+              << "                         simplify the cells before their features"
+              << " (default none)" << std::endl
+              << "  --grid=<param>:<start>:<end>:<step>" << std::endl
+              << "  --grid=<param>:<v1>,<v2>,..." << std::endl
+              << "                         sweep green_threshold, red_threshold,"
+              << " blue_threshold or" << std::endl
+              << "                         <filter>_min|max decoding every image once, repeat"
+              << std::endl
+              << "                         per parameter, results in " << GRID_RESULTS_FILE
+              << std::endl
+              << "  --huge-pages=on|off    image planes on transparent huge pages (default on)"
+              << std::endl
+              << "  --numa                 one pinned pool per NUMA node, image planes placed"
+              << std::endl
+              << "                         on the node processing the image" << std::endl
+              << "  --deadline=<seconds>   time budget of each image (default none)" << std::endl
+              << "  --stage-deadline=<seconds>" << std::endl
+              << "                         time budget of each stage of an image (default none)"
+              << std::endl
+              << "  --retry-degraded=<N>   retry the timed-out images downsampled N times"
+              << std::endl
+              << "  --workers=<N>          process the images in N crash-isolated worker"
+              << std::endl
+              << "                         processes, quarantining those they die on" << std::endl
+              << "  --serve=<socket>       analyze the images submitted in shared memory"
+              << std::endl
+              << "                         over this Unix socket instead of the image list"
+              << std::endl
+              << "  --interactive-slots=<N>" << std::endl
+              << "                         of the --jobs submissions served at once, slots"
+              << std::endl
+              << "                         bulk submissions may not take (default 1)" << std::endl
+              << "  --client-queue=<N>     submissions a client may have waiting"
+              << " (default " << DEFAULT_CLIENT_QUEUE << ")" << std::endl
+              << "  --class-queue=<N>      submissions a priority class may have waiting"
+              << " (default " << DEFAULT_CLASS_QUEUE << ")" << std::endl
+              << "  --index=<file>         results index to update and query"
+              << " (default: " << INDEX_FILE_NAME << " in the path)" << std::endl
+              << "  --query=<condition>    list the indexed images with name=<image>,"
+              << std::endl
+              << "                         hash=<hex> or <column><op><number>, op one of"
+              << std::endl
+              << "                         < <= > >= = !=, repeat to combine" << std::endl
+              << "  --sync=fdatasync|syncfs|none" << std::endl
+              << "                         how the outputs are made durable before they are"
+              << std::endl
+              << "                         published (default fdatasync)" << std::endl
+              << "  --sync-group=<N>       images per commit of the outputs"
+              << " (default " << DEFAULT_SYNC_GROUP << ")" << std::endl
+              << "  --roots=<file>         more image directory paths, one per line" << std::endl
+              << "  --log=<file>           JSON lines log (default: standard error)" << std::endl
+              << "  --log-level=debug|info|warn|error|off" << std::endl
+              << "                         lowest level logged (default info)" << std::endl;
+}
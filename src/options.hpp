@@ -0,0 +1,90 @@
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "histogram.hpp"
+#include "cell_filter.hpp"
+#include "contour_simplify.hpp"
+#include "artifact_publisher.hpp"
+#include "event_log.hpp"
+
+
+#define DEFAULT_READAHEAD_MB    256   // Default bytes kept in flight (MiB)
+#define DEFAULT_CLIENT_QUEUE    16    // Submissions a client may have waiting
+#define DEFAULT_CLASS_QUEUE     256   // Submissions a priority class may have waiting
+
+/* I/O backend used for reading the input images */
+enum class IoBackend : unsigned char {
+    AUTO = 0,
+    URING,
+    SYNC
+};
+
+/* Label images written for every channel */
+enum class LabelOutput : unsigned char {
+    NONE = 0,
+    RAW,
+    RLE
+};
+
+/* Contour processing strategies, AUTO picks them per channel by density */
+enum class AnalysisStrategy : unsigned char {
+    AUTO = 0,
+    SPARSE,
+    DENSE
+};
+
+/* Command line options */
+struct Options {
+    std::string     path;               // Image directory path, the first of paths
+    std::vector<std::string> paths;     // Dataset roots of a batch run, with / at end
+    size_t          readahead_bytes;    // Bytes kept in flight across upcoming images
+    IoBackend       io_backend;         // Backend used by the input reader
+    bool            direct_io;          // Open the inputs with O_DIRECT
+    unsigned int    threads;            // Worker threads, 0 for the core count
+    unsigned int    compression;        // TIFF compression of the output images
+    bool            convert_store;      // Convert the inputs into chunked array stores
+    bool            keep_masks;         // Keep the thresholded masks of each input
+    bool            from_masks;         // Start from the kept masks, skipping decode
+    unsigned int    region_x;           // Region of interest, whole image if
+    unsigned int    region_y;           // region_width is 0
+    unsigned int    region_width;
+    unsigned int    region_height;
+    LabelOutput     label_output;       // Per channel label images of the cells
+    unsigned int    jobs;               // Images processed concurrently
+    std::vector<std::string> merge_dirs;    // Shard directories to combine, if any
+    std::vector<HistogramSpec> histograms;  // Per-cell histograms of every channel
+    AnalysisStrategy strategy;          // Contour processing strategies
+    std::vector<FilterSpec> filters;    // Cell filters, ordered at run time
+    SimplifySpec    simplify;           // Cell simplification before the features
+    bool            huge_pages;         // Image planes on transparent huge pages
+    bool            numa;               // Pinned pool per node, planes placed on it
+    double          deadline;           // Seconds per image, 0 for no limit
+    double          stage_deadline;     // Seconds per stage, 0 for no limit
+    unsigned int    retry_downsample;   // Downsampling of timed-out retries, 0 for none
+    unsigned int    workers;            // Worker processes, 0 to run in threads
+    std::string     serve_socket;       // Serve submissions on this socket, if any
+    unsigned int    interactive_slots;  // Of the --jobs slots, kept from bulk submissions
+    unsigned int    client_queue;       // Admission limit per client
+    unsigned int    class_queue;        // Admission limit per priority class
+    std::string     index_file;         // Results index, empty for the one in the path
+    std::vector<std::string> queries;   // Conditions to look up in the index, if any
+    std::vector<std::string> grid;      // Parameter axes of a grid search, if any
+    SyncMode        sync_mode;          // Durability of the commits of the outputs
+    unsigned int    sync_group;         // Images per commit
+    std::string     log_file;           // JSON lines log, standard error if empty
+    LogLevel        log_level;          // Lowest level logged
+
+    Options();
+};
+
+/* Parse the command line into the options */
+bool parseOptions(int argc, char *argv[], Options *options);
+
+/* Print the command line usage */
+void printUsage(const char *program);
+
+#endif // OPTIONS_HPP
@@ -0,0 +1,158 @@
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+
+#include "plane_memory.hpp"
+
+
+/* Parse a sysfs CPU list such as "0-15,32-47" */
+static std::vector<int> parseCpuList(const std::string &text) {
+    std::vector<int> cpus;
+    std::stringstream stream(text);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || (range[0] < '0') || (range[0] > '9')) continue;
+        int first = atoi(range.c_str()), last = first;
+        size_t dash = range.find('-');
+        if (dash != std::string::npos) last = atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/* Read the nodes and their CPUs from sysfs */
+NumaTopology readNumaTopology() {
+
+    NumaTopology topology;
+    std::vector<int> node_ids;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "node", 4) || (entry->d_name[4] < '0') ||
+                                                    (entry->d_name[4] > '9')) {
+                continue;
+            }
+            node_ids.push_back(atoi(entry->d_name + 4));
+        }
+        closedir(dir);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+
+    // Nodes without CPUs (memory only) cannot run workers
+    for (size_t i = 0; i < node_ids.size(); i++) {
+        std::ostringstream path;
+        path << "/sys/devices/system/node/node" << node_ids[i] << "/cpulist";
+        std::ifstream stream(path.str().c_str());
+        std::string line;
+        if (!std::getline(stream, line)) continue;
+        std::vector<int> cpus = parseCpuList(line);
+        if (!cpus.empty()) topology.node_cpus.push_back(cpus);
+    }
+
+    if (topology.node_cpus.empty()) {
+        unsigned int cores = std::thread::hardware_concurrency();
+        std::vector<int> cpus;
+        for (unsigned int cpu = 0; cpu < std::max(cores, 1u); cpu++) cpus.push_back(cpu);
+        topology.node_cpus.push_back(cpus);
+    }
+    return topology;
+}
+
+/* Pin the calling thread to the CPUs, false if not permitted */
+bool pinCurrentThread(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if ((cpus[i] >= 0) && (cpus[i] < CPU_SETSIZE)) CPU_SET(cpus[i], &set);
+    }
+    return !sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Whether transparent huge pages are enabled for madvised regions */
+static bool transparentHugePages() {
+    static const bool enabled = [] {
+        std::ifstream stream("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string line;
+        if (!std::getline(stream, line)) return false;
+        return line.find("[never]") == std::string::npos;
+    }();
+    return enabled;
+}
+
+
+PlaneBuffer::PlaneBuffer(size_t size, bool huge_pages) :
+    m_data(NULL), m_size(0), m_huge_pages(false) {
+
+    if (!size) return;
+    size_t length = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+
+    // Over-map by one huge page and trim both ends to a 2 MB boundary
+    size_t mapped = length + HUGE_PAGE_SIZE;
+    void *map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return;
+    uintptr_t start = (uintptr_t)map;
+    uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+    if (aligned > start) munmap(map, aligned - start);
+    size_t tail = (start + mapped) - (aligned + length);
+    if (tail) munmap((void *)(aligned + length), tail);
+
+    m_data = (unsigned char *)aligned;
+    m_size = length;
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && transparentHugePages()) {
+        m_huge_pages = !madvise(m_data, m_size, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+PlaneBuffer::~PlaneBuffer() {
+    if (m_data) munmap(m_data, m_size);
+}
+
+/* NULL if the memory could not be mapped */
+unsigned char *PlaneBuffer::data() const {
+    return m_data;
+}
+
+size_t PlaneBuffer::size() const {
+    return m_size;
+}
+
+/* Whether the kernel accepted the huge page advice */
+bool PlaneBuffer::hugePages() const {
+    return m_huge_pages;
+}
+
+/* Fault every page in from the calling thread. Base pages are stepped
+ * over even with the huge page advice, which the kernel may not honour
+ * at fault time. */
+void PlaneBuffer::firstTouch() {
+    for (size_t offset = 0; offset < m_size; offset += SMALL_PAGE_SIZE) m_data[offset] = 0;
+}
+
+/* Continuous planes carved out of one PlaneBuffer */
+bool allocatePlanes(int rows, int cols, int type, size_t count,
+                    bool huge_pages, bool first_touch,
+                    std::vector<cv::Mat> *planes,
+                    std::shared_ptr<PlaneBuffer> *buffer    ) {
+
+    size_t step = (size_t)cols * CV_ELEM_SIZE(type);
+    size_t plane_size = (step * rows + PLANE_ALIGNMENT - 1) & ~((size_t)PLANE_ALIGNMENT - 1);
+    buffer->reset(new PlaneBuffer(plane_size * count, huge_pages));
+    if (!(*buffer)->data()) return false;
+    if (first_touch) (*buffer)->firstTouch();
+
+    planes->resize(count);
+    for (size_t i = 0; i < count; i++) {
+        (*planes)[i] = cv::Mat(rows, cols, type, (*buffer)->data() + i * plane_size, step);
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef PLANE_MEMORY_HPP
+#define PLANE_MEMORY_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "opencv2/core/core.hpp"
+
+
+#define HUGE_PAGE_SIZE          (2 << 20)   // Transparent huge page size
+#define SMALL_PAGE_SIZE         4096        // Base page size
+#define PLANE_ALIGNMENT         4096        // Alignment of each plane in a buffer
+
+/* CPUs of every NUMA node, a single node holding every CPU without NUMA */
+struct NumaTopology {
+    std::vector<std::vector<int>>   node_cpus;
+};
+
+/* Read the nodes and their CPUs from sysfs */
+NumaTopology readNumaTopology();
+
+/* Pin the calling thread to the CPUs, false if not permitted */
+bool pinCurrentThread(const std::vector<int> &cpus);
+
+/* Anonymous memory for the planes of one image, 2 MB aligned and advised
+ * for transparent huge pages. Falls back to base pages when the kernel
+ * has THP disabled. */
+class PlaneBuffer {
+public:
+    PlaneBuffer(size_t size, bool huge_pages);
+    ~PlaneBuffer();
+
+    /* NULL if the memory could not be mapped */
+    unsigned char *data() const;
+    size_t size() const;
+
+    /* Whether the kernel accepted the huge page advice */
+    bool hugePages() const;
+
+    /* Fault every page in from the calling thread, which places them on
+     * its NUMA node under the default first-touch policy */
+    void firstTouch();
+
+private:
+    PlaneBuffer(const PlaneBuffer &);
+    PlaneBuffer &operator=(const PlaneBuffer &);
+
+    unsigned char  *m_data;
+    size_t          m_size;
+    bool            m_huge_pages;
+};
+
+/* Continuous rows x cols planes of the given type carved out of one
+ * PlaneBuffer, which must outlive the planes. With first_touch the pages
+ * are faulted in by the calling thread. */
+bool allocatePlanes(int rows, int cols, int type, size_t count,
+                    bool huge_pages, bool first_touch,
+                    std::vector<cv::Mat> *planes,
+                    std::shared_ptr<PlaneBuffer> *buffer    );
+
+#endif // PLANE_MEMORY_HPP
@@ -0,0 +1,205 @@
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdint.h>
+
+#include "quantile_sketch.hpp"
+
+
+/* Arcsine scale function and its inverse, centroids are kept within one
+ * unit of k so that they shrink towards the tails */
+static double scaleK(double q) {
+    return SKETCH_COMPRESSION / (2.0 * M_PI) * asin(2.0 * q - 1.0);
+}
+
+static double scaleQ(double k) {
+    if (k >= SKETCH_COMPRESSION / 4.0) return 1.0;
+    return (sin(k * 2.0 * M_PI / SKETCH_COMPRESSION) + 1.0) / 2.0;
+}
+
+QuantileSketch::QuantileSketch() :
+    m_count(0),
+    m_min(std::numeric_limits<double>::infinity()),
+    m_max(-std::numeric_limits<double>::infinity()) {
+}
+
+void QuantileSketch::add(double value, double weight) {
+    if (!(weight > 0) || std::isnan(value)) return;
+    Centroid centroid = { value, weight };
+    m_buffer.push_back(centroid);
+    m_count += weight;
+    if (value < m_min) m_min = value;
+    if (value > m_max) m_max = value;
+    if (m_buffer.size() >= SKETCH_BUFFER_SIZE) compress();
+}
+
+/* Fold another sketch into this one */
+void QuantileSketch::merge(const QuantileSketch &other) {
+    if (!other.m_count) return;
+    m_buffer.insert(m_buffer.end(), other.m_centroids.begin(), other.m_centroids.end());
+    m_buffer.insert(m_buffer.end(), other.m_buffer.begin(), other.m_buffer.end());
+    m_count += other.m_count;
+    if (other.m_min < m_min) m_min = other.m_min;
+    if (other.m_max > m_max) m_max = other.m_max;
+    if (m_buffer.size() >= SKETCH_BUFFER_SIZE) compress();
+}
+
+/* Merge the buffer into the centroids in one sorted pass */
+void QuantileSketch::compress() const {
+    if (m_buffer.empty()) return;
+
+    m_buffer.insert(m_buffer.end(), m_centroids.begin(), m_centroids.end());
+    std::sort(m_buffer.begin(), m_buffer.end(),
+              [](const Centroid &a, const Centroid &b) { return a.mean < b.mean; });
+
+    double total = 0;
+    for (size_t i = 0; i < m_buffer.size(); i++) total += m_buffer[i].weight;
+
+    m_centroids.clear();
+    Centroid current = m_buffer[0];
+    double weight_so_far = 0;
+    double weight_limit = total * scaleQ(scaleK(0) + 1);
+    for (size_t i = 1; i < m_buffer.size(); i++) {
+        const Centroid &next = m_buffer[i];
+        if (weight_so_far + current.weight + next.weight <= weight_limit) {
+            current.weight += next.weight;
+            current.mean += (next.mean - current.mean) * next.weight / current.weight;
+        } else {
+            weight_so_far += current.weight;
+            m_centroids.push_back(current);
+            weight_limit = total * scaleQ(scaleK(weight_so_far / total) + 1);
+            current = next;
+        }
+    }
+    m_centroids.push_back(current);
+    m_buffer.clear();
+}
+
+/* Value at quantile q, interpolated between centroid centers */
+double QuantileSketch::quantile(double q) const {
+
+    compress();
+    if (m_centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+    if (q <= 0) return m_min;
+    if (q >= 1) return m_max;
+    if (m_centroids.size() == 1) return m_centroids[0].mean;
+
+    double index = q * m_count;
+    const Centroid &first = m_centroids.front();
+    if (index < first.weight / 2) {
+        return m_min + (first.mean - m_min) * index / (first.weight / 2);
+    }
+
+    double cumulative = first.weight / 2;
+    for (size_t i = 0; i + 1 < m_centroids.size(); i++) {
+        const Centroid &left = m_centroids[i], &right = m_centroids[i + 1];
+        double step = (left.weight + right.weight) / 2;
+        if (index < cumulative + step) {
+            return left.mean + (right.mean - left.mean) * (index - cumulative) / step;
+        }
+        cumulative += step;
+    }
+
+    const Centroid &last = m_centroids.back();
+    double tail = m_count - cumulative;
+    if (tail <= 0) return m_max;
+    return last.mean + (m_max - last.mean) * (index - cumulative) / tail;
+}
+
+double QuantileSketch::count() const {
+    return m_count;
+}
+
+double QuantileSketch::min() const {
+    return m_min;
+}
+
+double QuantileSketch::max() const {
+    return m_max;
+}
+
+/* Compact binary form: count, min, max, then float (mean, weight) pairs */
+void QuantileSketch::serialize(std::string *bytes) const {
+    compress();
+    uint32_t num_centroids = (uint32_t)m_centroids.size();
+    bytes->clear();
+    bytes->append((const char *)&num_centroids, sizeof(num_centroids));
+    bytes->append((const char *)&m_count, sizeof(m_count));
+    bytes->append((const char *)&m_min, sizeof(m_min));
+    bytes->append((const char *)&m_max, sizeof(m_max));
+    for (size_t i = 0; i < m_centroids.size(); i++) {
+        float pair[2] = { (float)m_centroids[i].mean, (float)m_centroids[i].weight };
+        bytes->append((const char *)pair, sizeof(pair));
+    }
+}
+
+bool QuantileSketch::deserialize(const std::string &bytes) {
+    const size_t header_size = sizeof(uint32_t) + 3 * sizeof(double);
+    if (bytes.size() < header_size) return false;
+    uint32_t num_centroids;
+    const char *p = bytes.data();
+    memcpy(&num_centroids, p, sizeof(num_centroids));           p += sizeof(num_centroids);
+    if (bytes.size() != header_size + num_centroids * 2 * sizeof(float)) return false;
+    memcpy(&m_count, p, sizeof(m_count));                       p += sizeof(m_count);
+    memcpy(&m_min, p, sizeof(m_min));                           p += sizeof(m_min);
+    memcpy(&m_max, p, sizeof(m_max));                           p += sizeof(m_max);
+
+    m_buffer.clear();
+    m_centroids.resize(num_centroids);
+    for (uint32_t i = 0; i < num_centroids; i++) {
+        float pair[2];
+        memcpy(pair, p, sizeof(pair));                          p += sizeof(pair);
+        m_centroids[i].mean = pair[0];
+        m_centroids[i].weight = pair[1];
+    }
+    return true;
+}
+
+
+static void writeField(std::ostream &stream, const std::string &field) {
+    uint32_t size = (uint32_t)field.size();
+    stream.write((const char *)&size, sizeof(size));
+    stream.write(field.data(), field.size());
+}
+
+static bool readField(std::istream &stream, std::string *field) {
+    uint32_t size;
+    if (!stream.read((char *)&size, sizeof(size))) return false;
+    field->resize(size);
+    return size ? (bool)stream.read(&(*field)[0], size) : true;
+}
+
+void writeSketchHeader(std::ostream &stream) {
+    stream.write(SKETCH_FILE_MAGIC, strlen(SKETCH_FILE_MAGIC));
+}
+
+void writeSketchRecord(std::ostream &stream, const SketchRecord &record) {
+    std::string bytes;
+    record.sketch.serialize(&bytes);
+    writeField(stream, record.image);
+    writeField(stream, record.channel);
+    writeField(stream, record.metric);
+    writeField(stream, bytes);
+}
+
+bool readSketchFile(const std::string &path, std::vector<SketchRecord> *records) {
+
+    std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
+    if (!stream.is_open()) return false;
+    std::string magic(strlen(SKETCH_FILE_MAGIC), '\0');
+    if (!stream.read(&magic[0], magic.size()) || (magic != SKETCH_FILE_MAGIC)) return false;
+
+    while (stream.peek() != EOF) {
+        SketchRecord record;
+        std::string bytes;
+        if (!readField(stream, &record.image) || !readField(stream, &record.channel) ||
+                !readField(stream, &record.metric) || !readField(stream, &bytes) ||
+                !record.sketch.deserialize(bytes)) {
+            return false;
+        }
+        records->push_back(record);
+    }
+    return true;
+}
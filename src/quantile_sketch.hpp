@@ -0,0 +1,63 @@
+#ifndef QUANTILE_SKETCH_HPP
+#define QUANTILE_SKETCH_HPP
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+
+#define SKETCH_COMPRESSION      100     // t-digest compression, ~2x centroids at most
+#define SKETCH_BUFFER_SIZE      500     // Values buffered before compressing
+#define SKETCH_FILE_MAGIC       "SKETCHES"
+
+/* Mergeable quantile sketch of a stream of values (merging t-digest with
+ * the arcsine scale function). Accurate at the tails, a few KiB at most. */
+class QuantileSketch {
+public:
+    QuantileSketch();
+
+    void add(double value, double weight = 1.0);
+
+    /* Fold another sketch into this one */
+    void merge(const QuantileSketch &other);
+
+    /* Value at quantile q in [0, 1], NaN when empty */
+    double quantile(double q) const;
+
+    double count() const;
+    double min() const;
+    double max() const;
+
+    /* Compact binary form: count, min, max, then float (mean, weight) pairs */
+    void serialize(std::string *bytes) const;
+    bool deserialize(const std::string &bytes);
+
+private:
+    struct Centroid {
+        double  mean;
+        double  weight;
+    };
+
+    void compress() const;
+
+    mutable std::vector<Centroid>   m_centroids;    // Sorted by mean once compressed
+    mutable std::vector<Centroid>   m_buffer;       // Values not yet compressed
+    double                          m_count;
+    double                          m_min;
+    double                          m_max;
+};
+
+/* One sketch of a sketch file, keyed by image, channel and metric */
+struct SketchRecord {
+    std::string     image;
+    std::string     channel;
+    std::string     metric;
+    QuantileSketch  sketch;
+};
+
+/* Sketch files hold SKETCH_FILE_MAGIC then length-prefixed records */
+void writeSketchHeader(std::ostream &stream);
+void writeSketchRecord(std::ostream &stream, const SketchRecord &record);
+bool readSketchFile(const std::string &path, std::vector<SketchRecord> *records);
+
+#endif // QUANTILE_SKETCH_HPP
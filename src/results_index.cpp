@@ -0,0 +1,514 @@
+#include <map>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "results_index.hpp"
+#include "artifact_publisher.hpp"
+#include "event_log.hpp"
+
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotateLeft(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return rotateLeft(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* 64-bit hash of a buffer (xxHash64, seed 0), four lanes of 8 bytes */
+uint64_t contentHash(const void *data, size_t size) {
+
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+        }
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = xxhMerge(hash, v1);
+        hash = xxhMerge(hash, v2);
+        hash = xxhMerge(hash, v3);
+        hash = xxhMerge(hash, v4);
+    } else {
+        hash = XXH_PRIME64_5;
+    }
+    hash += size;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= xxhRound(0, read64(p));
+        hash = rotateLeft(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        hash ^= (uint64_t)word * XXH_PRIME64_1;
+        hash = rotateLeft(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= (*p) * XXH_PRIME64_5;
+        hash = rotateLeft(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static uint64_t nameHash(const std::string &name) {
+    return contentHash(name.data(), name.size());
+}
+
+static uint64_t alignSection(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/* A section of count items of item_size bytes at offset lies within the
+ * file, the products checked before they could wrap */
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t item_size, uint64_t total) {
+    if (item_size && (count > total / item_size)) return false;
+    return offset <= total - count * item_size;
+}
+
+
+ResultsIndex::ResultsIndex() :
+    m_data(NULL),
+    m_size(0),
+    m_header(NULL),
+    m_records(NULL),
+    m_by_hash(NULL) {
+}
+
+ResultsIndex::~ResultsIndex() {
+    if (m_data) munmap((void *)m_data, m_size);
+}
+
+/* Map the index and check that its sections fit in the file and that the
+ * content hash order only names records of the file */
+bool ResultsIndex::open(const std::string &path) {
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat info;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &info) && (info.st_size >= (off_t)sizeof(IndexHeader))) {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    m_data = (const unsigned char *)map;
+    m_size = info.st_size;
+    m_header = (const IndexHeader *)m_data;
+
+    const IndexHeader &h = *m_header;
+    const uint64_t n = h.num_entries;
+    const uint64_t aligned = h.columns_offset | h.records_offset | h.by_hash_offset |
+                                                                    h.values_offset;
+    bool valid = !memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) && !(aligned & 7) &&
+            (n <= UINT32_MAX) && (!n || (h.num_columns <= m_size / n)) &&
+            sectionFits(h.columns_offset, h.num_columns, sizeof(uint32_t), m_size) &&
+            sectionFits(h.records_offset, n, sizeof(IndexRecord), m_size) &&
+            sectionFits(h.by_hash_offset, n, sizeof(uint32_t), m_size) &&
+            sectionFits(h.values_offset, h.num_columns * n, sizeof(double), m_size) &&
+            sectionFits(h.strings_offset, h.strings_size, 1, m_size) &&
+            (!h.strings_size || !m_data[h.strings_offset + h.strings_size - 1]);
+    if (valid) {
+        m_records = (const IndexRecord *)(m_data + h.records_offset);
+        m_by_hash = (const uint32_t *)(m_data + h.by_hash_offset);
+        for (uint64_t i = 0; valid && (i < n); i++) valid = (m_by_hash[i] < n);
+    }
+    if (!valid) {
+        LOG(ERROR, "invalid_results_index").field("path", path);
+        m_header = NULL;
+        m_records = NULL;
+        m_by_hash = NULL;
+        return false;
+    }
+
+    const uint32_t *names = (const uint32_t *)(m_data + h.columns_offset);
+    m_columns.clear();
+    for (uint64_t c = 0; c < h.num_columns; c++) m_columns.push_back(string(names[c]));
+    return true;
+}
+
+const char *ResultsIndex::string(uint32_t offset) const {
+    if (offset >= m_header->strings_size) return "";
+    return (const char *)m_data + m_header->strings_offset + offset;
+}
+
+size_t ResultsIndex::size() const {
+    return m_header ? m_header->num_entries : 0;
+}
+
+const std::vector<std::string> &ResultsIndex::columns() const {
+    return m_columns;
+}
+
+/* Column number of a name, -1 if the index has none */
+int ResultsIndex::column(const std::string &name) const {
+    for (size_t c = 0; c < m_columns.size(); c++) {
+        if (m_columns[c] == name) return (int)c;
+    }
+    return -1;
+}
+
+/* Values of a column, one per entry in entry order */
+const double *ResultsIndex::values(size_t column) const {
+    return (const double *)(m_data + m_header->values_offset) + column * m_header->num_entries;
+}
+
+IndexEntry ResultsIndex::entry(size_t i) const {
+    const IndexRecord &record = m_records[i];
+    IndexEntry entry;
+    entry.image = string(record.image);
+    entry.content_hash = record.content_hash;
+    entry.metrics_file = string(record.metrics_file);
+    entry.row_offset = record.row_offset;
+    entry.row_size = record.row_size;
+    entry.artifacts = string(record.artifacts);
+    entry.indexed = record.indexed;
+    for (size_t c = 0; c < m_columns.size(); c++) entry.values.push_back(values(c)[i]);
+    return entry;
+}
+
+/* Entries of an image name: binary search on the name hash */
+void ResultsIndex::findImage(const std::string &image, std::vector<size_t> *entries) const {
+    entries->clear();
+    const uint64_t hash = nameHash(image);
+    const size_t n = size();
+    size_t low = 0, high = n;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (m_records[middle].name_hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (size_t i = low; (i < n) && (m_records[i].name_hash == hash); i++) {
+        if (image == string(m_records[i].image)) entries->push_back(i);
+    }
+}
+
+/* Entries of an input content, through the records sorted by content hash */
+void ResultsIndex::findContent(uint64_t content_hash, std::vector<size_t> *entries) const {
+    entries->clear();
+    const size_t n = size();
+    size_t low = 0, high = n;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (m_records[m_by_hash[middle]].content_hash < content_hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (size_t i = low; (i < n) && (m_records[m_by_hash[i]].content_hash == content_hash); i++) {
+        entries->push_back(m_by_hash[i]);
+    }
+    std::sort(entries->begin(), entries->end());
+}
+
+
+/* Write the entries as an index file */
+static bool writeIndexFile( const std::string &path, const std::vector<std::string> &columns,
+                            const std::vector<IndexEntry> &entries  ) {
+
+    // Records in name hash order, strings shared where they repeat
+    const size_t n = entries.size();
+    std::vector<uint64_t> hashes(n);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = nameHash(entries[i].image);
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (hashes[a] != hashes[b]) return hashes[a] < hashes[b];
+        if (entries[a].image != entries[b].image) return entries[a].image < entries[b].image;
+        return entries[a].indexed < entries[b].indexed;
+    });
+
+    std::string strings;
+    std::map<std::string, uint32_t> interned;
+    auto intern = [&](const std::string &text) {
+        std::map<std::string, uint32_t>::iterator found = interned.find(text);
+        if (found != interned.end()) return found->second;
+        uint32_t offset = (uint32_t)strings.size();
+        strings.append(text.c_str(), text.size() + 1);
+        interned[text] = offset;
+        return offset;
+    };
+
+    std::vector<uint32_t> column_names(columns.size());
+    for (size_t c = 0; c < columns.size(); c++) column_names[c] = intern(columns[c]);
+    std::vector<IndexRecord> records(n);
+    for (size_t k = 0; k < n; k++) {
+        const IndexEntry &entry = entries[order[k]];
+        IndexRecord &record = records[k];
+        record.name_hash = hashes[order[k]];
+        record.content_hash = entry.content_hash;
+        record.row_offset = entry.row_offset;
+        record.indexed = entry.indexed;
+        record.image = intern(entry.image);
+        record.metrics_file = intern(entry.metrics_file);
+        record.artifacts = intern(entry.artifacts);
+        record.row_size = entry.row_size;
+    }
+    std::vector<uint32_t> by_hash(n);
+    for (size_t k = 0; k < n; k++) by_hash[k] = (uint32_t)k;
+    std::stable_sort(by_hash.begin(), by_hash.end(), [&](uint32_t a, uint32_t b) {
+        return records[a].content_hash < records[b].content_hash;
+    });
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.num_entries = n;
+    header.num_columns = columns.size();
+    header.columns_offset = alignSection(sizeof(header));
+    header.records_offset = alignSection(header.columns_offset + columns.size() * sizeof(uint32_t));
+    header.by_hash_offset = alignSection(header.records_offset + n * sizeof(IndexRecord));
+    header.values_offset = alignSection(header.by_hash_offset + n * sizeof(uint32_t));
+    header.strings_offset = header.values_offset + columns.size() * n * sizeof(double);
+    header.strings_size = strings.size();
+
+    std::ofstream stream(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!stream.is_open()) return false;
+    static const char padding[8] = { 0 };
+    auto pad = [&](uint64_t offset) {
+        stream.write(padding, offset - (uint64_t)stream.tellp());
+    };
+    stream.write((const char *)&header, sizeof(header));
+    pad(header.columns_offset);
+    stream.write((const char *)column_names.data(), column_names.size() * sizeof(uint32_t));
+    pad(header.records_offset);
+    stream.write((const char *)records.data(), n * sizeof(IndexRecord));
+    pad(header.by_hash_offset);
+    stream.write((const char *)by_hash.data(), n * sizeof(uint32_t));
+    pad(header.values_offset);
+
+    // Column after column, so that a range filter reads one contiguous run
+    std::vector<double> column(n);
+    for (size_t c = 0; c < columns.size(); c++) {
+        for (size_t k = 0; k < n; k++) {
+            const std::vector<double> &values = entries[order[k]].values;
+            column[k] = (c < values.size()) ? values[c] : NAN;
+        }
+        stream.write((const char *)column.data(), n * sizeof(double));
+    }
+    stream.write(strings.data(), strings.size());
+    stream.close();
+    return !stream.fail();
+}
+
+/* Fold the entries of a run into the index, replacing the entries of the
+ * same metrics files */
+bool updateResultsIndex(const std::string &path, const std::vector<std::string> &columns,
+                        const std::vector<IndexEntry> &entries) {
+
+    // One update at a time, the readers keep mapping whichever file is there
+    std::string lock_path = path + ".lock";
+    int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ((lock_fd < 0) || flock(lock_fd, LOCK_EX)) {
+        LOG(ERROR, "index_lock_failed").field("path", lock_path).field("error", strerror(errno));
+        if (lock_fd >= 0) close(lock_fd);
+        return false;
+    }
+
+    std::vector<std::string> merged_columns = columns;
+    std::vector<IndexEntry> merged = entries;
+    ResultsIndex old;
+    struct stat info;
+    if ((stat(path.c_str(), &info) == 0) && !old.open(path)) {
+        close(lock_fd);
+        return false;
+    }
+
+    std::map<std::string, size_t> column_numbers;
+    for (size_t c = 0; c < columns.size(); c++) column_numbers[columns[c]] = c;
+    std::vector<size_t> remap(old.columns().size());
+    for (size_t c = 0; c < old.columns().size(); c++) {
+        std::map<std::string, size_t>::iterator found = column_numbers.find(old.columns()[c]);
+        if (found == column_numbers.end()) {
+            found = column_numbers.insert(std::make_pair(old.columns()[c],
+                                                         merged_columns.size())).first;
+            merged_columns.push_back(old.columns()[c]);
+        }
+        remap[c] = found->second;
+    }
+
+    std::map<std::string, bool> replaced;
+    for (size_t i = 0; i < entries.size(); i++) replaced[entries[i].metrics_file] = true;
+    for (size_t i = 0; i < old.size(); i++) {
+        IndexEntry entry = old.entry(i);
+        if (replaced.count(entry.metrics_file)) continue;
+        std::vector<double> values(merged_columns.size(), NAN);
+        for (size_t c = 0; c < entry.values.size(); c++) values[remap[c]] = entry.values[c];
+        entry.values.swap(values);
+        merged.push_back(entry);
+    }
+
+    Artifact artifact = { stagedPath(path), path };
+    bool ok = writeIndexFile(artifact.temporary, merged_columns, merged) &&
+              publishArtifacts(std::vector<Artifact>(1, artifact), SyncMode::FDATASYNC);
+    if (!ok) {
+        LOG(ERROR, "output_failed").field("path", path);
+        remove(artifact.temporary.c_str());
+    }
+    close(lock_fd);
+    return ok;
+}
+
+
+/* Parse a query condition */
+bool parseIndexPredicate(const std::string &text, IndexPredicate *predicate) {
+
+    predicate->content_hash = 0;
+    predicate->value = 0.0;
+    predicate->op = IndexPredicate::EQUAL;
+    if (text.compare(0, 5, "name=") == 0) {
+        predicate->kind = IndexPredicate::IMAGE;
+        predicate->text = text.substr(5);
+        return !predicate->text.empty();
+    }
+    if (text.compare(0, 5, "hash=") == 0) {
+        predicate->kind = IndexPredicate::CONTENT;
+        char *end = NULL;
+        predicate->content_hash = strtoull(text.c_str() + 5, &end, 16);
+        return (text.size() > 5) && (*end == '\0');
+    }
+
+    // Column names hold < and = themselves, the operator is the last one
+    static const char *operators = "<>=!";
+    size_t op_end = text.find_last_of(operators);
+    if ((op_end == std::string::npos) || (op_end + 1 >= text.size())) return false;
+    size_t op_start = op_end;
+    while ((op_start > 0) && strchr(operators, text[op_start - 1])) op_start--;
+    predicate->kind = IndexPredicate::COMPARE;
+    const std::string op = text.substr(op_start, op_end + 1 - op_start);
+    static const char *op_names[] = { "<", "<=", ">", ">=", "=", "!=" };
+    size_t k = 0;
+    while ((k < sizeof(op_names) / sizeof(op_names[0])) && (op != op_names[k])) k++;
+    if (k == sizeof(op_names) / sizeof(op_names[0])) return false;
+    predicate->op = (IndexPredicate::Op)k;
+    std::string value = text.substr(op_end + 1);
+    char *end = NULL;
+    predicate->value = strtod(value.c_str(), &end);
+    while (*end == ' ') end++;
+    if ((end == value.c_str()) || (*end != '\0')) return false;
+
+    size_t first = text.find_first_not_of(' ');
+    size_t last = text.find_last_not_of(' ', op_start ? op_start - 1 : 0);
+    if ((first == std::string::npos) || (first >= op_start)) return false;
+    predicate->text = text.substr(first, last + 1 - first);
+    return true;
+}
+
+/* Absent values (NaN) match no comparison */
+static inline bool compareValue(double value, const IndexPredicate &predicate) {
+    switch (predicate.op) {
+        case IndexPredicate::LESS:          return value < predicate.value;
+        case IndexPredicate::LESS_EQUAL:    return value <= predicate.value;
+        case IndexPredicate::GREATER:       return value > predicate.value;
+        case IndexPredicate::GREATER_EQUAL: return value >= predicate.value;
+        case IndexPredicate::EQUAL:         return value == predicate.value;
+        default:                            return !std::isnan(value) && (value != predicate.value);
+    }
+}
+
+/* Entries matching every predicate: lookups narrow the candidates first,
+ * then every comparison scans its column over what is left */
+bool queryResultsIndex( const ResultsIndex &index, const std::vector<IndexPredicate> &predicates,
+                        std::vector<size_t> *matches    ) {
+
+    bool narrowed = false;
+    matches->clear();
+    std::vector<size_t> found, kept;
+    for (size_t p = 0; p < predicates.size(); p++) {
+        const IndexPredicate &predicate = predicates[p];
+        if (predicate.kind == IndexPredicate::COMPARE) continue;
+        if (predicate.kind == IndexPredicate::IMAGE) {
+            index.findImage(predicate.text, &found);
+        } else {
+            index.findContent(predicate.content_hash, &found);
+        }
+        if (narrowed) {
+            kept.clear();
+            std::set_intersection(matches->begin(), matches->end(), found.begin(), found.end(),
+                                                                    std::back_inserter(kept));
+            matches->swap(kept);
+        } else {
+            matches->swap(found);
+            narrowed = true;
+        }
+    }
+
+    for (size_t p = 0; p < predicates.size(); p++) {
+        const IndexPredicate &predicate = predicates[p];
+        if (predicate.kind != IndexPredicate::COMPARE) continue;
+        int column = index.column(predicate.text);
+        if (column < 0) {
+            std::cerr << "Unknown column: " << predicate.text << std::endl;
+            return false;
+        }
+        const double *values = index.values(column);
+        kept.clear();
+        if (narrowed) {
+            for (size_t i = 0; i < matches->size(); i++) {
+                if (compareValue(values[(*matches)[i]], predicate)) kept.push_back((*matches)[i]);
+            }
+        } else {
+            for (size_t i = 0; i < index.size(); i++) {
+                if (compareValue(values[i], predicate)) kept.push_back(i);
+            }
+            narrowed = true;
+        }
+        matches->swap(kept);
+    }
+
+    if (!narrowed) {
+        for (size_t i = 0; i < index.size(); i++) matches->push_back(i);
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+#ifndef RESULTS_INDEX_HPP
+#define RESULTS_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+
+#define INDEX_MAGIC             "RESIDX01"
+#define INDEX_FILE_NAME         "results.idx"
+
+/* 64-bit hash of a buffer (xxHash64, seed 0), identifies input contents */
+uint64_t contentHash(const void *data, size_t size);
+
+/* One image of a run as the index keeps it */
+struct IndexEntry {
+    std::string             image;          // Image name
+    uint64_t                content_hash;   // Of the input file, 0 if unknown
+    std::string             metrics_file;   // CSV holding its row
+    uint64_t                row_offset;     // Of the row in the CSV
+    uint32_t                row_size;       // Bytes, without the newline
+    std::string             artifacts;      // Result image, the others share its stem
+    int64_t                 indexed;        // Unix time of the run
+    std::vector<double>     values;         // One per column, NaN if absent
+};
+
+/* File layout, every section 8 byte aligned: the header, the column name
+ * offsets, the records sorted by name hash, the record numbers sorted by
+ * content hash, the values column after column, then the NUL terminated
+ * strings the offsets point into */
+struct IndexHeader {
+    char            magic[8];
+    uint64_t        num_entries;
+    uint64_t        num_columns;
+    uint64_t        columns_offset;
+    uint64_t        records_offset;
+    uint64_t        by_hash_offset;
+    uint64_t        values_offset;
+    uint64_t        strings_offset;
+    uint64_t        strings_size;
+};
+
+struct IndexRecord {
+    uint64_t        name_hash;
+    uint64_t        content_hash;
+    uint64_t        row_offset;
+    int64_t         indexed;
+    uint32_t        image;          // String offsets
+    uint32_t        metrics_file;
+    uint32_t        artifacts;
+    uint32_t        row_size;
+};
+
+/* Read-only view of an index file, mapped rather than parsed so that a
+ * lookup touches a few pages and a range filter one column */
+class ResultsIndex {
+public:
+    ResultsIndex();
+    ~ResultsIndex();
+
+    /* Map the index, false if it is missing or malformed */
+    bool open(const std::string &path);
+
+    size_t size() const;
+    const std::vector<std::string> &columns() const;
+
+    /* Column number of a name, -1 if the index has none */
+    int column(const std::string &name) const;
+
+    /* Values of a column, one per entry in entry order */
+    const double *values(size_t column) const;
+
+    IndexEntry entry(size_t i) const;
+
+    /* Entries of an image name or of an input content, in entry order */
+    void findImage(const std::string &image, std::vector<size_t> *entries) const;
+    void findContent(uint64_t content_hash, std::vector<size_t> *entries) const;
+
+private:
+    ResultsIndex(const ResultsIndex &);
+    ResultsIndex &operator=(const ResultsIndex &);
+
+    const char *string(uint32_t offset) const;
+
+    const unsigned char        *m_data;
+    size_t                      m_size;
+    const IndexHeader          *m_header;
+    const IndexRecord          *m_records;
+    const uint32_t             *m_by_hash;
+    std::vector<std::string>    m_columns;
+};
+
+/* Fold the entries of a run into the index at path, replacing the
+ * entries of the same metrics files, whose rows moved. The columns are
+ * the union of the old and new ones. Serialized across processes by a
+ * lock file, the new index is published atomically and durably. */
+bool updateResultsIndex(const std::string &path, const std::vector<std::string> &columns,
+                        const std::vector<IndexEntry> &entries);
+
+/* One condition of a query: name=<image>, hash=<hex> or
+ * <column><op><number> with op one of < <= > >= = != */
+struct IndexPredicate {
+    enum Kind { IMAGE, CONTENT, COMPARE } kind;
+    enum Op { LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL } op;
+    std::string     text;           // Image or column name
+    uint64_t        content_hash;
+    double          value;
+};
+
+bool parseIndexPredicate(const std::string &text, IndexPredicate *predicate);
+
+/* Entries matching every predicate, in entry order */
+bool queryResultsIndex( const ResultsIndex &index, const std::vector<IndexPredicate> &predicates,
+                        std::vector<size_t> *matches    );
+
+#endif // RESULTS_INDEX_HPP
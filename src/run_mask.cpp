@@ -0,0 +1,190 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "run_mask.hpp"
+#include "deadline.hpp"
+
+
+RunMask::RunMask() : width(0), height(0), row_runs(1, 0) {
+}
+
+/* Eight pixels at once */
+static inline uint64_t loadWord(const unsigned char *pixels) {
+    uint64_t word;
+    memcpy(&word, pixels, sizeof(word));
+    return word;
+}
+
+/* Runs of the pixels of an 8 bit image above thresh */
+void buildRunMask(const cv::Mat &src, double thresh, RunMask *mask) {
+
+    mask->width = src.cols;
+    mask->height = src.rows;
+    mask->row_runs.assign(src.rows + 1, 0);
+    mask->runs.clear();
+
+    // cv::threshold compares 8 bit pixels against the floor of thresh. Zero
+    // pixels are then background, so zero words are skipped whole.
+    const int level = (thresh >= 255) ? 255 : (thresh < 0) ? -1 : (int)floor(thresh);
+    const bool skip_zeros = (level >= 0);
+    const int cols = src.cols;
+    for (int y = 0; y < src.rows; y++) {
+        checkDeadline(y);
+        const unsigned char *row = src.ptr(y);
+        int x = 0;
+        while (true) {
+            if (skip_zeros) {
+                while ((x + 8 <= cols) && !loadWord(row + x)) x += 8;
+            }
+            if (x >= cols) break;
+            if (row[x] <= level) {
+                x++;
+                continue;
+            }
+            MaskRun run;
+            run.start = x;
+            while ((x < cols) && (row[x] > level)) x++;
+            run.end = x;
+            mask->runs.push_back(run);
+        }
+        mask->row_runs[y + 1] = (uint32_t)mask->runs.size();
+    }
+}
+
+/* Dense mask of the runs, 255 on the foreground */
+void renderRunMask(const RunMask &mask, cv::Mat *dst) {
+    *dst = cv::Mat::zeros(mask.height, mask.width, CV_8UC1);
+    for (int y = 0; y < mask.height; y++) {
+        checkDeadline(y);
+        unsigned char *row = dst->ptr(y);
+        for (uint32_t r = mask.row_runs[y]; r < mask.row_runs[y + 1]; r++) {
+            memset(row + mask.runs[r].start, 255, mask.runs[r].end - mask.runs[r].start);
+        }
+    }
+}
+
+/* Intersection of two masks of the same size */
+void andRunMasks(const RunMask &a, const RunMask &b, RunMask *dst) {
+
+    dst->width = a.width;
+    dst->height = a.height;
+    dst->row_runs.assign(a.height + 1, 0);
+    dst->runs.clear();
+    for (int y = 0; y < a.height; y++) {
+        checkDeadline(y);
+        uint32_t i = a.row_runs[y], j = b.row_runs[y];
+        while ((i < a.row_runs[y + 1]) && (j < b.row_runs[y + 1])) {
+            MaskRun run;
+            run.start = std::max(a.runs[i].start, b.runs[j].start);
+            run.end = std::min(a.runs[i].end, b.runs[j].end);
+            if (run.start < run.end) dst->runs.push_back(run);
+
+            // The run ending first cannot overlap anything further
+            if (a.runs[i].end < b.runs[j].end) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+        dst->row_runs[y + 1] = (uint32_t)dst->runs.size();
+    }
+}
+
+/* Union of two masks of the same size */
+void orRunMasks(const RunMask &a, const RunMask &b, RunMask *dst) {
+
+    dst->width = a.width;
+    dst->height = a.height;
+    dst->row_runs.assign(a.height + 1, 0);
+    dst->runs.clear();
+    for (int y = 0; y < a.height; y++) {
+        checkDeadline(y);
+        uint32_t i = a.row_runs[y], j = b.row_runs[y];
+        const uint32_t first = (uint32_t)dst->runs.size();
+        while ((i < a.row_runs[y + 1]) || (j < b.row_runs[y + 1])) {
+            // Next run by start, joined to the last one when they touch
+            const MaskRun *next;
+            if ((j >= b.row_runs[y + 1]) ||
+                    ((i < a.row_runs[y + 1]) && (a.runs[i].start <= b.runs[j].start))) {
+                next = &a.runs[i++];
+            } else {
+                next = &b.runs[j++];
+            }
+            if ((dst->runs.size() > first) && (next->start <= dst->runs.back().end)) {
+                dst->runs.back().end = std::max(dst->runs.back().end, next->end);
+            } else {
+                dst->runs.push_back(*next);
+            }
+        }
+        dst->row_runs[y + 1] = (uint32_t)dst->runs.size();
+    }
+}
+
+/* Foreground pixels */
+uint64_t runMaskArea(const RunMask &mask) {
+    uint64_t area = 0;
+    for (size_t r = 0; r < mask.runs.size(); r++) area += mask.runs[r].end - mask.runs[r].start;
+    return area;
+}
+
+/* Root of a run, halving the path on the way */
+static inline uint32_t findRoot(std::vector<uint32_t> &parent, uint32_t run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+/* 8-connected components of the runs. Runs of consecutive rows are
+ * joined when they overlap or touch diagonally, the earlier root wins so
+ * that the labels follow the raster order. */
+size_t labelRuns(   const RunMask &mask, std::vector<uint32_t> *labels,
+                    std::vector<RunComponent> *components   ) {
+
+    const uint32_t num_runs = (uint32_t)mask.runs.size();
+    std::vector<uint32_t> parent(num_runs);
+    for (uint32_t r = 0; r < num_runs; r++) parent[r] = r;
+
+    for (int y = 1; y < mask.height; y++) {
+        checkDeadline(y);
+        uint32_t p = mask.row_runs[y - 1];
+        const uint32_t p_end = mask.row_runs[y];
+        for (uint32_t c = mask.row_runs[y]; c < mask.row_runs[y + 1]; c++) {
+            const MaskRun &run = mask.runs[c];
+            while ((p < p_end) && (mask.runs[p].end < run.start)) p++;
+            for (uint32_t q = p; (q < p_end) && (mask.runs[q].start <= run.end); q++) {
+                uint32_t a = findRoot(parent, q), b = findRoot(parent, c);
+                if (a < b) {
+                    parent[b] = a;
+                } else if (b < a) {
+                    parent[a] = b;
+                }
+            }
+        }
+    }
+
+    // Roots come before their runs, so one pass in run order numbers them
+    labels->resize(num_runs);
+    components->clear();
+    for (int y = 0; y < mask.height; y++) {
+        for (uint32_t r = mask.row_runs[y]; r < mask.row_runs[y + 1]; r++) {
+            const MaskRun &run = mask.runs[r];
+            uint32_t root = findRoot(parent, r);
+            if (root == r) {
+                RunComponent component = { 0, run.start, y, run.end, y + 1 };
+                (*labels)[r] = (uint32_t)components->size();
+                components->push_back(component);
+            } else {
+                (*labels)[r] = (*labels)[root];
+            }
+            RunComponent &component = (*components)[(*labels)[r]];
+            component.area += run.end - run.start;
+            component.left = std::min(component.left, run.start);
+            component.right = std::max(component.right, run.end);
+            component.bottom = y + 1;
+        }
+    }
+    return components->size();
+}
@@ -0,0 +1,59 @@
+#ifndef RUN_MASK_HPP
+#define RUN_MASK_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "opencv2/core/core.hpp"
+
+
+/* One run of foreground pixels [start, end) along a row */
+struct MaskRun {
+    int32_t         start;
+    int32_t         end;
+};
+
+/* Binary mask as the foreground runs of every row. Row y owns the runs
+ * [row_runs[y], row_runs[y + 1]), sorted by x and never touching. Sparse
+ * channels take a few bytes per cell instead of one per pixel. */
+struct RunMask {
+    int             width;
+    int             height;
+    std::vector<uint32_t>   row_runs;       // height + 1 run indices
+    std::vector<MaskRun>    runs;
+
+    RunMask();
+};
+
+/* Bounding box [left, right) x [top, bottom) and pixels of a component */
+struct RunComponent {
+    uint64_t        area;
+    int             left;
+    int             top;
+    int             right;
+    int             bottom;
+};
+
+/* Runs of the pixels of an 8 bit image above thresh, the pixels
+ * cv::threshold(THRESH_BINARY) would set. 0 turns a dense mask into runs. */
+void buildRunMask(const cv::Mat &src, double thresh, RunMask *mask);
+
+/* Dense mask of the runs, 255 on the foreground */
+void renderRunMask(const RunMask &mask, cv::Mat *dst);
+
+/* Intersection and union of two masks of the same size, row by row
+ * merging of the runs */
+void andRunMasks(const RunMask &a, const RunMask &b, RunMask *dst);
+void orRunMasks(const RunMask &a, const RunMask &b, RunMask *dst);
+
+/* Foreground pixels */
+uint64_t runMaskArea(const RunMask &mask);
+
+/* 8-connected components of the runs, labelled from 0 in raster order of
+ * their first run. labels gets the component of every run and components
+ * their extent. Returns the number of components. */
+size_t labelRuns(   const RunMask &mask, std::vector<uint32_t> *labels,
+                    std::vector<RunComponent> *components   );
+
+#endif // RUN_MASK_HPP
@@ -0,0 +1,484 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cstring>
+
+#include "submit_server.hpp"
+#include "event_log.hpp"
+
+
+SubmitResult::SubmitResult() : status(SubmitStatus::OK) {
+}
+
+/* New anonymous memory file, mapped shared into data unless it is NULL */
+int createSegment(size_t size, unsigned char **data) {
+    int fd = memfd_create("analyze-segment", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return -1;
+    }
+    if (data) {
+        void *map = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        *data = (unsigned char *)map;
+    }
+    return fd;
+}
+
+/* Make a segment immutable. Its writable mappings must be gone. */
+bool sealSegment(int fd) {
+    return !fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+
+/* Planes of a request as Mats over the segment, checked against its size */
+bool submissionPlanes(  const SubmitRequest &request, unsigned char *segment,
+                        size_t segment_size, std::vector<cv::Mat> *planes,
+                        std::string *error  ) {
+
+    if ((request.depth != 8) && (request.depth != 16)) {
+        *error = "Depth must be 8 or 16 bits";
+        return false;
+    }
+    if ((request.channels != 1) && (request.channels != 3)) {
+        *error = "Channels must be 1 or 3";
+        return false;
+    }
+    if (!request.rows || !request.cols || (request.rows > SUBMIT_MAX_SIDE) ||
+                                          (request.cols > SUBMIT_MAX_SIDE)) {
+        *error = "Invalid image size";
+        return false;
+    }
+
+    // Every byte of the last row of the last plane must be in the segment
+    const int depth = (request.depth == 16) ? CV_16U : CV_8U;
+    const bool planar = request.planar && (request.channels > 1);
+    const uint64_t row_bytes = (uint64_t)request.cols * (request.depth / 8) *
+                                                        (planar ? 1 : request.channels);
+    const uint64_t planes_before = planar ? request.channels - 1 : 0;
+    if ((request.step < row_bytes) || (request.step > segment_size) ||
+            (request.plane_stride > segment_size) || (request.offset > segment_size) ||
+            (request.offset + planes_before * request.plane_stride +
+                (request.rows - 1) * request.step + row_bytes > segment_size)) {
+        *error = "Pixels out of the segment";
+        return false;
+    }
+
+    unsigned char *first = segment + request.offset;
+    planes->resize(3);
+    if (request.channels == 1) {
+        cv::Mat gray(request.rows, request.cols, depth, first, request.step);
+        (*planes)[0] = (*planes)[1] = (*planes)[2] = gray;
+    } else if (planar) {
+        for (int i = 0; i < 3; i++) {
+            (*planes)[i] = cv::Mat(request.rows, request.cols, depth,
+                                   first + i * request.plane_stride, request.step);
+        }
+    } else {
+        // The pipeline works on planes, interleaved samples are split once
+        cv::Mat image(request.rows, request.cols, CV_MAKETYPE(depth, 3), first, request.step);
+        cv::split(image, *planes);
+    }
+    return true;
+}
+
+/* Bytes of a result segment */
+static size_t resultSegmentSize(const SubmitResult &result) {
+    size_t size = sizeof(SubmitResultHeader) + result.values.size() * sizeof(double) +
+                                                                    result.names.size();
+    for (size_t c = 0; c < result.cells.size(); c++) {
+        size += sizeof(uint32_t);
+        for (size_t i = 0; i < result.cells[c].size(); i++) {
+            size += sizeof(uint32_t) + result.cells[c][i].size() * 2 * sizeof(int32_t);
+        }
+    }
+    return size;
+}
+
+/* Lay the result out in a segment of resultSegmentSize bytes */
+static void writeResultSegment(const SubmitResult &result, unsigned char *data) {
+
+    SubmitResultHeader header;
+    header.num_values = (uint32_t)result.values.size();
+    header.names_size = (uint32_t)result.names.size();
+    header.num_channels = (uint32_t)result.cells.size();
+    header.reserved = 0;
+    memcpy(data, &header, sizeof(header));                  data += sizeof(header);
+    memcpy(data, result.values.data(), result.values.size() * sizeof(double));
+    data += result.values.size() * sizeof(double);
+    memcpy(data, result.names.data(), result.names.size()); data += result.names.size();
+
+    for (size_t c = 0; c < result.cells.size(); c++) {
+        uint32_t num_cells = (uint32_t)result.cells[c].size();
+        memcpy(data, &num_cells, sizeof(num_cells));        data += sizeof(num_cells);
+        for (size_t i = 0; i < result.cells[c].size(); i++) {
+            const std::vector<cv::Point> &cell = result.cells[c][i];
+            uint32_t num_points = (uint32_t)cell.size();
+            memcpy(data, &num_points, sizeof(num_points));  data += sizeof(num_points);
+            for (size_t k = 0; k < cell.size(); k++) {
+                int32_t point[2] = { cell[k].x, cell[k].y };
+                memcpy(data, point, sizeof(point));         data += sizeof(point);
+            }
+        }
+    }
+}
+
+/* Parse a result segment, false if it is truncated */
+static bool readResultSegment(const unsigned char *data, size_t size, SubmitResult *result) {
+
+    const unsigned char *end = data + size;
+    SubmitResultHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));                  data += sizeof(header);
+    if ((size_t)(end - data) < header.num_values * sizeof(double) + header.names_size) {
+        return false;
+    }
+    result->values.resize(header.num_values);
+    memcpy(result->values.data(), data, header.num_values * sizeof(double));
+    data += header.num_values * sizeof(double);
+    result->names.assign((const char *)data, header.names_size);
+    data += header.names_size;
+
+    result->cells.assign(header.num_channels, std::vector<std::vector<cv::Point>>());
+    for (uint32_t c = 0; c < header.num_channels; c++) {
+        uint32_t num_cells;
+        if ((size_t)(end - data) < sizeof(num_cells)) return false;
+        memcpy(&num_cells, data, sizeof(num_cells));        data += sizeof(num_cells);
+        if (num_cells > (size_t)(end - data) / sizeof(uint32_t)) return false;
+        result->cells[c].resize(num_cells);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            uint32_t num_points;
+            if ((size_t)(end - data) < sizeof(num_points)) return false;
+            memcpy(&num_points, data, sizeof(num_points));  data += sizeof(num_points);
+            if (num_points > (size_t)(end - data) / (2 * sizeof(int32_t))) return false;
+            std::vector<cv::Point> &cell = result->cells[c][i];
+            cell.resize(num_points);
+            for (uint32_t k = 0; k < num_points; k++) {
+                int32_t point[2];
+                memcpy(point, data, sizeof(point));         data += sizeof(point);
+                cell[k] = cv::Point(point[0], point[1]);
+            }
+        }
+    }
+    return true;
+}
+
+/* Send a message with an optional descriptor attached */
+static bool sendWithFd(int socket_fd, const void *message, size_t size, int fd) {
+    struct iovec iov = { (void *)message, size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    while (((sent = sendmsg(socket_fd, &msg, MSG_NOSIGNAL)) < 0) && (errno == EINTR)) {}
+    return sent == (ssize_t)size;
+}
+
+/* Receive a message of exactly size bytes and its descriptor, -1 if none.
+ * False at the end of the connection or on a malformed message. */
+static bool receiveWithFd(int socket_fd, void *message, size_t size, int *fd) {
+    struct iovec iov = { message, size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t received;
+    while (((received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC)) < 0) && (errno == EINTR)) {}
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if ((received != (ssize_t)size) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/* Copy size bytes of an unsealed segment, false if it is shorter by now */
+static bool readSegment(int fd, size_t size, std::vector<unsigned char> *copy) {
+    copy->resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(fd, copy->data() + done, size - done, done);
+        if ((got < 0) && (errno == EINTR)) continue;
+        if (got <= 0) return false;
+        done += got;
+    }
+    return true;
+}
+
+
+SubmitServer::SubmitServer(const std::string &socket_path, const Handler &handler) :
+    m_socket_path(socket_path),
+    m_handler(handler),
+    m_listen_fd(-1),
+    m_stop(false) {
+}
+
+SubmitServer::~SubmitServer() {
+    stop();
+    for (size_t i = 0; i < m_threads.size(); i++) m_threads[i].join();
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+        unlink(m_socket_path.c_str());
+    }
+}
+
+/* Accept clients until stop(), a thread per connection */
+bool SubmitServer::run() {
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (m_socket_path.size() >= sizeof(address.sun_path)) {
+        LOG(ERROR, "socket_path_too_long").field("path", m_socket_path);
+        return false;
+    }
+    strncpy(address.sun_path, m_socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    // A socket left behind by a previous server is replaced
+    m_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(m_socket_path.c_str());
+    if ((m_listen_fd < 0) || bind(m_listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+                                                    listen(m_listen_fd, SUBMIT_BACKLOG)) {
+        LOG(ERROR, "listen_failed").field("path", m_socket_path).field("error", strerror(errno));
+        return false;
+    }
+
+    while (!m_stop) {
+        int fd = accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+            if (!m_stop) {
+                LOG(ERROR, "accept_failed").field("error", strerror(errno));
+            }
+            break;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            close(fd);
+            break;
+        }
+        reapThreads();
+        m_client_fds.push_back(fd);
+        m_threads.push_back(std::thread(&SubmitServer::serveClient, this, fd));
+    }
+    return true;
+}
+
+/* Join the connection threads that are done, with m_mutex held. They
+ * take no lock after reporting themselves done, so the joins are short. */
+void SubmitServer::reapThreads() {
+    for (size_t i = 0; i < m_finished.size(); i++) {
+        for (size_t t = 0; t < m_threads.size(); t++) {
+            if (m_threads[t].get_id() != m_finished[i]) continue;
+            m_threads[t].join();
+            m_threads[t].swap(m_threads.back());
+            m_threads.pop_back();
+            break;
+        }
+    }
+    m_finished.clear();
+}
+
+/* Stop accepting and close the connections, from any thread */
+void SubmitServer::stop() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+    if (m_listen_fd >= 0) shutdown(m_listen_fd, SHUT_RDWR);
+    for (size_t i = 0; i < m_client_fds.size(); i++) shutdown(m_client_fds[i], SHUT_RDWR);
+}
+
+/* Serve the requests of one connection in order */
+void SubmitServer::serveClient(int fd) {
+
+    // The kernel vouches for the peer, whatever the requests claim
+    SubmitPeer peer = { -1, (uint32_t)-1 };
+    struct ucred credentials;
+    socklen_t credentials_size = sizeof(credentials);
+    if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size)) {
+        peer.pid = credentials.pid;
+        peer.uid = credentials.uid;
+    }
+
+    SubmitRequest request;
+    int segment_fd;
+    while (receiveWithFd(fd, &request, sizeof(request), &segment_fd)) {
+
+        SubmitResult result;
+        const bool stats = (request.flags & SUBMIT_STATS) != 0;
+        if ((request.magic != SUBMIT_MAGIC) || (request.version != SUBMIT_VERSION) ||
+                                                        (!stats && (segment_fd < 0))) {
+            if (segment_fd >= 0) close(segment_fd);
+            result.status = SubmitStatus::INVALID;
+            result.message = "Not a version 1 request with a pixel segment";
+            if (!sendReply(fd, request.id, result)) break;
+            continue;
+        }
+        request.name[SUBMIT_NAME_SIZE - 1] = '\0';
+        request.client[SUBMIT_CLIENT_SIZE - 1] = '\0';
+
+        std::vector<cv::Mat> planes;
+        if (stats) {
+            if (segment_fd >= 0) close(segment_fd);
+            m_handler(request, peer, &planes, &result);
+            if (!sendReply(fd, request.id, result)) break;
+            continue;
+        }
+
+        // A segment sealed against shrinking and writes is mapped copy-on-write,
+        // so nothing the pipeline does reaches the client. Any other segment
+        // is copied first: the client could truncate it under the mapping,
+        // and the first access past its new end would kill the server.
+        struct stat info;
+        void *map = MAP_FAILED;
+        std::vector<unsigned char> copy;
+        unsigned char *segment = NULL;
+        if (!fstat(segment_fd, &info) && (info.st_size > 0)) {
+            int seals = fcntl(segment_fd, F_GET_SEALS);
+            if ((seals >= 0) && (seals & F_SEAL_SHRINK) && (seals & F_SEAL_WRITE)) {
+                map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                                                        segment_fd, 0);
+                if (map != MAP_FAILED) segment = (unsigned char *)map;
+            } else if (readSegment(segment_fd, info.st_size, &copy)) {
+                segment = copy.data();
+            }
+        }
+        close(segment_fd);
+
+        if (!segment) {
+            result.status = SubmitStatus::INVALID;
+            result.message = "Could not map or read the pixel segment";
+        } else if (!submissionPlanes(request, segment, info.st_size,
+                                                        &planes, &result.message)) {
+            result.status = SubmitStatus::INVALID;
+        } else {
+            m_handler(request, peer, &planes, &result);
+        }
+        planes.clear();
+        if (map != MAP_FAILED) munmap(map, info.st_size);
+        if (!sendReply(fd, request.id, result)) break;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_client_fds.size(); i++) {
+        if (m_client_fds[i] != fd) continue;
+        m_client_fds.erase(m_client_fds.begin() + i);
+        break;
+    }
+    close(fd);
+    m_finished.push_back(std::this_thread::get_id());
+}
+
+/* Send the reply, the results in a sealed segment when the status is OK */
+bool SubmitServer::sendReply(int fd, uint64_t id, const SubmitResult &result) {
+
+    SubmitReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = SUBMIT_MAGIC;
+    reply.version = SUBMIT_VERSION;
+    reply.id = id;
+    reply.status = result.status;
+    strncpy(reply.message, result.message.c_str(), SUBMIT_MESSAGE_SIZE - 1);
+
+    int segment_fd = -1;
+    if (result.status == SubmitStatus::OK) {
+        unsigned char *data = NULL;
+        reply.size = resultSegmentSize(result);
+        segment_fd = createSegment(reply.size, &data);
+        if (segment_fd < 0) {
+            reply.status = SubmitStatus::FAILED;
+            reply.size = 0;
+            strncpy(reply.message, "Could not create the result segment",
+                                                    SUBMIT_MESSAGE_SIZE - 1);
+        } else {
+            writeResultSegment(result, data);
+            munmap(data, reply.size);
+            sealSegment(segment_fd);
+        }
+    }
+    bool sent = sendWithFd(fd, &reply, sizeof(reply), segment_fd);
+    if (segment_fd >= 0) close(segment_fd);
+    return sent;
+}
+
+
+SubmitClient::SubmitClient(const std::string &socket_path) : m_fd(-1) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) return;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    m_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if ((m_fd >= 0) && connect(m_fd, (struct sockaddr *)&address, sizeof(address))) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+SubmitClient::~SubmitClient() {
+    if (m_fd >= 0) close(m_fd);
+}
+
+bool SubmitClient::connected() const {
+    return m_fd >= 0;
+}
+
+/* Send a request with its pixel segment and wait for the result */
+bool SubmitClient::submit(const SubmitRequest &request, int segment_fd, SubmitResult *result) {
+
+    SubmitReply reply;
+    int result_fd = -1;
+    if ((m_fd < 0) || !sendWithFd(m_fd, &request, sizeof(request), segment_fd) ||
+            !receiveWithFd(m_fd, &reply, sizeof(reply), &result_fd) ||
+            (reply.magic != SUBMIT_MAGIC) || (reply.id != request.id)) {
+        if (result_fd >= 0) close(result_fd);
+        return false;
+    }
+
+    reply.message[SUBMIT_MESSAGE_SIZE - 1] = '\0';
+    result->status = reply.status;
+    result->message = reply.message;
+    result->values.clear();
+    result->names.clear();
+    result->cells.clear();
+    if (result_fd < 0) return reply.status != SubmitStatus::OK;
+
+    bool ok = false;
+    void *map = mmap(NULL, reply.size, PROT_READ, MAP_SHARED, result_fd, 0);
+    if (map != MAP_FAILED) {
+        ok = readResultSegment((const unsigned char *)map, reply.size, result);
+        munmap(map, reply.size);
+    }
+    close(result_fd);
+    return ok;
+}
@@ -0,0 +1,168 @@
+#ifndef SUBMIT_SERVER_HPP
+#define SUBMIT_SERVER_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+#include "opencv2/core/core.hpp"
+
+
+#define SUBMIT_MAGIC            0x5a4c4e41  // "ANLZ"
+#define SUBMIT_VERSION          1
+#define SUBMIT_NAME_SIZE        128         // Image name, NUL padded
+#define SUBMIT_CLIENT_SIZE      32          // Client name, NUL padded
+#define SUBMIT_MESSAGE_SIZE     128         // Error message of a reply
+#define SUBMIT_MAX_SIDE         (1 << 20)   // Largest width or height accepted
+#define SUBMIT_BACKLOG          16          // Pending connections on the socket
+
+#define SUBMIT_WANT_CELLS       1           // Send the cell contours back
+#define SUBMIT_WRITE_IMAGES     2           // Also write the result images
+#define SUBMIT_BULK             4           // Bulk job, queued behind interactive ones
+#define SUBMIT_STATS            8           // Queue statistics instead, no segment
+
+/* Outcome of a submission */
+enum class SubmitStatus : int32_t {
+    OK = 0,
+    INVALID,        // Malformed request or pixel segment
+    FAILED,         // The pipeline failed on the image
+    TIMED_OUT,      // Over the deadline of the image
+    REJECTED        // The queue of the client or of the class is full
+};
+
+/* Control message of a submission, sent over the socket along with the
+ * file descriptor of the segment holding the pixels. Planes are in BGR
+ * order, a single plane is analyzed as gray. */
+struct SubmitRequest {
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        id;             // Echoed in the reply
+    uint32_t        rows;
+    uint32_t        cols;
+    uint32_t        depth;          // Bits per sample, 8 or 16
+    uint32_t        channels;       // 1 or 3
+    uint32_t        planar;         // Planes one after the other, else interleaved
+    uint32_t        flags;          // SUBMIT_WANT_CELLS, SUBMIT_WRITE_IMAGES, ...
+    uint64_t        offset;         // Of the first pixel in the segment
+    uint64_t        step;           // Bytes per row, of a plane when planar
+    uint64_t        plane_stride;   // Bytes between planes when planar
+    char            name[SUBMIT_NAME_SIZE];
+    char            client[SUBMIT_CLIENT_SIZE];     // Shares the queue, empty for the user
+};
+
+/* Credentials of the process on the other end of a connection */
+struct SubmitPeer {
+    int32_t         pid;
+    uint32_t        uid;
+};
+
+/* Reply to a submission, sent along with the descriptor of a sealed
+ * result segment when the status is OK */
+struct SubmitReply {
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        id;
+    SubmitStatus    status;
+    uint32_t        reserved;
+    uint64_t        size;           // Bytes of the result segment
+    char            message[SUBMIT_MESSAGE_SIZE];
+};
+
+/* Start of the result segment. It goes on with num_values doubles, the
+ * names_size bytes of the comma separated metric names, then for each of
+ * num_channels channels a uint32 cell count and, for every cell, a uint32
+ * point count followed by int32 x, y pairs. */
+struct SubmitResultHeader {
+    uint32_t        num_values;
+    uint32_t        names_size;
+    uint32_t        num_channels;   // 0 without SUBMIT_WANT_CELLS
+    uint32_t        reserved;
+};
+
+/* Everything a submission sends back */
+struct SubmitResult {
+    SubmitStatus                status;
+    std::string                 message;
+    std::vector<double>         values;     // Metric columns of the image
+    std::string                 names;      // Their names, comma separated
+    std::vector<std::vector<std::vector<cv::Point>>> cells;    // Per channel, if wanted
+
+    SubmitResult();
+};
+
+/* New anonymous memory file of the given size, mapped shared into data
+ * unless it is NULL. Returns its descriptor, -1 on failure. */
+int createSegment(size_t size, unsigned char **data);
+
+/* Make a segment immutable. Its writable mappings must be gone. */
+bool sealSegment(int fd);
+
+/* Planes of a request as Mats over the segment, without copying unless
+ * the samples are interleaved. False with the reason if out of bounds. */
+bool submissionPlanes(  const SubmitRequest &request, unsigned char *segment,
+                        size_t segment_size, std::vector<cv::Mat> *planes,
+                        std::string *error  );
+
+/* Local submission server. Clients connect to a Unix seqpacket socket and
+ * send requests with the descriptor of a memfd or shared memory segment
+ * holding the pixels. A memfd sealed against shrinking and writes is mapped
+ * copy-on-write and analyzed in place, other segments are copied first.
+ * The reply comes back with a sealed memfd of the results. Every
+ * connection is served by a thread of its own, one request at a time,
+ * joined by the accept loop once the connection is closed. */
+class SubmitServer {
+public:
+    typedef std::function<void( const SubmitRequest &request, const SubmitPeer &peer,
+                                std::vector<cv::Mat> *planes, SubmitResult *result )> Handler;
+
+    SubmitServer(const std::string &socket_path, const Handler &handler);
+    ~SubmitServer();
+
+    /* Accept clients until stop(), false if the socket cannot be bound */
+    bool run();
+
+    /* Stop accepting and close the connections, from any thread */
+    void stop();
+
+private:
+    SubmitServer(const SubmitServer &);
+    SubmitServer &operator=(const SubmitServer &);
+
+    void serveClient(int fd);
+    void reapThreads();
+    bool sendReply(int fd, uint64_t id, const SubmitResult &result);
+
+    std::string                 m_socket_path;
+    Handler                     m_handler;
+    int                         m_listen_fd;
+    std::atomic<bool>           m_stop;
+    std::vector<int>            m_client_fds;
+    std::vector<std::thread>    m_threads;
+    std::vector<std::thread::id> m_finished;   // Threads done, not yet joined
+    std::mutex                  m_mutex;
+};
+
+/* Client side of the protocol */
+class SubmitClient {
+public:
+    explicit SubmitClient(const std::string &socket_path);
+    ~SubmitClient();
+
+    bool connected() const;
+
+    /* Send a request with its pixel segment and wait for the result.
+     * False if the connection failed, the status tells the rest. */
+    bool submit(const SubmitRequest &request, int segment_fd, SubmitResult *result);
+
+private:
+    SubmitClient(const SubmitClient &);
+    SubmitClient &operator=(const SubmitClient &);
+
+    int                         m_fd;
+};
+
+#endif // SUBMIT_SERVER_HPP
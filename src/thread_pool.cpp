@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <memory>
+#include <exception>
+
+#include "thread_pool.hpp"
+#include "deadline.hpp"
+
+
+/* Shared state of one parallelFor call */
+struct ParallelJob {
+    std::atomic<size_t>                     next;
+    std::atomic<size_t>                     done;
+    size_t                                  count;
+    const std::function<void(size_t)>      *fn;
+    Deadline                               *deadline;   // Of the calling thread
+    std::exception_ptr                      error;
+    std::mutex                              mutex;
+    std::condition_variable                 cv;
+};
+
+/* Claim and run items until the job is exhausted. Items run under the
+ * deadline of the caller, and once it expires the rest only throw. */
+static void runJob(ParallelJob *job) {
+
+    DeadlineScope scope(job->deadline);
+    size_t index;
+    while ((index = job->next++) < job->count) {
+        try {
+            checkDeadline();
+            (*job->fn)(index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (!job->error) job->error = std::current_exception();
+        }
+        if (++job->done == job->count) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->cv.notify_all();
+        }
+    }
+}
+
+
+ThreadPool::ThreadPool(unsigned int num_threads) : m_stop(false) {
+    start(num_threads, std::vector<int>());
+}
+
+ThreadPool::ThreadPool(unsigned int num_threads, const std::vector<int> &cpus) : m_stop(false) {
+    start(num_threads, cpus);
+}
+
+/* Start the workers, pinned to the CPUs if any are given */
+void ThreadPool::start(unsigned int num_threads, const std::vector<int> &cpus) {
+
+    if (!num_threads) num_threads = std::thread::hardware_concurrency();
+    if (!num_threads) num_threads = 1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if ((cpus[i] >= 0) && (cpus[i] < CPU_SETSIZE)) CPU_SET(cpus[i], &set);
+    }
+    for (unsigned int i = 1; i < num_threads; i++) {
+        m_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+        if (!cpus.empty()) {
+            pthread_setaffinity_np(m_workers.back().native_handle(), sizeof(set), &set);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        m_workers[i].join();
+    }
+}
+
+/* Total concurrency including the calling thread */
+unsigned int ThreadPool::size() const {
+    return (unsigned int)m_workers.size() + 1;
+}
+
+/* Queue a task for the workers */
+void ThreadPool::submit(const std::function<void()> &task) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(task);
+    }
+    m_cv.notify_one();
+}
+
+/* Run fn(i) for every i in [0, count) and wait for all of them */
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+
+    if (!count) return;
+    if ((count == 1) || m_workers.empty()) {
+        for (size_t i = 0; i < count; i++) {
+            checkDeadline();
+            fn(i);
+        }
+        return;
+    }
+
+    std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>();
+    job->next  = 0;
+    job->done  = 0;
+    job->count = count;
+    job->fn    = &fn;
+    job->deadline = currentDeadline();
+
+    // Helpers that start after the last item was claimed return at once
+    size_t helpers = (count - 1 < m_workers.size()) ? count - 1 : m_workers.size();
+    for (size_t i = 0; i < helpers; i++) {
+        submit([job] { runJob(job.get()); });
+    }
+    runJob(job.get());
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&job, count] { return job->done == count; });
+    if (job->error) std::rethrow_exception(job->error);
+}
+
+/* Worker thread - run queued tasks until the pool is destroyed */
+void ThreadPool::workerLoop() {
+
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty()) return;
+            task = m_tasks.front();
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+
+/* Fixed set of worker threads shared by the whole pipeline */
+class ThreadPool {
+public:
+    /* num_threads counts the calling thread, 0 picks the core count */
+    explicit ThreadPool(unsigned int num_threads);
+
+    /* Workers pinned to the given CPUs, the calling thread is left alone */
+    ThreadPool(unsigned int num_threads, const std::vector<int> &cpus);
+    ~ThreadPool();
+
+    /* Total concurrency including the calling thread */
+    unsigned int size() const;
+
+    /* Queue a task for the workers */
+    void submit(const std::function<void()> &task);
+
+    /* Run fn(i) for every i in [0, count) and wait for all of them. The
+     * calling thread takes part, so nested calls from a worker cannot
+     * deadlock. The first exception thrown by fn is rethrown here. */
+    void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void start(unsigned int num_threads, const std::vector<int> &cpus);
+    void workerLoop();
+
+    std::vector<std::thread>            m_workers;
+    std::deque<std::function<void()>>   m_tasks;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_cv;
+    bool                                m_stop;
+};
+
+#endif // THREAD_POOL_HPP
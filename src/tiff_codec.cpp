@@ -0,0 +1,285 @@
+#include <cstring>
+#include <stdint.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tiff_codec.hpp"
+
+
+#define LZW_CLEAR_CODE          256   // Reset the string table
+#define LZW_EOI_CODE            257   // End of information
+#define LZW_FIRST_CODE          258   // First free table entry
+#define LZW_MAX_BITS            12    // Widest code
+#define LZW_TABLE_SIZE          (1 << LZW_MAX_BITS)
+
+/* Decode one LZW compressed strip or tile, short input is zero filled */
+bool lzwDecode( const unsigned char *src, size_t src_size,
+                unsigned char *dst, size_t dst_size ) {
+
+    uint16_t prefix[LZW_TABLE_SIZE];
+    uint16_t length[LZW_TABLE_SIZE];
+    uint8_t  suffix[LZW_TABLE_SIZE];
+    uint8_t  first[LZW_TABLE_SIZE];
+    for (unsigned int code = 0; code < 256; code++) {
+        prefix[code] = 0;
+        length[code] = 1;
+        suffix[code] = (uint8_t)code;
+        first[code]  = (uint8_t)code;
+    }
+
+    // Old style (LSB first) LZW streams are not supported
+    if ((src_size >= 2) && !src[0] && (src[1] & 0x1)) return false;
+
+    size_t in = 0, out = 0;
+    uint32_t bit_buffer = 0;
+    unsigned int bit_count = 0;
+    unsigned int code_bits = 9;
+    unsigned int next_code = LZW_FIRST_CODE;
+    int previous = -1;
+
+    while (out < dst_size) {
+
+        // Codes are packed MSB first
+        while (bit_count < code_bits) {
+            if (in >= src_size) break;
+            bit_buffer = (bit_buffer << 8) | src[in++];
+            bit_count += 8;
+        }
+        if (bit_count < code_bits) break;
+        unsigned int code = (bit_buffer >> (bit_count - code_bits)) & ((1u << code_bits) - 1);
+        bit_count -= code_bits;
+
+        if (code == LZW_EOI_CODE) break;
+        if (code == LZW_CLEAR_CODE) {
+            code_bits = 9;
+            next_code = LZW_FIRST_CODE;
+            previous = -1;
+            continue;
+        }
+
+        if (previous < 0) {
+            if (code > 255) return false;
+            dst[out++] = (unsigned char)code;
+            previous = (int)code;
+            continue;
+        }
+
+        // Emit the string for code, handling the KwKwK case
+        unsigned int emit_code = code;
+        unsigned int emit_length;
+        uint8_t first_char;
+        if (code < next_code) {
+            emit_length = length[code];
+            first_char = first[code];
+        } else if (code == next_code) {
+            emit_code = (unsigned int)previous;
+            emit_length = length[previous] + 1;
+            first_char = first[previous];
+        } else {
+            return false;
+        }
+
+        size_t end = out + emit_length;
+        size_t pos = end;
+        if (code == next_code) {
+            if (--pos < dst_size) dst[pos] = first_char;
+        }
+        for (unsigned int c = emit_code, n = length[emit_code]; n; n--) {
+            if (--pos < dst_size) dst[pos] = suffix[c];
+            c = prefix[c];
+        }
+        out = (end < dst_size) ? end : dst_size;
+
+        // Add the new table entry, the code width grows one code early
+        if (next_code < LZW_TABLE_SIZE) {
+            prefix[next_code] = (uint16_t)previous;
+            suffix[next_code] = first_char;
+            first[next_code]  = first[previous];
+            length[next_code] = length[previous] + 1;
+            next_code++;
+            if ((next_code + 1 >= (1u << code_bits)) && (code_bits < LZW_MAX_BITS)) {
+                code_bits++;
+            }
+        }
+        previous = (int)code;
+    }
+
+    if (!out) return false;
+    if (out < dst_size) memset(dst + out, 0, dst_size - out);
+    return true;
+}
+
+/* Decode one zlib (Deflate) compressed strip or tile */
+bool deflateDecode( const unsigned char *src, size_t src_size,
+                    unsigned char *dst, size_t dst_size ) {
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) return false;
+
+    size_t in = 0, out = 0;
+    int status = Z_OK;
+    while (status == Z_OK) {
+        // zlib counts in 32 bit quantities
+        size_t in_chunk = (src_size - in < 0x40000000) ? src_size - in : 0x40000000;
+        size_t out_chunk = (dst_size - out < 0x40000000) ? dst_size - out : 0x40000000;
+        stream.next_in = (Bytef *)(src + in);
+        stream.avail_in = (uInt)in_chunk;
+        stream.next_out = dst + out;
+        stream.avail_out = (uInt)out_chunk;
+        status = inflate(&stream, Z_NO_FLUSH);
+        in += in_chunk - stream.avail_in;
+        out += out_chunk - stream.avail_out;
+        if ((out == dst_size) || ((in == src_size) && (status == Z_OK))) break;
+    }
+    inflateEnd(&stream);
+
+    if ((status != Z_OK) && (status != Z_STREAM_END) && (status != Z_BUF_ERROR)) return false;
+    if (!out) return false;
+    if (out < dst_size) memset(dst + out, 0, dst_size - out);
+    return true;
+}
+
+/* Decode one zstd compressed strip or tile */
+bool zstdDecode(    const unsigned char *src, size_t src_size,
+                    unsigned char *dst, size_t dst_size ) {
+#ifdef USE_ZSTD
+    size_t out = ZSTD_decompress(dst, dst_size, src, src_size);
+    if (ZSTD_isError(out) || !out) return false;
+    if (out < dst_size) memset(dst + out, 0, dst_size - out);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Packs codes MSB first the way the TIFF LZW decoder expects */
+class CodeWriter {
+public:
+    explicit CodeWriter(std::vector<unsigned char> *dst) : m_dst(dst), m_buffer(0), m_count(0) {
+    }
+
+    void put(unsigned int code, unsigned int bits) {
+        m_buffer = (m_buffer << bits) | code;
+        m_count += bits;
+        while (m_count >= 8) {
+            m_count -= 8;
+            m_dst->push_back((unsigned char)(m_buffer >> m_count));
+        }
+        m_buffer &= (1u << m_count) - 1;
+    }
+
+    void flush() {
+        if (m_count) m_dst->push_back((unsigned char)(m_buffer << (8 - m_count)));
+        m_buffer = m_count = 0;
+    }
+
+private:
+    std::vector<unsigned char> *m_dst;
+    uint32_t                    m_buffer;
+    unsigned int                m_count;
+};
+
+#define LZW_HASH_BITS           13    // Open addressing table for the encoder
+#define LZW_HASH_SIZE           (1 << LZW_HASH_BITS)
+
+/* Encode one strip or tile with LZW */
+bool lzwEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst) {
+
+    int32_t  keys[LZW_HASH_SIZE];
+    uint16_t codes[LZW_HASH_SIZE];
+    memset(keys, 0xFF, sizeof(keys));
+
+    dst->clear();
+    dst->reserve(src_size / 2 + 16);
+    CodeWriter writer(dst);
+    unsigned int code_bits = 9;
+    unsigned int next_code = LZW_FIRST_CODE;
+    writer.put(LZW_CLEAR_CODE, code_bits);
+    if (!src_size) {
+        writer.put(LZW_EOI_CODE, code_bits);
+        writer.flush();
+        return true;
+    }
+
+    unsigned int prefix = src[0];
+    for (size_t i = 1; i < src_size; i++) {
+        int32_t key = (int32_t)((prefix << 8) | src[i]);
+        uint32_t slot = ((uint32_t)key * 2654435761u) >> (32 - LZW_HASH_BITS);
+        while ((keys[slot] != -1) && (keys[slot] != key)) {
+            slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+        }
+        if (keys[slot] == key) {
+            prefix = codes[slot];
+            continue;
+        }
+
+        writer.put(prefix, code_bits);
+        keys[slot] = key;
+        codes[slot] = (uint16_t)next_code++;
+
+        // Table full, start over the way libtiff does
+        if (next_code == LZW_TABLE_SIZE - 2) {
+            writer.put(LZW_CLEAR_CODE, code_bits);
+            memset(keys, 0xFF, sizeof(keys));
+            next_code = LZW_FIRST_CODE;
+            code_bits = 9;
+        } else if (next_code > (1u << code_bits) - 1) {
+            code_bits++;
+        }
+        prefix = src[i];
+    }
+
+    // The decoder adds one more entry before it reads the end code
+    writer.put(prefix, code_bits);
+    next_code++;
+    if (next_code == LZW_TABLE_SIZE - 2) {
+        writer.put(LZW_CLEAR_CODE, code_bits);
+        code_bits = 9;
+    } else if ((next_code > (1u << code_bits) - 1) && (code_bits < LZW_MAX_BITS)) {
+        code_bits++;
+    }
+    writer.put(LZW_EOI_CODE, code_bits);
+    writer.flush();
+    return true;
+}
+
+/* Encode one strip or tile with zlib (Deflate) */
+bool deflateEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst) {
+
+    uLongf dst_size = compressBound((uLong)src_size);
+    dst->resize(dst_size);
+    if (compress2(dst->data(), &dst_size, src, (uLong)src_size, DEFLATE_LEVEL) != Z_OK) {
+        return false;
+    }
+    dst->resize(dst_size);
+    return true;
+}
+
+/* Encode one strip or tile with zstd */
+bool zstdEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst) {
+#ifdef USE_ZSTD
+    dst->resize(ZSTD_compressBound(src_size));
+    size_t dst_size = ZSTD_compress(dst->data(), dst->size(), src, src_size, ZSTD_LEVEL);
+    if (ZSTD_isError(dst_size)) return false;
+    dst->resize(dst_size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* True if the compression scheme can be encoded by this build */
+bool compressionSupported(unsigned int compression) {
+    switch (compression) {
+        case TIFF_COMPRESSION_NONE    :
+        case TIFF_COMPRESSION_LZW     :
+        case TIFF_COMPRESSION_DEFLATE : return true;
+#ifdef USE_ZSTD
+        case TIFF_COMPRESSION_ZSTD    : return true;
+#endif
+        default: return false;
+    }
+}
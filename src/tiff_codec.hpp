@@ -0,0 +1,42 @@
+#ifndef TIFF_CODEC_HPP
+#define TIFF_CODEC_HPP
+
+#include <vector>
+#include <cstddef>
+
+
+/* TIFF compression schemes */
+#define TIFF_COMPRESSION_NONE           1
+#define TIFF_COMPRESSION_LZW            5
+#define TIFF_COMPRESSION_DEFLATE        8
+#define TIFF_COMPRESSION_ADOBE_DEFLATE  32946
+#define TIFF_COMPRESSION_ZSTD           50000   // Needs a build with USE_ZSTD
+
+#define DEFLATE_LEVEL                   1       // zlib level for the outputs, favors speed
+#define ZSTD_LEVEL                      3       // zstd level for the outputs
+
+/* Decode one LZW compressed strip or tile, short input is zero filled */
+bool lzwDecode( const unsigned char *src, size_t src_size,
+                unsigned char *dst, size_t dst_size );
+
+/* Decode one zlib (Deflate) compressed strip or tile */
+bool deflateDecode( const unsigned char *src, size_t src_size,
+                    unsigned char *dst, size_t dst_size );
+
+/* Decode one zstd compressed strip or tile */
+bool zstdDecode(    const unsigned char *src, size_t src_size,
+                    unsigned char *dst, size_t dst_size );
+
+/* Encode one strip or tile with LZW */
+bool lzwEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst);
+
+/* Encode one strip or tile with zlib (Deflate) */
+bool deflateEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst);
+
+/* Encode one strip or tile with zstd */
+bool zstdEncode(const unsigned char *src, size_t src_size, std::vector<unsigned char> *dst);
+
+/* True if the compression scheme can be encoded by this build */
+bool compressionSupported(unsigned int compression);
+
+#endif // TIFF_CODEC_HPP
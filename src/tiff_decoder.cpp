@@ -0,0 +1,339 @@
+#include <atomic>
+#include <cstring>
+
+#include "tiff_decoder.hpp"
+#include "tiff_codec.hpp"
+
+
+/* Tags of the baseline TIFF layout */
+#define TAG_IMAGE_WIDTH         256
+#define TAG_IMAGE_LENGTH        257
+#define TAG_BITS_PER_SAMPLE     258
+#define TAG_COMPRESSION         259
+#define TAG_PHOTOMETRIC         262
+#define TAG_STRIP_OFFSETS       273
+#define TAG_SAMPLES_PER_PIXEL   277
+#define TAG_ROWS_PER_STRIP      278
+#define TAG_STRIP_BYTE_COUNTS   279
+#define TAG_PLANAR_CONFIG       284
+#define TAG_PREDICTOR           317
+#define TAG_TILE_WIDTH          322
+#define TAG_TILE_LENGTH         323
+#define TAG_TILE_OFFSETS        324
+#define TAG_TILE_BYTE_COUNTS    325
+#define TAG_SAMPLE_FORMAT       339
+
+/* Field types */
+#define TYPE_BYTE               1
+#define TYPE_SHORT              3
+#define TYPE_LONG               4
+
+#define PHOTOMETRIC_MINISBLACK  1
+#define PHOTOMETRIC_RGB         2
+
+static uint16_t read16(const unsigned char *p, bool big_endian) {
+    return big_endian ? (uint16_t)((p[0] << 8) | p[1]) : (uint16_t)((p[1] << 8) | p[0]);
+}
+
+static uint32_t read32(const unsigned char *p, bool big_endian) {
+    return big_endian ?
+        ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3] :
+        ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static bool hostBigEndian() {
+    const uint16_t probe = 1;
+    return *(const unsigned char *)&probe == 0;
+}
+
+/* Read the values of one IFD entry */
+static bool readEntry(  const unsigned char *data, size_t size, const unsigned char *entry,
+                        bool big_endian, std::vector<uint64_t> *values ) {
+
+    uint16_t type  = read16(entry + 2, big_endian);
+    uint32_t count = read32(entry + 4, big_endian);
+    size_t type_size;
+    switch (type) {
+        case TYPE_BYTE  : type_size = 1; break;
+        case TYPE_SHORT : type_size = 2; break;
+        case TYPE_LONG  : type_size = 4; break;
+        default: return false;
+    }
+
+    const unsigned char *value = entry + 8;
+    if (type_size * count > 4) {
+        uint32_t offset = read32(entry + 8, big_endian);
+        if ((offset > size) || (type_size * count > size - offset)) return false;
+        value = data + offset;
+    }
+
+    values->resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        switch (type) {
+            case TYPE_BYTE  : (*values)[i] = value[i]; break;
+            case TYPE_SHORT : (*values)[i] = read16(value + 2*i, big_endian); break;
+            default         : (*values)[i] = read32(value + 4*i, big_endian); break;
+        }
+    }
+    return true;
+}
+
+/* Number of color samples decoded into planes (1 gray, 3 RGB) */
+unsigned int TiffInfo::colorSamples() const {
+    return (photometric == PHOTOMETRIC_RGB) ? 3 : 1;
+}
+
+/* Parse the first IFD, false if the layout is not supported natively */
+bool parseTiff(const unsigned char *data, size_t size, TiffInfo *info) {
+
+    if (size < 8) return false;
+    if (!memcmp(data, "MM", 2)) {
+        info->big_endian = true;
+    } else if (!memcmp(data, "II", 2)) {
+        info->big_endian = false;
+    } else {
+        return false;
+    }
+    bool be = info->big_endian;
+
+    // Classic TIFF only, BigTIFF goes through OpenCV
+    if (read16(data + 2, be) != 42) return false;
+    uint32_t ifd = read32(data + 4, be);
+    if ((ifd > size - 2)) return false;
+    uint16_t num_entries = read16(data + ifd, be);
+    if ((size_t)ifd + 2 + 12 * (size_t)num_entries > size) return false;
+
+    info->width = info->height = 0;
+    info->samples_per_pixel = 1;
+    info->bits_per_sample = 1;
+    info->compression = TIFF_COMPRESSION_NONE;
+    info->predictor = 1;
+    info->planar_config = 1;
+    info->photometric = PHOTOMETRIC_MINISBLACK;
+    info->tiled = false;
+    info->rows_per_strip = 0xFFFFFFFF;
+    info->tile_width = info->tile_height = 0;
+    info->offsets.clear();
+    info->byte_counts.clear();
+
+    std::vector<uint64_t> values;
+    for (uint16_t i = 0; i < num_entries; i++) {
+        const unsigned char *entry = data + ifd + 2 + 12 * i;
+        uint16_t tag = read16(entry, be);
+        switch (tag) {
+            case TAG_IMAGE_WIDTH       :
+            case TAG_IMAGE_LENGTH      :
+            case TAG_BITS_PER_SAMPLE   :
+            case TAG_COMPRESSION       :
+            case TAG_PHOTOMETRIC       :
+            case TAG_SAMPLES_PER_PIXEL :
+            case TAG_ROWS_PER_STRIP    :
+            case TAG_PLANAR_CONFIG     :
+            case TAG_PREDICTOR         :
+            case TAG_TILE_WIDTH        :
+            case TAG_TILE_LENGTH       :
+            case TAG_SAMPLE_FORMAT     :
+            case TAG_STRIP_OFFSETS     :
+            case TAG_STRIP_BYTE_COUNTS :
+            case TAG_TILE_OFFSETS      :
+            case TAG_TILE_BYTE_COUNTS  : break;
+            default: continue;
+        }
+        if (!readEntry(data, size, entry, be, &values) || values.empty()) return false;
+
+        unsigned int value = (unsigned int)values[0];
+        switch (tag) {
+            case TAG_IMAGE_WIDTH       : info->width = value; break;
+            case TAG_IMAGE_LENGTH      : info->height = value; break;
+            case TAG_COMPRESSION       : info->compression = value; break;
+            case TAG_PHOTOMETRIC       : info->photometric = value; break;
+            case TAG_SAMPLES_PER_PIXEL : info->samples_per_pixel = value; break;
+            case TAG_ROWS_PER_STRIP    : info->rows_per_strip = value; break;
+            case TAG_PLANAR_CONFIG     : info->planar_config = value; break;
+            case TAG_PREDICTOR         : info->predictor = value; break;
+            case TAG_TILE_WIDTH        : info->tile_width = value; info->tiled = true; break;
+            case TAG_TILE_LENGTH       : info->tile_height = value; info->tiled = true; break;
+            case TAG_BITS_PER_SAMPLE   : {
+                // Mixed sample depths are not supported
+                for (size_t k = 1; k < values.size(); k++) {
+                    if (values[k] != values[0]) return false;
+                }
+                info->bits_per_sample = value;
+            } break;
+            case TAG_SAMPLE_FORMAT     : {
+                // Unsigned integer samples only
+                for (size_t k = 0; k < values.size(); k++) {
+                    if (values[k] != 1) return false;
+                }
+            } break;
+            case TAG_STRIP_OFFSETS     :
+            case TAG_TILE_OFFSETS      : info->offsets = values; break;
+            case TAG_STRIP_BYTE_COUNTS :
+            case TAG_TILE_BYTE_COUNTS  : info->byte_counts = values; break;
+        }
+    }
+
+    if (!info->width || !info->height) return false;
+    if ((info->bits_per_sample != 8) && (info->bits_per_sample != 16)) return false;
+    if ((info->compression != TIFF_COMPRESSION_NONE) &&
+        (info->compression != TIFF_COMPRESSION_LZW) &&
+        (info->compression != TIFF_COMPRESSION_DEFLATE) &&
+        (info->compression != TIFF_COMPRESSION_ADOBE_DEFLATE) &&
+        !((info->compression == TIFF_COMPRESSION_ZSTD) &&
+                compressionSupported(TIFF_COMPRESSION_ZSTD))) return false;
+    if ((info->predictor != 1) && (info->predictor != 2)) return false;
+    if ((info->planar_config != 1) && (info->planar_config != 2)) return false;
+    if ((info->photometric != PHOTOMETRIC_MINISBLACK) &&
+        (info->photometric != PHOTOMETRIC_RGB)) return false;
+    if (!info->samples_per_pixel || (info->samples_per_pixel < info->colorSamples())) return false;
+
+    // Number of strips or tiles the layout implies
+    size_t per_plane;
+    if (info->tiled) {
+        if (!info->tile_width || !info->tile_height) return false;
+        size_t across = (info->width + info->tile_width - 1) / info->tile_width;
+        size_t down = (info->height + info->tile_height - 1) / info->tile_height;
+        per_plane = across * down;
+    } else {
+        if (!info->rows_per_strip) return false;
+        if (info->rows_per_strip > info->height) info->rows_per_strip = info->height;
+        per_plane = (info->height + info->rows_per_strip - 1) / info->rows_per_strip;
+    }
+    size_t expected = (info->planar_config == 2) ?
+                            per_plane * info->samples_per_pixel : per_plane;
+    if ((info->offsets.size() != expected) || (info->byte_counts.size() != expected)) {
+        return false;
+    }
+    for (size_t i = 0; i < expected; i++) {
+        if ((info->offsets[i] > size) || (info->byte_counts[i] > size - info->offsets[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Decode every strip or tile concurrently on the pool */
+bool decodeTiff(    const unsigned char *data, size_t size,
+                    const TiffInfo &info, ThreadPool *pool,
+                    unsigned char *const *planes, size_t plane_step ) {
+
+    const size_t sample_bytes = info.bits_per_sample / 8;
+    const bool swap_bytes = (sample_bytes == 2) && (info.big_endian != hostBigEndian());
+    const size_t chunk_count = info.offsets.size();
+    const size_t per_plane = (info.planar_config == 2) ?
+                                chunk_count / info.samples_per_pixel : chunk_count;
+    const unsigned int samples_in_chunk =
+                                (info.planar_config == 2) ? 1 : info.samples_per_pixel;
+    const size_t tiles_across = info.tiled ?
+                    (info.width + info.tile_width - 1) / info.tile_width : 1;
+
+    std::atomic<bool> failed(false);
+    pool->parallelFor(chunk_count, [&](size_t index) {
+        if (failed) return;
+
+        unsigned int first_sample = (unsigned int)(index / per_plane) * samples_in_chunk;
+        size_t local = index % per_plane;
+
+        // Pixel region covered by this strip or tile
+        size_t x0, y0, chunk_width, chunk_height, valid_width, valid_height;
+        if (info.tiled) {
+            x0 = (local % tiles_across) * info.tile_width;
+            y0 = (local / tiles_across) * info.tile_height;
+            chunk_width  = info.tile_width;
+            chunk_height = info.tile_height;
+            valid_width  = (info.width - x0 < chunk_width) ? info.width - x0 : chunk_width;
+            valid_height = (info.height - y0 < chunk_height) ? info.height - y0 : chunk_height;
+        } else {
+            x0 = 0;
+            y0 = local * info.rows_per_strip;
+            chunk_width  = info.width;
+            chunk_height = (info.height - y0 < info.rows_per_strip) ?
+                                    info.height - y0 : info.rows_per_strip;
+            valid_width  = chunk_width;
+            valid_height = chunk_height;
+        }
+        size_t row_bytes = chunk_width * samples_in_chunk * sample_bytes;
+        size_t chunk_size = row_bytes * chunk_height;
+
+        // Decompress into per thread scratch
+        static thread_local std::vector<unsigned char> scratch;
+        if (scratch.size() < chunk_size) scratch.resize(chunk_size);
+        unsigned char *buf = scratch.data();
+        const unsigned char *src = data + info.offsets[index];
+        size_t src_size = (size_t)info.byte_counts[index];
+        bool ok = false;
+        switch (info.compression) {
+            case TIFF_COMPRESSION_NONE : {
+                size_t copy = (src_size < chunk_size) ? src_size : chunk_size;
+                memcpy(buf, src, copy);
+                memset(buf + copy, 0, chunk_size - copy);
+                ok = true;
+            } break;
+            case TIFF_COMPRESSION_LZW : {
+                ok = lzwDecode(src, src_size, buf, chunk_size);
+            } break;
+            case TIFF_COMPRESSION_ZSTD : {
+                ok = zstdDecode(src, src_size, buf, chunk_size);
+            } break;
+            default : {
+                ok = deflateDecode(src, src_size, buf, chunk_size);
+            } break;
+        }
+        if (!ok) {
+            failed = true;
+            return;
+        }
+
+        if (swap_bytes) {
+            for (size_t i = 0; i + 1 < chunk_size; i += 2) {
+                unsigned char t = buf[i];
+                buf[i] = buf[i+1];
+                buf[i+1] = t;
+            }
+        }
+
+        // Undo horizontal differencing
+        if (info.predictor == 2) {
+            size_t row_samples = chunk_width * samples_in_chunk;
+            for (size_t r = 0; r < chunk_height; r++) {
+                if (sample_bytes == 1) {
+                    unsigned char *row = buf + r * row_bytes;
+                    for (size_t i = samples_in_chunk; i < row_samples; i++) {
+                        row[i] = (unsigned char)(row[i] + row[i - samples_in_chunk]);
+                    }
+                } else {
+                    uint16_t *row = (uint16_t *)(buf + r * row_bytes);
+                    for (size_t i = samples_in_chunk; i < row_samples; i++) {
+                        row[i] = (uint16_t)(row[i] + row[i - samples_in_chunk]);
+                    }
+                }
+            }
+        }
+
+        // Scatter the samples straight into the destination planes
+        for (unsigned int s = 0; s < samples_in_chunk; s++) {
+            unsigned int sample = first_sample + s;
+            if (sample >= info.colorSamples()) continue;
+            for (size_t r = 0; r < valid_height; r++) {
+                const unsigned char *src_row = buf + r * row_bytes;
+                unsigned char *dst_row = planes[sample] + (y0 + r) * plane_step +
+                                                                    x0 * sample_bytes;
+                if (samples_in_chunk == 1) {
+                    memcpy(dst_row, src_row, valid_width * sample_bytes);
+                } else if (sample_bytes == 1) {
+                    for (size_t c = 0; c < valid_width; c++) {
+                        dst_row[c] = src_row[c * samples_in_chunk + s];
+                    }
+                } else {
+                    const uint16_t *src16 = (const uint16_t *)src_row;
+                    uint16_t *dst16 = (uint16_t *)dst_row;
+                    for (size_t c = 0; c < valid_width; c++) {
+                        dst16[c] = src16[c * samples_in_chunk + s];
+                    }
+                }
+            }
+        }
+    });
+
+    return !failed;
+}
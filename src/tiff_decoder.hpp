@@ -0,0 +1,43 @@
+#ifndef TIFF_DECODER_HPP
+#define TIFF_DECODER_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "thread_pool.hpp"
+
+
+/* Layout of the first image of a baseline TIFF file */
+struct TiffInfo {
+    unsigned int            width;
+    unsigned int            height;
+    unsigned int            samples_per_pixel;
+    unsigned int            bits_per_sample;    // 8 or 16
+    unsigned int            compression;
+    unsigned int            predictor;          // 1 none, 2 horizontal
+    unsigned int            planar_config;      // 1 chunky, 2 planar
+    unsigned int            photometric;
+    bool                    big_endian;
+    bool                    tiled;
+    unsigned int            rows_per_strip;
+    unsigned int            tile_width;
+    unsigned int            tile_height;
+    std::vector<uint64_t>   offsets;            // Per strip or tile
+    std::vector<uint64_t>   byte_counts;
+
+    /* Number of color samples decoded into planes (1 gray, 3 RGB) */
+    unsigned int colorSamples() const;
+};
+
+/* Parse the first IFD, false if the layout is not supported natively */
+bool parseTiff(const unsigned char *data, size_t size, TiffInfo *info);
+
+/* Decode every strip or tile concurrently on the pool. Sample s of each
+ * pixel is written to planes[s] (s < colorSamples()), rows plane_step
+ * bytes apart. */
+bool decodeTiff(    const unsigned char *data, size_t size,
+                    const TiffInfo &info, ThreadPool *pool,
+                    unsigned char *const *planes, size_t plane_step );
+
+#endif // TIFF_DECODER_HPP
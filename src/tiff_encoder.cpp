@@ -0,0 +1,242 @@
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "tiff_encoder.hpp"
+#include "tiff_codec.hpp"
+
+
+/* Field types */
+#define TYPE_SHORT              3
+#define TYPE_LONG               4
+
+#define PHOTOMETRIC_MINISBLACK  1
+#define PHOTOMETRIC_RGB         2
+
+/* One IFD entry, written in host byte order */
+struct IfdEntry {
+    uint16_t                tag;
+    uint16_t                type;
+    std::vector<uint32_t>   values;
+};
+
+static void append16(std::vector<unsigned char> *buf, uint16_t value) {
+    const unsigned char *p = (const unsigned char *)&value;
+    buf->insert(buf->end(), p, p + 2);
+}
+
+static void append32(std::vector<unsigned char> *buf, uint32_t value) {
+    const unsigned char *p = (const unsigned char *)&value;
+    buf->insert(buf->end(), p, p + 4);
+}
+
+static void appendValue(std::vector<unsigned char> *buf, uint16_t type, uint32_t value) {
+    if (type == TYPE_SHORT) {
+        append16(buf, (uint16_t)value);
+    } else {
+        append32(buf, value);
+    }
+}
+
+/* Write every iovec, resuming after partial writes */
+static bool writeAll(int fd, std::vector<struct iovec> *iov) {
+
+    size_t first = 0;
+    while (first < iov->size()) {
+        size_t count = iov->size() - first;
+        if (count > IOV_MAX) count = IOV_MAX;
+        ssize_t written = writev(fd, &(*iov)[first], (int)count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while ((first < iov->size()) && ((size_t)written >= (*iov)[first].iov_len)) {
+            written -= (*iov)[first].iov_len;
+            first++;
+        }
+        if (written) {
+            (*iov)[first].iov_base = (char *)(*iov)[first].iov_base + written;
+            (*iov)[first].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/* Write separate sample planes (1 gray or 3 RGB) as a tiled TIFF */
+bool writeTiledTiff(    const std::string &path,
+                        const unsigned char *const *planes, unsigned int samples,
+                        unsigned int width, unsigned int height,
+                        unsigned int bits_per_sample, size_t plane_step,
+                        unsigned int compression, ThreadPool *pool  ) {
+
+    if (((samples != 1) && (samples != 3)) || !width || !height) return false;
+    if ((bits_per_sample != 8) && (bits_per_sample != 16)) return false;
+    if (!compressionSupported(compression)) return false;
+
+    const size_t sample_bytes = bits_per_sample / 8;
+    const size_t tiles_across = (width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    const size_t tiles_down = (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    const size_t tile_count = tiles_across * tiles_down;
+    const size_t row_bytes = (size_t)TIFF_TILE_SIZE * samples * sample_bytes;
+    const size_t tile_bytes = row_bytes * TIFF_TILE_SIZE;
+    const bool predictor = (compression != TIFF_COMPRESSION_NONE);
+
+    // Interleave, difference and compress every tile concurrently
+    std::vector<std::vector<unsigned char>> tiles(tile_count);
+    std::atomic<bool> failed(false);
+    pool->parallelFor(tile_count, [&](size_t index) {
+        if (failed) return;
+
+        size_t x0 = (index % tiles_across) * TIFF_TILE_SIZE;
+        size_t y0 = (index / tiles_across) * TIFF_TILE_SIZE;
+        size_t valid_width = (width - x0 < TIFF_TILE_SIZE) ? width - x0 : TIFF_TILE_SIZE;
+        size_t valid_height = (height - y0 < TIFF_TILE_SIZE) ? height - y0 : TIFF_TILE_SIZE;
+
+        static thread_local std::vector<unsigned char> scratch;
+        scratch.assign(tile_bytes, 0);
+        unsigned char *buf = scratch.data();
+        for (size_t r = 0; r < valid_height; r++) {
+            unsigned char *dst_row = buf + r * row_bytes;
+            for (unsigned int s = 0; s < samples; s++) {
+                const unsigned char *src_row = planes[s] + (y0 + r) * plane_step +
+                                                                    x0 * sample_bytes;
+                if (samples == 1) {
+                    memcpy(dst_row, src_row, valid_width * sample_bytes);
+                } else if (sample_bytes == 1) {
+                    for (size_t c = 0; c < valid_width; c++) {
+                        dst_row[c * samples + s] = src_row[c];
+                    }
+                } else {
+                    const uint16_t *src16 = (const uint16_t *)src_row;
+                    uint16_t *dst16 = (uint16_t *)dst_row;
+                    for (size_t c = 0; c < valid_width; c++) {
+                        dst16[c * samples + s] = src16[c];
+                    }
+                }
+            }
+        }
+
+        // Horizontal differencing, right to left
+        if (predictor) {
+            size_t row_samples = (size_t)TIFF_TILE_SIZE * samples;
+            for (size_t r = 0; r < TIFF_TILE_SIZE; r++) {
+                if (sample_bytes == 1) {
+                    unsigned char *row = buf + r * row_bytes;
+                    for (size_t i = row_samples - 1; i >= samples; i--) {
+                        row[i] = (unsigned char)(row[i] - row[i - samples]);
+                    }
+                } else {
+                    uint16_t *row = (uint16_t *)(buf + r * row_bytes);
+                    for (size_t i = row_samples - 1; i >= samples; i--) {
+                        row[i] = (uint16_t)(row[i] - row[i - samples]);
+                    }
+                }
+            }
+        }
+
+        bool ok;
+        switch (compression) {
+            case TIFF_COMPRESSION_LZW     : ok = lzwEncode(buf, tile_bytes, &tiles[index]); break;
+            case TIFF_COMPRESSION_DEFLATE : ok = deflateEncode(buf, tile_bytes, &tiles[index]); break;
+            case TIFF_COMPRESSION_ZSTD    : ok = zstdEncode(buf, tile_bytes, &tiles[index]); break;
+            default: {
+                tiles[index].assign(buf, buf + tile_bytes);
+                ok = true;
+            } break;
+        }
+        if (!ok) failed = true;
+    });
+    if (failed) return false;
+
+    // Layout: header, tiles, IFD, then the out of line IFD values
+    uint64_t offset = 8;
+    std::vector<uint32_t> tile_offsets(tile_count), tile_sizes(tile_count);
+    for (size_t i = 0; i < tile_count; i++) {
+        tile_offsets[i] = (uint32_t)offset;
+        tile_sizes[i] = (uint32_t)tiles[i].size();
+        offset += tiles[i].size();
+    }
+    uint64_t ifd_offset = (offset + 1) & ~(uint64_t)1;
+
+    std::vector<IfdEntry> entries;
+    IfdEntry entry;
+    entry.type = TYPE_LONG;
+    entry.tag = 256; entry.values.assign(1, width);                     entries.push_back(entry);
+    entry.tag = 257; entry.values.assign(1, height);                    entries.push_back(entry);
+    entry.type = TYPE_SHORT;
+    entry.tag = 258; entry.values.assign(samples, bits_per_sample);     entries.push_back(entry);
+    entry.tag = 259; entry.values.assign(1, compression);               entries.push_back(entry);
+    entry.tag = 262; entry.values.assign(1, (samples == 3) ?
+                            PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);  entries.push_back(entry);
+    entry.tag = 277; entry.values.assign(1, samples);                   entries.push_back(entry);
+    entry.tag = 284; entry.values.assign(1, 1);                         entries.push_back(entry);
+    if (predictor) {
+        entry.tag = 317; entry.values.assign(1, 2);                     entries.push_back(entry);
+    }
+    entry.tag = 322; entry.values.assign(1, TIFF_TILE_SIZE);            entries.push_back(entry);
+    entry.tag = 323; entry.values.assign(1, TIFF_TILE_SIZE);            entries.push_back(entry);
+    entry.type = TYPE_LONG;
+    entry.tag = 324; entry.values = tile_offsets;                       entries.push_back(entry);
+    entry.tag = 325; entry.values = tile_sizes;                         entries.push_back(entry);
+
+    uint64_t extra_offset = ifd_offset + 2 + 12 * entries.size() + 4;
+    std::vector<unsigned char> ifd, extra;
+    append16(&ifd, (uint16_t)entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        const IfdEntry &e = entries[i];
+        size_t value_bytes = e.values.size() * ((e.type == TYPE_SHORT) ? 2 : 4);
+        append16(&ifd, e.tag);
+        append16(&ifd, e.type);
+        append32(&ifd, (uint32_t)e.values.size());
+        if (value_bytes <= 4) {
+            std::vector<unsigned char> inline_value;
+            for (size_t k = 0; k < e.values.size(); k++) {
+                appendValue(&inline_value, e.type, e.values[k]);
+            }
+            inline_value.resize(4, 0);
+            ifd.insert(ifd.end(), inline_value.begin(), inline_value.end());
+        } else {
+            append32(&ifd, (uint32_t)(extra_offset + extra.size()));
+            for (size_t k = 0; k < e.values.size(); k++) {
+                appendValue(&extra, e.type, e.values[k]);
+            }
+        }
+    }
+    append32(&ifd, 0);
+
+    // Classic TIFF addresses 32 bit offsets only
+    if (extra_offset + extra.size() > UINT32_MAX) return false;
+
+    std::vector<unsigned char> header;
+    const uint16_t probe = 1;
+    header.push_back(*(const unsigned char *)&probe ? 'I' : 'M');
+    header.push_back(header[0]);
+    append16(&header, 42);
+    append32(&header, (uint32_t)ifd_offset);
+
+    static const unsigned char pad = 0;
+    std::vector<struct iovec> iov;
+    struct iovec part;
+    part.iov_base = header.data(); part.iov_len = header.size(); iov.push_back(part);
+    for (size_t i = 0; i < tile_count; i++) {
+        if (tiles[i].empty()) continue;
+        part.iov_base = tiles[i].data(); part.iov_len = tiles[i].size(); iov.push_back(part);
+    }
+    if (ifd_offset != offset) {
+        part.iov_base = (void *)&pad; part.iov_len = 1; iov.push_back(part);
+    }
+    part.iov_base = ifd.data(); part.iov_len = ifd.size(); iov.push_back(part);
+    part.iov_base = extra.data(); part.iov_len = extra.size(); iov.push_back(part);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, &iov);
+    if (close(fd)) ok = false;
+    return ok;
+}
@@ -0,0 +1,21 @@
+#ifndef TIFF_ENCODER_HPP
+#define TIFF_ENCODER_HPP
+
+#include <string>
+#include <cstddef>
+
+#include "thread_pool.hpp"
+
+
+#define TIFF_TILE_SIZE          256   // Tile width and height of the outputs
+
+/* Write separate sample planes (1 gray or 3 RGB) as a tiled TIFF. The
+ * tiles are compressed concurrently on the pool and the file is then
+ * written front to back in one pass. */
+bool writeTiledTiff(    const std::string &path,
+                        const unsigned char *const *planes, unsigned int samples,
+                        unsigned int width, unsigned int height,
+                        unsigned int bits_per_sample, size_t plane_step,
+                        unsigned int compression, ThreadPool *pool  );
+
+#endif // TIFF_ENCODER_HPP
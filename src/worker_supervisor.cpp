@@ -0,0 +1,421 @@
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "worker_supervisor.hpp"
+#include "event_log.hpp"
+
+
+#define JOB_STOP                1           // Worker exits instead
+#define JOB_INPUT_VALID         2           // The input slot holds the file
+#define SHARED_ALIGNMENT        4096        // Alignment of the shared regions
+
+/* One job of the ring, written by the supervisor before posting it */
+struct JobSlot {
+    uint64_t                index;
+    uint64_t                input_size;
+    uint32_t                param;
+    uint32_t                flags;
+};
+
+/* Header of every record of the result ring, padded to 8 bytes */
+struct ResultHeader {
+    uint64_t                index;
+    uint64_t                length;
+    uint32_t                param;
+    uint32_t                ok;
+};
+
+/* Shared memory between the supervisor and one worker. The job ring is
+ * written by the supervisor and the result ring by the worker, each with
+ * a single reader, so plain atomic counters are enough. */
+struct WorkerChannel {
+    sem_t                   jobs_posted;
+    std::atomic<uint32_t>   job_head;       // Jobs posted by the supervisor
+    std::atomic<uint32_t>   job_tail;       // Jobs done by the worker
+    JobSlot                 jobs[WORKER_QUEUE_DEPTH];
+    std::atomic<int64_t>    running;        // Index of the job in progress, -1 if none
+    std::atomic<int64_t>    started;        // Steady clock at its start, ns
+    std::atomic<uint64_t>   result_head;    // Bytes committed by the worker
+    std::atomic<uint64_t>   result_tail;    // Bytes consumed by the supervisor
+    unsigned char           results[WORKER_RESULT_BYTES];
+};
+
+static size_t alignShared(size_t size) {
+    return (size + SHARED_ALIGNMENT - 1) & ~((size_t)SHARED_ALIGNMENT - 1);
+}
+
+/* Steady clock in nanoseconds, CLOCK_MONOTONIC so shared by the processes */
+static int64_t steadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Copy in and out of the result ring, wrapping at its end */
+static void ringWrite(WorkerChannel *channel, uint64_t position, const void *data, size_t size) {
+    size_t offset = position % WORKER_RESULT_BYTES;
+    size_t first = std::min(size, (size_t)WORKER_RESULT_BYTES - offset);
+    memcpy(channel->results + offset, data, first);
+    memcpy(channel->results, (const unsigned char *)data + first, size - first);
+}
+
+static void ringRead(const WorkerChannel *channel, uint64_t position, void *data, size_t size) {
+    size_t offset = position % WORKER_RESULT_BYTES;
+    size_t first = std::min(size, (size_t)WORKER_RESULT_BYTES - offset);
+    memcpy(data, channel->results + offset, first);
+    memcpy((unsigned char *)data + first, channel->results, size - first);
+}
+
+/* Append a result, waiting for the supervisor to make room. Results too
+ * large for the ring are sent as failed. */
+static void pushResult(WorkerChannel *channel, const JobSlot &job, bool ok,
+                                                const std::string &bytes) {
+
+    static const std::string too_large = "result too large";
+    const std::string *sent = &bytes;
+    ResultHeader header = { job.index, bytes.size(), job.param, ok ? 1u : 0u };
+    size_t padded = (sizeof(header) + bytes.size() + 7) & ~(size_t)7;
+    if (padded > WORKER_RESULT_BYTES) {
+        LOG(ERROR, "worker_result_too_large").field("bytes", bytes.size());
+        sent = &too_large;
+        header.length = too_large.size();
+        header.ok = 0;
+        padded = (sizeof(header) + too_large.size() + 7) & ~(size_t)7;
+    }
+
+    uint64_t head = channel->result_head.load(std::memory_order_relaxed);
+    while (WORKER_RESULT_BYTES - (head - channel->result_tail.load()) < padded) usleep(1000);
+    ringWrite(channel, head, &header, sizeof(header));
+    ringWrite(channel, head + sizeof(header), sent->data(), header.length);
+    channel->result_head.store(head + padded, std::memory_order_release);
+}
+
+/* Body of a worker process: run the posted jobs until told to stop */
+static void workerMain( WorkerChannel *channel, sem_t *results_posted, unsigned char *inputs,
+                        size_t input_bytes, const WorkerSupervisor::WorkerFn &fn  ) {
+
+    for (;;) {
+        while (sem_wait(&channel->jobs_posted) && (errno == EINTR)) {}
+        uint32_t position = channel->job_tail.load();
+        const JobSlot job = channel->jobs[position % WORKER_QUEUE_DEPTH];
+        if (job.flags & JOB_STOP) break;
+        channel->started = steadyNanoseconds();
+        channel->running = (int64_t)job.index;
+
+        // The input is a view of the slot, detached before it would be freed
+        FileBuffer input;
+        input.data = inputs + (position % WORKER_QUEUE_DEPTH) * input_bytes;
+        input.size = job.input_size;
+        input.capacity = input_bytes;
+        input.valid = (job.flags & JOB_INPUT_VALID) != 0;
+        std::string result;
+        bool ok;
+        try {
+            ok = fn(job.index, job.param, input, &result);
+        } catch (...) {
+            input.data = NULL;
+            throw;
+        }
+        input.data = NULL;
+
+        channel->running = -1;
+        channel->job_tail = position + 1;
+        pushResult(channel, job, ok, result);
+        sem_post(results_posted);
+    }
+    flushLog();
+    std::cout.flush();
+    fflush(NULL);
+    _exit(0);
+}
+
+/* Read a whole file into an input slot, false if it does not fit */
+static bool loadInput(const std::string &path, unsigned char *slot, size_t capacity,
+                                                                    size_t *size) {
+    *size = 0;
+    if (path.empty()) return false;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    bool ok = !fstat(fd, &info) && ((size_t)info.st_size <= capacity);
+    if (ok) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (ok && (*size < (size_t)info.st_size)) {
+        ssize_t length = pread(fd, slot + *size, info.st_size - *size, *size);
+        if ((length < 0) && (errno == EINTR)) continue;
+        if (length <= 0) ok = false;
+        else *size += length;
+    }
+    close(fd);
+    return ok;
+}
+
+/* Largest of the input files, the size of every input slot */
+size_t largestInput(const std::vector<std::string> &paths) {
+    size_t largest = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        struct stat info;
+        if (paths[i].empty() || stat(paths[i].c_str(), &info)) continue;
+        largest = std::max(largest, (size_t)info.st_size);
+    }
+    return largest;
+}
+
+
+WorkerSupervisor::WorkerSupervisor( unsigned int num_workers, size_t input_bytes,
+                                    const WorkerSetup &setup, double hang_seconds   ) :
+    m_shared(NULL),
+    m_shared_size(0),
+    m_input_bytes(alignShared(std::max(input_bytes, (size_t)1))),
+    m_results_posted(NULL),
+    m_channels(num_workers, NULL),
+    m_inputs(num_workers, NULL),
+    m_pids(num_workers, 0),
+    m_hung(num_workers, false),
+    m_assigned(num_workers),
+    m_setup(setup),
+    m_hang_seconds(hang_seconds),
+    m_restarts(0) {
+
+    // One mapping shared with every worker: the result semaphore, then a
+    // channel and the input slots per worker. Untouched slots cost nothing.
+    const size_t header_size = alignShared(sizeof(sem_t));
+    const size_t channel_size = alignShared(sizeof(WorkerChannel));
+    const size_t worker_size = channel_size + WORKER_QUEUE_DEPTH * m_input_bytes;
+    m_shared_size = header_size + num_workers * worker_size;
+    void *map = mmap(NULL, m_shared_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        LOG(ERROR, "worker_channels_failed").field("bytes", m_shared_size);
+        m_shared_size = 0;
+        return;
+    }
+    m_shared = (unsigned char *)map;
+    m_results_posted = (sem_t *)m_shared;
+    sem_init(m_results_posted, 1, 0);
+
+    for (unsigned int w = 0; w < num_workers; w++) {
+        unsigned char *base = m_shared + header_size + w * worker_size;
+        m_channels[w] = new (base) WorkerChannel;
+        sem_init(&m_channels[w]->jobs_posted, 1, 0);
+        m_inputs[w] = base + channel_size;
+    }
+
+    for (unsigned int w = 0; w < num_workers; w++) startWorker(w);
+}
+
+/* Stop the idle workers, kill those still busy after a failed run */
+WorkerSupervisor::~WorkerSupervisor() {
+    for (size_t w = 0; w < m_pids.size(); w++) {
+        if (!m_pids[w]) continue;
+        if (!m_assigned[w].empty() || !postJob(w, WorkerJob(), true)) kill(m_pids[w], SIGKILL);
+    }
+    for (size_t w = 0; w < m_pids.size(); w++) {
+        if (m_pids[w]) waitpid(m_pids[w], NULL, 0);
+        if (m_channels[w]) sem_destroy(&m_channels[w]->jobs_posted);
+    }
+    if (m_shared) {
+        sem_destroy(m_results_posted);
+        munmap(m_shared, m_shared_size);
+    }
+}
+
+unsigned int WorkerSupervisor::size() const {
+    return (unsigned int)m_pids.size();
+}
+
+/* Workers started again after dying */
+unsigned int WorkerSupervisor::restarts() const {
+    return m_restarts;
+}
+
+/* Fork a worker onto a fresh channel */
+bool WorkerSupervisor::startWorker(unsigned int worker) {
+
+    m_pids[worker] = 0;
+    if (!m_shared) return false;
+    WorkerChannel *channel = m_channels[worker];
+    sem_destroy(&channel->jobs_posted);
+    sem_init(&channel->jobs_posted, 1, 0);
+    channel->job_head = 0;
+    channel->job_tail = 0;
+    channel->running = -1;
+    channel->started = 0;
+    channel->result_head = 0;
+    channel->result_tail = 0;
+    m_hung[worker] = false;
+    m_assigned[worker].clear();
+
+    // Buffered output would otherwise be written again by the worker
+    flushLog();
+    std::cout.flush();
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG(ERROR, "worker_start_failed").field("worker", worker).field("error", strerror(errno));
+        return false;
+    }
+    if (!pid) {
+        // Workers must not outlive a supervisor that died
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        WorkerFn fn = m_setup(worker);
+        workerMain(channel, m_results_posted, m_inputs[worker], m_input_bytes, fn);
+    }
+    m_pids[worker] = pid;
+    return true;
+}
+
+/* Load the input of a job into the next slot of the worker and post it */
+bool WorkerSupervisor::postJob(unsigned int worker, const WorkerJob &job, bool stop) {
+
+    WorkerChannel *channel = m_channels[worker];
+    uint32_t position = channel->job_head.load(std::memory_order_relaxed);
+    if (position - channel->job_tail.load() >= WORKER_QUEUE_DEPTH) return false;
+
+    JobSlot &slot = channel->jobs[position % WORKER_QUEUE_DEPTH];
+    slot.index = job.index;
+    slot.param = job.param;
+    slot.flags = stop ? JOB_STOP : 0;
+    slot.input_size = 0;
+    if (!stop) {
+        size_t size = 0;
+        unsigned char *input = m_inputs[worker] + (position % WORKER_QUEUE_DEPTH) * m_input_bytes;
+        if (loadInput(job.path, input, m_input_bytes, &size)) slot.flags |= JOB_INPUT_VALID;
+        slot.input_size = size;
+    }
+    channel->job_head.store(position + 1, std::memory_order_release);
+    sem_post(&channel->jobs_posted);
+    return true;
+}
+
+/* Hand the results committed by a worker to the callbacks, false if they
+ * do not follow its jobs */
+bool WorkerSupervisor::drainResults(  unsigned int worker, const Callback &completed,
+                                      const Callback &failed, size_t *remaining   ) {
+    WorkerChannel *channel = m_channels[worker];
+    std::vector<WorkerJob> &assigned = m_assigned[worker];
+    uint64_t tail = channel->result_tail.load(std::memory_order_relaxed);
+    const uint64_t head = channel->result_head.load(std::memory_order_acquire);
+
+    while (tail < head) {
+        ResultHeader header;
+        ringRead(channel, tail, &header, sizeof(header));
+        std::string bytes(header.length, '\0');
+        ringRead(channel, tail + sizeof(header), &bytes[0], header.length);
+        tail += (sizeof(header) + header.length + 7) & ~(size_t)7;
+        channel->result_tail.store(tail, std::memory_order_release);
+
+        // Jobs run in order, so the result is for the oldest one
+        if (assigned.empty() || (assigned.front().index != header.index)) {
+            LOG(ERROR, "unexpected_worker_result").field("worker", worker);
+            return false;
+        }
+        WorkerJob job = assigned.front();
+        assigned.erase(assigned.begin());
+        (*remaining)--;
+
+        // A rejected job fails alone, like one its worker died on
+        if (!header.ok) {
+            failed(job, bytes.empty() ? std::string("failed") : bytes);
+            continue;
+        }
+        completed(job, bytes);
+    }
+    return true;
+}
+
+/* Sleep until a worker posts a result, or WORKER_POLL_MS to reap the dead */
+void WorkerSupervisor::waitResults() {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += WORKER_POLL_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    while (sem_timedwait(m_results_posted, &until) && (errno == EINTR)) {}
+}
+
+/* Why a worker process ended */
+static std::string deathReason(int status, bool hung) {
+    std::ostringstream reason;
+    if (hung) reason << "hung, killed";
+    else if (WIFSIGNALED(status)) reason << "signal " << WTERMSIG(status) << " ("
+                                         << strsignal(WTERMSIG(status)) << ")";
+    else if (WIFEXITED(status)) reason << "exit status " << WEXITSTATUS(status);
+    else reason << "unknown";
+    return reason.str();
+}
+
+/* Run every job, restarting the workers that die */
+bool WorkerSupervisor::run( const std::vector<WorkerJob> &jobs, const Callback &completed,
+                                                                const Callback &failed ) {
+
+    std::vector<WorkerJob> pending(jobs.rbegin(), jobs.rend());   // Next job at the back
+    size_t remaining = jobs.size();
+    unsigned int idle_deaths = 0;
+    bool ok = (m_shared != NULL);
+
+    while (ok && remaining) {
+
+        // Keep the queue of every worker full, the inputs read ahead
+        for (unsigned int w = 0; w < m_pids.size(); w++) {
+            while (m_pids[w] && !pending.empty() && postJob(w, pending.back(), false)) {
+                m_assigned[w].push_back(pending.back());
+                pending.pop_back();
+            }
+        }
+
+        for (unsigned int w = 0; ok && (w < m_pids.size()); w++) {
+            if (!m_pids[w]) continue;
+            WorkerChannel *channel = m_channels[w];
+            ok = drainResults(w, completed, failed, &remaining);
+
+            // Stuck where the deadline checkpoints cannot reach
+            int64_t running = channel->running;
+            double seconds = (steadyNanoseconds() - channel->started) / 1e9;
+            if ((m_hang_seconds > 0) && (running >= 0) && (seconds > m_hang_seconds) &&
+                                                                        !m_hung[w]) {
+                m_hung[w] = true;
+                kill(m_pids[w], SIGKILL);
+            }
+
+            int status = 0;
+            if (waitpid(m_pids[w], &status, WNOHANG) != m_pids[w]) continue;
+            ok = ok && drainResults(w, completed, failed, &remaining);
+
+            // The job it died on is the offender, the others are requeued
+            std::vector<WorkerJob> &assigned = m_assigned[w];
+            running = channel->running;
+            std::string reason = deathReason(status, m_hung[w]);
+            if ((running >= 0) && !assigned.empty() &&
+                                    (assigned.front().index == (size_t)running)) {
+                failed(assigned.front(), reason);
+                assigned.erase(assigned.begin());
+                remaining--;
+                idle_deaths = 0;
+            } else if (++idle_deaths > WORKER_MAX_IDLE_DEATHS) {
+                LOG(ERROR, "workers_keep_dying").field("reason", reason);
+                ok = false;
+            }
+            pending.insert(pending.end(), assigned.rbegin(), assigned.rend());
+            m_restarts++;
+            if (!startWorker(w)) ok = false;
+        }
+        if (ok && remaining) waitResults();
+    }
+    return ok;
+}
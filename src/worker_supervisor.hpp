@@ -0,0 +1,91 @@
+#ifndef WORKER_SUPERVISOR_HPP
+#define WORKER_SUPERVISOR_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <functional>
+#include <semaphore.h>
+#include <sys/types.h>
+
+#include "input_reader.hpp"
+
+
+#define WORKER_QUEUE_DEPTH      2           // Jobs queued on a worker, one running
+#define WORKER_RESULT_BYTES     (1 << 20)   // Result ring of each worker
+#define WORKER_POLL_MS          50          // Supervisor wakeups to reap dead workers
+#define WORKER_MAX_IDLE_DEATHS  3           // Deaths outside of any job before giving up
+
+struct WorkerChannel;
+
+/* One job for the workers, its input file loaded into shared memory */
+struct WorkerJob {
+    size_t          index;      // Identifies the job to the callbacks
+    std::string     path;       // Input file, empty for none
+    unsigned int    param;      // Passed through to the worker
+};
+
+/* Largest of the input files, the size of every input slot */
+size_t largestInput(const std::vector<std::string> &paths);
+
+/* Runs jobs in forked worker processes so that a crash takes down one
+ * job rather than the batch. Every worker has a shared memory channel:
+ * a ring of WORKER_QUEUE_DEPTH jobs whose inputs the supervisor reads
+ * straight into input slots, and a ring of length-prefixed results.
+ * Dead workers are restarted. The job a worker died on is reported as
+ * failed and its other jobs go back to the queue, as is a job the worker
+ * rejected. */
+class WorkerSupervisor {
+public:
+    /* Runs the job of the given index and param in a worker and fills the
+     * bytes sent back, false with the reason in the bytes if the job failed */
+    typedef std::function<bool( size_t index, unsigned int param, const FileBuffer &input,
+                                std::string *result )> WorkerFn;
+
+    /* Called first thing in every new worker process */
+    typedef std::function<WorkerFn(unsigned int worker)> WorkerSetup;
+
+    typedef std::function<void(const WorkerJob &job, const std::string &bytes)> Callback;
+
+    /* Fork the workers. Jobs running longer than hang_seconds get their
+     * worker killed, 0 for no limit. */
+    WorkerSupervisor(   unsigned int num_workers, size_t input_bytes,
+                        const WorkerSetup &setup, double hang_seconds   );
+    ~WorkerSupervisor();
+
+    /* Run every job, calling completed(job, result) once a worker sent its
+     * result and failed(job, reason) once a worker failed the job or died
+     * running it. False if the workers keep dying. */
+    bool run(const std::vector<WorkerJob> &jobs, const Callback &completed,
+                                                 const Callback &failed);
+
+    unsigned int size() const;
+
+    /* Workers started again after dying */
+    unsigned int restarts() const;
+
+private:
+    WorkerSupervisor(const WorkerSupervisor &);
+    WorkerSupervisor &operator=(const WorkerSupervisor &);
+
+    bool startWorker(unsigned int worker);
+    bool postJob(unsigned int worker, const WorkerJob &job, bool stop);
+    bool drainResults(  unsigned int worker, const Callback &completed,
+                        const Callback &failed, size_t *remaining   );
+    void waitResults();
+
+    unsigned char                  *m_shared;
+    size_t                          m_shared_size;
+    size_t                          m_input_bytes;
+    sem_t                          *m_results_posted;   // Posted by every worker
+    std::vector<WorkerChannel *>    m_channels;
+    std::vector<unsigned char *>    m_inputs;           // WORKER_QUEUE_DEPTH slots each
+    std::vector<pid_t>              m_pids;             // 0 once reaped for good
+    std::vector<bool>               m_hung;
+    std::vector<std::vector<WorkerJob>> m_assigned;     // Jobs in each channel, in order
+    WorkerSetup                     m_setup;
+    double                          m_hang_seconds;
+    unsigned int                    m_restarts;
+};
+
+#endif // WORKER_SUPERVISOR_HPP